@@ -0,0 +1,192 @@
+#include <arpa/inet.h>
+#include <benchmark/benchmark.h>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <spawn.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "cluster.h"
+#include "serialize.h"
+#include "utils.h"
+
+extern char **environ;
+
+// Requests per iteration, spread over the nodes by key & pipelined.
+#define ROUND 1024
+#define KEYS (1 << 20)
+#define WORKERS_PER_NODE "2"
+
+// kv_server processes of one cluster, fresh slot maps.
+struct Nodes {
+    std::vector<pid_t> pids;
+    std::vector<int> fds;
+    char dir[32] = "/tmp/cluster_bench_XXXXXX";
+
+    bool start(const int n) {
+        char exe[4096];
+        const ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+        if (len <= 0 || !mkdtemp(dir))
+            return false;
+        exe[len] = '\0';
+        const std::string server = std::string(exe, strrchr(exe, '/') - exe) + "/kv_server";
+        // Below the ephemeral range, apart per run.
+        const int base = 20000 + (int) (getpid() % 1000) * 8;
+        std::string nodes;
+        for (int i = 0; i < n; i++) {
+            nodes += (i ? "," : "") + std::string("127.0.0.1:") + std::to_string(base + i);
+        }
+        posix_spawn_file_actions_t fa;
+        posix_spawn_file_actions_init(&fa);
+        posix_spawn_file_actions_addopen(&fa, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+        for (int i = 0; i < n; i++) {
+            const std::string port = std::to_string(base + i), id = std::to_string(i);
+            const std::string map = std::string(dir) + "/" + id + ".map";
+            const char *argv[] = {server.c_str(), "--port", port.c_str(), "--workers", WORKERS_PER_NODE,
+                                  "--cluster", id.c_str(), "--cluster-nodes", nodes.c_str(), "--cluster-map",
+                                  map.c_str(), nullptr};
+            pid_t pid;
+            if (posix_spawn(&pid, server.c_str(), &fa, nullptr, (char *const *) argv, environ))
+                return false;
+            pids.push_back(pid);
+        }
+        posix_spawn_file_actions_destroy(&fa);
+        for (int i = 0; i < n; i++) {
+            const int fd = connect_to(base + i);
+            if (fd < 0)
+                return false;
+            fds.push_back(fd);
+        }
+        return true;
+    }
+
+    // Retries while the node starts up.
+    static int connect_to(const int port) {
+        for (int tries = 0; tries < 500; tries++) {
+            const int fd = socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            addr.sin_port = htons(port);
+            if (!connect(fd, (sockaddr *) &addr, sizeof(addr))) {
+                const int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                return fd;
+            }
+            close(fd);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return -1;
+    }
+
+    void stop() {
+        for (const int fd: fds) {
+            close(fd);
+        }
+        for (const pid_t pid: pids) {
+            kill(pid, SIGTERM);
+            waitpid(pid, nullptr, 0);
+        }
+        std::system(("rm -rf " + std::string(dir)).c_str());
+    }
+};
+
+static void put_frame(std::string &b, const std::initializer_list<std::string_view> args) {
+    uint32_t len = 4;
+    for (const auto &a: args) {
+        len += 4 + a.size();
+    }
+    const uint32_t argc = args.size();
+    b.append((const char *) &len, 4);
+    b.append((const char *) &argc, 4);
+    for (const auto &a: args) {
+        const uint32_t n = a.size();
+        b.append((const char *) &n, 4);
+        b.append(a);
+    }
+}
+
+// Read `n` replies, false if the node hung up or one is an error.
+static bool read_replies(const int fd, std::string &buf, size_t n) {
+    size_t start = 0;
+    buf.clear();
+    while (n) {
+        while (buf.size() - start >= 4) {
+            uint32_t len;
+            memcpy(&len, buf.data() + start, 4);
+            if (buf.size() - start - 4 < len)
+                break;
+            if (len && buf[start + 4] == TAG_ERR)
+                return false;
+            start += 4 + len;
+            if (!--n)
+                return true;
+        }
+        char tmp[65536];
+        const ssize_t got = read(fd, tmp, sizeof(tmp));
+        if (got <= 0)
+            return false;
+        buf.append(tmp, got);
+    }
+    return true;
+}
+
+// SET throughput of a cluster by node count, each key sent to its owner.
+// Nodes run as processes, so it scales with the cores there are for them.
+// Arg: nodes.
+static void BM_ClusterSet(benchmark::State &state) {
+    const int n = (int) state.range(0);
+    Nodes nodes;
+    if (!nodes.start(n)) {
+        nodes.stop();
+        state.SkipWithError("can't start kv_server");
+        return;
+    }
+    std::vector<std::string> reqs(n);
+    std::vector<size_t> counts(n);
+    std::string replies, val(16, 'v');
+    uint64_t k = 0;
+    for (auto _: state) {
+        for (int i = 0; i < n; i++) {
+            reqs[i].clear();
+            counts[i] = 0;
+        }
+        char key[24];
+        for (int r = 0; r < ROUND; r++, k++) {
+            const int len = snprintf(key, sizeof(key), "key:%llu", (unsigned long long) (k % KEYS));
+            vstr *v = vstr_new(key, len);
+            // Fresh maps split the slots evenly in id order.
+            const int owner = (int) ((uint64_t) cluster_slot(v) * n / CLUSTER_SLOTS);
+            vstr_destroy(v);
+            put_frame(reqs[owner], {"set", std::string_view(key, len), val});
+            counts[owner]++;
+        }
+        for (int i = 0; i < n; i++) {
+            if (!write_all(nodes.fds[i], reqs[i].data(), reqs[i].size())) {
+                state.SkipWithError("send failed");
+                break;
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            if (!read_replies(nodes.fds[i], replies, counts[i])) {
+                state.SkipWithError("bad reply");
+                break;
+            }
+        }
+    }
+    state.SetItemsProcessed((int64_t) state.iterations() * ROUND);
+    nodes.stop();
+}
+BENCHMARK(BM_ClusterSet)->Arg(1)->Arg(2)->Arg(4)->UseRealTime()->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
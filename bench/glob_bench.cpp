@@ -0,0 +1,92 @@
+#include <benchmark/benchmark.h>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "utils.h"
+
+// --- Inputs ---
+
+#define KEYS (10 * 1000 * 1000)
+
+// Keys back to back, `ends[i]` past the i-th.
+struct Keyspace {
+    std::string dat;
+    std::vector<uint32_t> ends;
+};
+
+// Sessions, orders & carts of a million users, built once for all runs.
+static const Keyspace &keyspace() {
+    static Keyspace ks = [] {
+        Keyspace k;
+        std::mt19937_64 rng(42);
+        k.ends.reserve(KEYS);
+        for (int i = 0; i < KEYS; i++) {
+            const std::string id = std::to_string(rng() % 1000000);
+            switch (rng() % 3) {
+                case 0:
+                    k.dat += "user:" + id + ":session";
+                    break;
+                case 1:
+                    k.dat += "order:" + id;
+                    break;
+                default:
+                    k.dat += "cart:" + id + ":items";
+            }
+            k.ends.push_back(k.dat.size());
+        }
+        return k;
+    }();
+    return ks;
+}
+
+// A literal prefix, a literal suffix, a literal inside & all kinds of wildcards.
+static const char *const patterns[] = {"user:1*", "*:items", "*:4242*", "user:*[0-4]:s*n"};
+
+// --- Benchmarks ---
+
+// Args: pattern. Matches every key of the keyspace per iteration.
+static void BM_GlobMatch(benchmark::State &state) {
+    const Keyspace &ks = keyspace();
+    const char *pat = patterns[state.range(0)];
+    const size_t plen = strlen(pat);
+    size_t hits = 0;
+    for (auto _: state) {
+        hits = 0;
+        uint32_t start = 0;
+        for (const uint32_t end: ks.ends) {
+            hits += glob_match(pat, plen, ks.dat.data() + start, end - start);
+            start = end;
+        }
+        benchmark::DoNotOptimize(hits);
+    }
+    state.SetLabel(pat);
+    state.counters["hits"] = (double) hits;
+    state.SetItemsProcessed((int64_t) state.iterations() * KEYS);
+}
+BENCHMARK(BM_GlobMatch)->DenseRange(0, 3)->Unit(benchmark::kMillisecond);
+
+// Args: pattern. As above, compiled once.
+static void BM_GlobCompiled(benchmark::State &state) {
+    const Keyspace &ks = keyspace();
+    const char *pat = patterns[state.range(0)];
+    Glob g;
+    glob_compile(&g, pat, strlen(pat));
+    size_t hits = 0;
+    for (auto _: state) {
+        hits = 0;
+        uint32_t start = 0;
+        for (const uint32_t end: ks.ends) {
+            hits += glob_test(&g, ks.dat.data() + start, end - start);
+            start = end;
+        }
+        benchmark::DoNotOptimize(hits);
+    }
+    state.SetLabel(pat);
+    state.counters["hits"] = (double) hits;
+    state.SetItemsProcessed((int64_t) state.iterations() * KEYS);
+}
+BENCHMARK(BM_GlobCompiled)->DenseRange(0, 3)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
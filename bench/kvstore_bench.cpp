@@ -0,0 +1,521 @@
+#include <algorithm>
+#include <atomic>
+#include <benchmark/benchmark.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <malloc.h>
+#include <mutex>
+#include <random>
+#include <sys/socket.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "aof.h"
+#include "kvstore.h"
+#include "parse.h"
+#include "qsbr.h"
+#include "repl.h"
+#include "ringbuf.h"
+#include "snapshot.h"
+
+static KVStore *g_kv;
+static std::atomic<int> g_ready{0};
+
+static OwnedRequest make_req(std::initializer_list<std::string> args) {
+    OwnedRequest oreq;
+    oreq.is_alloc = false;
+    oreq.base.argc = args.size();
+    oreq.base.argv = (vstr **) malloc(oreq.base.argc * sizeof(vstr *));
+    size_t i = 0;
+    for (const auto &a: args) {
+        oreq.base.argv[i++] = vstr_new(a.c_str(), a.length());
+    }
+    simple2req(&oreq.base, &oreq.req);
+    return oreq;
+}
+
+// GET throughput of a single hot key from every thread, the worst case for
+// per-entry read locks. Arg: value size.
+static void BM_HotGet(benchmark::State &state) {
+    if (state.thread_index() == 0) {
+        qsbr_init(65536);
+        qsbr_reg();
+        g_kv = kv_new(nullptr);
+        RingBuf out;
+        rb_init(&out, 1024);
+        OwnedRequest set_req = make_req({"set", "hot", std::string(state.range(0), 'x')});
+        do_owned_req(g_kv, &set_req, &out);
+        owned_req_destroy(&set_req);
+        rb_destroy(&out);
+        g_ready.store(1, std::memory_order_release);
+    } else {
+        while (!g_ready.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+        qsbr_reg();
+    }
+
+    RingBuf out;
+    rb_init(&out, 4096);
+    OwnedRequest get_req = make_req({"get", "hot"});
+    int64_t n = 0;
+    for (auto _: state) {
+        rb_clear(&out);
+        do_owned_req(g_kv, &get_req, &out);
+        if (++n % 64 == 0)
+            qsbr_quiescent();
+    }
+    owned_req_destroy(&get_req);
+    rb_destroy(&out);
+    state.SetItemsProcessed(state.iterations());
+
+    qsbr_quiescent();
+    qsbr_unreg();
+    // The last one out tears down.
+    if (g_ready.fetch_add(1, std::memory_order_acq_rel) == state.threads()) {
+        qsbr_reg();
+        kv_clear(g_kv);
+        qsbr_unreg();
+        qsbr_destroy();
+        g_ready.store(0, std::memory_order_release);
+    }
+}
+BENCHMARK(BM_HotGet)->Arg(16)->Arg(1024)->ThreadRange(1, 8)->UseRealTime();
+
+// INCR throughput of a single hot counter from every thread, one CAS each.
+static void BM_HotIncr(benchmark::State &state) {
+    if (state.thread_index() == 0) {
+        qsbr_init(65536);
+        qsbr_reg();
+        g_kv = kv_new(nullptr);
+        g_ready.store(1, std::memory_order_release);
+    } else {
+        while (!g_ready.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+        qsbr_reg();
+    }
+
+    RingBuf out;
+    rb_init(&out, 64);
+    OwnedRequest incr_req = make_req({"incr", "ctr"});
+    int64_t n = 0;
+    for (auto _: state) {
+        rb_clear(&out);
+        do_owned_req(g_kv, &incr_req, &out);
+        if (++n % 64 == 0)
+            qsbr_quiescent();
+    }
+    owned_req_destroy(&incr_req);
+    rb_destroy(&out);
+    state.SetItemsProcessed(state.iterations());
+
+    qsbr_quiescent();
+    qsbr_unreg();
+    // The last one out tears down.
+    if (g_ready.fetch_add(1, std::memory_order_acq_rel) == state.threads()) {
+        qsbr_reg();
+        kv_clear(g_kv);
+        qsbr_unreg();
+        qsbr_destroy();
+        g_ready.store(0, std::memory_order_release);
+    }
+}
+BENCHMARK(BM_HotIncr)->ThreadRange(1, 8)->UseRealTime();
+
+// SET throughput over distinct keys with the append-only log. Arg: fsync
+// policy, -2 without a log.
+#define AOF_BENCH_PATH "/tmp/kvstore_bench.aof"
+
+static void BM_SetAof(benchmark::State &state) {
+    const int fsync_ms = (int) state.range(0);
+    if (state.thread_index() == 0) {
+        qsbr_init(65536);
+        qsbr_reg();
+        g_kv = kv_new(nullptr);
+        unlink(AOF_BENCH_PATH);
+        if (fsync_ms >= AOF_FSYNC_NEVER)
+            kv_set_aof(g_kv, aof_open(AOF_BENCH_PATH, fsync_ms));
+        g_ready.store(1, std::memory_order_release);
+    } else {
+        while (!g_ready.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+        qsbr_reg();
+    }
+
+    RingBuf out;
+    rb_init(&out, 64);
+    OwnedRequest req = make_req({"set", "t00:k0000000", "val:0000"});
+    req.req.key->dat[1] = (char) ('0' + state.thread_index() / 10);
+    req.req.key->dat[2] = (char) ('0' + state.thread_index() % 10);
+    int64_t n = 0;
+    char key[16];
+    for (auto _: state) {
+        snprintf(key, sizeof(key), "%07ld", (long) (n % 1000000));
+        memcpy(req.req.key->dat + 5, key, 7);
+        rb_clear(&out);
+        do_owned_req(g_kv, &req, &out);
+        if (++n % 64 == 0)
+            qsbr_quiescent();
+    }
+    owned_req_destroy(&req);
+    rb_destroy(&out);
+    state.SetItemsProcessed(state.iterations());
+
+    qsbr_quiescent();
+    qsbr_unreg();
+    // The last one out tears down.
+    if (g_ready.fetch_add(1, std::memory_order_acq_rel) == state.threads()) {
+        qsbr_reg();
+        kv_clear(g_kv);
+        qsbr_unreg();
+        qsbr_destroy();
+        unlink(AOF_BENCH_PATH);
+        g_ready.store(0, std::memory_order_release);
+    }
+}
+BENCHMARK(BM_SetAof)->Arg(-2)->Arg(AOF_FSYNC_NEVER)->Arg(1)->Arg(AOF_FSYNC_ALWAYS)->Threads(1)->Threads(4)->UseRealTime();
+
+// SET throughput over distinct keys with replication. Arg: 0 without it, 1
+// with no replica linked, 2 streaming to one whose end of a socket pair a
+// thread drains.
+static int g_replica_fd = -1;
+static std::thread g_drain;
+
+static void BM_SetRepl(benchmark::State &state) {
+    const int mode = (int) state.range(0);
+    if (state.thread_index() == 0) {
+        qsbr_init(65536);
+        qsbr_reg();
+        g_kv = kv_new(nullptr);
+        Repl *repl = mode >= 1 ? repl_new() : nullptr;
+        if (repl)
+            kv_set_repl(g_kv, repl);
+        if (mode == 2) {
+            int fds[2];
+            socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+            g_replica_fd = fds[1];
+            g_drain = std::thread([fd = fds[1]] {
+                static char buf[1 << 16];
+                while (read(fd, buf, sizeof(buf)) > 0) {
+                }
+            });
+            repl_add(repl, g_kv, fds[0]);
+            while (repl_replicas(repl) == 0) {
+                std::this_thread::yield();
+            }
+        }
+        g_ready.store(1, std::memory_order_release);
+    } else {
+        while (!g_ready.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+        qsbr_reg();
+    }
+
+    RingBuf out;
+    rb_init(&out, 64);
+    OwnedRequest req = make_req({"set", "t00:k0000000", "val:0000"});
+    req.req.key->dat[1] = (char) ('0' + state.thread_index() / 10);
+    req.req.key->dat[2] = (char) ('0' + state.thread_index() % 10);
+    int64_t n = 0;
+    char key[16];
+    for (auto _: state) {
+        snprintf(key, sizeof(key), "%07ld", (long) (n % 1000000));
+        memcpy(req.req.key->dat + 5, key, 7);
+        rb_clear(&out);
+        do_owned_req(g_kv, &req, &out);
+        if (++n % 64 == 0)
+            qsbr_quiescent();
+    }
+    owned_req_destroy(&req);
+    rb_destroy(&out);
+    state.SetItemsProcessed(state.iterations());
+
+    qsbr_quiescent();
+    qsbr_unreg();
+    // The last one out tears down.
+    if (g_ready.fetch_add(1, std::memory_order_acq_rel) == state.threads()) {
+        qsbr_reg();
+        // Closes the link, the drain sees EOF.
+        kv_clear(g_kv);
+        qsbr_unreg();
+        qsbr_destroy();
+        if (g_drain.joinable()) {
+            g_drain.join();
+            close(g_replica_fd);
+        }
+        g_ready.store(0, std::memory_order_release);
+    }
+}
+BENCHMARK(BM_SetRepl)->Arg(0)->Arg(1)->Arg(2)->Threads(1)->Threads(4)->UseRealTime();
+
+// Latency of a single hot ZSet: thread 0 ZADDs (score updates), the others
+// run ZQUERY scans, holding the entry's read lock for their whole length.
+// Reports per-op percentiles in ns for each side. Arg: scan length.
+#define HOT_ZSET_MEMBERS 10000
+
+static std::mutex g_lat_mu;
+static std::vector<double> g_rlat, g_wlat;
+static std::atomic<int> g_done{0};
+
+static double percentile(std::vector<double> &v, const double p) {
+    if (v.empty())
+        return 0;
+    const size_t i = std::min(v.size() - 1, (size_t) (p * v.size()));
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+static void BM_HotZSet(benchmark::State &state) {
+    const bool writer = state.thread_index() == 0;
+    if (writer) {
+        qsbr_init(65536);
+        qsbr_reg();
+        g_kv = kv_new(nullptr);
+        RingBuf out;
+        rb_init(&out, 1024);
+        for (int i = 0; i < HOT_ZSET_MEMBERS; i++) {
+            OwnedRequest req = make_req({"zadd", "hz", std::to_string(i), "m" + std::to_string(i)});
+            rb_clear(&out);
+            do_owned_req(g_kv, &req, &out);
+            owned_req_destroy(&req);
+        }
+        rb_destroy(&out);
+        g_ready.store(1, std::memory_order_release);
+    } else {
+        while (!g_ready.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+        qsbr_reg();
+    }
+
+    RingBuf out;
+    rb_init(&out, 4096);
+    std::mt19937 rng(state.thread_index());
+    OwnedRequest query = make_req({"zquery", "hz", "0", "", "0", std::to_string(state.range(0) * 2)});
+    std::vector<double> lat;
+    for (auto _: state) {
+        OwnedRequest zadd;
+        if (writer) {
+            const int m = rng() % HOT_ZSET_MEMBERS;
+            zadd = make_req({"zadd", "hz", std::to_string(rng() % HOT_ZSET_MEMBERS), "m" + std::to_string(m)});
+        }
+        rb_clear(&out);
+        const auto t0 = std::chrono::steady_clock::now();
+        do_owned_req(g_kv, writer ? &zadd : &query, &out);
+        lat.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count());
+        if (writer)
+            owned_req_destroy(&zadd);
+        if (lat.size() % 64 == 0)
+            qsbr_quiescent();
+    }
+    owned_req_destroy(&query);
+    rb_destroy(&out);
+    state.SetItemsProcessed(state.iterations());
+    {
+        std::lock_guard<std::mutex> g(g_lat_mu);
+        auto &all = writer ? g_wlat : g_rlat;
+        all.insert(all.end(), lat.begin(), lat.end());
+    }
+    // Counters add up across threads, only the writer reports once everyone
+    // has handed in their samples.
+    if (g_done.fetch_add(1, std::memory_order_acq_rel) + 1 == state.threads()) {
+        g_done.store(0, std::memory_order_release);
+    }
+    if (writer) {
+        while (g_done.load(std::memory_order_acquire) != 0) {
+            std::this_thread::yield();
+        }
+        std::lock_guard<std::mutex> g(g_lat_mu);
+        state.counters["r_p50"] = percentile(g_rlat, 0.5);
+        state.counters["r_p99"] = percentile(g_rlat, 0.99);
+        state.counters["w_p50"] = percentile(g_wlat, 0.5);
+        state.counters["w_p99"] = percentile(g_wlat, 0.99);
+        state.counters["w_p999"] = percentile(g_wlat, 0.999);
+        state.counters["w_max"] = percentile(g_wlat, 1);
+        g_rlat.clear();
+        g_wlat.clear();
+    }
+
+    qsbr_quiescent();
+    qsbr_unreg();
+    // The last one out tears down.
+    if (g_ready.fetch_add(1, std::memory_order_acq_rel) == state.threads()) {
+        qsbr_reg();
+        kv_clear(g_kv);
+        qsbr_unreg();
+        qsbr_destroy();
+        g_ready.store(0, std::memory_order_release);
+    }
+}
+BENCHMARK(BM_HotZSet)->Arg(16)->Arg(256)->Threads(2)->Threads(4)->Threads(8)->UseRealTime();
+
+// SET latency while background saves of a 1M key keyspace run back to back.
+// Reports percentiles in ns. Arg: save rate in MB/s, 0 unthrottled, -1
+// without saves.
+#define SNAP_BENCH_PATH "/tmp/kvstore_bench.snap"
+#define SNAP_BENCH_KEYS 1000000
+
+static void BM_SetDuringSave(benchmark::State &state) {
+    qsbr_init(65536);
+    qsbr_reg();
+    KVStore *kv = kv_new(nullptr);
+    Snapshot *snap = snap_new(SNAP_BENCH_PATH, state.range(0) > 0 ? (uint64_t) state.range(0) << 20 : 0);
+    kv_set_snapshot(kv, snap);
+    RingBuf out;
+    rb_init(&out, 64);
+    OwnedRequest req = make_req({"set", "key:00000000", "val:0000"});
+    char key[24];
+    for (int64_t i = 0; i < SNAP_BENCH_KEYS; i++) {
+        snprintf(key, sizeof(key), "%08ld", (long) i);
+        memcpy(req.req.key->dat + 4, key, 8);
+        rb_clear(&out);
+        do_owned_req(kv, &req, &out);
+        if (i % 1024 == 0)
+            qsbr_quiescent();
+    }
+
+    std::vector<double> lat;
+    int64_t n = 0, saves = 0;
+    for (auto _: state) {
+        if (state.range(0) >= 0 && !snap_running(snap)) {
+            saves += snap_start(snap, kv);
+        }
+        snprintf(key, sizeof(key), "%08ld", (long) (n % SNAP_BENCH_KEYS));
+        memcpy(req.req.key->dat + 4, key, 8);
+        rb_clear(&out);
+        const auto t0 = std::chrono::steady_clock::now();
+        do_owned_req(kv, &req, &out);
+        lat.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count());
+        if (++n % 64 == 0)
+            qsbr_quiescent();
+    }
+    state.SetItemsProcessed(state.iterations());
+    state.counters["p50"] = percentile(lat, 0.5);
+    state.counters["p99"] = percentile(lat, 0.99);
+    state.counters["p999"] = percentile(lat, 0.999);
+    state.counters["saves"] = (double) saves;
+
+    owned_req_destroy(&req);
+    rb_destroy(&out);
+    kv_clear(kv);
+    qsbr_quiescent();
+    qsbr_unreg();
+    qsbr_destroy();
+    unlink(SNAP_BENCH_PATH);
+}
+BENCHMARK(BM_SetDuringSave)->Arg(-1)->Arg(0)->Arg(64)->Arg(8)->UseRealTime()->Unit(benchmark::kMicrosecond);
+
+// Startup load of a snapshot of `state.range(0)` keys with 32 byte values,
+// a ZSet of 100 members every 1024 keys. Reports file bytes & keys per second.
+// Args: keys, load threads, compressed.
+static void BM_SnapLoad(benchmark::State &state) {
+    const int64_t nkeys = state.range(0);
+    qsbr_init(65536);
+    qsbr_reg();
+    KVStore *kv = kv_new(nullptr);
+    Snapshot *snap = snap_new(SNAP_BENCH_PATH, 0);
+    snap_set_compress(snap, state.range(2));
+    kv_set_snapshot(kv, snap);
+    RingBuf out;
+    rb_init(&out, 64);
+    OwnedRequest set_req = make_req({"set", "key:00000000", std::string(32, 'v')});
+    OwnedRequest zadd_req = make_req({"zadd", "key:00000000", "1", "member:0000"});
+    char key[24];
+    for (int64_t i = 0; i < nkeys; i++) {
+        OwnedRequest *req = i % 1024 ? &set_req : &zadd_req;
+        snprintf(key, sizeof(key), "%08ld", (long) i);
+        memcpy(req->req.key->dat + 4, key, 8);
+        for (int m = 0; m < (i % 1024 ? 1 : 100); m++) {
+            if (req == &zadd_req) {
+                req->req.args.zadd_arg.name->dat[9] = (char) ('0' + m / 10);
+                req->req.args.zadd_arg.name->dat[10] = (char) ('0' + m % 10);
+            }
+            rb_clear(&out);
+            do_owned_req(kv, req, &out);
+        }
+        if (i % 1024 == 0)
+            qsbr_quiescent();
+    }
+    OwnedRequest save_req = make_req({"save"});
+    rb_clear(&out);
+    do_owned_req(kv, &save_req, &out);
+    owned_req_destroy(&save_req);
+    owned_req_destroy(&set_req);
+    owned_req_destroy(&zadd_req);
+    kv_clear(kv);
+    qsbr_quiescent();
+
+    FILE *f = fopen(SNAP_BENCH_PATH, "rb");
+    fseek(f, 0, SEEK_END);
+    const int64_t size = ftell(f);
+    fclose(f);
+    for (auto _: state) {
+        kv = kv_new(nullptr);
+        if (snap_load(kv, SNAP_BENCH_PATH, (int) state.range(1)) != nkeys)
+            state.SkipWithError("load failed");
+        state.PauseTiming();
+        kv_clear(kv);
+        qsbr_quiescent();
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(state.iterations() * size);
+    state.counters["file_mb"] = (double) size / (1 << 20);
+    state.counters["keys"] = benchmark::Counter((double) (state.iterations() * nkeys), benchmark::Counter::kIsRate);
+    rb_destroy(&out);
+    qsbr_unreg();
+    qsbr_destroy();
+    unlink(SNAP_BENCH_PATH);
+}
+BENCHMARK(BM_SnapLoad)
+        ->Args({1 << 20, 1, 0})
+        ->Args({1 << 20, 1, 1})
+        ->Args({1 << 20, 4, 0})
+        ->Args({4 << 20, 4, 0})
+        ->UseRealTime()
+        ->Unit(benchmark::kMillisecond);
+
+// Heap bytes per key after SETting `state.range(0)` small keys (12 bytes)
+// with 8 byte values, table included.
+static size_t heap_used() {
+    const struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+static void BM_MemPerKey(benchmark::State &state) {
+    const int64_t nkeys = state.range(0);
+    qsbr_init(65536);
+    qsbr_reg();
+    RingBuf out;
+    rb_init(&out, 64);
+    OwnedRequest req = make_req({"set", "key:00000000", "val:0000"});
+    for (auto _: state) {
+        const size_t before = heap_used();
+        KVStore *kv = kv_new(nullptr);
+        char key[24], val[16];
+        for (int64_t i = 0; i < nkeys; i++) {
+            snprintf(key, sizeof(key), "key:%08ld", (long) i);
+            snprintf(val, sizeof(val), "val:%04ld", (long) (i % 10000));
+            memcpy(req.req.key->dat, key, 12);
+            memcpy(req.req.args.val->dat, val, 8);
+            rb_clear(&out);
+            do_owned_req(kv, &req, &out);
+        }
+        qsbr_quiescent();
+        state.counters["bytes_per_key"] = (double) (heap_used() - before) / (double) nkeys;
+        kv_clear(kv);
+        qsbr_quiescent();
+    }
+    owned_req_destroy(&req);
+    rb_destroy(&out);
+    qsbr_unreg();
+    qsbr_destroy();
+}
+BENCHMARK(BM_MemPerKey)->Arg(1 << 20)->Arg(10000000)->Iterations(1)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
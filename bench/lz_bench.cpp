@@ -0,0 +1,120 @@
+#include <benchmark/benchmark.h>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "lz.h"
+
+// --- Inputs ---
+
+enum Input { RECORDS, MEMBERS, RANDOM };
+
+// Log records of SETs with JSON-ish values, ZSet members with scores as
+// snapshots have them, or incompressible bytes.
+static std::string make_input(const int kind, const size_t n) {
+    std::mt19937_64 rng(42);
+    std::string s;
+    while (s.size() < n) {
+        const uint64_t id = rng() % 1000000;
+        switch (kind) {
+            case RECORDS: {
+                const std::string key = "user:" + std::to_string(id);
+                const std::string val = R"({"name":"user )" + std::to_string(id) + R"(","email":"user)" +
+                                        std::to_string(id) + R"(@example.com","active":)" +
+                                        (rng() % 2 ? "true" : "false") + "}";
+                const uint32_t lens[] = {(uint32_t) (4 + 4 + 3 + 4 + key.size() + 4 + val.size()), 3, 3};
+                s.append((const char *) lens, sizeof(lens));
+                s += "set";
+                const uint32_t klen = key.size(), vlen = val.size();
+                s.append((const char *) &klen, 4);
+                s += key;
+                s.append((const char *) &vlen, 4);
+                s += val;
+                break;
+            }
+            case MEMBERS: {
+                const std::string name = "player:" + std::to_string(id);
+                const double score = (double) (rng() % 100000);
+                s += (char) name.size();
+                s += name;
+                s.append((const char *) &score, 8);
+                break;
+            }
+            default: {
+                const uint64_t r = rng();
+                s.append((const char *) &r, 8);
+            }
+        }
+    }
+    s.resize(n);
+    return s;
+}
+
+// --- Benchmarks ---
+
+// Args: input kind, block size. Reports raw bytes per second & the ratio.
+static void BM_LzCompress(benchmark::State &state) {
+    const std::string in = make_input((int) state.range(0), 16 << 20);
+    const size_t block = state.range(1);
+    std::vector<uint8_t> out(lz_bound(block));
+    size_t raw = 0, compressed = 0;
+    for (auto _: state) {
+        for (size_t off = 0; off < in.size(); off += block) {
+            compressed += lz_compress((const uint8_t *) in.data() + off, block, out.data());
+            raw += block;
+        }
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed((int64_t) raw);
+    state.counters["ratio"] = (double) raw / (double) compressed;
+}
+BENCHMARK(BM_LzCompress)
+        ->ArgsProduct({{RECORDS, MEMBERS, RANDOM}, {4 << 10, 64 << 10}})
+        ->Unit(benchmark::kMillisecond);
+
+static void BM_LzDecompress(benchmark::State &state) {
+    const std::string in = make_input((int) state.range(0), 16 << 20);
+    const size_t block = state.range(1);
+    std::vector<std::vector<uint8_t>> blocks;
+    for (size_t off = 0; off < in.size(); off += block) {
+        std::vector<uint8_t> b(lz_bound(block));
+        b.resize(lz_compress((const uint8_t *) in.data() + off, block, b.data()));
+        blocks.push_back(std::move(b));
+    }
+    std::vector<uint8_t> out(block);
+    size_t raw = 0;
+    for (auto _: state) {
+        for (const auto &b: blocks) {
+            if (!lz_decompress(b.data(), b.size(), out.data(), block))
+                state.SkipWithError("bad block");
+            raw += block;
+        }
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed((int64_t) raw);
+}
+BENCHMARK(BM_LzDecompress)
+        ->ArgsProduct({{RECORDS, MEMBERS, RANDOM}, {4 << 10, 64 << 10}})
+        ->Unit(benchmark::kMillisecond);
+
+// Framing as the log & snapshots do it, checksum included.
+static void BM_LzBlockPut(benchmark::State &state) {
+    const std::string in = make_input(RECORDS, 16 << 20);
+    const size_t block = 64 << 10;
+    const bool compress = state.range(0);
+    std::vector<uint8_t> out(lz_block_bound(block));
+    size_t raw = 0, written = 0;
+    for (auto _: state) {
+        for (size_t off = 0; off < in.size(); off += block) {
+            written += lz_block_put((const uint8_t *) in.data() + off, block, out.data(), compress);
+            raw += block;
+        }
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed((int64_t) raw);
+    state.counters["ratio"] = (double) raw / (double) written;
+}
+BENCHMARK(BM_LzBlockPut)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
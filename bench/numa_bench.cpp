@@ -0,0 +1,101 @@
+#include <algorithm>
+#include <benchmark/benchmark.h>
+#include <numeric>
+#include <pthread.h>
+#include <random>
+#include <sched.h>
+#include <string>
+#include <sys/mman.h>
+#include <vector>
+
+#include "topo.h"
+
+// Dependent-load latency of memory placed on one node, read from a thread
+// pinned to another, like `numactl --cpunodebind=C --membind=M`.
+//
+// Registers every (cpu node, mem node) pair plus an interleaved placement
+// per cpu node. With a single node only the local and interleaved runs exist
+// and both measure local latency.
+
+// Larger than any LLC so every hop misses.
+static constexpr size_t kBufBytes = 256UL << 20;
+static constexpr size_t kLine = 64;
+static constexpr int kInterleave = -1;
+
+struct Line {
+    Line *next;
+    char pad[kLine - sizeof(Line *)];
+};
+
+// Link every line into a single random cycle so the prefetcher can't help.
+static Line *build_chase(Line *lines, size_t n) {
+    std::vector<size_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin() + 1, order.end(), std::mt19937_64(42));
+    for (size_t i = 0; i < n; i++) {
+        lines[order[i]].next = &lines[order[(i + 1) % n]];
+    }
+    return &lines[order[0]];
+}
+
+static void BM_PointerChase(benchmark::State &state) {
+    const int cpu_node = state.range(0), mem_node = state.range(1);
+
+    cpu_set_t orig;
+    pthread_getaffinity_np(pthread_self(), sizeof(orig), &orig);
+    int cpus[TOPO_MAX_CPUS];
+    const int ncpus = topo_node_cpus(cpu_node, cpus, TOPO_MAX_CPUS);
+    if (ncpus > 0) {
+        topo_pin(pthread_self(), cpus, ncpus);
+    }
+
+    void *buf = mmap(nullptr, kBufBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        state.SkipWithError("mmap failed");
+        return;
+    }
+    // Set the policy before `build_chase` touches the pages.
+    const int err = mem_node == kInterleave ? topo_interleave(buf, kBufBytes) : topo_bind(buf, kBufBytes, mem_node);
+    if (err) {
+        state.SkipWithError("mbind failed");
+        munmap(buf, kBufBytes);
+        return;
+    }
+    const size_t n = kBufBytes / sizeof(Line);
+    Line *p = build_chase(static_cast<Line *>(buf), n);
+
+    constexpr size_t kHops = 1 << 20;
+    for (auto _: state) {
+        for (size_t i = 0; i < kHops; i++) {
+            p = p->next;
+        }
+        benchmark::DoNotOptimize(p);
+    }
+    state.counters["ns_per_hop"] =
+            benchmark::Counter(state.iterations() * kHops, benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+    state.SetLabel(mem_node == kInterleave ? "interleave" : cpu_node == mem_node ? "local" : "remote");
+
+    munmap(buf, kBufBytes);
+    pthread_setaffinity_np(pthread_self(), sizeof(orig), &orig);
+}
+
+int main(int argc, char **argv) {
+    int nodes[TOPO_MAX_NODES];
+    const int n = topo_nodes(nodes, TOPO_MAX_NODES);
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            benchmark::RegisterBenchmark("BM_PointerChase", BM_PointerChase)
+                    ->ArgNames({"cpu_node", "mem_node"})
+                    ->Args({nodes[i], nodes[j]})
+                    ->Unit(benchmark::kMillisecond);
+        }
+        benchmark::RegisterBenchmark("BM_PointerChase", BM_PointerChase)
+                ->ArgNames({"cpu_node", "mem_node"})
+                ->Args({nodes[i], kInterleave})
+                ->Unit(benchmark::kMillisecond);
+    }
+    benchmark::Initialize(&argc, argv);
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,44 @@
+#include <atomic>
+#include <benchmark/benchmark.h>
+#include <thread>
+
+#include "qsbr.h"
+
+// Retire throughput: every thread allocates & retires small objects and
+// reports a quiescent state every `state.range(0)` retires, like a worker
+// finishing a batch of requests.
+
+static std::atomic<int> g_ready{0};
+
+static void BM_RetireQuiescent(benchmark::State &state) {
+    const int64_t batch = state.range(0);
+    if (state.thread_index() == 0) {
+        qsbr_init(65536);
+        g_ready.store(1, std::memory_order_release);
+    } else {
+        while (!g_ready.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+    }
+    qsbr_reg();
+
+    int64_t n = 0;
+    for (auto _: state) {
+        qsbr_retire(qsbr_calloc(1, 64), nullptr);
+        if (++n % batch == 0)
+            qsbr_quiescent();
+    }
+    qsbr_quiescent();
+    state.SetItemsProcessed(state.iterations());
+
+    qsbr_unreg();
+    // The benchmark library joins every thread before the next run starts,
+    // the last one out tears down.
+    if (g_ready.fetch_add(1, std::memory_order_acq_rel) == state.threads()) {
+        qsbr_destroy();
+        g_ready.store(0, std::memory_order_release);
+    }
+}
+BENCHMARK(BM_RetireQuiescent)->Arg(1)->Arg(64)->Threads(1)->ThreadRange(8, 32)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,110 @@
+#include <atomic>
+#include <benchmark/benchmark.h>
+#include <thread>
+#include <vector>
+
+#include "cqueue.h"
+#include "spsc.h"
+#include "thread_pool.h"
+
+// Result path of the thread pool: N workers hand nodes to one master that
+// drains them, either through one shared `cqueue` or one `spscq` per worker.
+//
+// Each benchmark iteration moves `kBatch` nodes per producer, the consumer is
+// the benchmark thread itself.
+
+static constexpr int kBatch = 1 << 14;
+
+static cnode g_node;
+
+// --- Uncontended put + pop, the per-op cost without any cache-line traffic ---
+
+static void BM_CQueue_PutPop(benchmark::State &state) {
+    cqueue *q = cq_init(nullptr, QUEUESIZE);
+    for (auto _: state) {
+        cq_put(q, &g_node);
+        benchmark::DoNotOptimize(cq_pop(q));
+    }
+    state.SetItemsProcessed(state.iterations());
+    cq_destroy(q);
+}
+BENCHMARK(BM_CQueue_PutPop);
+
+static void BM_SPSC_PutPop(benchmark::State &state) {
+    spscq *q = spsc_init(nullptr, QUEUESIZE);
+    for (auto _: state) {
+        spsc_put(q, &g_node);
+        benchmark::DoNotOptimize(spsc_pop(q));
+    }
+    state.SetItemsProcessed(state.iterations());
+    spsc_destroy(q);
+}
+BENCHMARK(BM_SPSC_PutPop);
+
+// --- N producers, one consumer ---
+
+static void BM_CQueue_Shared(benchmark::State &state) {
+    const int producers = state.range(0);
+    // Same total capacity as the per-producer rings
+    cqueue *q = cq_init(nullptr, QUEUESIZE * producers);
+
+    for (auto _: state) {
+        std::vector<std::thread> ts;
+        for (int i = 0; i < producers; i++) {
+            ts.emplace_back([q]() {
+                for (int j = 0; j < kBatch; j++) {
+                    while (!cq_put(q, &g_node))
+                        std::this_thread::yield();
+                }
+            });
+        }
+        for (long got = 0; got < (long) producers * kBatch;) {
+            if (cq_pop(q))
+                got++;
+            else
+                std::this_thread::yield();
+        }
+        for (auto &t: ts)
+            t.join();
+    }
+    state.SetItemsProcessed(state.iterations() * producers * kBatch);
+    cq_destroy(q);
+}
+BENCHMARK(BM_CQueue_Shared)->RangeMultiplier(2)->Range(1, 8)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+static void BM_SPSC_PerProducer(benchmark::State &state) {
+    const int producers = state.range(0);
+    std::vector<spscq *> qs;
+    for (int i = 0; i < producers; i++)
+        qs.push_back(spsc_init(nullptr, QUEUESIZE));
+
+    for (auto _: state) {
+        std::vector<std::thread> ts;
+        for (int i = 0; i < producers; i++) {
+            ts.emplace_back([q = qs[i]]() {
+                for (int j = 0; j < kBatch; j++) {
+                    while (!spsc_put(q, &g_node))
+                        std::this_thread::yield();
+                }
+            });
+        }
+        // Drain the rings in turn like `pool_cb`
+        for (long got = 0; got < (long) producers * kBatch;) {
+            long before = got;
+            for (spscq *q: qs) {
+                while (spsc_pop(q))
+                    got++;
+            }
+            if (got == before)
+                std::this_thread::yield();
+        }
+        for (auto &t: ts)
+            t.join();
+    }
+    state.SetItemsProcessed(state.iterations() * producers * kBatch);
+    for (spscq *q: qs)
+        spsc_destroy(q);
+}
+BENCHMARK(BM_SPSC_PerProducer)->RangeMultiplier(2)->Range(1, 8)->UseRealTime()->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
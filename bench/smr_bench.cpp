@@ -0,0 +1,110 @@
+#include <atomic>
+#include <benchmark/benchmark.h>
+#include <random>
+#include <thread>
+
+#include "hpmap.h"
+#include "smr.h"
+#include "utils.h"
+
+// Keyspace workloads under each reclamation backend. Every op is a critical
+// section and threads report a quiescent state every `QUIESCE_EVERY` ops,
+// like a worker between requests. Writes replace a key: remove & retire the
+// old entry, add a fresh one.
+//
+// Args: backend (0 = QSBR, 1 = EBR), percentage of reads.
+
+#define NKEYS (1 << 16)
+#define QUIESCE_EVERY 16
+
+struct TestEntry {
+    BNode node;
+    uint64_t key;
+    uint64_t value;
+};
+
+static bool test_entry_eq(BNode *lhs, BNode *rhs) {
+    if (!lhs || !rhs)
+        return lhs == rhs;
+    return container_of(lhs, TestEntry, node)->key == container_of(rhs, TestEntry, node)->key;
+}
+
+static TestEntry *new_entry(const uint64_t key) {
+    auto *e = static_cast<TestEntry *>(smr_calloc(1, sizeof(TestEntry)));
+    e->key = key;
+    e->value = key;
+    e->node.hcode = int_hash_rapid(key);
+    return e;
+}
+
+static bool free_entry(BNode *n, void *) {
+    smr_retire(container_of(n, TestEntry, node), nullptr);
+    return true;
+}
+
+static CHPMap *g_map;
+static std::atomic<int> g_ready{0};
+
+static void BM_Keyspace(benchmark::State &state) {
+    const SMR *backend = state.range(0) ? &smr_ebr : &smr_qsbr;
+    const int64_t read_pct = state.range(1);
+    if (state.thread_index() == 0) {
+        smr_init(backend, 65536);
+        smr_reg();
+        g_map = chpm_new(nullptr, NKEYS);
+        for (uint64_t k = 0; k < NKEYS; k++) {
+            chpm_add(g_map, &new_entry(k)->node, test_entry_eq);
+        }
+        g_ready.store(1, std::memory_order_release);
+    } else {
+        while (!g_ready.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+        smr_reg();
+    }
+
+    std::mt19937_64 rng(state.thread_index());
+    int64_t n = 0;
+    for (auto _: state) {
+        const uint64_t r = rng();
+        const uint64_t key = r % NKEYS;
+        TestEntry q{{int_hash_rapid(key)}, key, 0};
+        smr_enter();
+        if ((int64_t) (r >> 32) % 100 < read_pct) {
+            BNode *found = chpm_lookup(g_map, &q.node, test_entry_eq);
+            if (found)
+                benchmark::DoNotOptimize(container_of(found, TestEntry, node)->value);
+        } else {
+            BNode *old = chpm_remove(g_map, &q.node, test_entry_eq);
+            if (old)
+                smr_retire(container_of(old, TestEntry, node), nullptr);
+            TestEntry *e = new_entry(key);
+            if (!chpm_add(g_map, &e->node, test_entry_eq))
+                smr_retire(e, nullptr);
+        }
+        smr_exit();
+        if (++n % QUIESCE_EVERY == 0)
+            smr_quiescent();
+    }
+    smr_quiescent();
+    state.SetItemsProcessed(state.iterations());
+    state.SetLabel(backend->name);
+
+    smr_unreg();
+    // The last one out tears down.
+    if (g_ready.fetch_add(1, std::memory_order_acq_rel) == state.threads()) {
+        smr_reg();
+        chpm_foreach(g_map, free_entry, nullptr, test_entry_eq);
+        chpm_destroy(g_map);
+        smr_unreg();
+        smr_destroy();
+        g_ready.store(0, std::memory_order_release);
+    }
+}
+BENCHMARK(BM_Keyspace)
+        ->ArgNames({"ebr", "read%"})
+        ->ArgsProduct({{0, 1}, {95, 50}})
+        ->ThreadRange(1, 8)
+        ->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,92 @@
+#ifndef AOF_H
+#define AOF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+// fsync policy, any other positive value fsyncs every that many ms.
+#define AOF_FSYNC_ALWAYS 0 // writes wait for the fsync covering them
+#define AOF_FSYNC_NEVER (-1) // left to the kernel
+// Writer tick, the longest a record stays in memory unless fsyncs are rarer.
+#define AOF_WRITE_MS 10
+// Keys map to stripes, records of one stripe keep their order in the log.
+#define AOF_STRIPES 64
+// Auto rewrite defaults: once the log grew by this % since the last rewrite
+// & is at least that big.
+#define AOF_REWRITE_PCT 100
+#define AOF_REWRITE_MIN (64ull << 20)
+// In place of a record length, a block of records follows.
+#define AOF_BLOCK_MARK UINT32_MAX
+
+// Append-only log of write commands, one record per command in the request
+// wire format: u32 length, u32 argc, then u32 length + bytes per argument.
+// With compression on, writes go out as AOF_BLOCK_MARK & a block of whole
+// records (see `lz_block_put`), both kinds mix in a file.
+//
+// Workers append to per-stripe buffers under the stripe lock, a writer thread
+// drains them all per tick into one write (group commit) & fsyncs per policy.
+// Bytes not fsynced yet are kept, on an error the file is cut back to the
+// last fsync & they are written again.
+//
+// A rewrite compacts the log in the background: a thread dumps the keyspace
+// to a new file while appends are also copied to per-stripe diff buffers, it
+// catches up on those, then swaps files with appends held for the last of
+// the diff & one fsync. Every logged record sets state rather than changing
+// it (INCR is logged as the SET of its result), so replaying the writes that
+// raced the dump on top of it is harmless.
+struct AOF;
+typedef struct AOF AOF;
+struct KVStore;
+typedef struct KVStore KVStore;
+
+// Open or create `path` for appending & start the writer, NULL on error.
+AOF *aof_open(const char *path, int fsync_ms);
+// Drain, fsync & stop the writer, after any running rewrite.
+void aof_close(AOF *aof);
+// Rewrite once the log grew by `pct`% since the last one & is at least
+// `min_size` bytes, 0 disables. Defaults to AOF_REWRITE_PCT & AOF_REWRITE_MIN.
+void aof_set_auto_rewrite(AOF *aof, int pct, uint64_t min_size);
+// Whether the auto rewrite policy calls for one now, cheap.
+bool aof_wants_rewrite(AOF *aof);
+// Start rewriting the log from `kv`, false if a rewrite is running.
+bool aof_rewrite_start(AOF *aof, KVStore *kv);
+// Wait for the last rewrite, false if it failed or none ran.
+//
+// NOTE: Not concurrently with `aof_rewrite_start`.
+bool aof_rewrite_wait(AOF *aof);
+// Compress what the writer & rewrites write from now on, off by default.
+void aof_set_compress(AOF *aof, bool on);
+// Bytes in the log.
+uint64_t aof_size(AOF *aof);
+uint32_t aof_stripe(const vstr *key);
+void aof_lock(AOF *aof, uint32_t stripe);
+void aof_unlock(AOF *aof, uint32_t stripe);
+// Under the stripe lock. Returns the flush generation to `aof_wait` for.
+uint64_t aof_append(AOF *aof, uint32_t stripe, uint32_t argc, const vstr *const *argv);
+// Block until generation `gen` is on disk, returns right away unless the
+// policy is AOF_FSYNC_ALWAYS. Waiters of one flush share its fsync. False if
+// it failed to get there (or, under other policies, the log is failing).
+bool aof_wait(AOF *aof, uint64_t gen);
+// Whether drained records failed to be written or fsynced. The writer keeps
+// retrying them, the log is healthy again once they made it or a rewrite
+// replaced it. Writes are meant to be refused meanwhile.
+bool aof_failed(AOF *aof);
+// Replay `path` into `kv`, records are sharded by key over `nthreads`
+// threads. A torn last record is cut off the file. Returns the records
+// replayed, 0 if there's no file, -1 on I/O errors or a corrupt record.
+//
+// NOTE: Runs `do_owned_req`, `kv` must not have a log attached yet.
+int64_t aof_load(KVStore *kv, const char *path, int nthreads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* AOF_H */
@@ -0,0 +1,101 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+#define CLUSTER_SLOTS 16384
+#define CLUSTER_MAX_NODES 64
+// Slots map to stripes, the lock of one covers who owns its slots & the
+// writes to them while they move.
+#define CLUSTER_STRIPES 64
+// How long the source of a migration waits for the target to take over
+// before asking it.
+#define CLUSTER_FLIP_MS 5000
+
+// Hash-slot sharding over independent nodes.
+//
+// A key maps to one of CLUSTER_SLOTS slots by the top bits of its hash.
+// Every node knows who owns which slots, serves keys of its own & redirects
+// the rest to the owner's client address ("moved HOST:PORT"). Nodes start
+// with even ranges in id order, the map is saved to a file of each on
+// changes.
+//
+// CLUSTER MIGRATE moves a range of slots while both ends serve: the source
+// connects to the target as a client & sends CLUSTER IMPORT, the connection
+// leaves the target's event loop for an import thread that answers it. The
+// source marks the slots migrating, dumps their keys (see `kv_dump`), then
+// streams the writes to them since, which workers append to per-stripe
+// buffers. Once the stream runs dry it holds every stripe, sends the rest & a
+// CLUSTER SETSLOT and hands the slots over when the target acks it. Every
+// other node gets the SETSLOT too, then the source drops the keys it gave
+// away.
+//
+// Without an ack in CLUSTER_FLIP_MS either node may own the slots, requests
+// on them get "tryagain" until the source knows: it hangs up, then takes a
+// late ack or, once the import ended, the owner in the target's CLUSTER
+// SLOTS, asking until it answers.
+//
+// A node that missed the SETSLOT redirects to the old owner, which redirects
+// on. The target drops what it got if the link breaks before the SETSLOT.
+struct Cluster;
+typedef struct Cluster Cluster;
+struct KVStore;
+typedef struct KVStore KVStore;
+
+// Node `id` of the `n` nodes reached by clients at `addrs` (`host:port`),
+// serving `kv`. Loads the slot map from `path`, or splits the slots evenly if
+// there's none yet. NULL on errors.
+Cluster *cluster_new(KVStore *kv, int id, int n, const char *const *addrs, const char *path);
+// Stop migrations & imports.
+void cluster_free(Cluster *cl);
+static inline uint32_t cluster_slot(const vstr *key) {
+    return (uint32_t) (vstr_hash_rapid(key) >> 50);
+}
+// Before running a command on a key of `slot`: NULL if it's ours, with the
+// stripe held until `cluster_exit`, else the redirect for the client.
+const char *cluster_enter(Cluster *cl, uint32_t slot, bool write);
+void cluster_exit(Cluster *cl, uint32_t slot, bool write);
+// Whether writes to `key` go to a migration too, cheap unless one runs.
+bool cluster_migrating(Cluster *cl, const vstr *key);
+// A write to `key` as the log records it.
+//
+// NOTE: Under `cluster_enter`, which holds the stripe for it.
+void cluster_append(Cluster *cl, const vstr *key, uint32_t argc, const vstr *const *argv);
+// Start moving slots `first` to `last` to node `to` in the background, an
+// error for the client if it can't.
+const char *cluster_migrate(Cluster *cl, int64_t first, int64_t last, int64_t to);
+// Record that node `node` owns slots `first` to `last`, an error for the
+// client if it can't.
+//
+// NOTE: Giving slots of ours away waits for requests on keys to finish,
+// callers hold no references.
+const char *cluster_setslot(Cluster *cl, int64_t first, int64_t last, int64_t node);
+// Take over the connected socket `fd` of a node moving slots `first` to
+// `last` here, which sent CLUSTER IMPORT. `fd` is closed either way in the
+// end.
+bool cluster_import(Cluster *cl, int fd, int64_t first, int64_t last);
+// CLUSTER_FLIP_MS by default, for migrations started from now on.
+void cluster_set_flip_ms(Cluster *cl, int ms);
+int cluster_id(Cluster *cl);
+int cluster_nodes(Cluster *cl);
+int cluster_owner(Cluster *cl, uint32_t slot);
+// The client address of `node`.
+const char *cluster_addr(Cluster *cl, int node);
+// Slots this node owns.
+size_t cluster_owned(Cluster *cl);
+// Whether a migration out of this node runs, dropping the keys included.
+bool cluster_busy(Cluster *cl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CLUSTER_H */
@@ -26,6 +26,7 @@ enum ConnState {
     AGAIN,
     WAIT,
     CLOSE,
+    HANDOFF, // the connection left the loop, see `conn_detach`
 };
 typedef enum ConnState ConnState;
 
@@ -36,6 +37,8 @@ struct Conn {
     bool is_alloc;
     ev_io iow;
     uint64_t last_active;
+    // Requests handed to workers whose replies are not in outgo yet.
+    uint32_t inflight;
     RingBuf income, outgo;
 };
 typedef struct Conn Conn;
@@ -52,6 +55,9 @@ void srv_init(SrvConn *c, int fd, const struct sockaddr *addr, socklen_t len);
 void srv_clear(SrvConn *c);
 Conn *conn_init(Conn *c, int fd);
 void conn_clear(Conn *c);
+// Take `c` out of the loop & free it, but keep its socket open. Returns the
+// socket, the caller owns it from then on.
+int conn_detach(Conn *c);
 
 #ifdef __cplusplus
 }
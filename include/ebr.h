@@ -0,0 +1,38 @@
+#ifndef EBR_H
+#define EBR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* ifndef __cplusplus */
+
+#include <stddef.h>
+
+// Thread slots, a multiple of 64.
+#define EBR_MAX_THREADS 1024
+
+// Epoch based reclamation: readers bracket their accesses with
+// `ebr_enter`/`ebr_exit` instead of reporting quiescent states, so threads
+// outside a critical section never hold up reclamation.
+//
+// NOTE: `back_logs` is unused, as with `qsbr_init`.
+void ebr_init(size_t back_logs);
+void ebr_destroy();
+void ebr_reg();
+void ebr_unreg();
+void *ebr_calloc(size_t nmemb, size_t size);
+// Freed once every critical section that may still see `ptr` has exited.
+void ebr_retire(void *ptr, void (*cb)(void *));
+// Free right away, for objects only reachable through one being reclaimed.
+void ebr_free(void *ptr);
+// Critical sections nest.
+void ebr_enter();
+void ebr_exit();
+// Every so many calls, try to advance the epoch & reclaim. Outside of critical
+// sections only, `ebr_exit` does it too.
+void ebr_quiescent();
+
+#ifdef __cplusplus
+}
+#endif /* ifndef __cplusplus */
+
+#endif /* ifndef EBR_H */
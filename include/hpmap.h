@@ -53,6 +53,8 @@ struct BNode *shpm_lookup(struct SHPMap *m, struct BNode *k, node_eq eq);
 struct BNode *shpm_remove(struct SHPMap *m, struct BNode *k, node_eq eq);
 struct BNode *shpm_upsert(struct SHPMap *m, struct BNode *n, node_eq eq);
 bool shpm_foreach(struct SHPMap *m, bool (*f)(struct BNode *, void *), void *arg);
+// Bytes held by the tables, nodes excluded.
+u64 shpm_mem(struct SHPMap *m);
 
 struct CHPMap *chpm_new(struct CHPMap *m, size_t size);
 void chpm_destroy(struct CHPMap *m);
@@ -63,6 +65,26 @@ struct BNode *chpm_remove(struct CHPMap *m, struct BNode *k, node_eq eq);
 u64 chpm_size(struct CHPMap *m);
 struct BNode *chpm_upsert(struct CHPMap *m, struct BNode *n, node_eq eq);
 bool chpm_foreach(struct CHPMap *m, bool (*f)(struct BNode *, void *), void *arg, node_eq eq);
+// Grow the table ahead of `n` nodes, so adding them won't resize it.
+void chpm_reserve(struct CHPMap *m, size_t n, node_eq eq);
+// Resumable walk, a critical section per call so callers may pause in between.
+// Visits the nodes homed in the next `count` buckets from `cursor`, 0 to
+// start, & returns the cursor to go on from, 0 once done. `f` returning false
+// stops it after the current bucket. Stable across resizes: a node present
+// for the whole walk is visited once, one added or removed meanwhile at most
+// once. A grown table makes each call cover proportionally more buckets.
+#define CHPM_SCAN_BITS_SHIFT 58
+// Cursor fields: log2 of the table size the walk started on & the next home
+// by low bits of the hash.
+#define CHPM_SCAN_BITS(c) ((c) >> CHPM_SCAN_BITS_SHIFT)
+#define CHPM_SCAN_POS(c) ((c) & ((1ULL << CHPM_SCAN_BITS_SHIFT) - 1))
+u64 chpm_scan(struct CHPMap *m, u64 cursor, u64 count, bool (*f)(struct BNode *, void *), void *arg, node_eq eq);
+// Bytes held by the active table, nodes excluded.
+u64 chpm_mem(struct CHPMap *m);
+// Up to `n` nodes, segment by segment from a bucket picked by `seed`. For
+// approximate eviction, the nodes stay valid in the caller's critical section
+// only.
+size_t chpm_sample(struct CHPMap *m, u64 seed, struct BNode **out, size_t n);
 
 #ifdef __cplusplus
 }
@@ -30,9 +30,42 @@ enum ErrType {
     ERR_TOO_BIG = 2,
     ERR_BAD_TYP = 3,
     ERR_BAD_ARG = 4,
+    ERR_OOM = 5,
 };
 
+// What a write does once `maxmemory` is reached.
+enum EvictPolicy {
+    EVICT_NONE = 0, // reject it
+    EVICT_LRU = 1, // evict the least recently used of a sample
+    EVICT_LFU = 2, // evict the least frequently used of a sample
+};
+
+// Policy for running cheap read-only commands on the I/O thread.
+enum InlineMode {
+    INLINE_OFF = 0, // always offload to workers
+    INLINE_ADAPTIVE = 1, // inline when workers are busy or the request is cheap
+    INLINE_ALWAYS = 2,
+};
+
+// Entry flags
+#define ENT_F_PROBE 1 // lookup key on the stack, see `val.key`
+#define ENT_F_INLINE 2 // room for a value after the key
+// Largest value stored inline on key creation.
+#define ENT_INLINE_MAX 64
+
+// Keys compared per eviction & evictions a write may run.
+#define EVICT_SAMPLES 8
+#define EVICT_PER_WRITE 4
+
 #define NOEXPIRE ((CSKey) {-1, 0})
+// Default inline cost threshold while workers are idle.
+#define INLINE_COST_MAX 4096
+// Nothing costlier than this runs on the I/O thread.
+#define INLINE_COST_CAP 65536
+#define INLINE_BUF_SIZE 4096
+// Buckets a SCAN walks without a COUNT, & at most.
+#define SCAN_COUNT 10
+#define SCAN_COUNT_MAX 65536
 
 struct KVStore;
 typedef struct KVStore KVStore;
@@ -40,41 +73,142 @@ struct Entry;
 typedef struct Entry Entry;
 
 #ifndef __cplusplus
+// One allocation: the key & a first value of up to ENT_INLINE_MAX bytes
+// follow the header.
 struct Entry {
     BNode node;
-    spin_rwlock lock;
+    rwlock lock;
 
     CSKey expire_ms;
-    uint32_t type;
-    vstr *key;
     union {
-        vstr *s;
-        ZSet zs;
+        // Immutable & `smr_calloc`ed, inline or a tagged integer: SET & INCR
+        // swap in a new one & retire the old, no string op takes `lock`.
+        _Atomic(vstr *) s;
+        ZSet *zs;
+        // Lookup key of a probe
+        const vstr *key;
     } val;
+    // Moves from ENT_INIT once, under `lock`. Read without it by GET & SET.
+    _Atomic(uint8_t) type;
+    uint8_t flags;
+    // Eviction clock: last access in seconds under LRU, last decay in
+    // minutes << 8 | log access counter under LFU.
+    _Atomic(uint32_t) access;
+    // The key as a `vstr`, then the inline value if ENT_F_INLINE.
+    alignas(4) char data[];
 };
 struct KVStore {
     CHPMap *store;
     CSList expire;
     ThreadPool pool;
     ev_timer expire_w;
+    // Inline execution policy & counters
+    int inline_mode;
+    size_t inline_cost_max;
+    atomic_u64 n_inline, n_offload;
+    // Scratch reply buffer for inline requests, owned by the I/O thread.
+    RingBuf inline_buf;
+    // Memory limit, 0 for none, & accounting of entries, values & ZSets.
+    size_t maxmemory;
+    int evict_policy;
+    _Atomic(int64_t) used_mem;
+    atomic_u64 n_evicted;
+    // Append-only log of writes, NULL if not persisting.
+    struct AOF *aof;
+    // Target of SAVE & BGSAVE, NULL if not configured.
+    struct Snapshot *snap;
+    // Replicas streamed to, NULL if SYNC is refused. The primary we follow,
+    // NULL unless a replica.
+    struct Repl *repl;
+    struct Replica *replica;
+    // The cluster writes replicate through, NULL if not clustered.
+    struct Raft *raft;
+    // The slots this node serves of a sharded keyspace, NULL if not sharded.
+    struct Cluster *cluster;
     bool is_alloc;
 };
 #endif
 
+#ifndef __cplusplus
+static inline const vstr *entry_key(const Entry *ent) {
+    return ent->flags & ENT_F_PROBE ? ent->val.key : (const vstr *) ent->data;
+}
+
+// Integers of up to 63 bits sit in the value pointer itself, tagged by the
+// low bit & formatted on GET.
+static inline bool val_is_int(const vstr *v) { return (uintptr_t) v & 1; }
+static inline int64_t val_int(const vstr *v) { return (int64_t) (intptr_t) v >> 1; }
+#endif
+
 bool entry_eq(BNode *ln, BNode *rn);
 
 KVStore *kv_new(KVStore *kv);
 void kv_clear(KVStore *kv);
 void do_owned_req(KVStore *kv, OwnedRequest *oreq, RingBuf *out);
-// Called by `try_one_req` to dispatch to thread pool
-void kv_dispatch(KVStore *kv, Conn *c, OwnedRequest *req);
+// Run `oreq` here, logging & streaming writes. `do_owned_req` without the
+// cluster, which applies its log through it.
+void kv_apply(KVStore *kv, OwnedRequest *oreq, RingBuf *out);
+// Whether a key is picked.
+typedef bool (*kv_key_fn)(void *arg, const vstr *key);
+// DEL every key `drop` picks, all of them if it's NULL, through `kv_apply`,
+// reporting quiescent in between.
+void kv_flush(KVStore *kv, kv_key_fn drop, void *arg);
+// Called by `try_one_req` to dispatch to thread pool.
+//
+// Cheap reads may run directly on the calling I/O thread, see `enum InlineMode`.
+// Returns HANDOFF if `c` sent SYNC & can become a replica link, or CLUSTER
+// IMPORT & can become an import, the caller hands its socket to `repl_add`
+// or `cluster_import`. OK otherwise.
+ConnState kv_dispatch(KVStore *kv, Conn *c, OwnedRequest *req);
+// Set the inline policy, `cost_max` bounds the bytes an inline request may
+// hash & copy while workers are idle.
+void kv_set_inline(KVStore *kv, int mode, size_t cost_max);
+// Cap the keyspace at `bytes`, 0 for no limit. Writes evict a few sampled
+// keys per `policy` while over it, see `enum EvictPolicy`.
+void kv_set_maxmemory(KVStore *kv, size_t bytes, int policy);
+// Approximate bytes held by the keyspace, table included.
+size_t kv_used_memory(KVStore *kv);
+// Log every write from now on to `aof`, which `kv_clear` closes.
+void kv_set_aof(KVStore *kv, struct AOF *aof);
+// Snapshot to `snap` on SAVE & BGSAVE, which `kv_clear` frees.
+void kv_set_snapshot(KVStore *kv, struct Snapshot *snap);
+// Stream every write from now on to the replicas of `repl`, which `kv_clear`
+// frees. Replicas attach by sending SYNC.
+void kv_set_repl(KVStore *kv, struct Repl *repl);
+// Follow a primary through `replica`, which `kv_clear` stops. Writes of
+// clients are rejected from then on.
+void kv_set_replica(KVStore *kv, struct Replica *replica);
+// Replicate writes through `raft` & serve reads only while it leads, keys
+// expire & get evicted only through its log, see `raft.h`. `raft_open`
+// attaches it, `kv_clear` closes it.
+void kv_set_raft(KVStore *kv, struct Raft *raft);
+// Serve the slots `cluster` assigns this node & redirect the rest, see
+// `cluster.h`. `kv_clear` frees it.
+void kv_set_cluster(KVStore *kv, struct Cluster *cluster);
+// Gets the commands rebuilding a key, `argv` is only valid for the call.
+typedef bool (*kv_emit_fn)(void *arg, uint32_t argc, const vstr *const *argv);
+// Emit the commands that rebuild the keys of the next `count` buckets from
+// `cursor`, see `chpm_scan`: a SET or ZADDs per key, then a PEXPIREAT if it
+// has a TTL. Runs alongside writers, each key is seen as of its visit.
+// Returns the cursor to go on from, 0 once done. Stops early if `emit`
+// returns false.
+//
+// NOTE: A critical section per call, callers report quiescent in between.
+uint64_t kv_dump(KVStore *kv, uint64_t cursor, size_t count, kv_emit_fn emit, void *arg);
+// Bulk loading into a `kv` that serves nothing yet, bypassing requests & the
+// log: add a key holding a string, an integer or `zs`, which it takes over.
+// `deadline` in unix ms, -1 for none, a past one drops the key. False if the
+// key exists.
+bool kv_restore_str(KVStore *kv, const vstr *key, const vstr *val, int64_t deadline);
+bool kv_restore_int(KVStore *kv, const vstr *key, int64_t n, int64_t deadline);
+bool kv_restore_zset(KVStore *kv, const vstr *key, ZSet *zs, int64_t deadline);
 // Start thread pool
 //
 // NOTE: Doesn't start main loop
 void kv_start(KVStore *kv);
 // Stop thread pool.
 //
-// Currently by pushing a STOP_MAGIC to result queue
+// Asks the master loop to stop the pool once it drains the result rings.
 void kv_stop(KVStore *kv);
 
 void kv_set_ttl(KVStore *kv, Entry *ent, int64_t ttl);
@@ -0,0 +1,51 @@
+#ifndef LZ_H
+#define LZ_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// LZ77 byte codec in the LZ4 block format: sequences of a token (literal
+// length << 4 | match length - 4), extra length bytes, the literals, a u16
+// little endian offset back into the last 64KB & extra match length bytes.
+// Greedy matching on a hash of 4 bytes, it trades ratio for speed.
+//
+// Blocks frame it for files: a header of the raw length, the stored length &
+// a checksum of the raw bytes, then the payload, compressed only if that made
+// it smaller. Decoding never reads or writes out of bounds on garbage.
+#define LZ_BLOCK_HEAD 12
+
+struct LZBlock {
+    uint32_t raw_len, len, sum;
+};
+typedef struct LZBlock LZBlock;
+
+// Worst case compressed length of `n` bytes.
+static inline size_t lz_bound(const size_t n) { return n + n / 255 + 16; }
+static inline size_t lz_block_bound(const size_t n) { return LZ_BLOCK_HEAD + lz_bound(n); }
+
+// Compress `n` bytes into `dst` of at least `lz_bound(n)` bytes, returns the
+// compressed length.
+size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst);
+// Decompress exactly `raw_len` bytes into `dst`, false on garbage.
+bool lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t raw_len);
+
+// Frame `n` bytes as a block into `dst` of at least `lz_block_bound(n)`
+// bytes, compressed if `compress`. Returns the block length.
+size_t lz_block_put(const uint8_t *src, size_t n, uint8_t *dst, bool compress);
+// Parse a header, false if it can't be one.
+bool lz_block_head(const uint8_t *head, LZBlock *b);
+// The raw bytes of the block with `payload`, in place if stored as is, else
+// decompressed into `dst` of `raw_len` bytes. NULL if it doesn't decode or
+// the checksum is off.
+const uint8_t *lz_block_get(const LZBlock *b, const uint8_t *payload, uint8_t *dst);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LZ_H */
@@ -28,12 +28,25 @@ enum cmd_type {
     CMD_SET,
     CMD_DEL,
     CMD_KEYS,
+    CMD_SCAN,
     CMD_ZADD,
     CMD_ZREM,
     CMD_ZSCORE,
     CMD_ZQUERY,
     CMD_PTTL,
     CMD_PEXPIRE,
+    CMD_PEXPIREAT, // deadline in unix ms, what the log records
+    CMD_STATS,
+    CMD_INCRBY, // incr, decr, incrby & decrby
+    CMD_BGREWRITEAOF,
+    CMD_SAVE, // snapshot on the worker, replies once done
+    CMD_BGSAVE,
+    CMD_SYNC, // a replica asking for the keyspace, then the writes
+    CMD_CLUSTER_KEYSLOT,
+    CMD_CLUSTER_SLOTS,
+    CMD_CLUSTER_MIGRATE,
+    CMD_CLUSTER_SETSLOT,
+    CMD_CLUSTER_IMPORT, // a node moving slots here, then their keys & writes
     // Errors
     CMD_BAD,
     CMD_UNKNOWN,
@@ -54,6 +67,15 @@ struct Request {
             int64_t offset, limit;
         } zquery_arg;
         int64_t ttl;
+        int64_t deadline;
+        int64_t delta;
+        struct {
+            int64_t first, last, node;
+        } slots;
+        struct {
+            int64_t cursor, count; // count 0 for the default
+            vstr *match; // NULL for all keys
+        } scan;
         char *err;
     } args;
 };
@@ -68,6 +90,8 @@ typedef struct OwnedRequest OwnedRequest;
 
 bool str2dbl(const vstr *str, double *out);
 bool str2int(const vstr *str, int64_t *out);
+// False unless all of `str` is a decimal in range.
+bool str2int_strict(const vstr *str, int64_t *out);
 ssize_t parse_simple_req(RingBuf *rb, size_t sz, simple_req *out);
 void simple2req(const simple_req *sreq, Request *req);
 OwnedRequest *new_owned_req(OwnedRequest *oreq, RingBuf *rb, size_t sz);
@@ -6,14 +6,37 @@ extern "C" {
 #endif /* ifndef __cplusplus */
 
 #include <stddef.h>
+#include <stdint.h>
 
+// Thread slots, a multiple of 64 up to 4096.
+#define QSBR_MAX_THREADS 1024
+
+// NOTE: Retire lists are per-thread & unbounded, `back_logs` is unused.
 void qsbr_init(size_t back_logs);
 void qsbr_destroy();
 void qsbr_reg();
 void qsbr_unreg();
+// Small objects are recycled: once their grace period passes they go to the
+// reclaiming thread's size-classed pool, which later `qsbr_calloc`s reuse.
 void *qsbr_calloc(size_t nmemb, size_t size);
 void qsbr_retire(void *ptr, void (*cb)(void *));
+// Free right away, for objects only reachable through one being reclaimed.
+void qsbr_free(void *ptr);
 void qsbr_quiescent();
+// Leave & rejoin the grace period protocol around blocking, e.g. in an event
+// loop, so an idle thread doesn't hold up reclamation. Going offline reports
+// a quiescent state. Only the report that ends a grace period takes a lock, so
+// both are cheap enough to wrap every poll of a busy loop.
+//
+// NOTE: An offline thread must not hold references to shared objects, nor
+// retire or `qsbr_quiescent`. Both are no-ops if already in that state.
+void qsbr_offline();
+void qsbr_online();
+// `qsbr_calloc`s served from reclaimed memory vs. from malloc.
+//
+// NOTE: Other threads fold their counts in every few hundred allocations, so
+// it lags a bit.
+void qsbr_pool_stats(uint64_t *hits, uint64_t *misses);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,110 @@
+#ifndef RAFT_H
+#define RAFT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ringbuf.h"
+#include "utils.h"
+
+// Peers talk on the client port plus this.
+#define RAFT_PORT_OFFSET 10000
+#define RAFT_MAX_NODES 16
+// Leader heartbeats. A follower that heard nothing for RAFT_ELECTION_MS to
+// twice that stands for election, & votes for nobody before that long.
+#define RAFT_HEARTBEAT_MS 50
+#define RAFT_ELECTION_MS 500
+// A leader serves reads for this long after sending a round a majority
+// acked, short of RAFT_ELECTION_MS by the clock drift allowed for.
+#define RAFT_LEASE_MS 400
+// An AppendEntries carries up to this many bytes of entries, with up to
+// RAFT_PIPELINE of them in flight per follower.
+#define RAFT_BATCH_BYTES (1u << 20)
+#define RAFT_PIPELINE 8
+// Entries applied between snapshots, each truncates the log up to it.
+#define RAFT_SNAP_ENTRIES 100000
+// Keys map to stripes, writes to a key enter the log in the order they hold
+// its stripe.
+#define RAFT_STRIPES 64
+
+// Raft-replicated log of writes for strongly consistent clusters.
+//
+// Workers hand a write to the leader (`raft_submit`), which appends it to
+// its log & waits: an applier thread runs entries through `kv_apply` once a
+// majority has them on disk, in log order on every node, & hands the reply
+// back. PEXPIRE is logged as PEXPIREAT, INCR as the SET of the leader's
+// result, everything else as sent.
+//
+// The log alone changes the keyspace: followers neither expire nor evict,
+// the leader does both by appending DELs (`raft_propose`), & past TTLs only
+// take effect once their DEL applies.
+//
+// Per follower, a sender thread pipelines AppendEntries of the entries
+// appended since its last one, a reader thread takes the replies. A thread
+// of ours writes the log, fsyncs it in batches (group commit) & runs the
+// election timer. Followers fsync what they got before acking it.
+//
+// Reads on the leader are served locally while it holds a lease: a majority
+// acked a round sent less than RAFT_LEASE_MS ago, & none of them votes for
+// another before RAFT_ELECTION_MS since. Followers reject everything but
+// node-local commands with the address of the leader.
+//
+// Every RAFT_SNAP_ENTRIES the applier saves a snapshot (see `snapshot.h`)
+// with writes held, & the log is cut at it. Followers that need entries cut
+// off get the snapshot instead.
+//
+// On disk in `dir`: `meta` (term & vote), `log` (entries after the
+// snapshot, the index of its first & the term before it up front) &
+// `snap-<index>`.
+struct Raft;
+typedef struct Raft Raft;
+struct KVStore;
+typedef struct KVStore KVStore;
+
+// Node `id` of the `n` nodes reached by clients at `addrs` (`host:port`),
+// keeping its state in `dir`. Attaches itself to an empty `kv` that serves
+// nothing yet (see `kv_set_raft`), loads the snapshot into it, then starts
+// the threads. NULL on errors.
+Raft *raft_open(KVStore *kv, int id, int n, const char *const *addrs, const char *dir);
+// Stop the threads & close the files.
+void raft_close(Raft *raft);
+uint32_t raft_stripe(const vstr *key);
+void raft_lock(Raft *raft, uint32_t stripe);
+void raft_unlock(Raft *raft, uint32_t stripe);
+// False if the stripe is held.
+bool raft_trylock(Raft *raft, uint32_t stripe);
+// Replicate the write `argv` & wait until it's applied, the reply goes to
+// `out`. Under the lock of the key's `stripe`, released once the write is in
+// the log. An error for the client if this node doesn't lead, or lost the
+// lead before the write committed, which may still apply then.
+const char *raft_submit(Raft *raft, uint32_t stripe, uint32_t argc, const vstr *const *argv, RingBuf *out);
+// Append the write `argv` without waiting for it, under the key's stripe
+// lock. False if this node doesn't lead.
+bool raft_propose(Raft *raft, uint32_t argc, const vstr *const *argv);
+// Wait until every entry appended so far is applied, an error for the client
+// if this node doesn't lead or stops meanwhile.
+const char *raft_settle(Raft *raft);
+bool raft_leading(Raft *raft);
+// Whether a read can be served locally right away, cheap.
+bool raft_lease_valid(Raft *raft);
+// Wait until a read can be served locally, an error for the client if this
+// node doesn't lead or can't reach a majority.
+const char *raft_read_barrier(Raft *raft);
+// The leader's id, -1 if unknown.
+int raft_leader(Raft *raft);
+uint64_t raft_term(Raft *raft);
+// Index of the last entry applied.
+uint64_t raft_applied(Raft *raft);
+// Snapshot every `entries` entries applied, RAFT_SNAP_ENTRIES by default.
+void raft_set_snap_entries(Raft *raft, uint64_t entries);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RAFT_H */
@@ -0,0 +1,78 @@
+#ifndef REPL_H
+#define REPL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+// Keys map to stripes, records of one stripe keep their order in the stream.
+#define REPL_STRIPES 64
+// Sender tick, how long a write may wait to go out.
+#define REPL_SEND_MS 1
+// A replica this far behind is dropped, it resyncs on reconnecting.
+#define REPL_BACKLOG_MAX (256ull << 20)
+// Between connection attempts of a replica.
+#define REPLICA_RETRY_MS 1000
+
+// Asynchronous primary-replica replication over TCP.
+//
+// A replica connects to the primary & sends SYNC, the connection leaves the
+// event loop for a link thread of its own. The link dumps the keyspace to it
+// (see `kv_dump`), sends a SYNC record marking the end of the dump, then
+// streams writes as the log records them (see `aof.h`): INCR as the SET of
+// its result, PEXPIRE as a PEXPIREAT. Keys the primary expires or evicts go
+// out as DELs, replicas only drop keys they're told to.
+//
+// Workers append writes to per-stripe buffers under the stripe lock, nothing
+// while no replica is connected. A sender thread drains them all per tick
+// into one batch shared by the links, which write it out while the next one
+// fills. Writes that raced the dump are in the stream too, replaying them on
+// top is harmless as every record sets state.
+//
+// The replica drops its keys once connected, applies the stream on a thread
+// of its own & reconnects when the link breaks, with a full resync. It keeps
+// serving reads all along.
+struct Repl;
+typedef struct Repl Repl;
+struct Replica;
+typedef struct Replica Replica;
+struct KVStore;
+typedef struct KVStore KVStore;
+
+// Primary side, start the sender.
+Repl *repl_new(void);
+// Disconnect all replicas & stop the sender.
+void repl_free(Repl *repl);
+uint32_t repl_stripe(const vstr *key);
+void repl_lock(Repl *repl, uint32_t stripe);
+void repl_unlock(Repl *repl, uint32_t stripe);
+// False if the stripe is held.
+bool repl_trylock(Repl *repl, uint32_t stripe);
+// Under the stripe lock.
+void repl_append(Repl *repl, uint32_t stripe, uint32_t argc, const vstr *const *argv);
+// Take over the connected socket `fd` of a replica of `kv`, which sent SYNC.
+// False if the link can't start, `fd` is closed either way in the end.
+bool repl_add(Repl *repl, KVStore *kv, int fd);
+// Replicas linked, some may still be syncing.
+size_t repl_replicas(Repl *repl);
+
+// Replica side, follow the primary at `host`:`port` into `kv`.
+Replica *replica_start(KVStore *kv, const char *host, int port);
+// Disconnect & stop applying.
+void replica_stop(Replica *r);
+// Whether the current link got past the initial dump.
+bool replica_synced(Replica *r);
+// Records applied over all links.
+uint64_t replica_applied(Replica *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* REPL_H */
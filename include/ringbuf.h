@@ -26,6 +26,8 @@ size_t rb_peek(RingBuf *rb, uint8_t *buf, size_t len,
 size_t rb_peek0(RingBuf *rb, uint8_t *buf, size_t len);
 size_t rb_write(RingBuf *rb, const uint8_t *buf, size_t len);
 void rb_consume(RingBuf *rb, size_t len);
+// Drop what was written after the first `len` bytes.
+void rb_truncate(RingBuf *rb, size_t len);
 void rb_clear(RingBuf *rb);
 void rb_resize(RingBuf *rb, size_t new_cap);
 
@@ -0,0 +1,63 @@
+#ifndef SMR_H
+#define SMR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* ifndef __cplusplus */
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Safe memory reclamation for the concurrent containers, backed by either
+// QSBR (`qsbr.h`) or EBR (`ebr.h`), picked once per process by `smr_init`.
+//
+// Callers bracket accesses with `smr_enter`/`smr_exit` (no-ops under QSBR)
+// and report `smr_quiescent` between operations (a cheap reclaim attempt
+// under EBR), so the same code is correct under both.
+typedef struct SMR {
+    const char *name;
+    void (*init)(size_t back_logs);
+    void (*destroy)();
+    void (*reg)();
+    void (*unreg)();
+    void *(*calloc)(size_t nmemb, size_t size);
+    void (*retire)(void *ptr, void (*cb)(void *));
+    void (*free)(void *ptr);
+    void (*enter)();
+    void (*exit)();
+    void (*quiescent)();
+    void (*offline)();
+    void (*online)();
+    void (*pool_stats)(uint64_t *hits, uint64_t *misses);
+} SMR;
+
+extern const SMR smr_qsbr, smr_ebr;
+
+// Switch backends & init it. Without a call QSBR is used, initialised by
+// `qsbr_init`.
+void smr_init(const SMR *backend, size_t back_logs);
+// NULL if `name` is neither "qsbr" nor "ebr".
+const SMR *smr_find(const char *name);
+const SMR *smr_backend();
+void smr_destroy();
+void smr_reg();
+void smr_unreg();
+void *smr_calloc(size_t nmemb, size_t size);
+void smr_retire(void *ptr, void (*cb)(void *));
+// Free without a grace period, e.g. from the reclaim callback of the only
+// object pointing to `ptr`.
+void smr_free(void *ptr);
+void smr_enter();
+void smr_exit();
+void smr_quiescent();
+// Around blocking, see `qsbr_offline`. No-ops under EBR.
+void smr_offline();
+void smr_online();
+// See `qsbr_pool_stats`, 0 for backends without a pool.
+void smr_pool_stats(uint64_t *hits, uint64_t *misses);
+
+#ifdef __cplusplus
+}
+#endif /* ifndef __cplusplus */
+
+#endif /* ifndef SMR_H */
@@ -0,0 +1,81 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+// File header, the version is the last byte, & trailer.
+#define SNAP_MAGIC "KVSNAP\0\3"
+#define SNAP_TAIL "KVSNAPIX"
+#define SNAP_MAGIC_LEN 8
+// Index entry: u64 offset, length & keys of a section.
+#define SNAP_SECTION_LEN 24
+// `snap_save` while another save runs.
+#define SNAP_BUSY (-2)
+
+// Point-in-time dump of the keyspace to a compact binary file, without
+// forking: a thread walks the table a few buckets per critical section (see
+// `chpm_scan`), each key is seen as of its visit. Strings are read lock-free,
+// ZSets under their read lock. An optional rate limit in bytes per second
+// paces the walk so it stays out of the way of live traffic.
+//
+// Format: the magic, then sections of keys, each a range of key hashes in
+// walk order made of blocks of whole keys (see `lz_block_put`), compressed if
+// enabled, checksummed either way. Per key a type byte (`| SNAP_F_TTL`
+// followed by an i64 unix ms deadline), the key & the value. Lengths & counts
+// are varints, integers zigzag varints, scores raw doubles. At the tail, the
+// index of sections, their u64 count, the u64 count of keys & SNAP_TAIL.
+//
+// Loading maps the file & hands sections out to threads, which insert keys
+// straight into a table grown once up front for the count at the tail.
+enum SnapType {
+    SNAP_STR = 1,
+    SNAP_INT = 2, // an integer-encoded string
+    SNAP_ZSET = 3, // member count, then name & score per member by rank
+};
+#define SNAP_F_TTL 0x80
+
+struct Snapshot;
+typedef struct Snapshot Snapshot;
+struct KVStore;
+typedef struct KVStore KVStore;
+
+// Saves go to `path` through `path.tmp`, `rate` bytes per second, 0 for no
+// limit.
+Snapshot *snap_new(const char *path, uint64_t rate);
+// After any running save.
+void snap_free(Snapshot *snap);
+// Compress the blocks of saves from the next one on, off by default. Loading
+// takes either.
+void snap_set_compress(Snapshot *snap, bool on);
+// Save `kv` on the calling thread, which must be registered with SMR.
+// Returns the keys saved, -1 on I/O errors or SNAP_BUSY.
+int64_t snap_save(Snapshot *snap, KVStore *kv);
+// Save `kv` on a thread of its own, false if a save runs.
+bool snap_start(Snapshot *snap, KVStore *kv);
+// Wait for the last background save, false if it failed or none ran.
+//
+// NOTE: Not concurrently with `snap_start`.
+bool snap_wait(Snapshot *snap);
+bool snap_running(Snapshot *snap);
+// Unix ms of the last successful save, 0 if none.
+uint64_t snap_last_save(Snapshot *snap);
+// Load `path` into an empty `kv` on up to `nthreads` threads, the caller's
+// included. Returns the keys loaded, 0 if there's no file, -1 on I/O errors,
+// a corrupt or truncated file.
+//
+// NOTE: Before `kv` serves requests, bypasses them & any log.
+int64_t snap_load(KVStore *kv, const char *path, int nthreads);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SNAPSHOT_H */
@@ -0,0 +1,51 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "cqueue.h"
+
+// Bounded single-producer/single-consumer ring of `cnode` pointers.
+//
+// Unlike `cqueue`, neither side does an RMW: the producer only writes `head`,
+// the consumer only writes `tail`, and each keeps a cached copy of the other
+// index so the shared line is only read when the cache says full/empty.
+struct spscq;
+typedef struct spscq spscq;
+
+#ifndef __cplusplus
+#include <stdalign.h>
+#include <stdatomic.h>
+
+struct spscq {
+    // Producer side
+    alignas(64) atomic_size_t head;
+    size_t tail_cache;
+    // Consumer side
+    alignas(64) atomic_size_t tail;
+    size_t head_cache;
+    // Read-only after init
+    alignas(64) size_t mask;
+    cnode **buf;
+    bool is_alloc;
+};
+#endif
+
+// `cap` is rounded up to a power of 2.
+spscq *spsc_init(spscq *q, size_t cap);
+void spsc_destroy(spscq *q);
+bool spsc_put(spscq *q, cnode *n);
+cnode *spsc_pop(spscq *q);
+size_t spsc_size(spscq *q);
+size_t spsc_cap(spscq *q);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SPSC_H */
@@ -11,41 +11,102 @@ extern "C" {
 
 #include <ev.h>
 #include <pthread.h>
+#include <stdint.h>
 
 #include "cqueue.h"
+#include "spsc.h"
 
+// Defaults, see `pool_set_workers` & `pool_set_queue_size`.
 #define WORKERS 8
 #define QUEUESIZE 4096
 #define STOP_MAGIC 0xDEADBEEFCAFEBEEF
+// Max busy-poll rounds before a consumer parks in its loop, 0 disables spinning.
+#define POOL_SPIN 256
+#define POOL_SPIN_MIN 16
+// Let `pool_start` pick the spin budget from the core count.
+#define POOL_SPIN_AUTO UINT32_MAX
+
+struct wctx;
+typedef struct wctx wctx;
+// Master side parking state.
+struct mctx;
+typedef struct mctx mctx;
+
+#ifndef __cplusplus
+#include <stdalign.h>
+#include <stdatomic.h>
 
 struct wctx {
-    // worker id
-    int id;
+    // worker id, the CPU or else NUMA node it is pinned to, -1 if unpinned
+    int id, cpu, node;
     pthread_t thread;
     // self loop
     struct ev_loop *loop, *master;
     // async watchers
     ev_async *rev, wev;
-    // in & out queues
-    cqueue *q, *rq;
+    // in queue & own result ring toward the master
+    cqueue *q;
+    spscq *rq;
     // process f
     cnode *(*f)(cnode *);
+    // Set while the worker is (about to be) blocked in `ev_run`, producers
+    // only call `ev_async_send` when it is set.
+    alignas(64) atomic_bool sleeping;
+    atomic_bool *msleeping, *mstop;
+    uint32_t spin, spin_max;
 };
-typedef struct wctx wctx;
+
+struct mctx {
+    // Same as `wctx.sleeping`, for the master loop draining the result rings.
+    alignas(64) atomic_bool sleeping;
+    // Set by `pool_notify_stop`.
+    atomic_bool stop;
+};
+#endif
 
 struct ThreadPool {
     size_t rr_idx;
     bool (*res_cb)(cnode *);
     struct ev_loop *loop;
     ev_async rev;
-    cqueue *result_q;
-    wctx *workers[WORKERS];
+    wctx **workers;
+    int nworkers;
+    size_t qsize;
+    // Workers are pinned round-robin over `cpus`, unpinned if `ncpus` is 0.
+    int *cpus, ncpus;
+    // Spread workers round-robin over NUMA nodes when no `cpus` are set.
+    bool numa;
+    mctx *master;
+    // Current & max busy-poll rounds of the master, `spin_cfg` is the
+    // `pool_set_spin` setting that `spin_max` is resolved from.
+    uint32_t spin, spin_max, spin_cfg;
+    // Results taken off the rings while a post waited, for `res_cb` back in
+    // the loop. Linked through the padding of `cnode`.
+    cnode *held, *held_tail;
 };
 typedef struct ThreadPool ThreadPool;
 
 void pool_init(ThreadPool *pool, bool (*res_cb)(cnode *));
 void pool_start(ThreadPool *pool, cnode *(*f)(cnode *) );
+// Max busy-poll rounds the master & workers spend on an empty queue before
+// parking, trading CPU for wake-up latency. 0 disables spinning, the default
+// `POOL_SPIN_AUTO` spins only when every worker & the master can own a core.
+//
+// NOTE: All `pool_set_*` take effect on `pool_start`.
+void pool_set_spin(ThreadPool *pool, uint32_t spin_max);
+void pool_set_workers(ThreadPool *pool, int nworkers);
+// Capacity of each worker's job queue & result ring.
+void pool_set_queue_size(ThreadPool *pool, size_t qsize);
+// Pin worker i to `cpus[i % n]`, n = 0 leaves workers unpinned.
+void pool_set_cpus(ThreadPool *pool, const int *cpus, int n);
+// Pin worker i to all CPUs of the (i % nodes)-th NUMA node, allocating from
+// that node. Ignored when `pool_set_cpus` was given CPUs.
+void pool_set_numa(ThreadPool *pool, bool on);
 void pool_post(ThreadPool *pool, cnode *work);
+// Make the master stop the pool from its loop, as if `res_cb` returned true.
+void pool_notify_stop(ThreadPool *pool);
+// Number of jobs queued on the worker that receives the next post.
+size_t pool_backlog(ThreadPool *pool);
 void pool_destroy(ThreadPool *pool);
 void pool_stop(ThreadPool *pool);
 
@@ -0,0 +1,58 @@
+#ifndef TOPO_H
+#define TOPO_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Upper bound of CPU ids we parse / pin to.
+#define TOPO_MAX_CPUS 1024
+// Upper bound of NUMA node ids.
+#define TOPO_MAX_NODES 64
+
+// Parse a Linux cpulist, e.g. "0-3,8,10-11", into `cpus`.
+//
+// Returns the number of CPUs written, or -1 on a malformed list or more than
+// `max` CPUs.
+int topo_parse_cpulist(const char *s, int *cpus, int max);
+// CPUs of NUMA node `node` as listed by sysfs, -1 if the node doesn't exist.
+int topo_node_cpus(int node, int *cpus, int max);
+// Restrict thread `t` to `cpus`, returns 0 or an errno value.
+int topo_pin(pthread_t t, const int *cpus, int n);
+
+// Online NUMA node ids, 1 node (0) when the kernel reports none.
+int topo_nodes(int *nodes, int max);
+
+// Process-wide NUMA mode: shared tables get interleaved across nodes and
+// pool workers are spread & pinned per node.
+//
+// NOTE: Set it before creating the tables it should apply to.
+void topo_set_numa(bool on);
+bool topo_numa(void);
+
+// The memory policy calls below only affect pages that aren't touched yet,
+// and only whole pages inside `[p, p + len)`. They return 0 or an errno
+// value, and are a no-op with a single node.
+
+// Spread pages round-robin over all online nodes.
+int topo_interleave(void *p, size_t len);
+// Place pages on `node`.
+int topo_bind(void *p, size_t len, int node);
+// `len` zeroed bytes of fresh pages, interleaved before anything touches
+// them. Recycled heap memory is already placed, so shared tables come from
+// here. NULL if mapping fails, release with `topo_unmap`.
+void *topo_map_interleaved(size_t len);
+void topo_unmap(void *p, size_t len);
+// Make the calling thread allocate on its local node, overriding a
+// policy inherited from the parent (e.g. `numactl --interleave`).
+int topo_local(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TOPO_H */
@@ -10,6 +10,8 @@ extern "C" {
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 typedef uint8_t u8;
 typedef uint16_t u16;
@@ -27,14 +29,34 @@ typedef int64_t i64;
 #define MIN(x, y) ((y) ^ (((x) ^ (y)) & -((x) < (y))))
 #define MAX(x, y) ((x) ^ (((x) ^ (y)) & -((x) < (y))))
 
+// Spin-wait hint for busy loops.
+static inline void cpu_relax(void) {
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__("pause");
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
 struct vstr {
     uint32_t len;
     char dat[];
 };
 typedef struct vstr vstr;
 
+// Growable bytes, zeroed is empty.
+struct ByteBuf {
+    uint8_t *dat;
+    size_t len, cap;
+};
+typedef struct ByteBuf ByteBuf;
+
 struct spin_rwlock;
 typedef struct spin_rwlock spin_rwlock;
+struct rwlock;
+typedef struct rwlock rwlock;
+struct Glob;
+typedef struct Glob Glob;
 
 #ifndef __cplusplus
 #include <stdalign.h>
@@ -65,8 +87,37 @@ enum {
 struct spin_rwlock {
     alignas(64) atomic_int ticket;
 };
+
+// Writer preferring, spins a little then parks on a futex.
+struct rwlock {
+    // Reader count or RW_WRITE_LOCKED, plus the waiting bits.
+    _Atomic(uint32_t) state;
+    // Bumped on every writer wake up, parked writers wait on it.
+    _Atomic(uint32_t) writer_seq;
+};
 #endif
 
+enum glob_kind {
+    GLOB_EXACT, // no wildcards
+    GLOB_ANY, // only `*` between the ends
+    GLOB_FIND, // `*lit*` between the ends
+    GLOB_FULL, // `glob_match` between the ends
+};
+
+// A glob split once into its literal ends & what's between, so most keys are
+// settled by a memcmp of each end, `lit*`, `*lit`, `*lit*` never reaching
+// `glob_match`. Points into the pattern, which must outlive it.
+struct Glob {
+    const char *pat;
+    size_t plen;
+    // Lengths of the literal ends.
+    size_t prefix, suffix;
+    // Between the ends, the literal for GLOB_FIND.
+    const char *mid;
+    size_t mid_len;
+    enum glob_kind kind;
+};
+
 u64 next_pow2(u64 x);
 uint64_t int_hash_fnv(uint64_t val);
 uint64_t bytes_hash_fnv(const uint8_t *bytes, size_t len);
@@ -80,6 +131,36 @@ void die(const char *source);
 void set_nonblock(int fd);
 void set_reuseaddr(int fd);
 uint64_t get_clock_ms();
+// Wall clock, for deadlines that outlive the process.
+uint64_t get_unix_ms();
+// `write` until all of `buf` is out, false on errors.
+bool write_all(int fd, const void *buf, size_t len);
+// Make a rename or create in the directory of `path` durable.
+bool fsync_dir(const char *path);
+// Like `write_all`, but a peer gone doesn't raise SIGPIPE.
+bool send_all(int fd, const void *buf, size_t len);
+// `recv` until `buf` is full, false on errors or EOF.
+bool recv_all(int fd, void *buf, size_t len);
+// `ms` from now on CLOCK_MONOTONIC, for `pthread_cond_timedwait`s.
+void deadline_in(struct timespec *ts, int ms);
+// A condition whose timed waits take `deadline_in`s.
+void cond_init_monotonic(pthread_cond_t *cond);
+
+// Room for `extra` more bytes.
+void buf_reserve(ByteBuf *b, size_t extra);
+static inline void buf_put(ByteBuf *b, const void *src, const size_t len) {
+    buf_reserve(b, len);
+    memcpy(b->dat + b->len, src, len);
+    b->len += len;
+}
+// Framed as the log does it, see `aof.h`, a request is framed alike.
+void buf_put_record(ByteBuf *b, uint32_t argc, const vstr *const *argv);
+// Whether `s` matches the glob `pat`: `*`, `?`, classes like `[a-z]` or
+// `[^0-9]`, `\` escapes the next char.
+bool glob_match(const char *pat, size_t plen, const char *s, size_t slen);
+void glob_compile(Glob *g, const char *pat, size_t plen);
+// `glob_match` with `g`'s pattern.
+bool glob_test(const Glob *g, const char *s, size_t slen);
 
 vstr *vstr_new(const char *s, uint32_t len);
 vstr *vstr_new_s(const char *s);
@@ -93,6 +174,12 @@ void spin_rw_runlock(spin_rwlock *l);
 void spin_rw_wlock(spin_rwlock *l);
 void spin_rw_wunlock(spin_rwlock *l);
 
+void rw_init(rwlock *l);
+void rw_rlock(rwlock *l);
+void rw_runlock(rwlock *l);
+void rw_wlock(rwlock *l);
+void rw_wunlock(rwlock *l);
+
 #ifdef __cplusplus
 }
 #endif
@@ -16,6 +16,8 @@ struct ZSet {
     SkipList sl;
     // HMap hm;
     SHPMap hm;
+    // Bytes held by the nodes
+    size_t bytes;
 };
 typedef struct ZSet ZSet;
 
@@ -50,6 +52,8 @@ void zset_delete(ZSet *zset, ZNode *node);
 void zset_update(ZSet *zset, ZNode *node, double score);
 ZNode *zset_seekge(ZSet *zset, double score, const char *name, size_t len);
 ZNode *znode_offset(ZSet *zset, ZNode *node, int64_t offset);
+// Approximate bytes held, `zset` itself included.
+size_t zset_mem(ZSet *zset);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,699 @@
+#include "aof.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cqueue.h"
+#include "kvstore.h"
+#include "lz.h"
+#include "parse.h"
+#include "ringbuf.h"
+#include "smr.h"
+#include "spsc.h"
+#include "utils.h"
+
+// Anything longer is garbage, not a record.
+#define AOF_MAX_RECORD (64u << 20)
+#define AOF_READ_BUF (1 << 20)
+// Per replay thread.
+#define REPLAY_QSIZE 4096
+// A rewrite writes in chunks of this size, & is done catching up on the
+// diff once a round moved less or after that many rounds.
+#define AOF_REWRITE_BUF (1 << 20)
+#define REWRITE_CATCH_UP_ROUNDS 8
+// Buckets dumped per critical section.
+#define REWRITE_DUMP_BUCKETS 1024
+// Compressed blocks hold about this many bytes of records. Smaller drains
+// stay plain records, too little to gain from.
+#define AOF_BLOCK (64u << 10)
+#define AOF_LZ_MIN 1024
+
+struct Stripe {
+    alignas(64) pthread_mutex_t lock;
+    ByteBuf buf;
+    // While a rewrite runs, a copy of the records for the new file.
+    ByteBuf diff;
+    bool diffing;
+};
+typedef struct Stripe Stripe;
+
+struct AOF {
+    char *path;
+    int fd, fsync_ms;
+    pthread_t writer, rewriter;
+    // Held by the writer from a drain to its fsync, by a rewrite to swap
+    // `fd`. Taken before any stripe lock.
+    pthread_mutex_t io;
+    // Writer wake ups & `aof_wait`ers, `pending`, `stop`, `synced` &
+    // `failed_gen` are under `mu`.
+    pthread_mutex_t mu;
+    pthread_cond_t wake, done;
+    bool pending, stop;
+    // Last drain on disk & last one that failed to get there.
+    uint64_t synced, failed_gen;
+    // Set while drained records couldn't be written or fsynced, writes are
+    // refused until they are.
+    atomic_bool failed;
+    // Generation of the next drain, read under a stripe lock by appenders.
+    alignas(64) atomic_u64 gen;
+    // Bytes in the file & right after the last rewrite, auto rewrite policy.
+    atomic_u64 size, base_size;
+    int rewrite_pct;
+    uint64_t rewrite_min;
+    // Set by `aof_rewrite_start` until the rewriter is done.
+    atomic_bool rewriting;
+    bool rewriter_started, rewrite_ok;
+    KVStore *rewrite_kv;
+    atomic_bool compress;
+    // Under `io`. Drained records, then what goes to the file: everything
+    // since the last fsync, `written` bytes of it are in the file after the
+    // `synced_size` bytes known to be on disk (or handed to the kernel under
+    // AOF_FSYNC_NEVER).
+    ByteBuf recs, out;
+    size_t written;
+    uint64_t synced_size;
+    Stripe stripes[AOF_STRIPES];
+};
+
+// Frame the records in `src` as blocks of whole records.
+static void buf_put_blocks(ByteBuf *dst, const uint8_t *src, const size_t len) {
+    const uint32_t mark = AOF_BLOCK_MARK;
+    for (size_t start = 0, end; start < len; start = end) {
+        for (end = start; end < len && end - start < AOF_BLOCK;) {
+            uint32_t rlen;
+            memcpy(&rlen, src + end, 4);
+            end += 4 + rlen;
+        }
+        buf_reserve(dst, 4 + lz_block_bound(end - start));
+        buf_put(dst, &mark, 4);
+        dst->len += lz_block_put(src + start, end - start, dst->dat + dst->len, true);
+    }
+}
+
+// Cut the file back to what is on disk, everything since is written again on
+// the next try. A failed fdatasync may have dropped those pages, retrying
+// just the fsync could report them durable.
+static bool writer_cut(AOF *aof) {
+    if (ftruncate(aof->fd, (off_t) aof->synced_size))
+        logger(stderr, "ERROR", "[aof] ftruncate(): %s\n", strerror(errno));
+    STORE(&aof->size, aof->synced_size, RELAXED);
+    aof->written = 0;
+    return false;
+}
+
+// Under `io`. Write what's new in `out` & fsync it all if `sync`, false on
+// errors.
+static bool writer_flush(AOF *aof, const bool sync) {
+    if (aof->written < aof->out.len) {
+        const size_t n = aof->out.len - aof->written;
+        if (!write_all(aof->fd, aof->out.dat + aof->written, n)) {
+            logger(stderr, "ERROR", "[aof] write(): %s\n", strerror(errno));
+            return writer_cut(aof);
+        }
+        FAA(&aof->size, n, RELAXED);
+        aof->written = aof->out.len;
+    }
+    if (!sync || !aof->out.len) {
+        // Left to the kernel, nothing to keep for a retry.
+        if (aof->fsync_ms == AOF_FSYNC_NEVER) {
+            aof->synced_size += aof->out.len;
+            aof->out.len = aof->written = 0;
+        }
+        return true;
+    }
+    if (fdatasync(aof->fd)) {
+        logger(stderr, "ERROR", "[aof] fdatasync(): %s\n", strerror(errno));
+        return writer_cut(aof);
+    }
+    aof->synced_size += aof->out.len;
+    aof->out.len = aof->written = 0;
+    return true;
+}
+
+static void *aof_writer(void *arg) {
+    AOF *aof = arg;
+    const bool always = aof->fsync_ms == AOF_FSYNC_ALWAYS;
+    const int tick = aof->fsync_ms > 0 ? MIN(aof->fsync_ms, AOF_WRITE_MS) : AOF_WRITE_MS;
+    uint64_t last_sync = get_clock_ms();
+    bool stop;
+    do {
+        pthread_mutex_lock(&aof->mu);
+        // Writes are refused while failed, nobody would ask for a retry.
+        if (always && !LOAD(&aof->failed, RELAXED)) {
+            while (!aof->pending && !aof->stop)
+                pthread_cond_wait(&aof->wake, &aof->mu);
+        } else if (!aof->stop) {
+            struct timespec ts;
+            deadline_in(&ts, tick);
+            pthread_cond_timedwait(&aof->wake, &aof->mu, &ts);
+        }
+        aof->pending = false;
+        stop = aof->stop;
+        pthread_mutex_unlock(&aof->mu);
+
+        pthread_mutex_lock(&aof->io);
+        // Records appended from here on belong to the next drain.
+        const uint64_t gen = FAA(&aof->gen, 1, ACQ_REL);
+        ByteBuf *recs = &aof->recs;
+        recs->len = 0;
+        for (int i = 0; i < AOF_STRIPES; i++) {
+            Stripe *s = &aof->stripes[i];
+            pthread_mutex_lock(&s->lock);
+            if (s->buf.len) {
+                buf_reserve(recs, s->buf.len);
+                buf_put(recs, s->buf.dat, s->buf.len);
+                s->buf.len = 0;
+            }
+            pthread_mutex_unlock(&s->lock);
+        }
+        if (recs->len >= AOF_LZ_MIN && LOAD(&aof->compress, RELAXED)) {
+            buf_put_blocks(&aof->out, recs->dat, recs->len);
+        } else if (recs->len) {
+            buf_reserve(&aof->out, recs->len);
+            buf_put(&aof->out, recs->dat, recs->len);
+        }
+        const uint64_t now = get_clock_ms();
+        const bool failed = LOAD(&aof->failed, RELAXED);
+        // Once failed, retry every tick.
+        const bool sync =
+                always || stop || failed || (aof->fsync_ms > 0 && now - last_sync >= (uint64_t) aof->fsync_ms);
+        const bool dirty = aof->out.len;
+        const bool ok = writer_flush(aof, sync);
+        if (ok && sync && dirty)
+            last_sync = now;
+        // Healthy again once everything kept for a retry made it.
+        if (!ok || (failed && !aof->out.len))
+            STORE(&aof->failed, !ok, RELEASE);
+        pthread_mutex_unlock(&aof->io);
+        if (always || !ok) {
+            pthread_mutex_lock(&aof->mu);
+            if (ok) {
+                aof->synced = gen;
+            } else {
+                aof->failed_gen = gen;
+            }
+            pthread_cond_broadcast(&aof->done);
+            pthread_mutex_unlock(&aof->mu);
+        }
+    } while (!stop);
+    // Left to the kernel until now, not past a close.
+    if (aof->fsync_ms == AOF_FSYNC_NEVER && fdatasync(aof->fd))
+        logger(stderr, "ERROR", "[aof] fdatasync(): %s\n", strerror(errno));
+    return NULL;
+}
+
+AOF *aof_open(const char *path, const int fsync_ms) {
+    const int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return NULL;
+    AOF *aof = calloc(1, sizeof(AOF));
+    aof->path = strdup(path);
+    aof->fd = fd;
+    aof->fsync_ms = fsync_ms;
+    const off_t size = lseek(fd, 0, SEEK_END);
+    atomic_init(&aof->size, size > 0 ? (uint64_t) size : 0);
+    aof->synced_size = LOAD(&aof->size, RELAXED);
+    atomic_init(&aof->failed, false);
+    atomic_init(&aof->base_size, LOAD(&aof->size, RELAXED));
+    aof->rewrite_pct = AOF_REWRITE_PCT;
+    aof->rewrite_min = AOF_REWRITE_MIN;
+    atomic_init(&aof->rewriting, false);
+    pthread_mutex_init(&aof->io, NULL);
+    pthread_mutex_init(&aof->mu, NULL);
+    cond_init_monotonic(&aof->wake);
+    pthread_cond_init(&aof->done, NULL);
+    aof->synced = 0;
+    atomic_init(&aof->gen, 1);
+    for (int i = 0; i < AOF_STRIPES; i++) {
+        pthread_mutex_init(&aof->stripes[i].lock, NULL);
+    }
+    if (pthread_create(&aof->writer, NULL, aof_writer, aof)) {
+        close(fd);
+        free(aof->path);
+        free(aof);
+        return NULL;
+    }
+    return aof;
+}
+
+void aof_close(AOF *aof) {
+    aof_rewrite_wait(aof);
+    pthread_mutex_lock(&aof->mu);
+    aof->stop = true;
+    pthread_cond_signal(&aof->wake);
+    pthread_mutex_unlock(&aof->mu);
+    pthread_join(aof->writer, NULL);
+    close(aof->fd);
+    for (int i = 0; i < AOF_STRIPES; i++) {
+        pthread_mutex_destroy(&aof->stripes[i].lock);
+        free(aof->stripes[i].buf.dat);
+        free(aof->stripes[i].diff.dat);
+    }
+    free(aof->recs.dat);
+    free(aof->out.dat);
+    pthread_cond_destroy(&aof->wake);
+    pthread_cond_destroy(&aof->done);
+    pthread_mutex_destroy(&aof->mu);
+    pthread_mutex_destroy(&aof->io);
+    free(aof->path);
+    free(aof);
+}
+
+uint32_t aof_stripe(const vstr *key) { return (uint32_t) vstr_hash_rapid(key) & (AOF_STRIPES - 1); }
+
+void aof_lock(AOF *aof, const uint32_t stripe) { pthread_mutex_lock(&aof->stripes[stripe].lock); }
+
+void aof_unlock(AOF *aof, const uint32_t stripe) { pthread_mutex_unlock(&aof->stripes[stripe].lock); }
+
+uint64_t aof_append(AOF *aof, const uint32_t stripe, const uint32_t argc, const vstr *const *argv) {
+    Stripe *s = &aof->stripes[stripe];
+    const size_t start = s->buf.len;
+    buf_put_record(&s->buf, argc, argv);
+    if (s->diffing) {
+        buf_reserve(&s->diff, s->buf.len - start);
+        buf_put(&s->diff, s->buf.dat + start, s->buf.len - start);
+    }
+    // The writer bumps it before taking any stripe lock, ours orders the two.
+    return LOAD(&aof->gen, RELAXED);
+}
+
+uint64_t aof_size(AOF *aof) { return LOAD(&aof->size, RELAXED); }
+
+void aof_set_compress(AOF *aof, const bool on) { STORE(&aof->compress, on, RELAXED); }
+
+void aof_set_auto_rewrite(AOF *aof, const int pct, const uint64_t min_size) {
+    aof->rewrite_pct = pct;
+    aof->rewrite_min = min_size;
+}
+
+bool aof_wants_rewrite(AOF *aof) {
+    if (aof->rewrite_pct <= 0 || LOAD(&aof->rewriting, RELAXED))
+        return false;
+    const uint64_t size = LOAD(&aof->size, RELAXED), base = LOAD(&aof->base_size, RELAXED);
+    return size >= aof->rewrite_min && size >= base + base / 100 * (uint64_t) aof->rewrite_pct;
+}
+
+// The new file being written by a rewrite.
+struct Rewrite {
+    int fd;
+    bool ok, compress;
+    // Records & their blocks.
+    ByteBuf buf, zbuf;
+};
+typedef struct Rewrite Rewrite;
+
+static void rewrite_flush(Rewrite *rw) {
+    const ByteBuf *out = &rw->buf;
+    if (rw->ok && rw->compress && rw->buf.len) {
+        rw->zbuf.len = 0;
+        buf_put_blocks(&rw->zbuf, rw->buf.dat, rw->buf.len);
+        out = &rw->zbuf;
+    }
+    if (rw->ok && out->len && !write_all(rw->fd, out->dat, out->len)) {
+        logger(stderr, "ERROR", "[aof] rewrite write(): %s\n", strerror(errno));
+        rw->ok = false;
+    }
+    rw->buf.len = 0;
+}
+
+static bool rewrite_emit(void *arg, const uint32_t argc, const vstr *const *argv) {
+    Rewrite *rw = arg;
+    buf_put_record(&rw->buf, argc, argv);
+    if (rw->buf.len >= AOF_REWRITE_BUF)
+        rewrite_flush(rw);
+    return rw->ok;
+}
+
+// Move the diff buffers into the new file, stripes are locked unless `locked`.
+// Returns the bytes moved.
+static size_t rewrite_catch_up(AOF *aof, Rewrite *rw, const bool locked) {
+    size_t moved = 0;
+    for (int i = 0; i < AOF_STRIPES; i++) {
+        Stripe *s = &aof->stripes[i];
+        if (!locked)
+            pthread_mutex_lock(&s->lock);
+        buf_reserve(&rw->buf, s->diff.len);
+        buf_put(&rw->buf, s->diff.dat, s->diff.len);
+        moved += s->diff.len;
+        s->diff.len = 0;
+        if (!locked)
+            pthread_mutex_unlock(&s->lock);
+        if (rw->buf.len >= AOF_REWRITE_BUF)
+            rewrite_flush(rw);
+    }
+    rewrite_flush(rw);
+    return moved;
+}
+
+static void set_diffing(AOF *aof, const bool on) {
+    for (int i = 0; i < AOF_STRIPES; i++) {
+        Stripe *s = &aof->stripes[i];
+        pthread_mutex_lock(&s->lock);
+        s->diffing = on;
+        if (!on) {
+            free(s->diff.dat);
+            s->diff = (ByteBuf) {0};
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+static void *aof_rewriter(void *arg) {
+    AOF *aof = arg;
+    const size_t plen = strlen(aof->path);
+    char *tmp = malloc(plen + sizeof(".rewrite"));
+    memcpy(tmp, aof->path, plen);
+    memcpy(tmp + plen, ".rewrite", sizeof(".rewrite"));
+    Rewrite rw = {
+            .fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644),
+            .ok = true,
+            .compress = LOAD(&aof->compress, RELAXED),
+    };
+    if (rw.fd < 0) {
+        logger(stderr, "ERROR", "[aof] open(%s): %s\n", tmp, strerror(errno));
+        free(tmp);
+        aof->rewrite_ok = false;
+        STORE(&aof->rewriting, false, RELEASE);
+        return NULL;
+    }
+
+    // Every record appended from here on is also kept for the new file, the
+    // dump covers those before.
+    set_diffing(aof, true);
+    smr_reg();
+    uint64_t cursor = 0;
+    do {
+        cursor = kv_dump(aof->rewrite_kv, cursor, REWRITE_DUMP_BUCKETS, rewrite_emit, &rw);
+        smr_quiescent();
+    } while (cursor && rw.ok);
+    smr_unreg();
+    rewrite_flush(&rw);
+    // Catch up while appends go on, until little is left to do with them held.
+    for (int round = 0; round < REWRITE_CATCH_UP_ROUNDS && rw.ok; round++) {
+        if (rewrite_catch_up(aof, &rw, false) < AOF_REWRITE_BUF)
+            break;
+    }
+    if (rw.ok && fdatasync(rw.fd))
+        rw.ok = false;
+
+    pthread_mutex_lock(&aof->io);
+    for (int i = 0; i < AOF_STRIPES; i++) {
+        pthread_mutex_lock(&aof->stripes[i].lock);
+    }
+    rewrite_catch_up(aof, &rw, true);
+    rw.ok = rw.ok && !fdatasync(rw.fd) && !rename(tmp, aof->path);
+    if (rw.ok) {
+        // Undrained records are in the diff, the new file has them already.
+        for (int i = 0; i < AOF_STRIPES; i++) {
+            aof->stripes[i].buf.len = 0;
+        }
+        // So are drained ones the writer kept for a retry, & the file is
+        // fsynced: a failed log is healthy again.
+        aof->out.len = aof->written = 0;
+        close(aof->fd);
+        aof->fd = rw.fd;
+        const off_t size = lseek(rw.fd, 0, SEEK_END);
+        aof->synced_size = (uint64_t) size;
+        STORE(&aof->failed, false, RELEASE);
+        STORE(&aof->size, (uint64_t) size, RELAXED);
+        STORE(&aof->base_size, (uint64_t) size, RELAXED);
+    }
+    for (int i = AOF_STRIPES - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&aof->stripes[i].lock);
+    }
+    pthread_mutex_unlock(&aof->io);
+    set_diffing(aof, false);
+
+    if (rw.ok) {
+        if (!fsync_dir(aof->path))
+            logger(stderr, "WARN", "[aof] Can't fsync the directory of %s\n", aof->path);
+        logger(stderr, "INFO", "[aof] Rewrote %s\n", aof->path);
+    } else {
+        logger(stderr, "ERROR", "[aof] Rewrite of %s failed: %s\n", aof->path, strerror(errno));
+        close(rw.fd);
+        unlink(tmp);
+    }
+    free(rw.buf.dat);
+    free(rw.zbuf.dat);
+    free(tmp);
+    aof->rewrite_ok = rw.ok;
+    STORE(&aof->rewriting, false, RELEASE);
+    return NULL;
+}
+
+bool aof_rewrite_start(AOF *aof, KVStore *kv) {
+    bool expected = false;
+    if (!CMPXCHG(&aof->rewriting, &expected, true, ACQ_REL, RELAXED))
+        return false;
+    // The last one is done, reap it.
+    if (aof->rewriter_started) {
+        pthread_join(aof->rewriter, NULL);
+    }
+    aof->rewrite_kv = kv;
+    aof->rewriter_started = !pthread_create(&aof->rewriter, NULL, aof_rewriter, aof);
+    if (!aof->rewriter_started) {
+        STORE(&aof->rewriting, false, RELEASE);
+    }
+    return aof->rewriter_started;
+}
+
+bool aof_rewrite_wait(AOF *aof) {
+    if (!aof->rewriter_started)
+        return false;
+    pthread_join(aof->rewriter, NULL);
+    aof->rewriter_started = false;
+    return aof->rewrite_ok;
+}
+
+bool aof_wait(AOF *aof, const uint64_t gen) {
+    if (aof->fsync_ms != AOF_FSYNC_ALWAYS)
+        return !LOAD(&aof->failed, ACQUIRE);
+    pthread_mutex_lock(&aof->mu);
+    if (aof->synced < gen) {
+        aof->pending = true;
+        pthread_cond_signal(&aof->wake);
+    }
+    while (aof->synced < gen && aof->failed_gen < gen)
+        pthread_cond_wait(&aof->done, &aof->mu);
+    const bool ok = aof->synced >= gen;
+    pthread_mutex_unlock(&aof->mu);
+    return ok;
+}
+
+bool aof_failed(AOF *aof) { return LOAD(&aof->failed, ACQUIRE); }
+
+struct ReplayJob {
+    cnode node;
+    OwnedRequest req;
+};
+typedef struct ReplayJob ReplayJob;
+
+struct Replayer {
+    pthread_t thread;
+    spscq q;
+    KVStore *kv;
+    atomic_bool *done;
+    int64_t n;
+};
+typedef struct Replayer Replayer;
+
+static void replay_one(KVStore *kv, ReplayJob *job, RingBuf *out) {
+    rb_clear(out);
+    smr_enter();
+    do_owned_req(kv, &job->req, out);
+    smr_exit();
+    owned_req_destroy(&job->req);
+    free(job);
+}
+
+static void *replay_main(void *arg) {
+    Replayer *r = arg;
+    RingBuf out;
+    rb_init(&out, 256);
+    smr_reg();
+    for (;;) {
+        cnode *n = spsc_pop(&r->q);
+        if (!n) {
+            // Recheck once the producer is done, it may have raced the flag.
+            if (!LOAD(r->done, ACQUIRE)) {
+                sched_yield();
+                continue;
+            }
+            if (!(n = spsc_pop(&r->q)))
+                break;
+        }
+        replay_one(r->kv, container_of(n, ReplayJob, node), &out);
+        if (++r->n % 64 == 0)
+            smr_quiescent();
+    }
+    smr_quiescent();
+    smr_unreg();
+    rb_destroy(&out);
+    return NULL;
+}
+
+// Feeds records to the replay threads, or replays them itself without any.
+struct Replay {
+    KVStore *kv;
+    Replayer *rs;
+    int nr;
+    RingBuf rb, out;
+    int64_t n;
+};
+typedef struct Replay Replay;
+
+// One record past its length, false if it's bad.
+static bool replay_record(Replay *rp, const uint8_t *rec, const uint32_t len) {
+    if (len >= rp->rb.cap) {
+        rb_resize(&rp->rb, next_pow2(len + 1));
+    }
+    rb_clear(&rp->rb);
+    rb_write(&rp->rb, rec, len);
+    ReplayJob *job = calloc(1, sizeof(ReplayJob));
+    if (!new_owned_req(&job->req, &rp->rb, len)) {
+        owned_req_destroy(&job->req);
+        free(job);
+        return false;
+    }
+    rp->n++;
+    if (!rp->nr || !job->req.req.key) {
+        replay_one(rp->kv, job, &rp->out);
+    } else {
+        spscq *q = &rp->rs[vstr_hash_rapid(job->req.req.key) % rp->nr].q;
+        while (!spsc_put(q, &job->node))
+            sched_yield();
+    }
+    // Replay threads can't reclaim while we hold up grace periods.
+    if (rp->n % 1024 == 0)
+        smr_quiescent();
+    return true;
+}
+
+// The records of a block, false if one is bad.
+static bool replay_block(Replay *rp, const uint8_t *raw, const size_t len) {
+    for (size_t off = 0; off < len;) {
+        uint32_t rlen;
+        if (len - off < 4)
+            return false;
+        memcpy(&rlen, raw + off, 4);
+        if (rlen < 4 || rlen > len - off - 4 || !replay_record(rp, raw + off + 4, rlen))
+            return false;
+        off += 4 + rlen;
+    }
+    return true;
+}
+
+int64_t aof_load(KVStore *kv, const char *path, int nthreads) {
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return errno == ENOENT ? 0 : -1;
+    setvbuf(f, NULL, _IOFBF, AOF_READ_BUF);
+    nthreads = MAX(nthreads, 1);
+
+    atomic_bool done = false;
+    // A single thread replays on the caller.
+    Replay rp = {.kv = kv, .rs = calloc(nthreads, sizeof(Replayer)), .nr = nthreads > 1 ? nthreads : 0};
+    for (int i = 0; i < rp.nr; i++) {
+        spsc_init(&rp.rs[i].q, REPLAY_QSIZE);
+        rp.rs[i].kv = kv;
+        rp.rs[i].done = &done;
+        pthread_create(&rp.rs[i].thread, NULL, replay_main, &rp.rs[i]);
+    }
+
+    rb_init(&rp.rb, 4096);
+    rb_init(&rp.out, 256);
+    // A record or a block as read & the records of a compressed block.
+    uint8_t *rec = NULL, *blk = NULL;
+    size_t rec_cap = 0, blk_cap = 0;
+    int64_t ret = 0;
+    off_t good = 0;
+    bool torn = false;
+    for (;;) {
+        uint32_t len;
+        const size_t got = fread(&len, 1, 4, f);
+        if (!got && feof(f))
+            break;
+        if (got < 4) {
+            torn = true;
+            break;
+        }
+        LZBlock b;
+        const bool is_block = len == AOF_BLOCK_MARK;
+        if (is_block) {
+            uint8_t head[LZ_BLOCK_HEAD];
+            if (fread(head, 1, LZ_BLOCK_HEAD, f) < LZ_BLOCK_HEAD) {
+                torn = true;
+                break;
+            }
+            if (!lz_block_head(head, &b) || b.raw_len > AOF_BLOCK + 4 + AOF_MAX_RECORD) {
+                ret = -1;
+                break;
+            }
+            len = b.len;
+        } else if (len < 4 || len > AOF_MAX_RECORD) {
+            ret = -1;
+            break;
+        }
+        if (len > rec_cap) {
+            rec_cap = next_pow2(len);
+            rec = realloc(rec, rec_cap);
+        }
+        if (fread(rec, 1, len, f) < len) {
+            torn = true;
+            break;
+        }
+        if (is_block) {
+            if (b.raw_len > blk_cap) {
+                blk_cap = next_pow2(b.raw_len);
+                blk = realloc(blk, blk_cap);
+            }
+            const uint8_t *raw = lz_block_get(&b, rec, blk);
+            if (!raw || !replay_block(&rp, raw, b.raw_len)) {
+                ret = -1;
+                break;
+            }
+            good += 4 + LZ_BLOCK_HEAD + len;
+        } else {
+            if (!replay_record(&rp, rec, len)) {
+                ret = -1;
+                break;
+            }
+            good += 4 + len;
+        }
+    }
+    if (ferror(f))
+        ret = -1;
+    fclose(f);
+
+    STORE(&done, true, RELEASE);
+    for (int i = 0; i < rp.nr; i++) {
+        pthread_join(rp.rs[i].thread, NULL);
+        spsc_destroy(&rp.rs[i].q);
+    }
+    free(rp.rs);
+    free(rec);
+    free(blk);
+    rb_destroy(&rp.rb);
+    rb_destroy(&rp.out);
+
+    if (ret < 0) {
+        logger(stderr, "ERROR", "[aof] Bad record at offset %lld of %s\n", (long long) good, path);
+        return -1;
+    }
+    if (torn) {
+        logger(stderr, "WARN", "[aof] Truncating a torn record at offset %lld of %s\n", (long long) good, path);
+        if (truncate(path, good))
+            return -1;
+    }
+    return rp.n;
+}
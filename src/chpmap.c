@@ -1,6 +1,7 @@
 #include "hpmap.h"
 
 #include <assert.h>
+#include <stdalign.h>
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stddef.h>
@@ -10,7 +11,8 @@
 #include <strings.h>
 #include <unistd.h>
 
-#include "qsbr.h"
+#include "smr.h"
+#include "topo.h"
 #include "utils.h"
 
 struct Segment {
@@ -30,7 +32,9 @@ struct CHPTable {
     struct Bucket *buckets;
     u64 mask, nsegs;
     atomic_u64 size;
-    char data[];
+    // `buckets` is a mapping of its own, see `topo_map_interleaved`.
+    bool mapped;
+    alignas(max_align_t) char data[];
 };
 
 static bool find_closer_free_bucket(struct CHPTable *t, u64 free_segment, u64 *free_bucket_idx, u64 *free_distance);
@@ -40,11 +44,7 @@ static inline void spin_wait(struct CHPMap *m) {
     int spin = 0;
     while (LOAD(&m->migrate_started, ACQUIRE) && epoch == LOAD(&m->epoch, ACQUIRE)) {
         if (spin < 5) {
-#if defined(__i386__) || defined(__x86_64__)
-            __asm__ __volatile__("pause");
-#elif defined(__aarch64__) || defined(__arm__)
-            __asm__ __volatile__("yield");
-#endif
+            cpu_relax();
         } else {
             int sleep_duration = spin - 5 < 9 ? spin - 5 : 9;
             usleep(1 << sleep_duration);
@@ -56,11 +56,14 @@ static inline void spin_wait(struct CHPMap *m) {
 static struct CHPTable *hpt_new(size_t size) {
     u64 cap = next_pow2(size);
     u64 buckets = cap + INSERT_RANGE, nsegs = buckets / SEGMENT_SIZE + (buckets % SEGMENT_SIZE != 0);
-    struct CHPTable *t =
-            qsbr_calloc(1, sizeof(struct CHPTable) + sizeof(struct Segment) * nsegs + sizeof(struct Bucket) * buckets);
+    // Any thread may hit any bucket, spread them before the first touch.
+    struct Bucket *mapped = topo_numa() ? topo_map_interleaved(sizeof(struct Bucket) * buckets) : NULL;
+    struct CHPTable *t = smr_calloc(1, sizeof(struct CHPTable) + sizeof(struct Segment) * nsegs +
+                                               (mapped ? 0 : sizeof(struct Bucket) * buckets));
     assert(t);
     t->segments = (struct Segment *) t->data;
-    t->buckets = (struct Bucket *) (t->data + sizeof(struct Segment) * nsegs);
+    t->buckets = mapped ? mapped : (struct Bucket *) (t->data + sizeof(struct Segment) * nsegs);
+    t->mapped = mapped;
     t->mask = cap - 1;
     t->nsegs = nsegs;
 
@@ -71,7 +74,12 @@ static struct CHPTable *hpt_new(size_t size) {
     return t;
 }
 
-static void hpt_destroy(struct CHPTable *t) { qsbr_retire(t, NULL); }
+static void hpt_unmap(void *p) {
+    struct CHPTable *t = p;
+    topo_unmap(t->buckets, sizeof(struct Bucket) * (t->mask + 1 + INSERT_RANGE));
+}
+
+static void hpt_destroy(struct CHPTable *t) { smr_retire(t, t->mapped ? hpt_unmap : NULL); }
 
 static struct BNode *hpt_lookup(struct CHPTable *t, struct BNode *k, node_eq eq) {
     u64 hash = k->hcode;
@@ -202,6 +210,38 @@ static bool hpt_foreach(struct CHPTable *t, bool (*f)(struct BNode *, void *), v
     return true;
 }
 
+// Nodes homed in bucket `h`, as of one consistent read of its neighbourhood.
+static size_t hpt_home(struct CHPTable *t, const u64 h, struct BNode **out) {
+    const u64 seg = h / SEGMENT_SIZE;
+    u64 ts_before = LOAD(&t->segments[seg].ts, ACQUIRE);
+    for (;;) {
+        size_t n = 0;
+        u64 hop = LOAD(&t->buckets[h].hop, RELAXED);
+        while (hop > 0) {
+            u64 lowest_set = ffsll((i64) hop) - 1;
+            struct BNode *node = LOAD(&t->buckets[h + lowest_set].node, RELAXED);
+            hop &= ~(1ULL << lowest_set);
+            // A displaced node shows in both buckets until the old bit clears.
+            if (!node || (node->hcode & t->mask) != h) {
+                continue;
+            }
+            bool dup = false;
+            for (size_t i = 0; i < n && !dup; i++) {
+                dup = out[i] == node;
+            }
+            if (!dup) {
+                out[n++] = node;
+            }
+        }
+        u64 ts_after = LOAD(&t->segments[seg].ts, ACQUIRE);
+        if (ts_before != ts_after) {
+            ts_before = ts_after;
+            continue;
+        }
+        return n;
+    }
+}
+
 static u64 hpt_size(struct CHPTable *t) { return LOAD(&t->size, RELAXED); }
 
 static bool find_closer_free_bucket(struct CHPTable *t, const u64 free_seg, u64 *free_buc, u64 *free_dist) {
@@ -249,9 +289,10 @@ BEGIN:
 
 static void migrate_seg(struct CHPTable *t, struct CHPTable *nxt, u64 seg, node_eq eq) {
     pthread_mutex_lock(&t->segments[seg].lock);
-    u64 start = seg * SEGMENT_SIZE;
-    for (u64 i = 0; i < SEGMENT_SIZE; i++) {
-        struct BNode *node = LOAD(&t->buckets[start + i].node, RELAXED);
+    // The last segment may be partial.
+    const u64 start = seg * SEGMENT_SIZE, end = MIN(start + SEGMENT_SIZE, t->mask + 1 + INSERT_RANGE);
+    for (u64 i = start; i < end; i++) {
+        struct BNode *node = LOAD(&t->buckets[i].node, RELAXED);
         if (node) {
             hpt_upsert(nxt, node, eq);
         }
@@ -259,6 +300,19 @@ static void migrate_seg(struct CHPTable *t, struct CHPTable *nxt, u64 seg, node_
     pthread_mutex_unlock(&t->segments[seg].lock);
 }
 
+// Start migrating `t` to a table of `cap` buckets, unless one is already.
+static void hpt_grow(struct CHPMap *m, struct CHPTable *t, const u64 cap) {
+    if (LOAD(&t->next, ACQUIRE))
+        return;
+    struct CHPTable *nt = hpt_new(cap);
+    struct CHPTable *expect = NULL;
+    STORE(&m->migrate_pos, 0, RELEASE);
+    STORE(&m->migrate_started, true, RELEASE);
+    if (!CMPXCHG(&t->next, &expect, nt, ACQ_REL, RELAXED)) {
+        hpt_destroy(nt);
+    }
+}
+
 static void migrate_helper(struct CHPMap *m, struct CHPTable *t, struct CHPTable *nxt, node_eq eq) {
     if (nxt) {
         FAA(&m->mthreads, 1, ACQ_REL);
@@ -311,9 +365,7 @@ void chpm_destroy(struct CHPMap *m) {
     }
 }
 
-bool chpm_contains(struct CHPMap *m, struct BNode *k, node_eq eq) { return chpm_lookup(m, k, eq) != NULL; }
-
-struct BNode *chpm_lookup(struct CHPMap *m, struct BNode *k, node_eq eq) {
+static struct BNode *map_lookup(struct CHPMap *m, struct BNode *k, node_eq eq) {
     struct BNode *res;
     u64 e_before = LOAD(&m->epoch, ACQUIRE);
     for (;;) {
@@ -331,7 +383,7 @@ struct BNode *chpm_lookup(struct CHPMap *m, struct BNode *k, node_eq eq) {
     }
 }
 
-bool chpm_add(struct CHPMap *m, struct BNode *n, node_eq eq) {
+static bool map_add(struct CHPMap *m, struct BNode *n, node_eq eq) {
     struct CHPTable *t = NULL, *nxt = NULL;
     struct BNode *res;
 RETRY:
@@ -340,37 +392,33 @@ RETRY:
         nxt = LOAD(&t->next, ACQUIRE);
         if (nxt) {
             migrate_helper(m, t, nxt, eq);
-            qsbr_quiescent();
             continue;
         }
         break;
     }
 
     res = hpt_upsert(t, n, eq);
-    if (!res)
+    if (!res) {
+        // A full neighbourhood, e.g. keys inserted in hash order, grows the
+        // table whatever the load.
+        hpt_grow(m, t, (t->mask + 1) << 1);
         goto RETRY;
+    }
 
     if (res == n) { // Node was newly inserted
         u64 sz = hpt_size(t), cap = t->mask + 1;
         if (cap - sz <= (cap >> 2) + (cap >> 3) || sz >= cap) {
-            struct CHPTable *nt = hpt_new(cap << 1);
-            struct CHPTable *expect = NULL;
-            STORE(&m->migrate_pos, 0, RELEASE);
-            STORE(&m->migrate_started, true, RELEASE);
-            if (!CMPXCHG(&t->next, &expect, nt, ACQ_REL, RELAXED)) {
-                hpt_destroy(nt);
-            }
+            hpt_grow(m, t, cap << 1);
         }
         FAA(&m->size, 1, RELAXED);
         FAA(&m->epoch, 1, RELEASE);
-        qsbr_quiescent();
         return true;
     }
 
     return false;
 }
 
-struct BNode *chpm_remove(struct CHPMap *m, struct BNode *k, node_eq eq) {
+static struct BNode *map_remove(struct CHPMap *m, struct BNode *k, node_eq eq) {
     struct BNode *result = NULL;
     struct CHPTable *t = NULL, *nxt = NULL;
     for (;;) {
@@ -378,7 +426,6 @@ struct BNode *chpm_remove(struct CHPMap *m, struct BNode *k, node_eq eq) {
         nxt = LOAD(&t->next, ACQUIRE);
         if (nxt) {
             migrate_helper(m, t, nxt, eq);
-            qsbr_quiescent();
             continue;
         }
         break;
@@ -387,14 +434,11 @@ struct BNode *chpm_remove(struct CHPMap *m, struct BNode *k, node_eq eq) {
     if (result) {
         FAS(&m->size, 1, RELAXED);
         FAA(&m->epoch, 1, RELEASE);
-        qsbr_quiescent();
     }
     return result;
 }
 
-u64 chpm_size(struct CHPMap *m) { return LOAD(&m->size, RELAXED); }
-
-struct BNode *chpm_upsert(struct CHPMap *m, struct BNode *n, node_eq eq) {
+static struct BNode *map_upsert(struct CHPMap *m, struct BNode *n, node_eq eq) {
     struct BNode *result;
     struct CHPTable *t = NULL, *nxt = NULL;
 RETRY:
@@ -403,36 +447,30 @@ RETRY:
         nxt = LOAD(&t->next, ACQUIRE);
         if (nxt) {
             migrate_helper(m, t, nxt, eq);
-            qsbr_quiescent();
             continue;
         }
         break;
     }
 
     result = hpt_upsert(t, n, eq);
-    if (!result)
+    if (!result) {
+        hpt_grow(m, t, (t->mask + 1) << 1);
         goto RETRY;
+    }
 
     if (result == n) { // Node was newly inserted
         u64 sz = hpt_size(t), cap = t->mask + 1;
         if (cap - sz <= (cap >> 2) + (cap >> 3) || sz >= cap) {
-            struct CHPTable *nt = hpt_new(cap << 1);
-            struct CHPTable *expect = NULL;
-            STORE(&m->migrate_pos, 0, RELEASE);
-            STORE(&m->migrate_started, true, RELEASE);
-            if (!CMPXCHG(&t->next, &expect, nt, ACQ_REL, RELAXED)) {
-                hpt_destroy(nt);
-            }
+            hpt_grow(m, t, cap << 1);
         }
         FAA(&m->size, 1, RELAXED);
         FAA(&m->epoch, 1, RELEASE);
-        qsbr_quiescent();
     }
     result = (struct BNode *) ((uintptr_t) result & ~PTR_TAG);
     return result;
 }
 
-bool chpm_foreach(struct CHPMap *m, bool (*f)(struct BNode *, void *), void *arg, node_eq eq) {
+static bool map_foreach(struct CHPMap *m, bool (*f)(struct BNode *, void *), void *arg, node_eq eq) {
     struct CHPTable *t = LOAD(&m->active, ACQUIRE);
     struct CHPTable *nxt = LOAD(&t->next, ACQUIRE);
     if (nxt) {
@@ -441,3 +479,128 @@ bool chpm_foreach(struct CHPMap *m, bool (*f)(struct BNode *, void *), void *arg
     }
     return hpt_foreach(t, f, arg);
 }
+
+// Public entry points, each a critical section of its own. Tables retired by
+// a migration stay readable until the operation returns.
+bool chpm_contains(struct CHPMap *m, struct BNode *k, node_eq eq) { return chpm_lookup(m, k, eq) != NULL; }
+
+struct BNode *chpm_lookup(struct CHPMap *m, struct BNode *k, node_eq eq) {
+    smr_enter();
+    struct BNode *res = map_lookup(m, k, eq);
+    smr_exit();
+    return res;
+}
+
+bool chpm_add(struct CHPMap *m, struct BNode *n, node_eq eq) {
+    smr_enter();
+    const bool res = map_add(m, n, eq);
+    smr_exit();
+    return res;
+}
+
+struct BNode *chpm_remove(struct CHPMap *m, struct BNode *k, node_eq eq) {
+    smr_enter();
+    struct BNode *res = map_remove(m, k, eq);
+    smr_exit();
+    return res;
+}
+
+u64 chpm_size(struct CHPMap *m) { return LOAD(&m->size, RELAXED); }
+
+struct BNode *chpm_upsert(struct CHPMap *m, struct BNode *n, node_eq eq) {
+    smr_enter();
+    struct BNode *res = map_upsert(m, n, eq);
+    smr_exit();
+    return res;
+}
+
+bool chpm_foreach(struct CHPMap *m, bool (*f)(struct BNode *, void *), void *arg, node_eq eq) {
+    smr_enter();
+    const bool res = map_foreach(m, f, arg, eq);
+    smr_exit();
+    return res;
+}
+
+void chpm_reserve(struct CHPMap *m, const size_t n, node_eq eq) {
+    smr_enter();
+    struct CHPTable *t, *nxt;
+    for (;;) {
+        t = LOAD(&m->active, ACQUIRE);
+        nxt = LOAD(&t->next, ACQUIRE);
+        if (nxt) {
+            migrate_helper(m, t, nxt, eq);
+            continue;
+        }
+        break;
+    }
+    // Inserts grow the table once 5/8 full.
+    const u64 cap = next_pow2(n + (n >> 1) + (n >> 3) + 1);
+    if (cap > t->mask + 1) {
+        hpt_grow(m, t, cap);
+        migrate_helper(m, t, LOAD(&t->next, ACQUIRE), eq);
+    }
+    smr_exit();
+}
+
+u64 chpm_scan(struct CHPMap *m, u64 cursor, u64 count, bool (*f)(struct BNode *, void *), void *arg, node_eq eq) {
+    smr_enter();
+    struct CHPTable *t = LOAD(&m->active, ACQUIRE);
+    if (LOAD(&t->next, ACQUIRE)) {
+        migrate_helper(m, t, LOAD(&t->next, ACQUIRE), eq);
+        t = LOAD(&m->active, ACQUIRE);
+    }
+    const u64 bits = (u64) __builtin_ctzll(t->mask + 1);
+    // Homes are walked by their low `start_bits` bits, the table size at the
+    // first call: a grown table only splits each into more buckets.
+    const u64 start_bits = cursor ? CHPM_SCAN_BITS(cursor) : bits;
+    u64 pos = CHPM_SCAN_POS(cursor);
+    if (start_bits > bits || pos >> start_bits) {
+        smr_exit();
+        return 0;
+    }
+    const u64 stride = 1ULL << start_bits, end = MIN(pos + MAX(count, 1), stride);
+    struct BNode *nodes[MASK_RANGE];
+    bool go = true;
+    for (; pos < end && go; pos++) {
+        for (u64 h = pos; h <= t->mask; h += stride) {
+            const size_t n = hpt_home(t, h, nodes);
+            for (size_t i = 0; i < n; i++) {
+                go &= f(nodes[i], arg);
+            }
+        }
+    }
+    smr_exit();
+    return pos == stride ? 0 : start_bits << CHPM_SCAN_BITS_SHIFT | pos;
+}
+
+u64 chpm_mem(struct CHPMap *m) {
+    smr_enter();
+    const struct CHPTable *t = LOAD(&m->active, ACQUIRE);
+    const u64 res = sizeof(struct CHPTable) + sizeof(struct Segment) * t->nsegs +
+                    sizeof(struct Bucket) * (t->mask + 1 + INSERT_RANGE);
+    smr_exit();
+    return res;
+}
+
+size_t chpm_sample(struct CHPMap *m, const u64 seed, struct BNode **out, const size_t n) {
+    smr_enter();
+    const struct CHPTable *t = LOAD(&m->active, ACQUIRE);
+    const u64 buckets = t->mask + 1 + INSERT_RANGE;
+    u64 i = seed % buckets;
+    size_t found = 0;
+    // Rest of the first segment, then whole ones, wrapping around.
+    for (u64 seen = 0; seen < t->nsegs && found < n; seen++) {
+        const u64 end = MIN((i / SEGMENT_SIZE + 1) * SEGMENT_SIZE, buckets);
+        for (; i < end && found < n; i++) {
+            struct BNode *node = LOAD(&t->buckets[i].node, ACQUIRE);
+            if (node) {
+                out[found++] = node;
+            }
+        }
+        if (i == buckets) {
+            i = 0;
+        }
+    }
+    smr_exit();
+    return found;
+}
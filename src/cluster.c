@@ -0,0 +1,834 @@
+#include "cluster.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "kvstore.h"
+#include "list.h"
+#include "parse.h"
+#include "ringbuf.h"
+#include "serialize.h"
+#include "smr.h"
+#include "utils.h"
+
+#define CLUSTER_MAP_MAGIC "KVSLOTS\1"
+// Buckets dumped per critical section, dumped records go out in chunks of
+// this size.
+#define CLUSTER_DUMP_BUCKETS 1024
+#define CLUSTER_DUMP_BUF (1 << 20)
+// The slots flip once a drain of the stream is this small.
+#define CLUSTER_FLIP_BYTES (64u << 10)
+// Anything longer is garbage, not a record.
+#define CLUSTER_MAX_RECORD (64u << 20)
+#define CLUSTER_READ_BUF (1 << 16)
+// Records an import applies between reporting quiescent.
+#define CLUSTER_QUIESCE 1024
+// Bounds connecting to a node & its reply to a SETSLOT.
+#define CLUSTER_CONNECT_MS 1000
+// What the target of a migration sends once it owns the slots.
+#define CLUSTER_ACK 1
+// In `moving` while the target may or may not have taken the slots.
+#define MOVING_DOUBT (1ull << 33)
+
+// A CLUSTER command on `slots` with its arguments, `node` left out if < 0.
+static void buf_put_cluster(ByteBuf *b, const char *sub, const uint32_t first, const uint32_t last,
+                            const int node) {
+    char nums[3][16];
+    vstr *argv[5] = {vstr_new_s("cluster"), vstr_new_s(sub)};
+    snprintf(nums[0], sizeof(nums[0]), "%u", first);
+    snprintf(nums[1], sizeof(nums[1]), "%u", last);
+    snprintf(nums[2], sizeof(nums[2]), "%d", node);
+    const uint32_t argc = node < 0 ? 4 : 5;
+    for (uint32_t i = 2; i < argc; i++) {
+        argv[i] = vstr_new_s(nums[i - 2]);
+    }
+    buf_put_record(b, argc, (const vstr *const *) argv);
+    for (uint32_t i = 0; i < argc; i++) {
+        vstr_destroy(argv[i]);
+    }
+}
+
+static void set_rcvtimeo(const int fd, const int ms) {
+    const struct timeval tv = {ms / 1000, ms % 1000 * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+struct ClusterStripe {
+    alignas(64) rwlock lock;
+    // Writes to migrating slots, appended under `mu` with `lock` held shared.
+    pthread_mutex_t mu;
+    ByteBuf buf;
+};
+typedef struct ClusterStripe ClusterStripe;
+
+// A node moving slots here.
+struct ClusterImport {
+    DList node;
+    Cluster *cl;
+    int fd;
+    uint32_t first, last;
+    pthread_t thread;
+    atomic_bool done;
+    // Import thread only, a record to parse & the replies nobody reads.
+    RingBuf rb, out;
+};
+typedef struct ClusterImport ClusterImport;
+
+struct Cluster {
+    KVStore *kv;
+    int id, n;
+    char *path;
+    char *addrs[CLUSTER_MAX_NODES], *hosts[CLUSTER_MAX_NODES];
+    int ports[CLUSTER_MAX_NODES];
+    // Redirects to each node.
+    char *moved[CLUSTER_MAX_NODES];
+    // Slots of ours change hands with every stripe held, `cluster_enter`
+    // reads their owner under one.
+    _Atomic(uint16_t) owner[CLUSTER_SLOTS];
+    // The range moving out, 1 << 32 | first << 16 | last, 0 if none, plus
+    // MOVING_DOUBT once the flip went unacked. Changes with every stripe held.
+    atomic_u64 moving;
+    atomic_bool busy;
+    // The fields below, the map file & the migration starting are under `mu`.
+    pthread_mutex_t mu;
+    bool stop;
+    // The last migration out, its socket -1 once it's done with it.
+    pthread_t migrator;
+    bool joinable;
+    int flip_ms;
+    int mig_fd, mig_to;
+    uint32_t mig_first, mig_last;
+    DList imports;
+    // Migration thread only, dumped & drained records.
+    ByteBuf dump, out;
+    ClusterStripe stripes[CLUSTER_STRIPES];
+};
+
+static inline ClusterStripe *stripe_of(Cluster *cl, const uint32_t slot) {
+    return &cl->stripes[slot & (CLUSTER_STRIPES - 1)];
+}
+
+static inline bool moving_has(const uint64_t mv, const uint32_t slot) {
+    return mv && slot >= (mv >> 16 & 0xffff) && slot <= (mv & 0xffff);
+}
+
+// Hold every stripe, no request on a key is midway.
+static void stripes_wlock(Cluster *cl) {
+    for (int i = 0; i < CLUSTER_STRIPES; i++) {
+        rw_wlock(&cl->stripes[i].lock);
+    }
+}
+
+static void stripes_wunlock(Cluster *cl) {
+    for (int i = CLUSTER_STRIPES - 1; i >= 0; i--) {
+        rw_wunlock(&cl->stripes[i].lock);
+    }
+}
+
+// Under `mu`. The node forgets a hand-over it wasn't able to save, the
+// others redirect to the new owner regardless.
+static void map_save(Cluster *cl) {
+    if (!cl->path)
+        return;
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", cl->path);
+    uint16_t owner[CLUSTER_SLOTS];
+    for (uint32_t s = 0; s < CLUSTER_SLOTS; s++) {
+        owner[s] = LOAD(&cl->owner[s], RELAXED);
+    }
+    const uint32_t n = (uint32_t) cl->n;
+    const int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    const bool ok = fd >= 0 && write_all(fd, CLUSTER_MAP_MAGIC, 8) && write_all(fd, &n, 4) &&
+                    write_all(fd, owner, sizeof(owner)) && !fdatasync(fd);
+    if (fd >= 0)
+        close(fd);
+    if (!ok || rename(tmp, cl->path) || !fsync_dir(cl->path))
+        logger(stderr, "ERROR", "[cluster] Can't save the slot map to %s\n", cl->path);
+}
+
+// The saved map, even ranges in id order if there's none. False if it's
+// garbage or for another number of nodes.
+static bool map_load(Cluster *cl) {
+    const int fd = cl->path ? open(cl->path, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd < 0) {
+        for (uint32_t s = 0; s < CLUSTER_SLOTS; s++) {
+            atomic_init(&cl->owner[s], (uint16_t) ((uint64_t) s * cl->n / CLUSTER_SLOTS));
+        }
+        return !cl->path || errno == ENOENT;
+    }
+    char magic[8];
+    uint32_t n = 0;
+    uint16_t owner[CLUSTER_SLOTS];
+    bool ok = read(fd, magic, 8) == 8 && !memcmp(magic, CLUSTER_MAP_MAGIC, 8) && read(fd, &n, 4) == 4 &&
+              n == (uint32_t) cl->n && read(fd, owner, sizeof(owner)) == sizeof(owner);
+    close(fd);
+    for (uint32_t s = 0; ok && s < CLUSTER_SLOTS; s++) {
+        ok = owner[s] < n;
+        atomic_init(&cl->owner[s], owner[s]);
+    }
+    return ok;
+}
+
+// A blocking socket connected to `node`'s client port, -1 if it can't be
+// reached.
+static int node_connect(Cluster *cl, const int node) {
+    char port[8];
+    snprintf(port, sizeof(port), "%d", cl->ports[node]);
+    const struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *res;
+    if (getaddrinfo(cl->hosts[node], port, &hints, &res))
+        return -1;
+    int fd = -1;
+    for (const struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) < 0)
+            continue;
+        // Bounds the connect only.
+        struct timeval tv = {CLUSTER_CONNECT_MS / 1000, CLUSTER_CONNECT_MS % 1000 * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        tv = (struct timeval) {0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// Tell every node but us & the new owner, best effort: those that miss it
+// get redirected by us.
+static void notify_setslot(Cluster *cl, const uint32_t first, const uint32_t last, const int to) {
+    ByteBuf req = {0};
+    buf_put_cluster(&req, "setslot", first, last, to);
+    for (int i = 0; i < cl->n; i++) {
+        if (i == cl->id || i == to)
+            continue;
+        const int fd = node_connect(cl, i);
+        bool ok = fd >= 0 && send_all(fd, req.dat, req.len);
+        if (ok) {
+            // The reply, whatever it says.
+            set_rcvtimeo(fd, CLUSTER_CONNECT_MS);
+            uint32_t len = 0;
+            uint8_t skip[256];
+            ok = recv_all(fd, &len, 4);
+            for (uint32_t got; ok && len; len -= got) {
+                got = MIN(len, (uint32_t) sizeof(skip));
+                ok = recv_all(fd, skip, got);
+            }
+        }
+        if (fd >= 0)
+            close(fd);
+        if (!ok)
+            logger(stderr, "WARN", "[cluster] Can't tell node %d about slots %u-%u\n", i, first, last);
+    }
+    free(req.dat);
+}
+
+// Keys of `range` this node doesn't own (any more).
+static bool drop_unowned(void *arg, const vstr *key) {
+    const ClusterImport *range = arg;
+    const uint32_t slot = cluster_slot(key);
+    return slot >= range->first && slot <= range->last && LOAD(&range->cl->owner[slot], RELAXED) != range->cl->id;
+}
+
+static bool mig_emit(void *arg, const uint32_t argc, const vstr *const *argv) {
+    Cluster *cl = arg;
+    // Every record names the key first.
+    const uint32_t slot = cluster_slot(argv[1]);
+    if (slot >= cl->mig_first && slot <= cl->mig_last)
+        buf_put_record(&cl->dump, argc, argv);
+    return true;
+}
+
+// Send `b` outside the critical section.
+static bool mig_send(const int fd, ByteBuf *b) {
+    smr_offline();
+    const bool ok = send_all(fd, b->dat, b->len);
+    smr_online();
+    b->len = 0;
+    return ok;
+}
+
+// Append the writes streamed since the last drain to `out`.
+static void mig_drain(Cluster *cl) {
+    for (int i = 0; i < CLUSTER_STRIPES; i++) {
+        ClusterStripe *s = &cl->stripes[i];
+        pthread_mutex_lock(&s->mu);
+        if (s->buf.len) {
+            buf_reserve(&cl->out, s->buf.len);
+            buf_put(&cl->out, s->buf.dat, s->buf.len);
+            s->buf.len = 0;
+        }
+        pthread_mutex_unlock(&s->mu);
+    }
+}
+
+// With every stripe held, stop streaming & hand the slots to `to` unless
+// it's -1.
+static void mig_end(Cluster *cl, const int to) {
+    for (uint32_t s = cl->mig_first; to >= 0 && s <= cl->mig_last; s++) {
+        STORE(&cl->owner[s], (uint16_t) to, RELAXED);
+    }
+    STORE(&cl->moving, 0, RELAXED);
+    for (int i = 0; i < CLUSTER_STRIPES; i++) {
+        free(cl->stripes[i].buf.dat);
+        cl->stripes[i].buf = (ByteBuf) {0};
+    }
+}
+
+static bool mig_stopped(Cluster *cl) {
+    pthread_mutex_lock(&cl->mu);
+    const bool stop = cl->stop;
+    pthread_mutex_unlock(&cl->mu);
+    return stop;
+}
+
+// Whether the target took the import, its reply to CLUSTER IMPORT.
+static bool mig_accepted(const int fd, const uint32_t first, const uint32_t last, const int to) {
+    uint8_t rep[256];
+    uint32_t len = 0;
+    smr_offline();
+    bool ok = recv_all(fd, &len, 4) && len && len <= sizeof(rep) && recv_all(fd, rep, len);
+    smr_online();
+    if (ok && len == 1 && rep[0] == TAG_NIL)
+        return true;
+    if (ok && len >= 9 && rep[0] == TAG_ERR) {
+        logger(stderr, "WARN", "[cluster] Node %d refused slots %u-%u: %.*s\n", to, first, last, (int) (len - 9),
+               (const char *) rep + 9);
+    }
+    return false;
+}
+
+// Who `node` says owns `slot`, -1 if it can't be asked.
+static int node_owner(Cluster *cl, const int node, const uint32_t slot) {
+    ByteBuf b = {0};
+    vstr *argv[2] = {vstr_new_s("cluster"), vstr_new_s("slots")};
+    buf_put_record(&b, 2, (const vstr *const *) argv);
+    vstr_destroy(argv[0]);
+    vstr_destroy(argv[1]);
+    const int fd = node_connect(cl, node);
+    uint32_t len = 0;
+    bool ok = fd >= 0 && send_all(fd, b.dat, b.len);
+    if (ok) {
+        set_rcvtimeo(fd, CLUSTER_CONNECT_MS);
+        ok = recv_all(fd, &len, 4) && len <= CLUSTER_MAX_RECORD;
+    }
+    b.len = 0;
+    if (ok) {
+        buf_reserve(&b, len);
+        ok = recv_all(fd, b.dat, len);
+    }
+    if (fd >= 0)
+        close(fd);
+    // An array of first slot, last slot & owner address triples.
+    int owner = -1;
+    const uint8_t *p = b.dat + 5, *end = b.dat + len;
+    ok = ok && len >= 5 && b.dat[0] == TAG_ARR;
+    while (ok && end - p >= 23) {
+        int64_t first, last;
+        uint32_t alen;
+        memcpy(&first, p + 1, 8);
+        memcpy(&last, p + 10, 8);
+        memcpy(&alen, p + 19, 4);
+        if (p[0] != TAG_INT || p[9] != TAG_INT || p[18] != TAG_STR || alen > (size_t) (end - p - 23))
+            break;
+        if (first <= slot && slot <= last) {
+            for (int i = 0; i < cl->n; i++) {
+                if (strlen(cl->addrs[i]) == alen && !memcmp(cl->addrs[i], p + 23, alen))
+                    owner = i;
+            }
+            break;
+        }
+        p += 23 + alen;
+    }
+    free(b.dat);
+    return owner;
+}
+
+// Whether the target took the slots after the SETSLOT went out on `fd`
+// unacked, -1 if we stop before it's known. Its import ends once it applied
+// what it got: it acks late, or hangs up & tells who owns them when asked.
+static int mig_settle(Cluster *cl, const int fd, const uint32_t first, const int to) {
+    shutdown(fd, SHUT_WR);
+    for (;;) {
+        uint8_t ack = 0;
+        const ssize_t n = recv(fd, &ack, 1, 0);
+        if (n == 1 && ack == CLUSTER_ACK)
+            return 1;
+        if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) && !mig_stopped(cl))
+            continue;
+        break;
+    }
+    for (;;) {
+        if (mig_stopped(cl))
+            return -1;
+        const int owner = node_owner(cl, to, first);
+        if (owner >= 0)
+            return owner == to;
+        usleep(CLUSTER_CONNECT_MS * 1000);
+    }
+}
+
+static void *mig_main(void *arg) {
+    Cluster *cl = arg;
+    const uint32_t first = cl->mig_first, last = cl->mig_last;
+    const int to = cl->mig_to;
+    const uint64_t start_ms = get_clock_ms();
+    const int fd = node_connect(cl, to);
+    pthread_mutex_lock(&cl->mu);
+    bool ok = fd >= 0 && !cl->stop;
+    cl->mig_fd = ok ? fd : -1;
+    const int flip_ms = cl->flip_ms;
+    pthread_mutex_unlock(&cl->mu);
+    if (!ok) {
+        if (fd >= 0)
+            close(fd);
+        logger(stderr, "ERROR", "[cluster] Can't reach node %d to move slots %u-%u\n", to, first, last);
+        STORE(&cl->busy, false, RELEASE);
+        return NULL;
+    }
+    smr_reg();
+    set_rcvtimeo(fd, flip_ms);
+    buf_put_cluster(&cl->out, "import", first, last, -1);
+    ok = mig_send(fd, &cl->out) && mig_accepted(fd, first, last, to);
+
+    // Writes from here on are streamed, the dump covers those before.
+    smr_offline();
+    stripes_wlock(cl);
+    STORE(&cl->moving, 1ull << 32 | (uint64_t) first << 16 | last, RELAXED);
+    stripes_wunlock(cl);
+    smr_online();
+    uint64_t cursor = 0;
+    while (ok && !mig_stopped(cl)) {
+        cursor = kv_dump(cl->kv, cursor, CLUSTER_DUMP_BUCKETS, mig_emit, cl);
+        smr_quiescent();
+        if (cl->dump.len >= CLUSTER_DUMP_BUF || !cursor)
+            ok = mig_send(fd, &cl->dump);
+        if (!cursor)
+            break;
+    }
+    // Until what came in while sending is small enough to send with every
+    // request held up.
+    size_t drained = SIZE_MAX;
+    while (ok && drained >= CLUSTER_FLIP_BYTES && !mig_stopped(cl)) {
+        mig_drain(cl);
+        drained = cl->out.len;
+        ok = mig_send(fd, &cl->out);
+    }
+
+    smr_offline();
+    stripes_wlock(cl);
+    ok = ok && !mig_stopped(cl);
+    bool sent = false;
+    if (ok) {
+        mig_drain(cl);
+        buf_put_cluster(&cl->out, "setslot", first, last, to);
+        sent = send_all(fd, cl->out.dat, cl->out.len);
+        cl->out.len = 0;
+        uint8_t ack = 0;
+        ok = sent && recv_all(fd, &ack, 1) && ack == CLUSTER_ACK;
+    }
+    // Unacked, the target may own the slots by now or later: requests on
+    // them get TRYAGAIN until it's known, the other slots are served.
+    int flipped = ok;
+    if (sent && !ok) {
+        logger(stderr, "WARN", "[cluster] Node %d didn't ack slots %u-%u, holding them until it's known\n", to,
+               first, last);
+        STORE(&cl->moving, LOAD(&cl->moving, RELAXED) | MOVING_DOUBT, RELAXED);
+        stripes_wunlock(cl);
+        flipped = mig_settle(cl, fd, first, to);
+        stripes_wlock(cl);
+        ok = flipped > 0;
+    }
+    // Stopping in doubt, neither node may serve them meanwhile.
+    if (flipped >= 0)
+        mig_end(cl, ok ? to : -1);
+    stripes_wunlock(cl);
+    smr_online();
+    pthread_mutex_lock(&cl->mu);
+    cl->mig_fd = -1;
+    if (ok)
+        map_save(cl);
+    pthread_mutex_unlock(&cl->mu);
+    close(fd);
+    free(cl->dump.dat);
+    free(cl->out.dat);
+    cl->dump = cl->out = (ByteBuf) {0};
+
+    if (ok) {
+        logger(stderr, "INFO", "[cluster] Moved slots %u-%u to node %d in %" PRIu64 " ms\n", first, last, to,
+               get_clock_ms() - start_ms);
+        notify_setslot(cl, first, last, to);
+        ClusterImport range = {.cl = cl, .first = first, .last = last};
+        kv_flush(cl->kv, drop_unowned, &range);
+    } else if (flipped < 0) {
+        logger(stderr, "ERROR", "[cluster] Stopped not knowing whether node %d took slots %u-%u\n", to, first, last);
+    } else {
+        logger(stderr, "ERROR", "[cluster] Moving slots %u-%u to node %d failed, they stay here\n", first, last, to);
+    }
+    smr_quiescent();
+    smr_unreg();
+    STORE(&cl->busy, false, RELEASE);
+    return NULL;
+}
+
+// Apply a record past its length, false if it's bad.
+static bool import_apply(ClusterImport *im, const uint8_t *rec, const uint32_t len, bool *flipped) {
+    if (len >= im->rb.cap) {
+        rb_resize(&im->rb, next_pow2(len + 1));
+    }
+    rb_clear(&im->rb);
+    rb_write(&im->rb, rec, len);
+    OwnedRequest oreq = {0};
+    if (!new_owned_req(&oreq, &im->rb, len)) {
+        owned_req_destroy(&oreq);
+        return false;
+    }
+    bool ok = true;
+    if (oreq.req.type == CMD_CLUSTER_SETSLOT) {
+        const Request *req = &oreq.req;
+        *flipped = !cluster_setslot(im->cl, req->args.slots.first, req->args.slots.last, req->args.slots.node);
+        const uint8_t ack = *flipped ? CLUSTER_ACK : 0;
+        ok = *flipped && send_all(im->fd, &ack, 1);
+    } else {
+        rb_clear(&im->out);
+        smr_enter();
+        kv_apply(im->cl->kv, &oreq, &im->out);
+        smr_exit();
+    }
+    owned_req_destroy(&oreq);
+    return ok;
+}
+
+static void *import_main(void *arg) {
+    ClusterImport *im = arg;
+    Cluster *cl = im->cl;
+    smr_reg();
+    ByteBuf in = {0};
+    size_t start = 0;
+    uint64_t applied = 0;
+    // The reply to CLUSTER IMPORT, the source streams once it has it.
+    const uint8_t taken[] = {1, 0, 0, 0, TAG_NIL};
+    bool flipped = false, bad = !send_all(im->fd, taken, sizeof(taken));
+    while (!bad) {
+        buf_reserve(&in, CLUSTER_READ_BUF);
+        smr_offline();
+        const ssize_t n = recv(im->fd, in.dat + in.len, in.cap - in.len, 0);
+        smr_online();
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        in.len += n;
+        while (in.len - start >= 4) {
+            uint32_t len;
+            memcpy(&len, in.dat + start, 4);
+            if (len < 4 || len > CLUSTER_MAX_RECORD) {
+                bad = true;
+                break;
+            }
+            if (in.len - start - 4 < len) {
+                buf_reserve(&in, 4 + len);
+                break;
+            }
+            if (!import_apply(im, in.dat + start + 4, len, &flipped)) {
+                bad = true;
+                break;
+            }
+            start += 4 + len;
+            if (++applied % CLUSTER_QUIESCE == 0)
+                smr_quiescent();
+        }
+        // Keep the partial record at the front.
+        memmove(in.dat, in.dat + start, in.len - start);
+        in.len -= start;
+        start = 0;
+        smr_quiescent();
+    }
+    free(in.dat);
+    // The source waits for us to hang up if the flip went unacked.
+    shutdown(im->fd, SHUT_RDWR);
+    if (flipped) {
+        logger(stderr, "INFO", "[cluster] Took over slots %u-%u with %" PRIu64 " records\n", im->first, im->last,
+               applied);
+    } else {
+        logger(stderr, "WARN", "[cluster] Import of slots %u-%u broke off, dropping it\n", im->first, im->last);
+        kv_flush(cl->kv, drop_unowned, im);
+    }
+    smr_quiescent();
+    smr_unreg();
+    STORE(&im->done, true, RELEASE);
+    return NULL;
+}
+
+static void import_free(ClusterImport *im) {
+    pthread_join(im->thread, NULL);
+    close(im->fd);
+    rb_destroy(&im->rb);
+    rb_destroy(&im->out);
+    free(im);
+}
+
+static void cluster_destroy(Cluster *cl) {
+    for (int i = 0; i < CLUSTER_MAX_NODES; i++) {
+        free(cl->addrs[i]);
+        free(cl->hosts[i]);
+        free(cl->moved[i]);
+    }
+    for (int i = 0; i < CLUSTER_STRIPES; i++) {
+        pthread_mutex_destroy(&cl->stripes[i].mu);
+        free(cl->stripes[i].buf.dat);
+    }
+    pthread_mutex_destroy(&cl->mu);
+    free(cl->path);
+    free(cl);
+}
+
+Cluster *cluster_new(KVStore *kv, const int id, const int n, const char *const *addrs, const char *path) {
+    if (n < 1 || n > CLUSTER_MAX_NODES || id < 0 || id >= n)
+        return NULL;
+    Cluster *cl = calloc(1, sizeof(Cluster));
+    cl->kv = kv;
+    cl->id = id;
+    cl->n = n;
+    cl->path = path ? strdup(path) : NULL;
+    cl->mig_fd = -1;
+    cl->flip_ms = CLUSTER_FLIP_MS;
+    atomic_init(&cl->moving, 0);
+    atomic_init(&cl->busy, false);
+    pthread_mutex_init(&cl->mu, NULL);
+    dlist_init(&cl->imports);
+    for (int i = 0; i < CLUSTER_STRIPES; i++) {
+        rw_init(&cl->stripes[i].lock);
+        pthread_mutex_init(&cl->stripes[i].mu, NULL);
+    }
+    bool ok = true;
+    for (int i = 0; i < n; i++) {
+        cl->addrs[i] = strdup(addrs[i]);
+        cl->hosts[i] = strdup(addrs[i]);
+        char *colon = strrchr(cl->hosts[i], ':');
+        const long port = colon ? strtol(colon + 1, NULL, 10) : 0;
+        if (!colon || port <= 0 || port > 65535) {
+            logger(stderr, "ERROR", "[cluster] Bad address %s\n", addrs[i]);
+            ok = false;
+            continue;
+        }
+        *colon = '\0';
+        cl->ports[i] = (int) port;
+        const size_t len = strlen(addrs[i]) + 8;
+        cl->moved[i] = malloc(len);
+        snprintf(cl->moved[i], len, "moved %s", addrs[i]);
+    }
+    if (!ok || !map_load(cl)) {
+        if (ok)
+            logger(stderr, "ERROR", "[cluster] Bad slot map in %s\n", path);
+        cluster_destroy(cl);
+        return NULL;
+    }
+    logger(stderr, "INFO", "[cluster] Node %d of %d, owning %zu slots\n", id, n, cluster_owned(cl));
+    return cl;
+}
+
+void cluster_free(Cluster *cl) {
+    if (!cl)
+        return;
+    pthread_mutex_lock(&cl->mu);
+    cl->stop = true;
+    // Unblocks sends to & reads from a stuck node.
+    if (cl->mig_fd >= 0)
+        shutdown(cl->mig_fd, SHUT_RDWR);
+    for (DList *n = cl->imports.next; n != &cl->imports; n = n->next) {
+        shutdown(container_of(n, ClusterImport, node)->fd, SHUT_RDWR);
+    }
+    const bool joinable = cl->joinable;
+    pthread_mutex_unlock(&cl->mu);
+    // Imports may take `mu` to flip slots.
+    if (joinable)
+        pthread_join(cl->migrator, NULL);
+    while (!dlist_empty(&cl->imports)) {
+        ClusterImport *im = container_of(cl->imports.next, ClusterImport, node);
+        dlist_detach(&im->node);
+        import_free(im);
+    }
+    cluster_destroy(cl);
+}
+
+const char *cluster_enter(Cluster *cl, const uint32_t slot, const bool write) {
+    ClusterStripe *s = stripe_of(cl, slot);
+    rw_rlock(&s->lock);
+    const int owner = LOAD(&cl->owner[slot], RELAXED);
+    if (owner != cl->id) {
+        rw_runlock(&s->lock);
+        return cl->moved[owner];
+    }
+    const uint64_t mv = LOAD(&cl->moving, RELAXED);
+    if ((mv & MOVING_DOUBT) && moving_has(mv, slot)) {
+        rw_runlock(&s->lock);
+        return "tryagain slots are changing hands";
+    }
+    if (write && moving_has(mv, slot))
+        pthread_mutex_lock(&s->mu);
+    return NULL;
+}
+
+void cluster_exit(Cluster *cl, const uint32_t slot, const bool write) {
+    ClusterStripe *s = stripe_of(cl, slot);
+    if (write && moving_has(LOAD(&cl->moving, RELAXED), slot))
+        pthread_mutex_unlock(&s->mu);
+    rw_runlock(&s->lock);
+}
+
+bool cluster_migrating(Cluster *cl, const vstr *key) {
+    const uint64_t mv = LOAD(&cl->moving, RELAXED);
+    return mv && moving_has(mv, cluster_slot(key));
+}
+
+void cluster_append(Cluster *cl, const vstr *key, const uint32_t argc, const vstr *const *argv) {
+    buf_put_record(&stripe_of(cl, cluster_slot(key))->buf, argc, argv);
+}
+
+// Whether `first` to `last` & `node` make sense.
+static bool range_valid(Cluster *cl, const int64_t first, const int64_t last, const int64_t node) {
+    return first >= 0 && first <= last && last < CLUSTER_SLOTS && node >= 0 && node < cl->n;
+}
+
+const char *cluster_migrate(Cluster *cl, const int64_t first, const int64_t last, const int64_t to) {
+    if (!range_valid(cl, first, last, to))
+        return "bad slot range or node";
+    if (to == cl->id)
+        return "slots are here already";
+    const char *err = NULL;
+    pthread_mutex_lock(&cl->mu);
+    for (int64_t s = first; s <= last && !err; s++) {
+        if (LOAD(&cl->owner[s], RELAXED) != cl->id)
+            err = "slots not all here";
+    }
+    if (cl->stop) {
+        err = "shutting down";
+    } else if (LOAD(&cl->busy, ACQUIRE)) {
+        err = "migration in progress";
+    }
+    if (!err) {
+        if (cl->joinable)
+            pthread_join(cl->migrator, NULL);
+        cl->mig_first = (uint32_t) first;
+        cl->mig_last = (uint32_t) last;
+        cl->mig_to = (int) to;
+        STORE(&cl->busy, true, RELAXED);
+        cl->joinable = !pthread_create(&cl->migrator, NULL, mig_main, cl);
+        if (!cl->joinable) {
+            STORE(&cl->busy, false, RELAXED);
+            err = "can't start the migration";
+        }
+    }
+    pthread_mutex_unlock(&cl->mu);
+    return err;
+}
+
+const char *cluster_setslot(Cluster *cl, const int64_t first, const int64_t last, const int64_t node) {
+    if (!range_valid(cl, first, last, node))
+        return "bad slot range or node";
+    pthread_mutex_lock(&cl->mu);
+    const uint64_t mv = LOAD(&cl->moving, RELAXED);
+    // Moving ones are ours until the migration flips them.
+    if (mv && (uint32_t) first <= (mv & 0xffff) && (uint32_t) last >= (mv >> 16 & 0xffff)) {
+        pthread_mutex_unlock(&cl->mu);
+        return "slots are migrating";
+    }
+    bool ours = false;
+    for (int64_t s = first; s <= last && !ours; s++) {
+        ours = LOAD(&cl->owner[s], RELAXED) == cl->id && node != cl->id;
+    }
+    // Only giving slots away needs requests on them out of the way.
+    if (ours)
+        stripes_wlock(cl);
+    for (int64_t s = first; s <= last; s++) {
+        STORE(&cl->owner[s], (uint16_t) node, RELAXED);
+    }
+    if (ours)
+        stripes_wunlock(cl);
+    map_save(cl);
+    pthread_mutex_unlock(&cl->mu);
+    return NULL;
+}
+
+bool cluster_import(Cluster *cl, const int fd, const int64_t first, const int64_t last) {
+    // The import thread blocks on it.
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    ClusterImport *im = calloc(1, sizeof(ClusterImport));
+    im->cl = cl;
+    im->fd = fd;
+    im->first = (uint32_t) first;
+    im->last = (uint32_t) last;
+    atomic_init(&im->done, false);
+    rb_init(&im->rb, 4096);
+    rb_init(&im->out, 256);
+
+    pthread_mutex_lock(&cl->mu);
+    // Reap the imports done by now.
+    for (DList *n = cl->imports.next, *next; n != &cl->imports; n = next) {
+        next = n->next;
+        ClusterImport *old = container_of(n, ClusterImport, node);
+        if (LOAD(&old->done, ACQUIRE)) {
+            dlist_detach(n);
+            import_free(old);
+        }
+    }
+    bool ok = !cl->stop && range_valid(cl, first, last, cl->id);
+    if (ok) {
+        ok = !pthread_create(&im->thread, NULL, import_main, im);
+        if (ok)
+            dlist_insert_before(&cl->imports, &im->node);
+    }
+    pthread_mutex_unlock(&cl->mu);
+    if (!ok) {
+        close(fd);
+        rb_destroy(&im->rb);
+        rb_destroy(&im->out);
+        free(im);
+        return false;
+    }
+    logger(stderr, "INFO", "[cluster] Importing slots %u-%u over %d\n", im->first, im->last, fd);
+    return true;
+}
+
+void cluster_set_flip_ms(Cluster *cl, const int ms) {
+    pthread_mutex_lock(&cl->mu);
+    cl->flip_ms = ms;
+    pthread_mutex_unlock(&cl->mu);
+}
+
+int cluster_id(Cluster *cl) { return cl->id; }
+
+int cluster_nodes(Cluster *cl) { return cl->n; }
+
+int cluster_owner(Cluster *cl, const uint32_t slot) { return LOAD(&cl->owner[slot], RELAXED); }
+
+const char *cluster_addr(Cluster *cl, const int node) { return cl->addrs[node]; }
+
+size_t cluster_owned(Cluster *cl) {
+    size_t n = 0;
+    for (uint32_t s = 0; s < CLUSTER_SLOTS; s++) {
+        n += LOAD(&cl->owner[s], RELAXED) == cl->id;
+    }
+    return n;
+}
+
+bool cluster_busy(Cluster *cl) { return LOAD(&cl->busy, ACQUIRE); }
@@ -7,6 +7,7 @@
 #include <errno.h>
 #include <ev.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -42,6 +43,8 @@ static void conn_cb(EV_P_ ev_io *w, const int revents) {
                     goto WRITE_PHASE;
                 case CLOSE:
                     goto CLOSE;
+                case HANDOFF: // `c` is gone
+                    return;
             }
         }
     }
@@ -55,6 +58,7 @@ WRITE_PHASE:
                     break;
                 case WAIT: // need more data
                 case AGAIN: // write returns EAGAIN
+                case HANDOFF: // not from writes
                     goto EXIT;
                 case CLOSE: // connection need close
                     goto CLOSE;
@@ -86,6 +90,7 @@ static void accept_cb(EV_P_ ev_io *w, const int revents) {
             switch (s) {
                 case OK: // continue accept next connection.
                 case WAIT: // nop for accept
+                case HANDOFF:
                     break;
                 case AGAIN: // wait next notif
                     return;
@@ -193,6 +198,18 @@ void conn_clear(Conn *c) {
         free(c);
 }
 
+int conn_detach(Conn *c) {
+    const int fd = c->fd;
+    dlist_detach(&c->node);
+    struct ev_loop *loop = ev_default_loop(0);
+    ev_io_stop(loop, &c->iow);
+    rb_destroy(&c->income);
+    rb_destroy(&c->outgo);
+    if (c->is_alloc)
+        free(c);
+    return fd;
+}
+
 static ConnState handle_read(Conn *c) {
     uint8_t buf[INIT_BUFFER_SIZE];
     errno = 0;
@@ -230,8 +247,8 @@ static ConnState handle_read(Conn *c) {
     while ((s = try_one_req(c)) == OK)
         ;
 
-    if (s == CLOSE)
-        return CLOSE;
+    if (s == CLOSE || s == HANDOFF)
+        return s;
 
     return OK;
 }
@@ -290,6 +307,10 @@ static ConnState handle_accept(SrvConn *c) {
         logger(stderr, "INFO", "[srv] new client from %u.%u.%u.%u:%u\n", ip & 255, (ip >> 8) & 255, (ip >> 16) & 255,
                ip >> 24, ntohs(caddr.sin_port));
         set_nonblock(cfd);
+        // Replies to pipelined requests go out in pieces, don't hold them
+        // for the client's delayed ack.
+        const int one = 1;
+        setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
         conn_init(NULL, cfd);
         return OK;
     }
@@ -8,7 +8,7 @@
 #include <strings.h>
 #include <time.h>
 
-#include "qsbr.h"
+#include "smr.h"
 #include "utils.h"
 
 // Should work on 8-byte aligned & above pointers on 64-bit machines
@@ -74,7 +74,7 @@ RETRY:
             CSNode *curr = pnext;
             while (curr != succ) {
                 CSNode *next = untag_ptr(LOAD(&curr->next[i], memory_order_acquire));
-                qsbr_retire(curr, NULL);
+                smr_retire(curr, NULL);
                 curr = next;
             }
         }
@@ -117,7 +117,7 @@ void csl_destroy(CSList *l) {
 
     while (curr != &l->tail) {
         CSNode *next = curr->next[0];
-        qsbr_retire(curr, NULL);
+        smr_retire(curr, NULL);
         curr = next;
     }
 
@@ -126,14 +126,14 @@ void csl_destroy(CSList *l) {
     }
 }
 
-void *csl_lookup(CSList *l, CSKey key) {
+static void *list_lookup(CSList *l, CSKey key) {
     CSNode *preds[CSKIPLIST_MAX_LEVELS], *succs[CSKIPLIST_MAX_LEVELS];
     csl_search(l, key, preds, succs);
 
     return (!cskey_cmp(succs[0]->key, key)) ? LOAD(&succs[0]->ptr, memory_order_acquire) : NULL;
 }
 
-void *csl_remove(CSList *l, CSKey key) {
+static void *list_remove(CSList *l, CSKey key) {
     CSNode *preds[CSKIPLIST_MAX_LEVELS], *succs[CSKIPLIST_MAX_LEVELS];
     void *val;
     csl_search(l, key, preds, succs);
@@ -156,7 +156,7 @@ void *csl_remove(CSList *l, CSKey key) {
     return val;
 }
 
-CSKey csl_find_min_key(CSList *l) {
+static CSKey list_find_min_key(CSList *l) {
     CSNode *node, *succ;
     node = &l->head;
     for (;;) {
@@ -170,7 +170,7 @@ CSKey csl_find_min_key(CSList *l) {
     return node->key;
 }
 
-void *csl_pop_min(CSList *l) {
+static void *list_pop_min(CSList *l) {
     CSNode *node, *succ, *preds[CSKIPLIST_MAX_LEVELS], *succs[CSKIPLIST_MAX_LEVELS];
     void *val;
 
@@ -198,10 +198,10 @@ RETRY:
     return val;
 }
 
-void *csl_update(CSList *l, CSKey key, void *val) {
+static void *list_update(CSList *l, CSKey key, void *val) {
     bool snip;
     CSNode *preds[CSKIPLIST_MAX_LEVELS], *succs[CSKIPLIST_MAX_LEVELS];
-    CSNode *nnode = qsbr_calloc(1, sizeof(CSNode)), *pred, *succ, *nnext;
+    CSNode *nnode = smr_calloc(1, sizeof(CSNode)), *pred, *succ, *nnext;
     nnode->level = grand();
     nnode->key = key;
     atomic_init(&nnode->ptr, val);
@@ -217,7 +217,7 @@ RETRY:
             }
             snip = CMPXCHG(&succs[0]->ptr, &oval, val, memory_order_acq_rel, memory_order_relaxed);
             if (snip) {
-                qsbr_retire(nnode, NULL);
+                smr_retire(nnode, NULL);
                 return oval;
             }
         }
@@ -253,3 +253,39 @@ RETRY:
 
     return NULL;
 }
+
+// Public entry points, each a critical section of its own.
+void *csl_lookup(CSList *l, CSKey key) {
+    smr_enter();
+    void *val = list_lookup(l, key);
+    smr_exit();
+    return val;
+}
+
+void *csl_remove(CSList *l, CSKey key) {
+    smr_enter();
+    void *val = list_remove(l, key);
+    smr_exit();
+    return val;
+}
+
+CSKey csl_find_min_key(CSList *l) {
+    smr_enter();
+    const CSKey key = list_find_min_key(l);
+    smr_exit();
+    return key;
+}
+
+void *csl_pop_min(CSList *l) {
+    smr_enter();
+    void *val = list_pop_min(l);
+    smr_exit();
+    return val;
+}
+
+void *csl_update(CSList *l, CSKey key, void *val) {
+    smr_enter();
+    void *oval = list_update(l, key, val);
+    smr_exit();
+    return oval;
+}
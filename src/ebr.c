@@ -0,0 +1,260 @@
+#include "ebr.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <strings.h>
+
+#include "utils.h"
+
+#define EBR_WORDS (EBR_MAX_THREADS / 64)
+static_assert(EBR_MAX_THREADS % 64 == 0, "EBR_MAX_THREADS");
+// Critical section exits & quiescent calls between two attempts to advance
+// the epoch, each is a scan of every slot.
+#define EBR_ADVANCE_EVERY 64
+// Same reasoning as the QSBR limbo lists: a critical section running when a
+// node is unlinked has observed at most one epoch less than its retirer, and
+// must exit before the epoch can move two past the one it observed.
+#define LIMBO_GRACE 3
+#define LIMBO_SLOTS 4
+
+// `(epoch << 1) | 1` while in a critical section, 0 outside.
+struct Slot {
+    alignas(64) atomic_u64 state;
+};
+
+struct EBR {
+    alignas(64) atomic_u64 epoch;
+    alignas(64) pthread_mutex_t lock;
+    // Registered slots & the bound of the scan, only written under `lock`.
+    u64 used[EBR_WORDS];
+    atomic_int nslots;
+    // Limbo lists left by unregistered threads, only touched under `lock`.
+    struct Limbo *orphans;
+    struct Slot slots[EBR_MAX_THREADS];
+};
+typedef struct EBR EBR;
+
+struct Node {
+    void (*cb)(void *arg); // callback run before free
+    alignas(8) atomic_bool retired; // Double retire guard
+    alignas(16) struct Node *next;
+};
+typedef struct Node Node;
+
+struct Limbo {
+    Node *head, *tail;
+    u64 epoch;
+    struct Limbo *next;
+};
+typedef struct Limbo Limbo;
+
+static EBR ebr;
+static __thread int TID = -1;
+static __thread u32 t_nest, t_exits;
+// Epoch observed on the last `ebr_enter`, tags new retires.
+static __thread u64 t_epoch;
+static __thread Limbo t_limbo[LIMBO_SLOTS];
+
+static inline Node *ptr_to_node(void *ptr) { return (Node *) ((char *) ptr - sizeof(Node)); }
+static inline void *node_to_ptr(Node *node) { return (void *) ((char *) node + sizeof(Node)); }
+
+static void process_list(Node *node) {
+    while (node) {
+        Node *next = node->next;
+        if (node->cb) {
+            node->cb(node_to_ptr(node));
+        }
+        free(node);
+        node = next;
+    }
+}
+
+static void limbo_reclaim(Limbo *l) {
+    process_list(l->head);
+    l->head = l->tail = NULL;
+}
+
+static void limbo_collect(const u64 epoch) {
+    for (int i = 0; i < LIMBO_SLOTS; i++) {
+        Limbo *l = &t_limbo[i];
+        if (l->head && l->epoch + LIMBO_GRACE <= epoch) {
+            limbo_reclaim(l);
+        }
+    }
+}
+
+// Under `ebr.lock`.
+static void orphans_collect(const u64 epoch, const bool all) {
+    for (Limbo **pl = &ebr.orphans; *pl;) {
+        Limbo *l = *pl;
+        if (all || l->epoch + LIMBO_GRACE <= epoch) {
+            *pl = l->next;
+            process_list(l->head);
+            free(l);
+        } else {
+            pl = &l->next;
+        }
+    }
+}
+
+// Advance the epoch if every thread in a critical section has observed it.
+static void try_advance() {
+    if (pthread_mutex_trylock(&ebr.lock))
+        return;
+    // Pairs with the fence in `ebr_enter`.
+    atomic_thread_fence(SEQ_CST);
+    const u64 epoch = LOAD(&ebr.epoch, RELAXED);
+    const int n = LOAD(&ebr.nslots, RELAXED);
+    bool ok = true;
+    for (int i = 0; i < n && ok; i++) {
+        const u64 s = LOAD(&ebr.slots[i].state, ACQUIRE);
+        ok = !(s & 1) || s >> 1 == epoch;
+    }
+    if (ok) {
+        STORE(&ebr.epoch, epoch + 1, RELEASE);
+        orphans_collect(epoch + 1, false);
+    }
+    pthread_mutex_unlock(&ebr.lock);
+}
+
+void ebr_init(size_t back_logs) {
+    (void) back_logs;
+    atomic_init(&ebr.epoch, 0);
+    pthread_mutex_init(&ebr.lock, NULL);
+    for (int w = 0; w < EBR_WORDS; w++) {
+        ebr.used[w] = 0;
+    }
+    atomic_init(&ebr.nslots, 0);
+    ebr.orphans = NULL;
+    for (int i = 0; i < EBR_MAX_THREADS; i++) {
+        atomic_init(&ebr.slots[i].state, 0);
+    }
+    atomic_thread_fence(RELEASE);
+}
+
+void ebr_reg() {
+    if (TID != -1)
+        return;
+    pthread_mutex_lock(&ebr.lock);
+    for (int w = 0; w < EBR_WORDS; w++) {
+        if (~ebr.used[w]) {
+            const int slot = ffsll(~(i64) ebr.used[w]) - 1;
+            ebr.used[w] |= 1ULL << slot;
+            TID = w * 64 + slot;
+            break;
+        }
+    }
+    assert(TID != -1 && "Too many threads");
+    STORE(&ebr.slots[TID].state, 0, RELAXED);
+    if (TID >= LOAD(&ebr.nslots, RELAXED))
+        STORE(&ebr.nslots, TID + 1, RELEASE);
+    pthread_mutex_unlock(&ebr.lock);
+    t_nest = t_exits = 0;
+    t_epoch = LOAD(&ebr.epoch, ACQUIRE);
+}
+
+void ebr_unreg() {
+    if (TID == -1)
+        return;
+    assert(!t_nest && "Unregister inside a critical section");
+    pthread_mutex_lock(&ebr.lock);
+    // Hand the pending limbo lists over to whoever advances past them.
+    for (int i = 0; i < LIMBO_SLOTS; i++) {
+        Limbo *l = &t_limbo[i];
+        if (!l->head)
+            continue;
+        Limbo *o = malloc(sizeof(Limbo));
+        *o = *l;
+        o->next = ebr.orphans;
+        ebr.orphans = o;
+        l->head = l->tail = NULL;
+    }
+    ebr.used[TID / 64] &= ~(1ULL << (TID % 64));
+    pthread_mutex_unlock(&ebr.lock);
+    TID = -1;
+}
+
+void *ebr_calloc(size_t nmemb, size_t size) {
+    Node *node = calloc(1, sizeof(Node) + nmemb * size);
+    if (!node)
+        return NULL;
+    STORE(&node->retired, false, RELAXED);
+    return node_to_ptr(node);
+}
+
+void ebr_retire(void *ptr, void (*cb)(void *)) {
+    assert(TID != -1 && "Thread not registered");
+    if (!ptr)
+        return;
+
+    Node *node = ptr_to_node(ptr);
+    bool expected = false;
+    if (!CMPXCHG(&node->retired, &expected, true, ACQ_REL, RELAXED)) {
+        return;
+    }
+
+    node->cb = cb;
+    node->next = NULL;
+    // Outside a critical section the current epoch is at least the one the
+    // node was unlinked in.
+    const u64 epoch = t_nest ? t_epoch : LOAD(&ebr.epoch, ACQUIRE);
+    Limbo *l = &t_limbo[epoch % LIMBO_SLOTS];
+    if (l->head && l->epoch != epoch) {
+        // LIMBO_SLOTS epochs old, long safe
+        limbo_reclaim(l);
+    }
+    l->epoch = epoch;
+    if (l->tail) {
+        l->tail->next = node;
+    } else {
+        l->head = node;
+    }
+    l->tail = node;
+}
+
+void ebr_free(void *ptr) {
+    if (ptr)
+        free(ptr_to_node(ptr));
+}
+
+void ebr_enter() {
+    assert(TID != -1 && "Thread not registered");
+    if (t_nest++)
+        return;
+    t_epoch = LOAD(&ebr.epoch, RELAXED);
+    STORE(&ebr.slots[TID].state, (t_epoch << 1) | 1, RELAXED);
+    // Announce before reading any shared pointer.
+    atomic_thread_fence(SEQ_CST);
+}
+
+void ebr_exit() {
+    assert(t_nest && "Unbalanced ebr_exit");
+    if (--t_nest)
+        return;
+    STORE(&ebr.slots[TID].state, 0, RELEASE);
+    ebr_quiescent();
+}
+
+void ebr_quiescent() {
+    assert(!t_nest && "Inside a critical section");
+    if (++t_exits < EBR_ADVANCE_EVERY)
+        return;
+    t_exits = 0;
+    try_advance();
+    limbo_collect(LOAD(&ebr.epoch, ACQUIRE));
+}
+
+// NOTE: Assumes exclusive access on destroy
+void ebr_destroy() {
+    for (int i = 0; i < LIMBO_SLOTS; i++) {
+        limbo_reclaim(&t_limbo[i]);
+    }
+    orphans_collect(0, true);
+    pthread_mutex_destroy(&ebr.lock);
+}
@@ -1,19 +1,30 @@
+#include <errno.h>
 #include <ev.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <netinet/in.h>
 #include <signal.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include "aof.h"
+#include "cluster.h"
 #include "connection.h"
 #include "kvstore.h"
 #include "parse.h"
-#include "qsbr.h"
+#include "raft.h"
+#include "repl.h"
+#include "smr.h"
+#include "snapshot.h"
+#include "topo.h"
 #include "utils.h"
 
 #define MAX_MSG 32 << 20
 #define MAX_EVENTS 128
+#define PORT 1234
 
 SrvConn srv;
 KVStore g_data;
@@ -38,9 +49,16 @@ ConnState try_one_req(Conn *c) {
         return CLOSE;
     }
 
-    kv_dispatch(&g_data, c, oreq);
-
-    return OK;
+    // Gone once handed off.
+    const Request req = oreq->req;
+    const ConnState s = kv_dispatch(&g_data, c, oreq);
+    if (s == HANDOFF && req.type == CMD_CLUSTER_IMPORT) {
+        // The socket leaves the loop for a thread of its own.
+        cluster_import(g_data.cluster, conn_detach(c), req.args.slots.first, req.args.slots.last);
+    } else if (s == HANDOFF) {
+        repl_add(g_data.repl, &g_data, conn_detach(c));
+    }
+    return s;
 }
 
 static void exit_cb(EV_P_ ev_signal *w, const int revents) {
@@ -49,11 +67,407 @@ static void exit_cb(EV_P_ ev_signal *w, const int revents) {
     srv_clear(&srv);
 }
 
-int main() {
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --inline off|adaptive|always  run cheap reads on the I/O thread (default: adaptive)\n"
+            "  --inline-cost N               inline cost threshold in bytes (default: %d)\n"
+            "  --spin N                      busy-poll rounds before parking, 0 disables\n"
+            "                                (default: %d with spare cores, else 0)\n"
+            "  --port N                      TCP port to listen on (default: %d)\n"
+            "  --workers N                   worker threads (default: %d)\n"
+            "  --queue-size N                per-worker queue capacity (default: %d)\n"
+            "  --cpus LIST                   pin workers round-robin to a cpulist, e.g. 2-7,10\n"
+            "  --io-cpus LIST                pin the I/O thread to a cpulist\n"
+            "  --numa-node N                 default --cpus & --io-cpus to the CPUs of node N\n"
+            "  --numa                        interleave the keyspace over NUMA nodes, spread\n"
+            "                                & pin workers per node (unless --cpus is set)\n"
+            "  --smr qsbr|ebr                memory reclamation scheme (default: qsbr)\n"
+            "  --maxmemory N[k|m|g]          evict or reject writes past N bytes, 0 for no limit\n"
+            "  --maxmemory-policy POLICY     noeviction|allkeys-lru|allkeys-lfu (default: allkeys-lru)\n"
+            "  --aof PATH                    replay & append writes to an append-only log\n"
+            "  --aof-fsync always|never|N    fsync the log before replying, never, or every N ms\n"
+            "                                (default: 1000)\n"
+            "  --aof-rewrite-pct N           compact the log once it grew by N%% since the last\n"
+            "                                rewrite, 0 disables (default: %d)\n"
+            "  --snapshot PATH               SAVE & BGSAVE to PATH, loaded on start without --aof\n"
+            "  --snapshot-rate N[k|m|g]      pace saves to N bytes/s, 0 for no limit (default: 0)\n"
+            "  --compress                    compress the log & snapshots in checksummed blocks\n"
+            "  --replicas                    serve replicas, streaming writes to those that SYNC\n"
+            "  --replicaof HOST:PORT         follow the primary at HOST:PORT, read-only, nothing\n"
+            "                                is loaded from --aof or --snapshot\n"
+            "  --raft ID                     join a Raft cluster as node ID of --raft-peers, no\n"
+            "                                --aof or --replicaof, --snapshot isn't loaded\n"
+            "  --raft-peers HOST:PORT,...    client addresses of all nodes in ID order, peers\n"
+            "                                talk on PORT + %d\n"
+            "  --raft-dir DIR                log, term & snapshots of the node (default: raft-ID)\n"
+            "  --cluster ID                  serve the hash slots of node ID of --cluster-nodes,\n"
+            "                                redirect the rest, no --raft or --replicaof\n"
+            "  --cluster-nodes HOST:PORT,... client addresses of all nodes in ID order\n"
+            "  --cluster-map PATH            who owns which slots (default: cluster-ID.map)\n",
+            prog, INLINE_COST_MAX, POOL_SPIN, PORT, WORKERS, QUEUESIZE, AOF_REWRITE_PCT, RAFT_PORT_OFFSET);
+}
+
+static int parse_inline_mode(const char *s) {
+    if (!strcmp(s, "off"))
+        return INLINE_OFF;
+    if (!strcmp(s, "adaptive"))
+        return INLINE_ADAPTIVE;
+    if (!strcmp(s, "always"))
+        return INLINE_ALWAYS;
+    return -1;
+}
+
+static int parse_evict_policy(const char *s) {
+    if (!strcmp(s, "noeviction"))
+        return EVICT_NONE;
+    if (!strcmp(s, "allkeys-lru"))
+        return EVICT_LRU;
+    if (!strcmp(s, "allkeys-lfu"))
+        return EVICT_LFU;
+    return -1;
+}
+
+// fsync policy of the log, -2 on garbage.
+static int parse_aof_fsync(const char *s) {
+    if (!strcmp(s, "always"))
+        return AOF_FSYNC_ALWAYS;
+    if (!strcmp(s, "never"))
+        return AOF_FSYNC_NEVER;
+    char *end;
+    const long ms = strtol(s, &end, 10);
+    return end != s && !*end && ms > 0 && ms <= INT32_MAX ? (int) ms : -2;
+}
+
+// Bytes with an optional k/m/g suffix, false on garbage or overflow.
+static bool parse_bytes(const char *s, size_t *out) {
+    char *end;
+    errno = 0;
+    const unsigned long long n = strtoull(s, &end, 10);
+    int shift = 0;
+    switch (*end) {
+        case 'g':
+        case 'G':
+            shift += 10;
+            /* fallthrough */
+        case 'm':
+        case 'M':
+            shift += 10;
+            /* fallthrough */
+        case 'k':
+        case 'K':
+            shift += 10;
+            end++;
+    }
+    if (end == s || *end || *s == '-' || errno || n > SIZE_MAX >> shift)
+        return false;
+    *out = (size_t) n << shift;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    int inline_mode = INLINE_ADAPTIVE;
+    size_t inline_cost = INLINE_COST_MAX;
+    long spin = -1;
+    int port = PORT, workers = WORKERS, numa_node = -1;
+    bool numa = false;
+    size_t qsize = QUEUESIZE;
+    static int cpus[TOPO_MAX_CPUS], io_cpus[TOPO_MAX_CPUS];
+    int ncpus = 0, nio_cpus = 0;
+    const SMR *smr = &smr_qsbr;
+    size_t maxmemory = 0;
+    int evict_policy = EVICT_LRU;
+    const char *aof_path = NULL;
+    int aof_fsync = 1000, aof_rewrite_pct = AOF_REWRITE_PCT;
+    const char *snap_path = NULL;
+    size_t snap_rate = 0;
+    bool compress = false, replicas = false;
+    char *primary = NULL;
+    int primary_port = 0;
+    int raft_id = -1, raft_n = 0;
+    const char *raft_peers[RAFT_MAX_NODES];
+    const char *raft_dir = NULL;
+    int cluster_id = -1, cluster_n = 0;
+    const char *cluster_nodes[CLUSTER_MAX_NODES];
+    const char *cluster_map = NULL;
+
+    static const struct option opts[] = {
+            {"inline", required_argument, NULL, 'i'},
+            {"inline-cost", required_argument, NULL, 'c'},
+            {"spin", required_argument, NULL, 's'},
+            {"port", required_argument, NULL, 'p'},
+            {"workers", required_argument, NULL, 'w'},
+            {"queue-size", required_argument, NULL, 'q'},
+            {"cpus", required_argument, NULL, 'C'},
+            {"io-cpus", required_argument, NULL, 'I'},
+            {"numa-node", required_argument, NULL, 'n'},
+            {"numa", no_argument, NULL, 'N'},
+            {"smr", required_argument, NULL, 'R'},
+            {"maxmemory", required_argument, NULL, 'm'},
+            {"maxmemory-policy", required_argument, NULL, 'P'},
+            {"aof", required_argument, NULL, 'a'},
+            {"aof-fsync", required_argument, NULL, 'F'},
+            {"aof-rewrite-pct", required_argument, NULL, 'W'},
+            {"snapshot", required_argument, NULL, 'S'},
+            {"snapshot-rate", required_argument, NULL, 'T'},
+            {"compress", no_argument, NULL, 'Z'},
+            {"replicas", no_argument, NULL, 'Y'},
+            {"replicaof", required_argument, NULL, 'O'},
+            {"raft", required_argument, NULL, 'r'},
+            {"raft-peers", required_argument, NULL, 'L'},
+            {"raft-dir", required_argument, NULL, 'D'},
+            {"cluster", required_argument, NULL, 'k'},
+            {"cluster-nodes", required_argument, NULL, 'K'},
+            {"cluster-map", required_argument, NULL, 'M'},
+            {"help", no_argument, NULL, 'h'},
+            {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", opts, NULL)) != -1) {
+        switch (opt) {
+            case 'i':
+                if ((inline_mode = parse_inline_mode(optarg)) < 0) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'c':
+                inline_cost = strtoull(optarg, NULL, 10);
+                break;
+            case 's':
+                spin = strtol(optarg, NULL, 10);
+                break;
+            case 'p':
+                port = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'w':
+                workers = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'q':
+                qsize = strtoull(optarg, NULL, 10);
+                break;
+            case 'C':
+                if ((ncpus = topo_parse_cpulist(optarg, cpus, TOPO_MAX_CPUS)) < 0) {
+                    fprintf(stderr, "Invalid cpulist: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'I':
+                if ((nio_cpus = topo_parse_cpulist(optarg, io_cpus, TOPO_MAX_CPUS)) < 0) {
+                    fprintf(stderr, "Invalid cpulist: %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'n':
+                numa_node = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'N':
+                numa = true;
+                break;
+            case 'R':
+                if (!(smr = smr_find(optarg))) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'm':
+                if (!parse_bytes(optarg, &maxmemory)) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'P':
+                if ((evict_policy = parse_evict_policy(optarg)) < 0) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'a':
+                aof_path = optarg;
+                break;
+            case 'F':
+                if ((aof_fsync = parse_aof_fsync(optarg)) < AOF_FSYNC_NEVER) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'W':
+                aof_rewrite_pct = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'S':
+                snap_path = optarg;
+                break;
+            case 'T':
+                if (!parse_bytes(optarg, &snap_rate)) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'Z':
+                compress = true;
+                break;
+            case 'Y':
+                replicas = true;
+                break;
+            case 'O': {
+                char *colon = strrchr(optarg, ':');
+                if (!colon || colon == optarg || (primary_port = (int) strtol(colon + 1, NULL, 10)) <= 0 ||
+                    primary_port > 65535) {
+                    usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+                *colon = '\0';
+                primary = optarg;
+                break;
+            }
+            case 'r':
+                raft_id = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'L':
+                raft_n = 0;
+                for (char *tok = strtok(optarg, ","); tok; tok = strtok(NULL, ",")) {
+                    if (raft_n == RAFT_MAX_NODES) {
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                    }
+                    raft_peers[raft_n++] = tok;
+                }
+                break;
+            case 'D':
+                raft_dir = optarg;
+                break;
+            case 'k':
+                cluster_id = (int) strtol(optarg, NULL, 10);
+                break;
+            case 'K':
+                cluster_n = 0;
+                for (char *tok = strtok(optarg, ","); tok; tok = strtok(NULL, ",")) {
+                    if (cluster_n == CLUSTER_MAX_NODES) {
+                        usage(argv[0]);
+                        return EXIT_FAILURE;
+                    }
+                    cluster_nodes[cluster_n++] = tok;
+                }
+                break;
+            case 'M':
+                cluster_map = optarg;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (port <= 0 || port > 65535 || workers <= 0 || qsize < 2) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    // The cluster's log has every write & nodes follow its leader.
+    if (raft_id >= 0 && (raft_id >= raft_n || aof_path || primary)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    char raft_dir_buf[32];
+    if (raft_id >= 0 && !raft_dir) {
+        snprintf(raft_dir_buf, sizeof(raft_dir_buf), "raft-%d", raft_id);
+        raft_dir = raft_dir_buf;
+    }
+    // A shard is a single node, a replica would need the slot map too.
+    if (cluster_id >= 0 && (cluster_id >= cluster_n || raft_id >= 0 || primary)) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    char cluster_map_buf[32];
+    if (cluster_id >= 0 && !cluster_map) {
+        snprintf(cluster_map_buf, sizeof(cluster_map_buf), "cluster-%d.map", cluster_id);
+        cluster_map = cluster_map_buf;
+    }
+    if (numa_node >= 0) {
+        int node_cpus[TOPO_MAX_CPUS];
+        const int n = topo_node_cpus(numa_node, node_cpus, TOPO_MAX_CPUS);
+        if (n <= 0) {
+            fprintf(stderr, "No CPUs found for NUMA node %d\n", numa_node);
+            return EXIT_FAILURE;
+        }
+        if (!ncpus) {
+            memcpy(cpus, node_cpus, n * sizeof(int));
+            ncpus = n;
+        }
+        if (!nio_cpus) {
+            memcpy(io_cpus, node_cpus, n * sizeof(int));
+            nio_cpus = n;
+        }
+    }
+
     // Init KVStore.
-    qsbr_init(65536);
-    qsbr_reg();
+    topo_set_numa(numa);
+    smr_init(smr, 65536);
+    smr_reg();
     kv_new(&g_data);
+    kv_set_inline(&g_data, inline_mode, inline_cost);
+    // A replica's keys come from the primary, the log only records them.
+    if (aof_path && !primary) {
+        // Before the limit is set, a replay must not be rejected.
+        const int64_t n = aof_load(&g_data, aof_path, workers);
+        if (n < 0) {
+            fprintf(stderr, "Can't replay %s\n", aof_path);
+            return EXIT_FAILURE;
+        }
+        logger(stderr, "INFO", "[main] Replayed %lld records from %s\n", (long long) n, aof_path);
+    } else if (snap_path && !primary && raft_id < 0) {
+        // The log has every write, the snapshot only matters without one.
+        const int64_t n = snap_load(&g_data, snap_path, workers);
+        if (n < 0) {
+            fprintf(stderr, "Can't load %s\n", snap_path);
+            return EXIT_FAILURE;
+        }
+        logger(stderr, "INFO", "[main] Loaded %lld keys from %s\n", (long long) n, snap_path);
+    }
+    if (aof_path) {
+        AOF *aof = aof_open(aof_path, aof_fsync);
+        if (!aof) {
+            die("aof_open()");
+        }
+        aof_set_auto_rewrite(aof, aof_rewrite_pct, AOF_REWRITE_MIN);
+        aof_set_compress(aof, compress);
+        kv_set_aof(&g_data, aof);
+    }
+    if (snap_path) {
+        Snapshot *snap = snap_new(snap_path, snap_rate);
+        snap_set_compress(snap, compress);
+        kv_set_snapshot(&g_data, snap);
+    }
+    kv_set_maxmemory(&g_data, maxmemory, evict_policy);
+    // Without it SYNC is refused & writes skip the stripe locks.
+    if (replicas) {
+        Repl *repl = repl_new();
+        if (!repl) {
+            die("repl_new()");
+        }
+        kv_set_repl(&g_data, repl);
+    }
+    if (spin >= 0) {
+        pool_set_spin(&g_data.pool, (uint32_t) spin);
+    }
+    pool_set_workers(&g_data.pool, workers);
+    pool_set_queue_size(&g_data.pool, qsize);
+    pool_set_cpus(&g_data.pool, cpus, ncpus);
+    pool_set_numa(&g_data.pool, numa);
+    if (raft_id >= 0) {
+        if (!raft_open(&g_data, raft_id, raft_n, raft_peers, raft_dir)) {
+            die("raft_open()");
+        }
+    }
+    if (cluster_id >= 0) {
+        Cluster *cluster = cluster_new(&g_data, cluster_id, cluster_n, cluster_nodes, cluster_map);
+        if (!cluster) {
+            die("cluster_new()");
+        }
+        kv_set_cluster(&g_data, cluster);
+    }
     struct ev_loop *loop = ev_default_loop(0);
     // Signal Handling
     ev_signal sigint, sigterm;
@@ -69,17 +483,28 @@ int main() {
     struct sockaddr_in addr;
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = htonl(0);
-    addr.sin_port = htons(1234);
+    addr.sin_port = htons(port);
     srv_init(&srv, fd, (const struct sockaddr *) &addr, sizeof(struct sockaddr_in));
     // Start thread pool
     kv_start(&g_data);
+    if (primary) {
+        Replica *replica = replica_start(&g_data, primary, primary_port);
+        if (!replica) {
+            die("replica_start()");
+        }
+        kv_set_replica(&g_data, replica);
+    }
+    // NOTE: Pin after the workers are spawned, they'd inherit our mask.
+    if (nio_cpus && topo_pin(pthread_self(), io_cpus, nio_cpus)) {
+        logger(stderr, "WARN", "[main] Can't pin the I/O thread\n");
+    }
     // Start loop
     ev_run(loop, 0);
     // Epilogue
     kv_clear(&g_data);
     ev_default_destroy();
-    qsbr_quiescent();
-    qsbr_unreg();
-    qsbr_destroy();
+    smr_quiescent();
+    smr_unreg();
+    smr_destroy();
     logger(stderr, "INFO", "[main] Exit main loop\n");
 }
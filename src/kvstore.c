@@ -5,20 +5,28 @@
 
 #include <assert.h>
 #include <ev.h>
+#include <inttypes.h>
+#include <stdarg.h>
 #include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "aof.h"
+#include "cluster.h"
 #include "connection.h"
 #include "cqueue.h"
 #include "cskiplist.h"
 #include "hpmap.h"
 #include "parse.h"
-#include "qsbr.h"
+#include "raft.h"
+#include "smr.h"
 #include "ringbuf.h"
 #include "serialize.h"
+#include "repl.h"
+#include "snapshot.h"
 #include "thread_pool.h"
 #include "utils.h"
 #include "zset.h"
@@ -26,6 +34,8 @@
 #define MAX_MSG (32 << 20)
 #define TIMEOUT 5000
 #define TIMEOUT_S 5.0
+// Buckets `kv_flush` dumps at a time.
+#define KV_FLUSH_BUCKETS 1024
 
 static atomic_u64 g_nonce_cnt = 0;
 
@@ -45,29 +55,39 @@ struct Result {
 };
 typedef struct Result Result;
 
-// Callbacks for thread pool
-static bool kv_res_cb(cnode *rn) {
-    if ((uint64_t) rn == STOP_MAGIC) {
-        return true;
-    }
+static bool get_bounded(KVStore *kv, RingBuf *out, vstr *kstr, size_t max);
+static bool req_is_write(enum cmd_type type);
+static bool req_is_keyed(enum cmd_type type);
+
+// Append a framed reply to the connection's outgo & watch for EV_WRITE.
+static void kv_write_reply(Conn *c, RingBuf *buf) {
     struct ev_loop *loop = ev_default_loop(0);
-    Result *r = container_of(rn, Result, node);
-    Conn *c = r->c;
-    // Write buf to outgo
-    size_t resp_size = rb_size(r->buf);
+    size_t resp_size = rb_size(buf);
     if (resp_size > MAX_MSG) {
-        rb_clear(r->buf);
-        out_err(r->buf, ERR_TOO_BIG, "message too long");
-        resp_size = rb_size(r->buf);
+        rb_clear(buf);
+        out_err(buf, ERR_TOO_BIG, "message too long");
+        resp_size = rb_size(buf);
+    }
+    const size_t sz = rb_size(&c->outgo);
+    if (4 + resp_size > c->outgo.cap - 1 - sz) {
+        rb_resize(&c->outgo, next_pow2(sz + 4 + resp_size + 1));
     }
     write_u32(&c->outgo, (uint32_t) resp_size);
-    out_buf(&c->outgo, r->buf);
+    out_buf(&c->outgo, buf);
     // Add EV_WRITE for conn
     if (c->fd) {
         ev_io_stop(loop, &c->iow);
         ev_io_set(&c->iow, c->fd, EV_READ | EV_WRITE);
         ev_io_start(loop, &c->iow);
     }
+}
+
+// Callbacks for thread pool
+static bool kv_res_cb(cnode *rn) {
+    Result *r = container_of(rn, Result, node);
+    Conn *c = r->c;
+    c->inflight--;
+    kv_write_reply(c, r->buf);
     // Cleanup
     rb_destroy(r->buf);
     free(r->buf);
@@ -81,7 +101,9 @@ static cnode *kv_wrk_cb(cnode *wn) {
     KVStore *kv = w->kv;
     Result *r = calloc(1, sizeof(Result));
     // Do req
+    smr_enter();
     do_owned_req(kv, w->req, w->buf);
+    smr_exit();
     // Setup result
     r->buf = w->buf;
     r->c = w->c;
@@ -99,14 +121,156 @@ static void kv_expire_cb(EV_P_ ev_timer *w, const int revents) {
     ev_timer_start(EV_A_ w);
 }
 
-static Entry *create_empty_entry(vstr *key) {
+static inline size_t vstr_size(const vstr *v) { return sizeof(vstr) + v->len + 1; }
+
+static inline vstr *entry_inline_val(Entry *ent) {
+    const size_t off = vstr_size((const vstr *) ent->data);
+    return (vstr *) (ent->data + ((off + 3) & ~(size_t) 3));
+}
+
+// The value lives in `ent` itself, it goes with it.
+static inline bool val_is_inline(Entry *ent, const vstr *v) {
+    return (ent->flags & ENT_F_INLINE) && v == entry_inline_val(ent);
+}
+
+#define VAL_INT_MIN (INT64_MIN / 2)
+#define VAL_INT_MAX (INT64_MAX / 2)
+
+// Swapped out of `ent`, retire unless it's inline or an integer.
+static inline void val_release(Entry *ent, vstr *v) {
+    if (v && !val_is_int(v) && !val_is_inline(ent, v))
+        smr_retire(v, NULL);
+}
+
+// Per allocation: SMR header & malloc chunk.
+#define MEM_ALLOC_OVERHEAD 48
+// LFU counter: initial value, how fast it saturates & minutes per decay.
+#define LFU_INIT 5
+#define LFU_LOG_FACTOR 10
+#define LFU_DECAY_MIN 1
+
+static __thread u64 t_rng = 0x9e3779b97f4a7c15ULL;
+
+static inline u64 rng_next() {
+    t_rng ^= t_rng << 13;
+    t_rng ^= t_rng >> 7;
+    t_rng ^= t_rng << 17;
+    return t_rng;
+}
+
+// Eviction clocks don't need better than a few ms, far cheaper to read.
+static inline u64 clock_coarse_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (u64) ts.tv_sec * 1000 + (u64) ts.tv_nsec / 1000000;
+}
+
+static inline u32 lfu_minutes(const u64 now_ms) { return (u32) (now_ms / 60000) & 0xffffff; }
+
+static inline u32 lfu_decayed(const u32 access, const u32 now_min) {
+    const u32 periods = ((now_min - (access >> 8)) & 0xffffff) / LFU_DECAY_MIN, cnt = access & 0xff;
+    return periods >= cnt ? 0 : cnt - periods;
+}
+
+static u32 access_init(KVStore *kv) {
+    switch (kv->evict_policy) {
+        case EVICT_LRU:
+            return (u32) (clock_coarse_ms() / 1000);
+        case EVICT_LFU:
+            return lfu_minutes(clock_coarse_ms()) << 8 | LFU_INIT;
+        default:
+            return 0;
+    }
+}
+
+// Record an access for eviction, stores only when it changes anything.
+static void entry_touch(KVStore *kv, Entry *ent) {
+    if (!kv->maxmemory || kv->evict_policy == EVICT_NONE)
+        return;
+    const u64 now_ms = clock_coarse_ms();
+    const u32 old = LOAD(&ent->access, RELAXED);
+    u32 access;
+    if (kv->evict_policy == EVICT_LRU) {
+        access = (u32) (now_ms / 1000);
+    } else {
+        const u32 now_min = lfu_minutes(now_ms);
+        u32 cnt = lfu_decayed(old, now_min);
+        // Logarithmic, the more hits the less likely one counts.
+        const u32 base = cnt > LFU_INIT ? cnt - LFU_INIT : 0;
+        if (cnt < 255 && (double) (rng_next() >> 11) * 0x1.0p-53 * (base * LFU_LOG_FACTOR + 1) < 1.0)
+            cnt++;
+        access = now_min << 8 | cnt;
+    }
+    if (access != old)
+        STORE(&ent->access, access, RELAXED);
+}
+
+// Eviction candidates with higher scores go first.
+static u32 evict_score(KVStore *kv, Entry *ent, const u64 now_ms) {
+    const u32 access = LOAD(&ent->access, RELAXED);
+    if (kv->evict_policy == EVICT_LRU)
+        return (u32) (now_ms / 1000) - access;
+    return 255 - lfu_decayed(access, lfu_minutes(now_ms));
+}
+
+static inline void mem_add(KVStore *kv, const int64_t bytes) {
+    if (bytes)
+        FAA(&kv->used_mem, bytes, RELAXED);
+}
+
+// The entry allocation, inline key & value included.
+static int64_t entry_mem(Entry *ent) {
+    size_t size = sizeof(Entry) + vstr_size(entry_key(ent));
+    if (ent->flags & ENT_F_INLINE) {
+        size = ((size + 3) & ~(size_t) 3) + vstr_size(entry_inline_val(ent));
+    }
+    return (int64_t) (size + MEM_ALLOC_OVERHEAD);
+}
+
+static inline int64_t val_mem(Entry *ent, const vstr *v) {
+    if (!v || val_is_int(v) || val_is_inline(ent, v))
+        return 0;
+    return (int64_t) (vstr_size(v) + MEM_ALLOC_OVERHEAD);
+}
+
+// Everything `ent` holds.
+//
+// NOTE: Under `ent->lock` for ZSets.
+static int64_t entry_total_mem(Entry *ent) {
+    int64_t bytes = entry_mem(ent);
+    switch (LOAD(&ent->type, ACQUIRE)) {
+        case ENT_STR:
+            bytes += val_mem(ent, LOAD(&ent->val.s, ACQUIRE));
+            break;
+        case ENT_ZSET:
+            bytes += (int64_t) (zset_mem(ent->val.zs) + MEM_ALLOC_OVERHEAD);
+            break;
+    }
+    return bytes;
+}
+
+// A string entry holding `val` inline if it fits, else an ENT_INIT one.
+static Entry *entry_new(KVStore *kv, const vstr *key, const vstr *val) {
     assert(key);
-    Entry *ent = qsbr_calloc(1, sizeof(Entry));
-    spin_rw_init(&ent->lock);
-    vstr_cpy(&ent->key, key);
+    const bool inl = val && val->len <= ENT_INLINE_MAX;
+    size_t size = sizeof(Entry) + vstr_size(key);
+    if (inl) {
+        size = ((size + 3) & ~(size_t) 3) + vstr_size(val);
+    }
+    Entry *ent = smr_calloc(1, size);
+    rw_init(&ent->lock);
+    memcpy(ent->data, key, vstr_size(key) - 1);
     ent->type = ENT_INIT;
     ent->node.hcode = vstr_hash_rapid(key);
     ent->expire_ms = NOEXPIRE;
+    ent->access = access_init(kv);
+    if (inl) {
+        ent->flags = ENT_F_INLINE;
+        vstr *v = entry_inline_val(ent);
+        memcpy(v, val, vstr_size(val) - 1);
+        ent->val.s = v;
+        ent->type = ENT_STR;
+    }
 
     return ent;
 }
@@ -116,22 +280,26 @@ static void entry_clean(void *p) {
         return;
     Entry *ent = p;
     ent->expire_ms = NOEXPIRE;
-    vstr_destroy(ent->key);
     switch (ent->type) {
-        case ENT_STR:
-            vstr_destroy(ent->val.s);
+        case ENT_STR: {
+            // Readers reached it through `ent` only.
+            vstr *v = LOAD(&ent->val.s, RELAXED);
+            if (!val_is_int(v) && !val_is_inline(ent, v))
+                smr_free(v);
             break;
+        }
         case ENT_ZSET:
-            zset_destroy(&ent->val.zs);
+            zset_destroy(ent->val.zs);
+            free(ent->val.zs);
             break;
     }
 }
 
 bool entry_eq(BNode *ln, BNode *rn) {
-    const Entry *le = container_of(ln, Entry, node);
-    const Entry *re = container_of(rn, Entry, node);
+    const vstr *lk = entry_key(container_of(ln, Entry, node));
+    const vstr *rk = entry_key(container_of(rn, Entry, node));
 
-    return le->key->len == re->key->len && !strncmp(le->key->dat, re->key->dat, le->key->len);
+    return lk->len == rk->len && !memcmp(lk->dat, rk->dat, lk->len);
 }
 
 KVStore *kv_new(KVStore *kv) {
@@ -142,6 +310,21 @@ KVStore *kv_new(KVStore *kv) {
         kv->is_alloc = false;
     }
     kv->store = chpm_new(NULL, 4096);
+    kv->inline_mode = INLINE_ADAPTIVE;
+    kv->inline_cost_max = INLINE_COST_MAX;
+    atomic_init(&kv->n_inline, 0);
+    atomic_init(&kv->n_offload, 0);
+    rb_init(&kv->inline_buf, INLINE_BUF_SIZE);
+    kv->maxmemory = 0;
+    kv->evict_policy = EVICT_NONE;
+    atomic_init(&kv->used_mem, 0);
+    atomic_init(&kv->n_evicted, 0);
+    kv->aof = NULL;
+    kv->snap = NULL;
+    kv->repl = NULL;
+    kv->replica = NULL;
+    kv->raft = NULL;
+    kv->cluster = NULL;
     pool_init(&kv->pool, kv_res_cb);
     csl_new(&kv->expire);
     return kv;
@@ -149,22 +332,129 @@ KVStore *kv_new(KVStore *kv) {
 
 bool entry_catcher(BNode *node, void *arg) {
     Entry *ent = container_of(node, Entry, node);
-    qsbr_retire(ent, entry_clean);
+    smr_retire(ent, entry_clean);
     return true;
 }
 
 void kv_clear(KVStore *kv) {
+    // Nothing applies or streams writes past here.
+    cluster_free(kv->cluster);
+    raft_close(kv->raft);
+    replica_stop(kv->replica);
+    repl_free(kv->repl);
+    snap_free(kv->snap);
+    if (kv->aof) {
+        aof_close(kv->aof);
+    }
     chpm_foreach(kv->store, entry_catcher, NULL, entry_eq);
     pool_destroy(&kv->pool);
     chpm_destroy(kv->store);
     csl_destroy(&kv->expire);
+    rb_destroy(&kv->inline_buf);
     if (kv->is_alloc) {
         free(kv);
     }
 }
-void kv_dispatch(KVStore *kv, Conn *c, OwnedRequest *req) {
+// Read-only O(1) commands are worth running inline when their cost,
+// approximated by the bytes hashed, compared & copied into the reply, stays
+// below the threshold, or below `INLINE_COST_CAP` while the target worker
+// already has a backlog to wait behind.
+//
+// Returns the cost budget for the request, 0 if it must be offloaded.
+// Connections with replies still pending on workers are never inlined to
+// keep their replies in order.
+static size_t kv_inline_budget(KVStore *kv, Conn *c, OwnedRequest *oreq) {
+    if (kv->inline_mode == INLINE_OFF || c->inflight)
+        return 0;
+    // Reads waiting on the cluster, or rejected by it, go to workers.
+    if (kv->raft && !raft_lease_valid(kv->raft))
+        return 0;
+
+    size_t cost;
+    switch (oreq->req.type) {
+        case CMD_GET:
+        case CMD_PTTL:
+            cost = oreq->req.key->len;
+            break;
+        case CMD_ZSCORE:
+            cost = oreq->req.key->len + oreq->req.args.val->len;
+            break;
+        default:
+            return 0;
+    }
+    const size_t budget = kv->inline_mode == INLINE_ALWAYS || pool_backlog(&kv->pool) > 0
+                                  ? INLINE_COST_CAP
+                                  : MIN(kv->inline_cost_max, INLINE_COST_CAP);
+    return cost < budget ? budget - cost : 0;
+}
+
+// Run `oreq` on the I/O thread within `budget`, false if it has to be offloaded.
+static bool kv_run_inline(KVStore *kv, Conn *c, OwnedRequest *oreq, const size_t budget) {
+    RingBuf *buf = &kv->inline_buf;
+    Cluster *cl = kv->cluster;
+    const uint32_t slot = cl ? cluster_slot(oreq->req.key) : 0;
+    // Redirects come from the workers.
+    if (cl && cluster_enter(cl, slot, false))
+        return false;
+    bool done = true;
+    smr_enter();
+    if (oreq->req.type == CMD_GET) {
+        done = get_bounded(kv, buf, oreq->req.key, budget);
+    } else if (cl) {
+        kv_apply(kv, oreq, buf);
+    } else {
+        do_owned_req(kv, oreq, buf);
+    }
+    smr_exit();
+    if (cl)
+        cluster_exit(cl, slot, false);
+    if (!done)
+        return false;
+    owned_req_destroy(oreq);
+    kv_write_reply(c, buf);
+    rb_clear(buf);
+    // Don't keep a buffer grown by a large reply around.
+    if (buf->cap > INLINE_BUF_SIZE) {
+        rb_destroy(buf);
+        rb_init(buf, INLINE_BUF_SIZE);
+    }
+    FAA(&kv->n_inline, 1, RELAXED);
+    return true;
+}
+
+// Why `c` can't become a replica link or an import, NULL if it can.
+static const char *kv_handoff_err(KVStore *kv, Conn *c, const enum cmd_type type) {
+    if (type == CMD_SYNC && !kv->repl)
+        return "replication disabled";
+    if (type == CMD_CLUSTER_IMPORT && !kv->cluster)
+        return "cluster disabled";
+    // Replies still owed, or requests after it, would be lost.
+    if (c->inflight || !rb_empty(&c->outgo) || !rb_empty(&c->income))
+        return type == CMD_SYNC ? "sync must be the only request" : "import must be the only request";
+    return NULL;
+}
+
+ConnState kv_dispatch(KVStore *kv, Conn *c, OwnedRequest *req) {
     ThreadPool *pool = &kv->pool;
 
+    // Rejections go through the workers like any request, keeping replies in order.
+    if (req->req.type == CMD_SYNC || req->req.type == CMD_CLUSTER_IMPORT) {
+        const char *err = kv_handoff_err(kv, c, req->req.type);
+        if (!err) {
+            owned_req_destroy(req);
+            return HANDOFF;
+        }
+        req->req.type = CMD_BAD;
+        req->req.args.err = (char *) err;
+    } else if (kv->replica && req_is_write(req->req.type)) {
+        req->req.type = CMD_BAD;
+        req->req.args.err = "read-only replica";
+    }
+
+    const size_t budget = kv_inline_budget(kv, c, req);
+    if (budget && kv_run_inline(kv, c, req, budget))
+        return OK;
+
     Work *w = calloc(1, sizeof(Work));
     assert(w);
     w->buf = calloc(1, sizeof(RingBuf));
@@ -173,11 +463,192 @@ void kv_dispatch(KVStore *kv, Conn *c, OwnedRequest *req) {
     w->kv = kv;
     w->req = req;
 
+    c->inflight++;
+    FAA(&kv->n_offload, 1, RELAXED);
     pool_post(pool, &w->node);
+    return OK;
+}
+
+void kv_set_maxmemory(KVStore *kv, const size_t bytes, const int policy) {
+    kv->maxmemory = bytes;
+    kv->evict_policy = policy;
+}
+
+void kv_set_aof(KVStore *kv, AOF *aof) { kv->aof = aof; }
+
+void kv_set_snapshot(KVStore *kv, Snapshot *snap) { kv->snap = snap; }
+
+void kv_set_repl(KVStore *kv, Repl *repl) { kv->repl = repl; }
+
+void kv_set_replica(KVStore *kv, Replica *replica) { kv->replica = replica; }
+
+void kv_set_raft(KVStore *kv, Raft *raft) { kv->raft = raft; }
+
+void kv_set_cluster(KVStore *kv, Cluster *cluster) { kv->cluster = cluster; }
+
+size_t kv_used_memory(KVStore *kv) {
+    const int64_t used = LOAD(&kv->used_mem, RELAXED);
+    // Racing updates of an entry being unlinked may leave it a little off.
+    return (size_t) MAX(used, 0) + chpm_mem(kv->store);
+}
+
+// `ent` was just removed from the store: drop its TTL & its bytes, retire it.
+static void entry_unlinked(KVStore *kv, Entry *ent) {
+    rw_wlock(&ent->lock);
+    if (cskey_cmp(ent->expire_ms, NOEXPIRE)) {
+        csl_remove(&kv->expire, ent->expire_ms);
+        ent->expire_ms = NOEXPIRE;
+    }
+    mem_add(kv, -entry_total_mem(ent));
+    rw_wunlock(&ent->lock);
+    smr_retire(ent, entry_clean);
+}
+
+// A `vstr` in caller storage, for short formatted arguments.
+struct vstr_buf {
+    alignas(vstr) char dat[sizeof(vstr) + 32];
+};
+
+static const vstr *vstr_fmt(struct vstr_buf *b, const char *fmt, ...) {
+    vstr *v = (vstr *) b->dat;
+    va_list args;
+    va_start(args, fmt);
+    const int len = vsnprintf(v->dat, sizeof(b->dat) - sizeof(vstr), fmt, args);
+    va_end(args);
+    v->len = (uint32_t) len;
+    return v;
+}
+
+// Replication stripe the calling worker holds in `kv_apply`, -1 if none.
+static __thread int t_rstripe = -1;
+
+// Take the replication stripe of `key` before unlinking it on our own, so its
+// DEL goes out in order with writes to the key. Without `wait` false if
+// someone else holds it: evictions run under another write's stripe, waiting
+// on a second one could deadlock.
+static bool unlink_lock(Repl *repl, const vstr *key, const bool wait, uint32_t *stripe) {
+    *stripe = repl_stripe(key);
+    if ((int) *stripe == t_rstripe)
+        return true;
+    if (wait) {
+        repl_lock(repl, *stripe);
+        return true;
+    }
+    return repl_trylock(repl, *stripe);
+}
+
+// Pairs with `unlink_lock`, streams the DEL if the key was unlinked.
+static void unlink_unlock(Repl *repl, const vstr *key, const uint32_t stripe, const bool unlinked) {
+    if (unlinked) {
+        struct vstr_buf cmd;
+        const vstr *argv[2] = {vstr_fmt(&cmd, "del"), key};
+        repl_append(repl, stripe, 2, argv);
+    }
+    if ((int) stripe != t_rstripe)
+        repl_unlock(repl, stripe);
+}
+
+// Append the DEL of `key` to the log of a leader, under the key's stripe
+// unless it's `held` already. False if not leading, or if someone else holds
+// the stripe: they may wait on the log for a while.
+static bool raft_del(Raft *raft, const vstr *key, const int held) {
+    const uint32_t stripe = raft_stripe(key);
+    if ((int) stripe != held && !raft_trylock(raft, stripe))
+        return false;
+    struct vstr_buf cmd;
+    const vstr *argv[2] = {vstr_fmt(&cmd, "del"), key};
+    const bool ok = raft_propose(raft, 2, argv);
+    if ((int) stripe != held)
+        raft_unlock(raft, stripe);
+    return ok;
+}
+
+// The best victim of a sample, NULL if empty. In a critical section.
+static Entry *evict_pick(KVStore *kv) {
+    BNode *sample[EVICT_SAMPLES];
+    const size_t n = chpm_sample(kv->store, rng_next(), sample, EVICT_SAMPLES);
+    const u64 now_ms = clock_coarse_ms();
+    Entry *victim = NULL;
+    u32 best = 0;
+    for (size_t i = 0; i < n; i++) {
+        Entry *ent = container_of(sample[i], Entry, node);
+        const u32 score = evict_score(kv, ent, now_ms);
+        if (!victim || score > best) {
+            victim = ent;
+            best = score;
+        }
+    }
+    return victim;
+}
+
+// Evict the best victim of a sample, false if none could be.
+static bool evict_one(KVStore *kv) {
+    bool evicted = false;
+    smr_enter();
+    Entry *victim = evict_pick(kv);
+    Repl *repl = kv->repl;
+    uint32_t rstripe = 0;
+    // Busy with a write to it, the next write picks another one.
+    if (victim && repl && !unlink_lock(repl, entry_key(victim), false, &rstripe))
+        victim = NULL;
+    // Whatever holds the victim's key by now goes, it was unlinked all the same.
+    BNode *res = victim ? chpm_remove(kv->store, &victim->node, entry_eq) : NULL;
+    if (victim && repl)
+        unlink_unlock(repl, entry_key(victim), rstripe, res);
+    if (res) {
+        entry_unlinked(kv, container_of(res, Entry, node));
+        FAA(&kv->n_evicted, 1, RELAXED);
+        evicted = true;
+    }
+    smr_exit();
+    return evicted;
+}
+
+// Run before a write that may grow the keyspace, false if it must be
+// rejected. At most `EVICT_PER_WRITE` evictions keep the latency flat: usage
+// may overshoot the limit for a while, but each write pulls it back.
+static bool kv_make_room(KVStore *kv) {
+    // A cluster's leader makes room before the write enters the log, see
+    // `raft_make_room`.
+    if (!kv->maxmemory || kv->raft)
+        return true;
+    bool evicted = false;
+    for (int i = 0; i < EVICT_PER_WRITE; i++) {
+        if (kv_used_memory(kv) <= kv->maxmemory)
+            return true;
+        if (kv->evict_policy == EVICT_NONE || !evict_one(kv))
+            break;
+        evicted = true;
+    }
+    return evicted || kv_used_memory(kv) <= kv->maxmemory;
+}
+
+// `kv_make_room` of a cluster's leader holding the write's `stripe`: the
+// victim goes as a DEL through the log, nothing is unlinked before it
+// applies. One per write as usage only drops then, so it may overshoot the
+// limit a little longer.
+static bool raft_make_room(KVStore *kv, const uint32_t stripe) {
+    if (!kv->maxmemory || kv_used_memory(kv) <= kv->maxmemory)
+        return true;
+    if (kv->evict_policy == EVICT_NONE)
+        return false;
+    Entry *victim = evict_pick(kv);
+    if (!victim || !raft_del(kv->raft, entry_key(victim), (int) stripe))
+        return false;
+    FAA(&kv->n_evicted, 1, RELAXED);
+    return true;
+}
+
+void kv_set_inline(KVStore *kv, const int mode, const size_t cost_max) {
+    kv->inline_mode = mode;
+    kv->inline_cost_max = cost_max;
 }
 
 void kv_start(KVStore *kv) {
     struct ev_loop *loop = ev_default_loop(0);
+    // The I/O thread touches the store when running requests inline, the
+    // pool takes it offline while the loop blocks.
+    smr_reg();
     pool_start(&kv->pool, kv_wrk_cb);
     ev_timer_init(&kv->expire_w, kv_expire_cb, TIMEOUT_S, 0.);
     kv->expire_w.data = kv;
@@ -187,12 +658,11 @@ void kv_stop(KVStore *kv) {
     logger(stderr, "INFO", "[master] Send stop signal...\n");
     struct ev_loop *loop = ev_default_loop(0);
     ev_timer_stop(loop, &kv->expire_w);
-    cq_put(kv->pool.result_q, (cnode *) STOP_MAGIC);
-    ev_async_send(EV_DEFAULT, &kv->pool.rev);
+    pool_notify_stop(&kv->pool);
 }
 
 void kv_set_ttl(KVStore *kv, Entry *ent, int64_t ttl) {
-    spin_rw_wlock(&ent->lock);
+    rw_wlock(&ent->lock);
     if (cskey_cmp(ent->expire_ms, NOEXPIRE)) {
         csl_remove(&kv->expire, ent->expire_ms);
     }
@@ -203,155 +673,383 @@ void kv_set_ttl(KVStore *kv, Entry *ent, int64_t ttl) {
         ent->expire_ms.nonce = atomic_fetch_add_explicit(&g_nonce_cnt, 1, memory_order_relaxed);
         csl_update(&kv->expire, ent->expire_ms, ent);
     }
-    spin_rw_wunlock(&ent->lock);
+    rw_wunlock(&ent->lock);
+}
+
+// `kv_clean_expired` of a cluster: only the leader expires, by appending
+// DELs, so every node drops the key at the same point of the log. Entries
+// get another deadline a while out meanwhile, in case the DEL doesn't apply.
+static uint64_t raft_clean_expired(KVStore *kv) {
+    if (!raft_leading(kv->raft))
+        return RAFT_ELECTION_MS;
+    CSKey now = {get_clock_ms(), UINT64_MAX};
+    smr_enter();
+    CSKey expire_ms = csl_find_min_key(&kv->expire);
+    while (cskey_cmp(now, expire_ms) >= 0) {
+        Entry *ent = csl_pop_min(&kv->expire);
+        if (ent) {
+            rw_wlock(&ent->lock);
+            // Unlinked or made persistent since, its TTL is gone.
+            if (cskey_cmp(ent->expire_ms, NOEXPIRE)) {
+                if (cskey_cmp(ent->expire_ms, now) <= 0) {
+                    const bool ok = raft_del(kv->raft, entry_key(ent), -1);
+                    ent->expire_ms.key = now.key + (ok ? RAFT_ELECTION_MS : RAFT_HEARTBEAT_MS);
+                    ent->expire_ms.nonce = FAA(&g_nonce_cnt, 1, RELAXED);
+                }
+                csl_update(&kv->expire, ent->expire_ms, ent);
+            }
+            rw_wunlock(&ent->lock);
+        }
+        expire_ms = csl_find_min_key(&kv->expire);
+        now.key = get_clock_ms();
+    }
+    smr_exit();
+
+    return expire_ms.key - now.key;
 }
 
 // Returns the min not-expired key
 uint64_t kv_clean_expired(KVStore *kv) {
+    if (kv->raft)
+        return raft_clean_expired(kv);
     // No need to lock as we don't read the content of ent
     CSKey now = {get_clock_ms(), UINT64_MAX};
+    smr_enter();
     CSKey expire_ms = csl_find_min_key(&kv->expire);
     // now >= expire_ms
     while (cskey_cmp(now, expire_ms) >= 0) {
         Entry *ent = csl_pop_min(&kv->expire);
         if (ent) {
-            spin_rw_rlock(&ent->lock);
+            rw_rlock(&ent->lock);
             // if (ent->expire_ms > now) {
-            if (cskey_cmp(ent->expire_ms, now) > 0) {
+            const bool later = cskey_cmp(ent->expire_ms, now) > 0;
+            if (later) {
                 csl_update(&kv->expire, ent->expire_ms, ent);
                 expire_ms = ent->expire_ms;
-            } else {
+            }
+            rw_runlock(&ent->lock);
+            if (!later) {
+                Repl *repl = kv->repl;
+                uint32_t rstripe = 0;
+                if (repl)
+                    unlink_lock(repl, entry_key(ent), true, &rstripe);
+                // A DEL & SET racing us may have put another entry under the
+                // key, whatever we unlink is the one to account & retire.
                 BNode *res = chpm_remove(kv->store, &ent->node, entry_eq);
+                if (repl)
+                    unlink_unlock(repl, entry_key(ent), rstripe, res);
                 if (res) {
-                    qsbr_retire(ent, entry_clean);
+                    entry_unlinked(kv, container_of(res, Entry, node));
                 }
                 expire_ms = csl_find_min_key(&kv->expire);
             }
-            spin_rw_runlock(&ent->lock);
         } else {
             expire_ms = csl_find_min_key(&kv->expire);
         }
         now.key = get_clock_ms();
     }
+    smr_exit();
 
     return expire_ms.key - now.key;
 }
 
-// get key
-void do_get(KVStore *kv, RingBuf *out, vstr *kstr) {
+// get key, bails out without writing if the value is longer than `max`.
+static bool get_bounded(KVStore *kv, RingBuf *out, vstr *kstr, const size_t max) {
     Entry key = {
-            .key = kstr,
             .node.hcode = vstr_hash_rapid(kstr),
+            .val.key = kstr,
+            .flags = ENT_F_PROBE,
     };
 
     BNode *node = chpm_lookup(kv->store, &key.node, entry_eq);
     if (!node) {
         out_nil(out);
-        return;
+        return true;
     }
 
+    // Lock-free: the value is immutable & stays alive for our critical
+    // section even if a SET swaps it out meanwhile.
     Entry *ent = container_of(node, Entry, node);
-    spin_rw_rlock(&ent->lock);
-    if (ent->type != ENT_STR) {
-        out_err(out, ERR_BAD_TYP, "not a string");
-    } else {
-        out_vstr(out, ent->val.s);
+    entry_touch(kv, ent);
+    switch (LOAD(&ent->type, ACQUIRE)) {
+        case ENT_INIT: // Not set yet
+            out_nil(out);
+            break;
+        case ENT_STR: {
+            const vstr *s = LOAD(&ent->val.s, ACQUIRE);
+            if (val_is_int(s)) {
+                char buf[24];
+                const int len = snprintf(buf, sizeof(buf), "%" PRId64, val_int(s));
+                if ((size_t) len > max)
+                    return false;
+                out_str(out, buf, len);
+            } else {
+                if (s->len > max)
+                    return false;
+                out_vstr(out, s);
+            }
+            break;
+        }
+        default:
+            out_err(out, ERR_BAD_TYP, "not a string");
     }
-    spin_rw_runlock(&ent->lock);
+    return true;
 }
 
+static vstr *val_new(const vstr *src) {
+    vstr *v = smr_calloc(1, sizeof(vstr) + src->len + 1);
+    v->len = src->len;
+    memcpy(v->dat, src->dat, src->len);
+    return v;
+}
+
+// Tagged if it fits, else formatted.
+static vstr *val_from_int(const int64_t n) {
+    if (n >= VAL_INT_MIN && n <= VAL_INT_MAX)
+        return (vstr *) (uintptr_t) (((uint64_t) n << 1) | 1);
+    char buf[24];
+    const int len = snprintf(buf, sizeof(buf), "%" PRId64, n);
+    vstr *v = smr_calloc(1, sizeof(vstr) + len + 1);
+    v->len = len;
+    memcpy(v->dat, buf, len);
+    return v;
+}
+
+// get key
+void do_get(KVStore *kv, RingBuf *out, vstr *kstr) { get_bounded(kv, out, kstr, SIZE_MAX); }
+
 // set key val_str
 void do_set(KVStore *kv, RingBuf *out, vstr *kstr, vstr *vstr) {
-    Entry *e = create_empty_entry(kstr);
+    if (!kv_make_room(kv)) {
+        out_err(out, ERR_OOM, "out of memory");
+        return;
+    }
+    Entry *e = entry_new(kv, kstr, vstr);
 
     BNode *node = chpm_upsert(kv->store, &e->node, entry_eq);
     if (!node) {
         out_err(out, ERR_UNKNOWN, "store not initialized");
-        qsbr_retire(e, entry_clean);
+        smr_retire(e, entry_clean);
+        return;
+    }
+    Entry *found = container_of(node, Entry, node);
+    if (found == e) {
+        mem_add(kv, entry_mem(e));
+        if (e->type == ENT_STR) {
+            // New key, published with its value inline.
+            out_nil(out);
+            return;
+        }
     } else {
-        Entry *found = container_of(node, Entry, node);
-        spin_rw_wlock(&found->lock);
-        switch (found->type) {
-            case ENT_INIT:
-                found->type = ENT_STR;
-            case ENT_STR:
-                vstr_cpy(&found->val.s, vstr);
-                break;
-            case ENT_ZSET:
-                spin_rw_wunlock(&found->lock);
-                qsbr_retire(e, entry_clean);
-                out_err(out, ERR_BAD_TYP, "non string entry");
-                return;
+        entry_touch(kv, found);
+    }
+    // Copy outside of any lock, publishing is a single swap.
+    struct vstr *val = val_new(vstr), *old;
+    // ENT_STR is final, only ENT_INIT needs `lock` to settle the type.
+    if (LOAD(&found->type, ACQUIRE) != ENT_STR) {
+        rw_wlock(&found->lock);
+        if (found->type == ENT_ZSET) {
+            rw_wunlock(&found->lock);
+            smr_free(val);
+            smr_retire(e, entry_clean);
+            out_err(out, ERR_BAD_TYP, "non string entry");
+            return;
         }
-        spin_rw_wunlock(&found->lock);
-        if (found != e) {
-            qsbr_retire(e, entry_clean);
+        // Publish the value before the type, GET reads them unlocked.
+        old = XCHG(&found->val.s, val, RELEASE);
+        STORE(&found->type, ENT_STR, RELEASE);
+        rw_wunlock(&found->lock);
+    } else {
+        old = XCHG(&found->val.s, val, ACQ_REL);
+    }
+    mem_add(kv, val_mem(found, val) - val_mem(found, old));
+    val_release(found, old);
+    if (found != e) {
+        smr_retire(e, entry_clean);
+    }
+    out_nil(out);
+}
+
+// incrby key delta, also incr, decr & decrby. Lock-free: a CAS on the
+// value, which stays tagged unless it outgrows 63 bits.
+void do_incrby(KVStore *kv, RingBuf *out, vstr *kstr, const int64_t delta) {
+    if (!kv_make_room(kv)) {
+        out_err(out, ERR_OOM, "out of memory");
+        return;
+    }
+    Entry key = {
+            .node.hcode = vstr_hash_rapid(kstr),
+            .val.key = kstr,
+            .flags = ENT_F_PROBE,
+    };
+    BNode *node = chpm_lookup(kv->store, &key.node, entry_eq);
+    if (!node) {
+        Entry *e = entry_new(kv, kstr, NULL);
+        e->val.s = val_from_int(delta);
+        e->type = ENT_STR;
+        node = chpm_upsert(kv->store, &e->node, entry_eq);
+        if (!node) {
+            out_err(out, ERR_UNKNOWN, "store not initialized");
+            smr_retire(e, entry_clean);
+            return;
         }
-        out_nil(out);
+        if (node == &e->node) {
+            mem_add(kv, entry_mem(e) + val_mem(e, e->val.s));
+            out_int(out, delta);
+            return;
+        }
+        // Lost the race to create it.
+        smr_retire(e, entry_clean);
+    }
+    Entry *found = container_of(node, Entry, node);
+    entry_touch(kv, found);
+    if (LOAD(&found->type, ACQUIRE) != ENT_STR) {
+        rw_wlock(&found->lock);
+        if (found->type == ENT_INIT) {
+            STORE(&found->val.s, val_from_int(0), RELAXED);
+            STORE(&found->type, ENT_STR, RELEASE);
+        }
+        rw_wunlock(&found->lock);
+        if (found->type != ENT_STR) {
+            out_err(out, ERR_BAD_TYP, "non string entry");
+            return;
+        }
+    }
+
+    vstr *old = LOAD(&found->val.s, ACQUIRE);
+    for (;;) {
+        int64_t n;
+        if (val_is_int(old)) {
+            n = val_int(old);
+        } else if (!str2int_strict(old, &n)) {
+            out_err(out, ERR_BAD_ARG, "value is not an integer");
+            return;
+        }
+        if (__builtin_add_overflow(n, delta, &n)) {
+            out_err(out, ERR_BAD_ARG, "increment would overflow");
+            return;
+        }
+        vstr *val = val_from_int(n);
+        if (CMPXCHG(&found->val.s, &old, val, ACQ_REL, ACQUIRE)) {
+            mem_add(kv, val_mem(found, val) - val_mem(found, old));
+            val_release(found, old);
+            out_int(out, n);
+            return;
+        }
+        if (!val_is_int(val))
+            smr_free(val);
     }
 }
 
 // del key
 void do_del(KVStore *kv, RingBuf *out, vstr *kstr) {
     Entry key = {
-            .key = kstr,
             .node.hcode = vstr_hash_rapid(kstr),
+            .val.key = kstr,
+            .flags = ENT_F_PROBE,
     };
     BNode *node = chpm_remove(kv->store, &key.node, entry_eq);
     if (!node) {
         out_int(out, 0);
     } else {
-        Entry *ent = container_of(node, Entry, node);
-        qsbr_retire(ent, entry_clean);
+        entry_unlinked(kv, container_of(node, Entry, node));
         out_int(out, 1);
     }
 }
 
+// Keys collected ahead of the array header, which needs their count.
+struct KeysCtx {
+    RingBuf keys;
+    uint32_t n;
+    const Glob *match;
+};
+
 bool keys_cb(BNode *node, void *arg) {
-    RingBuf *out = (RingBuf *) arg;
-    Entry *ent = container_of(node, Entry, node);
-    vstr *key;
-    spin_rw_rlock(&ent->lock);
-    key = container_of(node, Entry, node)->key;
-    spin_rw_runlock(&ent->lock);
-    out_vstr(out, key);
+    struct KeysCtx *ctx = arg;
+    // Keys are immutable, no need to lock.
+    const vstr *key = entry_key(container_of(node, Entry, node));
+    if (!ctx->match || glob_test(ctx->match, key->dat, key->len)) {
+        out_vstr(&ctx->keys, key);
+        ctx->n++;
+    }
     return true;
 }
 
-// keys
-void do_keys(KVStore *kv, RingBuf *out) {
-    out_arr(out, (uint32_t) chpm_size(kv->store));
-    chpm_foreach(kv->store, keys_cb, out, entry_eq);
+// keys [pattern]
+void do_keys(KVStore *kv, RingBuf *out, const vstr *match) {
+    Glob glob;
+    if (match) {
+        glob_compile(&glob, match->dat, match->len);
+    }
+    // Writers may come & go meanwhile, the count is what's seen.
+    struct KeysCtx ctx = {.match = match ? &glob : NULL};
+    rb_init(&ctx.keys, 4096);
+    chpm_foreach(kv->store, keys_cb, &ctx, entry_eq);
+    out_arr(out, ctx.n);
+    out_buf(out, &ctx.keys);
+    rb_destroy(&ctx.keys);
+}
+
+// scan cursor [match pattern] [count n]
+void do_scan(KVStore *kv, RingBuf *out, const int64_t cursor, const int64_t count, const vstr *match) {
+    Glob glob;
+    if (match) {
+        glob_compile(&glob, match->dat, match->len);
+    }
+    struct KeysCtx ctx = {.match = match ? &glob : NULL};
+    rb_init(&ctx.keys, 4096);
+    const uint64_t buckets = count ? MIN((uint64_t) count, SCAN_COUNT_MAX) : SCAN_COUNT;
+    // Cursors are opaque, they go out & come back as i64.
+    const uint64_t next = chpm_scan(kv->store, (uint64_t) cursor, buckets, keys_cb, &ctx, entry_eq);
+    out_arr(out, 2);
+    out_int(out, (int64_t) next);
+    out_arr(out, ctx.n);
+    out_buf(out, &ctx.keys);
+    rb_destroy(&ctx.keys);
 }
 
 // zadd key score name
 void do_zadd(KVStore *kv, RingBuf *out, vstr *kstr, const double score, vstr *name) {
     bool added = false;
-    Entry *e = create_empty_entry(kstr);
+    if (!kv_make_room(kv)) {
+        out_err(out, ERR_OOM, "out of memory");
+        return;
+    }
+    Entry *e = entry_new(kv, kstr, NULL);
 
     BNode *node = chpm_upsert(kv->store, &e->node, entry_eq);
     if (!node) {
         out_err(out, ERR_UNKNOWN, "store not initialized");
-        qsbr_retire(e, entry_clean);
+        smr_retire(e, entry_clean);
         return;
     } else {
         Entry *found = container_of(node, Entry, node);
-        spin_rw_wlock(&found->lock);
+        if (found == e) {
+            mem_add(kv, entry_mem(e));
+        } else {
+            entry_touch(kv, found);
+        }
+        rw_wlock(&found->lock);
         switch (found->type) {
             case ENT_INIT:
+                found->val.zs = malloc(sizeof(ZSet));
+                zset_init(found->val.zs);
                 found->type = ENT_ZSET;
-                zset_init(&found->val.zs);
-            case ENT_ZSET:
-                added = zset_insert(&found->val.zs, name->dat, name->len, score);
+                mem_add(kv, (int64_t) (zset_mem(found->val.zs) + MEM_ALLOC_OVERHEAD));
+            case ENT_ZSET: {
+                const size_t before = zset_mem(found->val.zs);
+                added = zset_insert(found->val.zs, name->dat, name->len, score);
+                mem_add(kv, (int64_t) zset_mem(found->val.zs) - (int64_t) before);
                 break;
+            }
             case ENT_STR:
-                spin_rw_wunlock(&found->lock);
+                rw_wunlock(&found->lock);
                 out_err(out, ERR_BAD_TYP, "non zset entry");
                 return;
         }
-        spin_rw_wunlock(&found->lock);
+        rw_wunlock(&found->lock);
         if (found != e) {
-            qsbr_retire(e, entry_clean);
+            smr_retire(e, entry_clean);
         }
     }
 
@@ -361,25 +1059,28 @@ void do_zadd(KVStore *kv, RingBuf *out, vstr *kstr, const double score, vstr *na
 // zrem key name
 void do_zrem(KVStore *kv, RingBuf *out, vstr *kstr, vstr *name) {
     Entry key = {
-            .key = kstr,
             .node.hcode = vstr_hash_rapid(kstr),
+            .val.key = kstr,
+            .flags = ENT_F_PROBE,
     };
     BNode *node = chpm_lookup(kv->store, &key.node, entry_eq);
     if (!node) {
         out_int(out, 0);
     } else {
         Entry *ent = container_of(node, Entry, node);
-        spin_rw_wlock(&ent->lock);
+        rw_wlock(&ent->lock);
         if (ent->type != ENT_ZSET) {
-            spin_rw_wunlock(&ent->lock);
+            rw_wunlock(&ent->lock);
             out_err(out, ERR_BAD_TYP, "not a zset");
             return;
         }
-        ZNode *znode = zset_lookup(&ent->val.zs, name->dat, name->len);
+        ZNode *znode = zset_lookup(ent->val.zs, name->dat, name->len);
         if (znode) {
-            zset_delete(&ent->val.zs, znode);
+            const size_t before = zset_mem(ent->val.zs);
+            zset_delete(ent->val.zs, znode);
+            mem_add(kv, (int64_t) zset_mem(ent->val.zs) - (int64_t) before);
         }
-        spin_rw_wunlock(&ent->lock);
+        rw_wunlock(&ent->lock);
         out_int(out, znode ? 1 : 0);
     }
 }
@@ -387,27 +1088,29 @@ void do_zrem(KVStore *kv, RingBuf *out, vstr *kstr, vstr *name) {
 // zscore key name
 void do_zscore(KVStore *kv, RingBuf *out, vstr *kstr, vstr *name) {
     Entry key = {
-            .key = kstr,
             .node.hcode = vstr_hash_rapid(kstr),
+            .val.key = kstr,
+            .flags = ENT_F_PROBE,
     };
     BNode *node = chpm_lookup(kv->store, &key.node, entry_eq);
     if (!node) {
         out_nil(out);
     } else {
         Entry *ent = container_of(node, Entry, node);
-        spin_rw_rlock(&ent->lock);
+        entry_touch(kv, ent);
+        rw_rlock(&ent->lock);
         if (ent->type != ENT_ZSET) {
-            spin_rw_runlock(&ent->lock);
+            rw_runlock(&ent->lock);
             out_err(out, ERR_BAD_TYP, "not a zset");
             return;
         }
-        const ZNode *znode = zset_lookup(&ent->val.zs, name->dat, name->len);
+        const ZNode *znode = zset_lookup(ent->val.zs, name->dat, name->len);
         if (znode) {
             out_dbl(out, znode->score);
         } else {
             out_nil(out);
         }
-        spin_rw_runlock(&ent->lock);
+        rw_runlock(&ent->lock);
     }
 }
 
@@ -415,8 +1118,9 @@ void do_zscore(KVStore *kv, RingBuf *out, vstr *kstr, vstr *name) {
 void do_zquery(KVStore *kv, RingBuf *out, vstr *kstr, const double score, vstr *name, const int64_t offset,
                const int64_t limit) {
     Entry key = {
-            .key = kstr,
             .node.hcode = vstr_hash_rapid(kstr),
+            .val.key = kstr,
+            .flags = ENT_F_PROBE,
     };
     BNode *node = chpm_lookup(kv->store, &key.node, entry_eq);
     if (!node) {
@@ -425,20 +1129,21 @@ void do_zquery(KVStore *kv, RingBuf *out, vstr *kstr, const double score, vstr *
     }
 
     Entry *ent = container_of(node, Entry, node);
-    spin_rw_rlock(&ent->lock);
+    entry_touch(kv, ent);
+    rw_rlock(&ent->lock);
     if (ent->type != ENT_ZSET) {
-        spin_rw_runlock(&ent->lock);
+        rw_runlock(&ent->lock);
         out_err(out, ERR_BAD_TYP, "not a zset");
         return;
     }
 
     if (limit <= 0) {
-        spin_rw_runlock(&ent->lock);
+        rw_runlock(&ent->lock);
         out_arr(out, 0);
         return;
     }
-    ZNode *znode = zset_seekge(&ent->val.zs, score, name->dat, name->len);
-    znode = znode_offset(&ent->val.zs, znode, offset);
+    ZNode *znode = zset_seekge(ent->val.zs, score, name->dat, name->len);
+    znode = znode_offset(ent->val.zs, znode, offset);
 
     RingBuf buf;
     rb_init(&buf, 4096);
@@ -451,7 +1156,7 @@ void do_zquery(KVStore *kv, RingBuf *out, vstr *kstr, const double score, vstr *
         znode = next ? container_of(next, ZNode, tnode) : NULL;
         n += 2;
     }
-    spin_rw_runlock(&ent->lock);
+    rw_runlock(&ent->lock);
     out_arr(out, n);
     out_buf(out, &buf);
     rb_destroy(&buf);
@@ -459,8 +1164,9 @@ void do_zquery(KVStore *kv, RingBuf *out, vstr *kstr, const double score, vstr *
 
 void do_pttl(KVStore *kv, RingBuf *out, vstr *kstr) {
     Entry key = {
-            .key = kstr,
             .node.hcode = vstr_hash_rapid(kstr),
+            .val.key = kstr,
+            .flags = ENT_F_PROBE,
     };
     BNode *node = chpm_lookup(kv->store, &key.node, entry_eq);
     if (!node) {
@@ -482,8 +1188,9 @@ void do_pttl(KVStore *kv, RingBuf *out, vstr *kstr) {
 // pexpire key ttl
 void do_pexpire(KVStore *kv, RingBuf *out, vstr *kstr, int64_t ttl) {
     Entry key = {
-            .key = kstr,
             .node.hcode = vstr_hash_rapid(kstr),
+            .val.key = kstr,
+            .flags = ENT_F_PROBE,
     };
     BNode *node = chpm_lookup(kv->store, &key.node, entry_eq);
     if (node) {
@@ -493,7 +1200,253 @@ void do_pexpire(KVStore *kv, RingBuf *out, vstr *kstr, int64_t ttl) {
     out_int(out, node ? 1 : 0);
 }
 
-void do_owned_req(KVStore *kv, OwnedRequest *oreq, RingBuf *out) {
+struct DumpCtx {
+    kv_emit_fn emit;
+    void *arg;
+    // Wall clock minus `get_clock_ms`, TTLs are dumped as deadlines.
+    int64_t clock_off;
+};
+
+static bool dump_cb(BNode *node, void *arg) {
+    struct DumpCtx *ctx = arg;
+    Entry *ent = container_of(node, Entry, node);
+    const vstr *key = entry_key(ent);
+    struct vstr_buf cmd, num, ttl;
+    bool ok = true;
+    CSKey expire_ms;
+    switch (LOAD(&ent->type, ACQUIRE)) {
+        case ENT_STR: {
+            // Like GET, the value stays alive for our critical section.
+            const vstr *s = LOAD(&ent->val.s, ACQUIRE);
+            const vstr *argv[3] = {vstr_fmt(&cmd, "set"), key,
+                                   val_is_int(s) ? vstr_fmt(&num, "%" PRId64, val_int(s)) : s};
+            ok = ctx->emit(ctx->arg, 3, argv);
+            rw_rlock(&ent->lock);
+            expire_ms = ent->expire_ms;
+            rw_runlock(&ent->lock);
+            break;
+        }
+        case ENT_ZSET: {
+            const vstr *argv[4] = {vstr_fmt(&cmd, "zadd"), key, NULL, NULL};
+            vstr *name = NULL;
+            size_t cap = 0;
+            rw_rlock(&ent->lock);
+            for (SLNode *sn = ent->val.zs->sl.head->next[0]; sn && ok; sn = sn->next[0]) {
+                const ZNode *zn = container_of(sn, ZNode, tnode);
+                if (!name || zn->len > cap) {
+                    cap = next_pow2(zn->len | 15);
+                    name = realloc(name, sizeof(vstr) + cap);
+                }
+                name->len = (uint32_t) zn->len;
+                memcpy(name->dat, zn->name, zn->len);
+                argv[2] = vstr_fmt(&num, "%.17g", zn->score);
+                argv[3] = name;
+                ok = ctx->emit(ctx->arg, 4, argv);
+            }
+            expire_ms = ent->expire_ms;
+            rw_runlock(&ent->lock);
+            free(name);
+            break;
+        }
+        default:
+            return true;
+    }
+    if (ok && cskey_cmp(expire_ms, NOEXPIRE)) {
+        const vstr *argv[3] = {vstr_fmt(&cmd, "pexpireat"), key,
+                               vstr_fmt(&ttl, "%" PRId64, (int64_t) expire_ms.key + ctx->clock_off)};
+        ok = ctx->emit(ctx->arg, 3, argv);
+    }
+    return ok;
+}
+
+uint64_t kv_dump(KVStore *kv, const uint64_t cursor, const size_t count, const kv_emit_fn emit, void *arg) {
+    struct DumpCtx ctx = {emit, arg, (int64_t) get_unix_ms() - (int64_t) get_clock_ms()};
+    return chpm_scan(kv->store, cursor, count, dump_cb, &ctx, entry_eq);
+}
+
+// Publish a new `ent` of a bulk load with its TTL, false if the key exists.
+static bool restore_entry(KVStore *kv, Entry *ent, const int64_t deadline) {
+    const int64_t ttl = deadline - (int64_t) get_unix_ms();
+    // A cluster drops the key once the leader's DEL applies.
+    if (deadline >= 0 && ttl <= 0 && !kv->raft) {
+        entry_clean(ent);
+        smr_free(ent);
+        return true;
+    }
+    if (!chpm_add(kv->store, &ent->node, entry_eq)) {
+        entry_clean(ent);
+        smr_free(ent);
+        return false;
+    }
+    mem_add(kv, entry_total_mem(ent));
+    if (deadline >= 0) {
+        kv_set_ttl(kv, ent, MAX(ttl, 0));
+    }
+    return true;
+}
+
+bool kv_restore_str(KVStore *kv, const vstr *key, const vstr *val, const int64_t deadline) {
+    Entry *ent = entry_new(kv, key, val);
+    if (ent->type == ENT_INIT) {
+        ent->val.s = val_new(val);
+        ent->type = ENT_STR;
+    }
+    return restore_entry(kv, ent, deadline);
+}
+
+bool kv_restore_int(KVStore *kv, const vstr *key, const int64_t n, const int64_t deadline) {
+    Entry *ent = entry_new(kv, key, NULL);
+    ent->val.s = val_from_int(n);
+    ent->type = ENT_STR;
+    return restore_entry(kv, ent, deadline);
+}
+
+bool kv_restore_zset(KVStore *kv, const vstr *key, ZSet *zs, const int64_t deadline) {
+    Entry *ent = entry_new(kv, key, NULL);
+    ent->val.zs = zs;
+    ent->type = ENT_ZSET;
+    return restore_entry(kv, ent, deadline);
+}
+
+// pexpireat key unix_ms, a deadline already past deletes the key. In a
+// cluster it only expires, nodes apply it at different times.
+void do_pexpireat(KVStore *kv, RingBuf *out, vstr *kstr, const int64_t deadline) {
+    const int64_t ttl = deadline - (int64_t) get_unix_ms();
+    if (ttl <= 0 && kv->raft) {
+        do_pexpire(kv, out, kstr, 0);
+    } else if (ttl <= 0) {
+        do_del(kv, out, kstr);
+    } else {
+        do_pexpire(kv, out, kstr, ttl);
+    }
+}
+
+// bgrewriteaof
+void do_bgrewriteaof(KVStore *kv, RingBuf *out) {
+    if (!kv->aof) {
+        out_err(out, ERR_BAD_ARG, "no append-only log");
+    } else if (!aof_rewrite_start(kv->aof, kv)) {
+        out_err(out, ERR_BAD_ARG, "rewrite already in progress");
+    } else {
+        out_str(out, "rewrite started", 15);
+    }
+}
+
+// save, on this worker. It holds no references while it waits, the save
+// reports quiescent as it goes.
+void do_save(KVStore *kv, RingBuf *out) {
+    if (!kv->snap) {
+        out_err(out, ERR_BAD_ARG, "no snapshot file");
+        return;
+    }
+    smr_exit();
+    const int64_t n = snap_save(kv->snap, kv);
+    smr_enter();
+    if (n == SNAP_BUSY) {
+        out_err(out, ERR_BAD_ARG, "save already in progress");
+    } else if (n < 0) {
+        out_err(out, ERR_UNKNOWN, "save failed");
+    } else {
+        out_int(out, n);
+    }
+}
+
+// bgsave
+void do_bgsave(KVStore *kv, RingBuf *out) {
+    if (!kv->snap) {
+        out_err(out, ERR_BAD_ARG, "no snapshot file");
+    } else if (!snap_start(kv->snap, kv)) {
+        out_err(out, ERR_BAD_ARG, "save already in progress");
+    } else {
+        out_str(out, "save started", 12);
+    }
+}
+
+// stats
+void do_stats(KVStore *kv, RingBuf *out) {
+    uint64_t hits, misses;
+    smr_pool_stats(&hits, &misses);
+    out_arr(out, 24);
+    out_str(out, "keys", 4);
+    out_int(out, (int64_t) chpm_size(kv->store));
+    out_str(out, "inline_reqs", 11);
+    out_int(out, (int64_t) LOAD(&kv->n_inline, RELAXED));
+    out_str(out, "offload_reqs", 12);
+    out_int(out, (int64_t) LOAD(&kv->n_offload, RELAXED));
+    out_str(out, "recycle_hits", 12);
+    out_int(out, (int64_t) hits);
+    out_str(out, "recycle_misses", 14);
+    out_int(out, (int64_t) misses);
+    out_str(out, "used_memory", 11);
+    out_int(out, (int64_t) kv_used_memory(kv));
+    out_str(out, "maxmemory", 9);
+    out_int(out, (int64_t) kv->maxmemory);
+    out_str(out, "evicted_keys", 12);
+    out_int(out, (int64_t) LOAD(&kv->n_evicted, RELAXED));
+    out_str(out, "last_save", 9);
+    out_int(out, kv->snap ? (int64_t) snap_last_save(kv->snap) : 0);
+    out_str(out, "raft_leader", 11);
+    out_int(out, kv->raft ? raft_leader(kv->raft) : -1);
+    out_str(out, "raft_applied", 12);
+    out_int(out, kv->raft ? (int64_t) raft_applied(kv->raft) : 0);
+    out_str(out, "cluster_slots", 13);
+    out_int(out, kv->cluster ? (int64_t) cluster_owned(kv->cluster) : 0);
+}
+
+// cluster slots, as first, last & address per range of one node.
+void do_cluster_slots(KVStore *kv, RingBuf *out) {
+    Cluster *cl = kv->cluster;
+    if (!cl) {
+        out_err(out, ERR_BAD_ARG, "cluster disabled");
+        return;
+    }
+    RingBuf buf;
+    rb_init(&buf, 4096);
+    uint32_t n = 0;
+    for (uint32_t first = 0, last; first < CLUSTER_SLOTS; first = last + 1) {
+        const int owner = cluster_owner(cl, first);
+        for (last = first; last + 1 < CLUSTER_SLOTS && cluster_owner(cl, last + 1) == owner; last++)
+            ;
+        const char *addr = cluster_addr(cl, owner);
+        out_int(&buf, first);
+        out_int(&buf, last);
+        out_str(&buf, addr, strlen(addr));
+        n += 3;
+    }
+    out_arr(out, n);
+    out_buf(out, &buf);
+    rb_destroy(&buf);
+}
+
+// cluster migrate first last node
+void do_cluster_migrate(KVStore *kv, RingBuf *out, const int64_t first, const int64_t last, const int64_t node) {
+    const char *err = kv->cluster ? cluster_migrate(kv->cluster, first, last, node) : "cluster disabled";
+    if (err) {
+        out_err(out, ERR_BAD_ARG, err);
+    } else {
+        out_str(out, "migration started", 17);
+    }
+}
+
+// cluster setslot first last node, this worker holds no references while it
+// waits for requests on slots it gives away.
+void do_cluster_setslot(KVStore *kv, RingBuf *out, const int64_t first, const int64_t last, const int64_t node) {
+    const char *err = "cluster disabled";
+    if (kv->cluster) {
+        smr_exit();
+        smr_offline();
+        err = cluster_setslot(kv->cluster, first, last, node);
+        smr_online();
+        smr_enter();
+    }
+    if (err) {
+        out_err(out, ERR_BAD_ARG, err);
+    } else {
+        out_nil(out);
+    }
+}
+
+static void run_req(KVStore *kv, OwnedRequest *oreq, RingBuf *out) {
     switch (oreq->req.type) {
         case CMD_GET:
             return do_get(kv, out, oreq->req.key);
@@ -502,7 +1455,9 @@ void do_owned_req(KVStore *kv, OwnedRequest *oreq, RingBuf *out) {
         case CMD_DEL:
             return do_del(kv, out, oreq->req.key);
         case CMD_KEYS:
-            return do_keys(kv, out);
+            return do_keys(kv, out, oreq->req.args.val);
+        case CMD_SCAN:
+            return do_scan(kv, out, oreq->req.args.scan.cursor, oreq->req.args.scan.count, oreq->req.args.scan.match);
         case CMD_ZADD:
             return do_zadd(kv, out, oreq->req.key, oreq->req.args.zadd_arg.score, oreq->req.args.zadd_arg.name);
         case CMD_ZREM:
@@ -516,9 +1471,344 @@ void do_owned_req(KVStore *kv, OwnedRequest *oreq, RingBuf *out) {
             return do_pttl(kv, out, oreq->req.key);
         case CMD_PEXPIRE:
             return do_pexpire(kv, out, oreq->req.key, oreq->req.args.ttl);
+        case CMD_PEXPIREAT:
+            return do_pexpireat(kv, out, oreq->req.key, oreq->req.args.deadline);
+        case CMD_STATS:
+            return do_stats(kv, out);
+        case CMD_INCRBY:
+            return do_incrby(kv, out, oreq->req.key, oreq->req.args.delta);
+        case CMD_BGREWRITEAOF:
+            return do_bgrewriteaof(kv, out);
+        case CMD_SAVE:
+            return do_save(kv, out);
+        case CMD_BGSAVE:
+            return do_bgsave(kv, out);
+        case CMD_SYNC:
+            // Only `kv_dispatch` takes it, over a connection of its own.
+            return out_err(out, ERR_BAD_ARG, "sync needs a connection");
+        case CMD_CLUSTER_KEYSLOT:
+            return out_int(out, cluster_slot(oreq->req.key));
+        case CMD_CLUSTER_SLOTS:
+            return do_cluster_slots(kv, out);
+        case CMD_CLUSTER_MIGRATE:
+            return do_cluster_migrate(kv, out, oreq->req.args.slots.first, oreq->req.args.slots.last,
+                                      oreq->req.args.slots.node);
+        case CMD_CLUSTER_SETSLOT:
+            return do_cluster_setslot(kv, out, oreq->req.args.slots.first, oreq->req.args.slots.last,
+                                      oreq->req.args.slots.node);
+        case CMD_CLUSTER_IMPORT:
+            return out_err(out, ERR_BAD_ARG, "import needs a connection");
         case CMD_BAD:
             return out_err(out, ERR_BAD_ARG, oreq->req.args.err);
         case CMD_UNKNOWN:
             return out_err(out, ERR_UNKNOWN, "unknown command");
     }
 }
+
+// Reads of the keyspace, which a cluster serves from its leader only.
+static bool req_is_read(const enum cmd_type type) {
+    switch (type) {
+        case CMD_GET:
+        case CMD_KEYS:
+        case CMD_SCAN:
+        case CMD_ZSCORE:
+        case CMD_ZQUERY:
+        case CMD_PTTL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool req_is_write(const enum cmd_type type) {
+    switch (type) {
+        case CMD_SET:
+        case CMD_DEL:
+        case CMD_ZADD:
+        case CMD_ZREM:
+        case CMD_PEXPIRE:
+        case CMD_PEXPIREAT:
+        case CMD_INCRBY:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Commands on a key, which a sharded keyspace serves from the key's owner only.
+static bool req_is_keyed(const enum cmd_type type) {
+    return type != CMD_KEYS && type != CMD_SCAN && (req_is_read(type) || req_is_write(type));
+}
+
+// A write as the log & replicas record it, `argv` may point into `cmd` &
+// `num`.
+struct LogCmd {
+    uint32_t argc;
+    const vstr *const *argv;
+    const vstr *args[3];
+    struct vstr_buf cmd, num;
+};
+
+// A relative TTL would restart on replay, log the deadline instead.
+static void log_pexpire(struct LogCmd *lc, OwnedRequest *oreq) {
+    lc->args[0] = vstr_fmt(&lc->cmd, "pexpireat");
+    lc->args[1] = oreq->req.key;
+    lc->args[2] = vstr_fmt(&lc->num, "%" PRIu64, get_unix_ms() + (uint64_t) oreq->req.args.ttl);
+    lc->argc = 3;
+    lc->argv = lc->args;
+}
+
+static void log_set_int(struct LogCmd *lc, const vstr *key, const int64_t n) {
+    lc->args[0] = vstr_fmt(&lc->cmd, "set");
+    lc->args[1] = key;
+    lc->args[2] = vstr_fmt(&lc->num, "%" PRId64, n);
+    lc->argc = 3;
+    lc->argv = lc->args;
+}
+
+// Logged as the SET of the result, a rewrite may replay it twice.
+static void log_incrby(struct LogCmd *lc, OwnedRequest *oreq, RingBuf *out, const size_t reply) {
+    int64_t n = 0;
+    rb_peek(out, (uint8_t *) &n, 8, reply + 1);
+    log_set_int(lc, oreq->req.key, n);
+}
+
+// With a log or replicas attached, writes are recorded in the order they hit
+// each key: the key's stripe locks cover both. Writes that fail aren't.
+// Writes to slots moving to another node are streamed to it alike, under the
+// stripe `cluster_enter` holds.
+void kv_apply(KVStore *kv, OwnedRequest *oreq, RingBuf *out) {
+    AOF *aof = kv->aof;
+    Repl *repl = kv->repl;
+    const bool write = req_is_write(oreq->req.type);
+    Cluster *cl = write && kv->cluster && cluster_migrating(kv->cluster, oreq->req.key) ? kv->cluster : NULL;
+    if ((!aof && !repl && !cl) || !write) {
+        run_req(kv, oreq, out);
+        return;
+    }
+    if (aof && aof_failed(aof)) {
+        out_err(out, ERR_UNKNOWN, "log write failed, writes are refused");
+        return;
+    }
+    const size_t before = rb_size(out);
+    const uint32_t astripe = aof ? aof_stripe(oreq->req.key) : 0;
+    const uint32_t rstripe = repl ? repl_stripe(oreq->req.key) : 0;
+    if (aof)
+        aof_lock(aof, astripe);
+    if (repl) {
+        repl_lock(repl, rstripe);
+        t_rstripe = (int) rstripe;
+    }
+    run_req(kv, oreq, out);
+    uint8_t tag = TAG_ERR;
+    rb_peek(out, &tag, 1, before);
+    uint64_t gen = 0;
+    if (tag != TAG_ERR) {
+        struct LogCmd lc = {.argc = oreq->base.argc, .argv = (const vstr *const *) oreq->base.argv};
+        if (oreq->req.type == CMD_PEXPIRE && oreq->req.args.ttl >= 0) {
+            log_pexpire(&lc, oreq);
+        } else if (oreq->req.type == CMD_INCRBY) {
+            log_incrby(&lc, oreq, out, before);
+        }
+        if (aof)
+            gen = aof_append(aof, astripe, lc.argc, lc.argv);
+        if (repl)
+            repl_append(repl, rstripe, lc.argc, lc.argv);
+        if (cl)
+            cluster_append(cl, oreq->req.key, lc.argc, lc.argv);
+    }
+    if (repl) {
+        t_rstripe = -1;
+        repl_unlock(repl, rstripe);
+    }
+    if (!aof)
+        return;
+    aof_unlock(aof, astripe);
+    // Applied all the same, but not durable as the reply would claim.
+    if (gen && !aof_wait(aof, gen)) {
+        rb_truncate(out, before);
+        out_err(out, ERR_UNKNOWN, "log write failed");
+    }
+    if (aof_wants_rewrite(aof)) {
+        aof_rewrite_start(aof, kv);
+    }
+}
+
+// What `do_incrby` would make of the key as applied so far, false with the
+// error in `out`.
+static bool incr_result(KVStore *kv, OwnedRequest *oreq, RingBuf *out, int64_t *n) {
+    Entry key = {
+            .node.hcode = vstr_hash_rapid(oreq->req.key),
+            .val.key = oreq->req.key,
+            .flags = ENT_F_PROBE,
+    };
+    BNode *node = chpm_lookup(kv->store, &key.node, entry_eq);
+    *n = 0;
+    if (node) {
+        Entry *ent = container_of(node, Entry, node);
+        const int type = LOAD(&ent->type, ACQUIRE);
+        const vstr *old = type == ENT_STR ? LOAD(&ent->val.s, ACQUIRE) : NULL;
+        if (type == ENT_ZSET) {
+            out_err(out, ERR_BAD_TYP, "non string entry");
+            return false;
+        }
+        if (old && val_is_int(old)) {
+            *n = val_int(old);
+        } else if (old && !str2int_strict(old, n)) {
+            out_err(out, ERR_BAD_ARG, "value is not an integer");
+            return false;
+        }
+    }
+    if (__builtin_add_overflow(*n, oreq->req.args.delta, n)) {
+        out_err(out, ERR_BAD_ARG, "increment would overflow");
+        return false;
+    }
+    return true;
+}
+
+// A write going through the cluster, this worker holds no references while
+// it waits. Writes to a key enter the log in the order they hold its
+// stripe: an INCR waits there for the entries before it to apply & goes in
+// as the SET of its result, so nodes can't compute it apart.
+static void raft_write(KVStore *kv, OwnedRequest *oreq, RingBuf *out) {
+    Raft *raft = kv->raft;
+    const enum cmd_type type = oreq->req.type;
+    const uint32_t stripe = raft_stripe(oreq->req.key);
+    struct LogCmd lc = {.argc = oreq->base.argc, .argv = (const vstr *const *) oreq->base.argv};
+    if (type == CMD_PEXPIRE && oreq->req.args.ttl >= 0)
+        log_pexpire(&lc, oreq);
+    smr_exit();
+    smr_offline();
+    raft_lock(raft, stripe);
+    const char *err = type == CMD_INCRBY ? raft_settle(raft) : NULL;
+    smr_online();
+    smr_enter();
+    // Writes `kv_make_room` guards.
+    const bool grows = type == CMD_SET || type == CMD_INCRBY || type == CMD_ZADD;
+    int64_t n = 0;
+    if (err) {
+        out_err(out, ERR_BAD_ARG, err);
+        raft_unlock(raft, stripe);
+        return;
+    }
+    // Its error is in `out` already.
+    if (type == CMD_INCRBY && !incr_result(kv, oreq, out, &n)) {
+        raft_unlock(raft, stripe);
+        return;
+    }
+    if (grows && !raft_make_room(kv, stripe)) {
+        out_err(out, ERR_OOM, "out of memory");
+        raft_unlock(raft, stripe);
+        return;
+    }
+    if (type == CMD_INCRBY)
+        log_set_int(&lc, oreq->req.key, n);
+    const size_t before = rb_size(out);
+    smr_exit();
+    smr_offline();
+    err = raft_submit(raft, stripe, lc.argc, lc.argv, out);
+    smr_online();
+    smr_enter();
+    uint8_t tag = TAG_ERR;
+    rb_peek(out, &tag, 1, before);
+    if (err) {
+        out_err(out, ERR_BAD_ARG, err);
+    } else if (type == CMD_INCRBY && tag != TAG_ERR) {
+        // The SET's reply, the client asked for the number.
+        rb_truncate(out, before);
+        out_int(out, n);
+    }
+}
+
+// Commands on keys of a slot this node owns run while it can't move, the
+// others get redirected.
+static void cluster_req(KVStore *kv, OwnedRequest *oreq, RingBuf *out) {
+    const uint32_t slot = cluster_slot(oreq->req.key);
+    const bool write = req_is_write(oreq->req.type);
+    const char *moved = cluster_enter(kv->cluster, slot, write);
+    if (moved) {
+        out_err(out, ERR_BAD_ARG, moved);
+        return;
+    }
+    kv_apply(kv, oreq, out);
+    cluster_exit(kv->cluster, slot, write);
+}
+
+// With Raft, writes apply in log order once committed & reads wait for a
+// lease. Sharded, keys of other nodes are redirected. Everything else runs
+// here.
+void do_owned_req(KVStore *kv, OwnedRequest *oreq, RingBuf *out) {
+    if (kv->cluster && req_is_keyed(oreq->req.type)) {
+        cluster_req(kv, oreq, out);
+    } else if (!kv->raft) {
+        kv_apply(kv, oreq, out);
+    } else if (req_is_write(oreq->req.type)) {
+        raft_write(kv, oreq, out);
+    } else if (req_is_read(oreq->req.type)) {
+        smr_exit();
+        smr_offline();
+        const char *err = raft_read_barrier(kv->raft);
+        smr_online();
+        smr_enter();
+        if (err) {
+            out_err(out, ERR_BAD_ARG, err);
+        } else {
+            run_req(kv, oreq, out);
+        }
+    } else {
+        run_req(kv, oreq, out);
+    }
+}
+
+struct FlushCtx {
+    kv_key_fn drop;
+    void *arg;
+    vstr **keys;
+    size_t n, cap;
+    const vstr *last;
+};
+
+static bool flush_emit(void *arg, const uint32_t argc, const vstr *const *argv) {
+    struct FlushCtx *ctx = arg;
+    // ZADDs of a key come in a row.
+    if (ctx->last == argv[1])
+        return true;
+    ctx->last = argv[1];
+    if (ctx->drop && !ctx->drop(ctx->arg, argv[1]))
+        return true;
+    if (ctx->n == ctx->cap) {
+        ctx->cap = ctx->cap ? ctx->cap * 2 : 256;
+        ctx->keys = realloc(ctx->keys, ctx->cap * sizeof(vstr *));
+        assert(ctx->keys);
+    }
+    ctx->keys[ctx->n++] = vstr_new(argv[1]->dat, argv[1]->len);
+    return true;
+}
+
+void kv_flush(KVStore *kv, const kv_key_fn drop, void *arg) {
+    struct FlushCtx ctx = {.drop = drop, .arg = arg};
+    RingBuf out;
+    rb_init(&out, 64);
+    uint64_t cursor = 0;
+    do {
+        ctx.n = 0;
+        ctx.last = NULL;
+        cursor = kv_dump(kv, cursor, KV_FLUSH_BUCKETS, flush_emit, &ctx);
+        for (size_t i = 0; i < ctx.n; i++) {
+            OwnedRequest oreq = {0};
+            oreq.base.argc = 2;
+            oreq.base.argv = malloc(2 * sizeof(vstr *));
+            oreq.base.argv[0] = vstr_new_s("del");
+            oreq.base.argv[1] = ctx.keys[i];
+            simple2req(&oreq.base, &oreq.req);
+            rb_clear(&out);
+            smr_enter();
+            kv_apply(kv, &oreq, &out);
+            smr_exit();
+            owned_req_destroy(&oreq);
+        }
+        smr_quiescent();
+    } while (cursor);
+    free(ctx.keys);
+    rb_destroy(&out);
+}
@@ -0,0 +1,192 @@
+#include "lz.h"
+
+#include <string.h>
+
+#include "utils.h"
+
+#define LZ_MIN_MATCH 4
+// The format ends in literals: no match starts in the last 12 bytes or runs
+// into the last 5.
+#define LZ_MF_LIMIT 12
+#define LZ_LAST_LITERALS 5
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_LOG 13
+// Misses before the search skips ahead faster, incompressible input goes
+// through quickly.
+#define LZ_SKIP_TRIGGER 6
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint32_t lz_hash(const uint32_t v) { return (v * 2654435761u) >> (32 - LZ_HASH_LOG); }
+
+// Bytes `p` & `ref` have in common, up to `limit`.
+static inline const uint8_t *match_end(const uint8_t *p, const uint8_t *ref, const uint8_t *limit) {
+    while (p + 8 <= limit) {
+        const uint64_t x = read64(p) ^ read64(ref);
+        if (x)
+            // NOTE: Little endian
+            return p + (__builtin_ctzll(x) >> 3);
+        p += 8;
+        ref += 8;
+    }
+    while (p < limit && *p == *ref) {
+        p++;
+        ref++;
+    }
+    return p;
+}
+
+static inline uint8_t *put_len(uint8_t *op, size_t n) {
+    for (; n >= 255; n -= 255) {
+        *op++ = 255;
+    }
+    *op++ = (uint8_t) n;
+    return op;
+}
+
+static inline uint8_t *put_literals(uint8_t *op, uint8_t *token, const uint8_t *lit, const size_t n) {
+    *token = (uint8_t) (MIN(n, 15) << 4);
+    if (n >= 15)
+        op = put_len(op, n - 15);
+    memcpy(op, lit, n);
+    return op + n;
+}
+
+size_t lz_compress(const uint8_t *src, const size_t n, uint8_t *dst) {
+    const uint8_t *ip = src, *anchor = src, *end = src + n;
+    uint8_t *op = dst;
+    if (n > LZ_MF_LIMIT) {
+        // Positions of 4 byte prefixes, the stale ones fail the compare.
+        uint32_t table[1 << LZ_HASH_LOG] = {0};
+        const uint8_t *mf_limit = end - LZ_MF_LIMIT, *match_limit = end - LZ_LAST_LITERALS;
+        uint32_t misses = 1 << LZ_SKIP_TRIGGER;
+        while (ip < mf_limit) {
+            const uint32_t h = lz_hash(read32(ip));
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint32_t) (ip - src);
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != read32(ip)) {
+                ip += misses++ >> LZ_SKIP_TRIGGER;
+                continue;
+            }
+            misses = 1 << LZ_SKIP_TRIGGER;
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *mend = match_end(ip + LZ_MIN_MATCH, ref + LZ_MIN_MATCH, match_limit);
+            uint8_t *token = op++;
+            op = put_literals(op, token, anchor, (size_t) (ip - anchor));
+            const uint16_t off = (uint16_t) (ip - ref);
+            *op++ = (uint8_t) off;
+            *op++ = (uint8_t) (off >> 8);
+            const size_t mlen = (size_t) (mend - ip) - LZ_MIN_MATCH;
+            *token |= (uint8_t) MIN(mlen, 15);
+            if (mlen >= 15)
+                op = put_len(op, mlen - 15);
+            ip = anchor = mend;
+            if (ip < mf_limit)
+                table[lz_hash(read32(ip - 2))] = (uint32_t) (ip - 2 - src);
+        }
+    }
+    uint8_t *token = op++;
+    return (size_t) (put_literals(op, token, anchor, (size_t) (end - anchor)) - dst);
+}
+
+static inline bool get_len(const uint8_t **ip, const uint8_t *end, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip == end)
+            return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+bool lz_decompress(const uint8_t *src, const size_t n, uint8_t *dst, const size_t raw_len) {
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + raw_len;
+    while (ip < iend) {
+        const uint8_t token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && !get_len(&ip, iend, &lit))
+            return false;
+        if ((size_t) (iend - ip) < lit || (size_t) (oend - op) < lit)
+            return false;
+        // Short runs copy a fixed 16 bytes when both sides have room.
+        if (lit <= 16 && iend - ip >= 16 && oend - op >= 16) {
+            memcpy(op, ip, 16);
+        } else {
+            memcpy(op, ip, lit);
+        }
+        op += lit;
+        ip += lit;
+        // The last sequence has no match.
+        if (ip == iend)
+            break;
+        if (iend - ip < 2)
+            return false;
+        const size_t off = ip[0] | (size_t) ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && !get_len(&ip, iend, &mlen))
+            return false;
+        mlen += LZ_MIN_MATCH;
+        if (!off || off > (size_t) (op - dst) || (size_t) (oend - op) < mlen)
+            return false;
+        const uint8_t *ref = op - off;
+        if (off >= 8 && (size_t) (oend - op) >= mlen + 8) {
+            // 8 bytes at a time, each read is behind what's written so far.
+            for (size_t i = 0; i < mlen; i += 8) {
+                memcpy(op + i, ref + i, 8);
+            }
+        } else {
+            for (size_t i = 0; i < mlen; i++) {
+                op[i] = ref[i];
+            }
+        }
+        op += mlen;
+    }
+    return ip == iend && op == oend;
+}
+
+static inline uint32_t lz_sum(const uint8_t *p, const size_t n) { return (uint32_t) bytes_hash_rapid(p, n); }
+
+size_t lz_block_put(const uint8_t *src, const size_t n, uint8_t *dst, const bool compress) {
+    LZBlock b = {.raw_len = (uint32_t) n, .len = (uint32_t) n, .sum = lz_sum(src, n)};
+    if (compress) {
+        const size_t len = lz_compress(src, n, dst + LZ_BLOCK_HEAD);
+        if (len < n)
+            b.len = (uint32_t) len;
+    }
+    if (b.len == n)
+        memcpy(dst + LZ_BLOCK_HEAD, src, n);
+    memcpy(dst, &b, LZ_BLOCK_HEAD);
+    return LZ_BLOCK_HEAD + b.len;
+}
+
+bool lz_block_head(const uint8_t *head, LZBlock *b) {
+    memcpy(b, head, LZ_BLOCK_HEAD);
+    // Each byte of a match token covers at most 255 raw ones.
+    return b->len == b->raw_len || (b->len < b->raw_len && b->raw_len <= (uint64_t) b->len * 255);
+}
+
+const uint8_t *lz_block_get(const LZBlock *b, const uint8_t *payload, uint8_t *dst) {
+    const uint8_t *raw = payload;
+    if (b->len != b->raw_len) {
+        if (!lz_decompress(payload, b->len, dst, b->raw_len))
+            return NULL;
+        raw = dst;
+    }
+    return lz_sum(raw, b->raw_len) == b->sum ? raw : NULL;
+}
@@ -2,6 +2,7 @@
 #include "ringbuf.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <math.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -23,6 +24,13 @@ bool str2int(const vstr *str, int64_t *out) {
     return true;
 }
 
+bool str2int_strict(const vstr *str, int64_t *out) {
+    char *endptr = NULL;
+    errno = 0;
+    *out = strtoll(str->dat, &endptr, 10);
+    return str->len && endptr == str->dat + str->len && errno != ERANGE;
+}
+
 OwnedRequest *new_owned_req(OwnedRequest *oreq, RingBuf *rb, const size_t sz) {
     if (!oreq) {
         oreq = calloc(1, sizeof(OwnedRequest));
@@ -90,6 +98,69 @@ ssize_t parse_simple_req(RingBuf *rb, const size_t sz, simple_req *out) {
     return 0;
 }
 
+// cluster keyslot key, cluster slots, cluster migrate|setslot first last
+// node & cluster import first last
+static void parse_cluster(const simple_req *sreq, Request *req) {
+    const vstr *sub = sreq->argv[1];
+    if (sreq->argc == 3 && !strncmp("keyslot", sub->dat, 7)) {
+        req->type = CMD_CLUSTER_KEYSLOT;
+        req->key = sreq->argv[2];
+        return;
+    }
+    if (sreq->argc == 2 && !strncmp("slots", sub->dat, 5)) {
+        req->type = CMD_CLUSTER_SLOTS;
+        return;
+    }
+    if (sreq->argc == 5 && !strncmp("migrate", sub->dat, 7)) {
+        req->type = CMD_CLUSTER_MIGRATE;
+    } else if (sreq->argc == 5 && !strncmp("setslot", sub->dat, 7)) {
+        req->type = CMD_CLUSTER_SETSLOT;
+    } else if (sreq->argc == 4 && !strncmp("import", sub->dat, 6)) {
+        req->type = CMD_CLUSTER_IMPORT;
+        req->args.slots.node = -1;
+    } else {
+        req->type = CMD_UNKNOWN;
+        return;
+    }
+    if (!str2int_strict(sreq->argv[2], &req->args.slots.first) ||
+        !str2int_strict(sreq->argv[3], &req->args.slots.last) ||
+        (sreq->argc == 5 && !str2int_strict(sreq->argv[4], &req->args.slots.node))) {
+        req->type = CMD_BAD;
+        req->args.err = "expect i64";
+    }
+}
+
+// scan cursor [match pattern] [count n]
+static void parse_scan(const simple_req *sreq, Request *req) {
+    req->type = CMD_SCAN;
+    if (!str2int_strict(sreq->argv[1], &req->args.scan.cursor)) {
+        req->type = CMD_BAD;
+        req->args.err = "expect i64";
+        return;
+    }
+    for (uint32_t i = 2; i < sreq->argc; i += 2) {
+        const vstr *opt = sreq->argv[i];
+        if (i + 1 == sreq->argc) {
+            req->type = CMD_BAD;
+            req->args.err = "option without a value";
+            return;
+        }
+        if (opt->len == 5 && !strncmp("match", opt->dat, 5)) {
+            req->args.scan.match = sreq->argv[i + 1];
+        } else if (opt->len == 5 && !strncmp("count", opt->dat, 5)) {
+            if (!str2int_strict(sreq->argv[i + 1], &req->args.scan.count) || req->args.scan.count <= 0) {
+                req->type = CMD_BAD;
+                req->args.err = "expect a positive count";
+                return;
+            }
+        } else {
+            req->type = CMD_BAD;
+            req->args.err = "unknown scan option";
+            return;
+        }
+    }
+}
+
 void simple2req(const simple_req *sreq, Request *req) {
     bzero(req, sizeof(Request));
     if (sreq->argc == 2 && !strncmp("get", sreq->argv[0]->dat, 3)) {
@@ -105,9 +176,12 @@ void simple2req(const simple_req *sreq, Request *req) {
         // del key
         req->type = CMD_DEL;
         req->key = sreq->argv[1];
-    } else if (sreq->argc == 1 && !strncmp("keys", sreq->argv[0]->dat, 4)) {
-        // keys
+    } else if ((sreq->argc == 1 || sreq->argc == 2) && !strncmp("keys", sreq->argv[0]->dat, 4)) {
+        // keys [pattern]
         req->type = CMD_KEYS;
+        req->args.val = sreq->argc == 2 ? sreq->argv[1] : NULL;
+    } else if (sreq->argc >= 2 && !strncmp("scan", sreq->argv[0]->dat, 4)) {
+        parse_scan(sreq, req);
     } else if (sreq->argc == 4 && !strncmp("zadd", sreq->argv[0]->dat, 4)) {
         // zadd key score name
         double score;
@@ -154,6 +228,17 @@ void simple2req(const simple_req *sreq, Request *req) {
         // pttl key
         req->type = CMD_PTTL;
         req->key = sreq->argv[1];
+    } else if (sreq->argc == 3 && !strncmp("pexpireat", sreq->argv[0]->dat, 9)) {
+        // pexpireat key unix_ms
+        int64_t deadline;
+        if (!str2int_strict(sreq->argv[2], &deadline)) {
+            req->type = CMD_BAD;
+            req->args.err = "expect i64";
+            return;
+        }
+        req->type = CMD_PEXPIREAT;
+        req->key = sreq->argv[1];
+        req->args.deadline = deadline;
     } else if (sreq->argc == 3 && !strncmp("pexpire", sreq->argv[0]->dat, 7)) {
         // pexpire key ttl
         int64_t ttl;
@@ -165,6 +250,45 @@ void simple2req(const simple_req *sreq, Request *req) {
         req->type = CMD_PEXPIRE;
         req->key = sreq->argv[1];
         req->args.ttl = ttl;
+    } else if (sreq->argc == 1 && !strncmp("bgrewriteaof", sreq->argv[0]->dat, 12)) {
+        // bgrewriteaof
+        req->type = CMD_BGREWRITEAOF;
+    } else if (sreq->argc == 1 && !strncmp("bgsave", sreq->argv[0]->dat, 6)) {
+        // bgsave
+        req->type = CMD_BGSAVE;
+    } else if (sreq->argc == 1 && !strncmp("save", sreq->argv[0]->dat, 4)) {
+        // save
+        req->type = CMD_SAVE;
+    } else if (sreq->argc == 1 && !strncmp("sync", sreq->argv[0]->dat, 4)) {
+        // sync
+        req->type = CMD_SYNC;
+    } else if (sreq->argc == 1 && !strncmp("stats", sreq->argv[0]->dat, 5)) {
+        // stats
+        req->type = CMD_STATS;
+    } else if (sreq->argc == 2 && !strncmp("incr", sreq->argv[0]->dat, 4)) {
+        // incr key
+        req->type = CMD_INCRBY;
+        req->key = sreq->argv[1];
+        req->args.delta = 1;
+    } else if (sreq->argc == 2 && !strncmp("decr", sreq->argv[0]->dat, 4)) {
+        // decr key
+        req->type = CMD_INCRBY;
+        req->key = sreq->argv[1];
+        req->args.delta = -1;
+    } else if (sreq->argc == 3 &&
+               (!strncmp("incrby", sreq->argv[0]->dat, 6) || !strncmp("decrby", sreq->argv[0]->dat, 6))) {
+        // incrby key delta, decrby key delta
+        int64_t delta;
+        if (!str2int_strict(sreq->argv[2], &delta) || (sreq->argv[0]->dat[0] == 'd' && delta == INT64_MIN)) {
+            req->type = CMD_BAD;
+            req->args.err = "expect i64";
+            return;
+        }
+        req->type = CMD_INCRBY;
+        req->key = sreq->argv[1];
+        req->args.delta = sreq->argv[0]->dat[0] == 'd' ? -delta : delta;
+    } else if (sreq->argc >= 2 && !strncmp("cluster", sreq->argv[0]->dat, 7)) {
+        parse_cluster(sreq, req);
     } else {
         req->type = CMD_UNKNOWN;
     }
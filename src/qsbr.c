@@ -6,29 +6,113 @@
 #include <stdatomic.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 
-#include "cqueue.h"
 #include "utils.h"
 
-struct QSBR {
+struct Node;
+
+// Size classes of recycled nodes (header included), every `POOL_GRAIN` bytes
+// up to `POOL_GRAIN * POOL_CLASSES`. Bigger ones go straight back to malloc.
+#define POOL_GRAIN 64
+#define POOL_CLASSES 16
+#define POOL_NONE UINT16_MAX
+// Nodes a thread keeps per class before handing `POOL_BATCH` to the depot.
+#define POOL_LOCAL_MAX 1024
+#define POOL_BATCH 128
+// Batches the depot keeps per class, the rest are freed.
+#define POOL_DEPOT_MAX 512
+// Allocations a thread counts locally before folding them into `gc`.
+#define POOL_STATS_FOLD 256
+
+// Shared overflow of the per-thread pools, a stack of whole batches per class
+// so the lock is only held for a pointer swap.
+struct Depot {
+    pthread_mutex_t lock;
+    struct Node *top[POOL_CLASSES];
+    // Written under `lock`, peeked without it to skip an empty depot.
+    _Atomic(u32) n[POOL_CLASSES];
+};
+
+#define QSBR_WORDS (QSBR_MAX_THREADS / 64)
+#define QSBR_ALL_WORDS (QSBR_WORDS == 64 ? ~0ULL : (1ULL << QSBR_WORDS) - 1)
+static_assert(QSBR_MAX_THREADS % 64 == 0 && QSBR_WORDS <= 64, "QSBR_MAX_THREADS");
+
+// 64 thread slots, done with the current grace period once `quiescent`
+// equals `active`.
+struct Word {
     alignas(64) atomic_u64 quiescent;
-    alignas(64) atomic_u64 active;
+    // Registered threads, only written under `gc.lock`.
+    atomic_u64 active;
+    // Offline threads, set & cleared by the threads themselves without the
+    // lock. They count as quiescent: each flip sets their `quiescent` bits.
+    atomic_u64 offline;
+    // Registered threads, only touched under `gc.lock`.
+    u64 used;
+};
+
+struct QSBR {
+    struct Word words[QSBR_WORDS];
+    // Words seen done since the last flip. Only a hint: it may miss a word,
+    // whose next report sets it again, or keep one a thread came online in,
+    // so the flipper rechecks every word.
+    alignas(64) atomic_u64 done;
+    // Completed grace periods.
+    alignas(64) atomic_u64 epoch;
     alignas(64) pthread_mutex_t lock;
-    cqueue *curr, *prev;
+    // Limbo lists left by unregistered threads, only touched under `lock`.
+    struct Limbo *orphans;
+    struct Depot depot;
+    // Recycle counters, folded in from the threads on quiescent.
+    alignas(64) atomic_u64 hits, misses;
 };
 typedef struct QSBR QSBR;
 
 struct Node {
-    void (*cb)(void *arg); // callback run before free
+    union {
+        void (*cb)(void *arg); // callback run before free
+        struct Node *batch; // Next batch in the depot, once reclaimed
+    };
     alignas(8) atomic_bool retired; // Double retire guard
-    alignas(16) cnode qnode; // MPSC queue node
+    uint16_t cls; // Size class, `POOL_NONE` if not recycled
+    uint32_t nbatch; // Nodes in the batch headed by this one
+    alignas(16) struct Node *next; // Limbo / free list link
 };
 typedef struct Node Node;
 
+// Nodes a thread retired while its last observed epoch was `epoch`.
+//
+// The thread's report preceded the grace period that ends `epoch`, so it
+// reports again after the retire before `epoch + 2` can end, and every
+// thread reports after that before `epoch + 3` ends: then nobody can still
+// hold a reference.
+#define LIMBO_GRACE 3
+#define LIMBO_SLOTS 4
+struct Limbo {
+    Node *head, *tail;
+    u64 epoch;
+    struct Limbo *next;
+};
+typedef struct Limbo Limbo;
+
+// Reclaimed nodes of this thread, by size class.
+struct Pool {
+    Node *head[POOL_CLASSES];
+    u32 n[POOL_CLASSES];
+    u64 hits, misses;
+};
+typedef struct Pool Pool;
+
 static QSBR gc;
 static __thread int TID = -1;
+static __thread bool t_online;
+// Epoch observed on the last `qsbr_quiescent`, tags new retires.
+static __thread u64 t_epoch;
+static __thread Limbo t_limbo[LIMBO_SLOTS];
+static __thread Pool t_pool;
 
 static inline Node *ptr_to_node(void *ptr) {
     if (!ptr)
@@ -42,52 +126,350 @@ static inline void *node_to_ptr(Node *node) {
     return (void *) ((char *) node + sizeof(Node));
 }
 
-static void process_queue(cqueue *q) {
-    if (!q)
+static inline size_t class_bytes(const uint16_t cls) { return (size_t) (cls + 1) * POOL_GRAIN; }
+
+static void free_list(Node *node) {
+    while (node) {
+        Node *next = node->next;
+        free(node);
+        node = next;
+    }
+}
+
+// Push a chain of `n` nodes as one batch, freed if the depot is full.
+static void depot_push(const uint16_t cls, Node *head, const u32 n) {
+    head->nbatch = n;
+    pthread_mutex_lock(&gc.depot.lock);
+    const u32 n_batches = LOAD(&gc.depot.n[cls], RELAXED);
+    const bool full = n_batches >= POOL_DEPOT_MAX;
+    if (!full) {
+        head->batch = gc.depot.top[cls];
+        gc.depot.top[cls] = head;
+        STORE(&gc.depot.n[cls], n_batches + 1, RELAXED);
+    }
+    pthread_mutex_unlock(&gc.depot.lock);
+    if (full)
+        free_list(head);
+}
+
+static Node *depot_pop(const uint16_t cls) {
+    if (!LOAD(&gc.depot.n[cls], RELAXED))
+        return NULL;
+    pthread_mutex_lock(&gc.depot.lock);
+    Node *head = gc.depot.top[cls];
+    if (head) {
+        gc.depot.top[cls] = head->batch;
+        STORE(&gc.depot.n[cls], LOAD(&gc.depot.n[cls], RELAXED) - 1, RELAXED);
+    }
+    pthread_mutex_unlock(&gc.depot.lock);
+    return head;
+}
+
+static void pool_put(Node *node) {
+    Pool *p = &t_pool;
+    const uint16_t cls = node->cls;
+    node->next = p->head[cls];
+    p->head[cls] = node;
+    if (++p->n[cls] <= POOL_LOCAL_MAX)
         return;
-    cnode *qnode = NULL;
-    while ((qnode = cq_pop(q))) {
-        Node *node = container_of(qnode, Node, qnode);
+    // Hand the most recent `POOL_BATCH` to the depot, cache-hot so the walk
+    // is cheap.
+    Node *head = p->head[cls], *tail = head;
+    for (u32 i = 1; i < POOL_BATCH; i++) {
+        tail = tail->next;
+    }
+    p->head[cls] = tail->next;
+    p->n[cls] -= POOL_BATCH;
+    tail->next = NULL;
+    depot_push(cls, head, POOL_BATCH);
+}
+
+static Node *pool_get(const uint16_t cls) {
+    Pool *p = &t_pool;
+    if (!p->head[cls]) {
+        Node *head = depot_pop(cls);
+        if (!head)
+            return NULL;
+        p->head[cls] = head;
+        p->n[cls] = head->nbatch;
+    }
+    Node *node = p->head[cls];
+    p->head[cls] = node->next;
+    p->n[cls]--;
+    return node;
+}
+
+// Hand every pooled node of this thread to the depot.
+static void pool_flush() {
+    Pool *p = &t_pool;
+    for (int cls = 0; cls < POOL_CLASSES; cls++) {
+        if (p->head[cls]) {
+            depot_push(cls, p->head[cls], p->n[cls]);
+        }
+        p->head[cls] = NULL;
+        p->n[cls] = 0;
+    }
+}
+
+static void pool_fold_stats() {
+    Pool *p = &t_pool;
+    if (p->hits) {
+        FAA(&gc.hits, p->hits, RELAXED);
+        p->hits = 0;
+    }
+    if (p->misses) {
+        FAA(&gc.misses, p->misses, RELAXED);
+        p->misses = 0;
+    }
+}
+
+static void process_list(Node *node) {
+    while (node) {
+        Node *next = node->next;
         if (node->cb) {
             node->cb(node_to_ptr(node));
         }
-        free(node);
+        if (node->cls != POOL_NONE) {
+            pool_put(node);
+        } else {
+            free(node);
+        }
+        node = next;
+    }
+}
+
+static void limbo_reclaim(Limbo *l) {
+    process_list(l->head);
+    l->head = l->tail = NULL;
+}
+
+// Reclaim this thread's limbo lists whose grace period has passed.
+static void limbo_collect(const u64 epoch) {
+    for (int i = 0; i < LIMBO_SLOTS; i++) {
+        Limbo *l = &t_limbo[i];
+        if (l->head && l->epoch + LIMBO_GRACE <= epoch) {
+            limbo_reclaim(l);
+        }
     }
 }
 
+// Under `gc.lock`.
+static void orphans_collect(const u64 epoch, const bool all) {
+    for (Limbo **pl = &gc.orphans; *pl;) {
+        Limbo *l = *pl;
+        if (all || l->epoch + LIMBO_GRACE <= epoch) {
+            *pl = l->next;
+            process_list(l->head);
+            free(l);
+        } else {
+            pl = &l->next;
+        }
+    }
+}
+
+// Hand this thread's pending limbo lists over to whoever completes their
+// grace period.
+static void limbo_orphan() {
+    pthread_mutex_lock(&gc.lock);
+    for (int i = 0; i < LIMBO_SLOTS; i++) {
+        Limbo *l = &t_limbo[i];
+        if (!l->head)
+            continue;
+        Limbo *o = malloc(sizeof(Limbo));
+        *o = *l;
+        o->next = gc.orphans;
+        gc.orphans = o;
+        l->head = l->tail = NULL;
+    }
+    pthread_mutex_unlock(&gc.lock);
+}
+
 void qsbr_init(size_t back_logs) {
-    gc.quiescent = 0;
-    gc.active = 0;
+    (void) back_logs;
+    for (int w = 0; w < QSBR_WORDS; w++) {
+        atomic_init(&gc.words[w].quiescent, 0);
+        atomic_init(&gc.words[w].active, 0);
+        atomic_init(&gc.words[w].offline, 0);
+        gc.words[w].used = 0;
+    }
+    atomic_init(&gc.done, QSBR_ALL_WORDS);
+    atomic_init(&gc.epoch, 0);
     pthread_mutex_init(&gc.lock, NULL);
-    gc.curr = cq_init(NULL, back_logs);
-    gc.prev = cq_init(NULL, back_logs);
+    gc.orphans = NULL;
+    pthread_mutex_init(&gc.depot.lock, NULL);
+    for (int cls = 0; cls < POOL_CLASSES; cls++) {
+        gc.depot.top[cls] = NULL;
+        atomic_init(&gc.depot.n[cls], 0);
+    }
+    atomic_init(&gc.hits, 0);
+    atomic_init(&gc.misses, 0);
     atomic_thread_fence(RELEASE);
 }
 
+// Under `gc.lock`. End the current grace period if every word is done.
+static void try_flip() {
+    bool all = true;
+    for (int w = 0; w < QSBR_WORDS; w++) {
+        const u64 active = LOAD(&gc.words[w].active, ACQUIRE);
+        if (LOAD(&gc.words[w].quiescent, SEQ_CST) != active) {
+            FAAND(&gc.done, ~(1ULL << w), SEQ_CST);
+            // A report between the check & the clear would be lost, and the
+            // last one of an offline thread isn't repeated.
+            if (LOAD(&gc.words[w].quiescent, SEQ_CST) == active) {
+                FAOR(&gc.done, 1ULL << w, RELAXED);
+            } else {
+                all = false;
+            }
+        }
+    }
+    if (!all)
+        return;
+    // Bump before clearing, a report that sees the clear sees the new epoch
+    // too.
+    const u64 epoch = FAA(&gc.epoch, 1, SEQ_CST) + 1;
+    u64 idle = 0;
+    for (int w = 0; w < QSBR_WORDS; w++) {
+        // Offline threads report for the new period right away. One that goes
+        // offline meanwhile reports itself after the clear, one that comes
+        // online meanwhile may skip this period, but it loads the new epoch,
+        // so its retires & reads are covered by the later ones.
+        STORE(&gc.words[w].quiescent, 0, SEQ_CST);
+        const u64 offline = LOAD(&gc.words[w].offline, SEQ_CST);
+        if (offline)
+            FAOR(&gc.words[w].quiescent, offline, SEQ_CST);
+        if (offline == LOAD(&gc.words[w].active, RELAXED))
+            idle |= 1ULL << w;
+    }
+    STORE(&gc.done, idle, RELEASE);
+    orphans_collect(epoch, false);
+}
+
+enum flip_mode { FLIP_TRY, FLIP_WAIT, FLIP_LOCKED };
+
+// Mark word `w` done & flip if it was the last one. `FLIP_TRY` leaves it to
+// a later report if the lock is busy.
+static void word_done(const int w, const enum flip_mode mode) {
+    const u64 wbit = 1ULL << w;
+    u64 done = LOAD(&gc.done, ACQUIRE);
+    if (!(done & wbit))
+        done = FAOR(&gc.done, wbit, SEQ_CST) | wbit;
+    if (done != QSBR_ALL_WORDS)
+        return;
+    if (mode == FLIP_LOCKED) {
+        try_flip();
+    } else if (mode == FLIP_WAIT ? !pthread_mutex_lock(&gc.lock) : !pthread_mutex_trylock(&gc.lock)) {
+        try_flip();
+        pthread_mutex_unlock(&gc.lock);
+    }
+}
+
+// Report the calling thread quiescent for the current grace period.
+static void report(const enum flip_mode mode) {
+    const int w = TID / 64;
+    const u64 loc = 1ULL << (TID % 64);
+    const u64 q = FAOR(&gc.words[w].quiescent, loc, SEQ_CST);
+    if ((q | loc) == LOAD(&gc.words[w].active, ACQUIRE))
+        word_done(w, mode);
+}
+
+// The slot rejoins with its quiescent bit clear, so the grace periods after
+// the epoch it loads wait for it.
+static void slot_online() {
+    const int w = TID / 64;
+    const u64 loc = 1ULL << (TID % 64);
+    FAAND(&gc.words[w].offline, ~loc, SEQ_CST);
+    FAAND(&gc.words[w].quiescent, ~loc, SEQ_CST);
+    t_epoch = LOAD(&gc.epoch, SEQ_CST);
+    t_online = true;
+}
+
+// Offline threads stay quiescent until they come back, see `try_flip`. The
+// last report of a word waits for the lock, there may be no later one.
+static void slot_offline() {
+    FAOR(&gc.words[TID / 64].offline, 1ULL << (TID % 64), SEQ_CST);
+    t_online = false;
+    report(FLIP_WAIT);
+}
+
 void qsbr_reg() {
     if (TID == -1) {
-        u64 lactive = LOAD(&gc.active, ACQUIRE);
-        int slot;
-        do {
-            slot = ffsll(~(i64) lactive) - 1;
-            assert(slot != -1 && "Too many threads");
-        } while (!CMPXCHG(&gc.active, &lactive, lactive | (1ULL << slot), RELEASE, ACQUIRE));
-        TID = slot;
+        pthread_mutex_lock(&gc.lock);
+        for (int w = 0; w < QSBR_WORDS; w++) {
+            if (~gc.words[w].used) {
+                const int slot = ffsll(~(i64) gc.words[w].used) - 1;
+                gc.words[w].used |= 1ULL << slot;
+                TID = w * 64 + slot;
+                break;
+            }
+        }
+        assert(TID != -1 && "Too many threads");
+        const int w = TID / 64;
+        FAOR(&gc.words[w].active, 1ULL << (TID % 64), RELEASE);
+        FAAND(&gc.done, ~(1ULL << w), RELAXED);
+        slot_online();
+        pthread_mutex_unlock(&gc.lock);
     }
 }
 
 void qsbr_unreg() {
     if (TID != -1) {
-        FAAND(&gc.active, ~(1ULL << TID), ACQ_REL);
+        limbo_orphan();
+        pool_flush();
+        pool_fold_stats();
+        const int w = TID / 64;
+        const u64 loc = 1ULL << (TID % 64);
+        pthread_mutex_lock(&gc.lock);
+        // Drop a stale quiescent bit too, or `quiescent` never equals `active`
+        // again and no grace period completes.
+        FAAND(&gc.words[w].offline, ~loc, SEQ_CST);
+        FAAND(&gc.words[w].quiescent, ~loc, SEQ_CST);
+        const u64 active = FAAND(&gc.words[w].active, ~loc, SEQ_CST) & ~loc;
+        gc.words[w].used &= ~loc;
+        t_online = false;
+        if (LOAD(&gc.words[w].quiescent, SEQ_CST) == active)
+            word_done(w, FLIP_LOCKED);
+        pthread_mutex_unlock(&gc.lock);
         TID = -1;
     }
 }
 
+void qsbr_offline() {
+    assert(TID != -1 && "Thread not registered");
+    if (!t_online)
+        return;
+    slot_offline();
+    limbo_collect(LOAD(&gc.epoch, ACQUIRE));
+}
+
+void qsbr_online() {
+    assert(TID != -1 && "Thread not registered");
+    if (t_online)
+        return;
+    slot_online();
+    limbo_collect(t_epoch);
+}
+
 void *qsbr_calloc(size_t nmemb, size_t size) {
     assert(TID != -1 && "Thread not registered");
-    Node *node = calloc(1, sizeof(Node) + nmemb * size);
-    if (!node)
-        return NULL;
+    const size_t bytes = sizeof(Node) + nmemb * size;
+    const size_t cls = (bytes - 1) / POOL_GRAIN;
+    Node *node;
+    if (cls < POOL_CLASSES) {
+        if ((node = pool_get(cls))) {
+            memset(node, 0, class_bytes(cls));
+            t_pool.hits++;
+        } else {
+            node = calloc(1, class_bytes(cls));
+            t_pool.misses++;
+        }
+        if (!node)
+            return NULL;
+        node->cls = cls;
+    } else {
+        if (!(node = calloc(1, bytes)))
+            return NULL;
+        node->cls = POOL_NONE;
+    }
 
     STORE(&node->retired, false, RELAXED);
     return node_to_ptr(node);
@@ -106,40 +488,68 @@ void qsbr_retire(void *ptr, void (*cb)(void *)) {
     }
 
     node->cb = cb;
-    cq_put(gc.curr, &node->qnode);
+    node->next = NULL;
+    Limbo *l = &t_limbo[t_epoch % LIMBO_SLOTS];
+    if (l->head && l->epoch != t_epoch) {
+        // LIMBO_SLOTS epochs old, long safe
+        limbo_reclaim(l);
+    }
+    l->epoch = t_epoch;
+    if (l->tail) {
+        l->tail->next = node;
+    } else {
+        l->head = node;
+    }
+    l->tail = node;
+}
+
+void qsbr_free(void *ptr) {
+    Node *node = ptr_to_node(ptr);
+    if (!node)
+        return;
+    if (node->cls != POOL_NONE && TID != -1) {
+        pool_put(node);
+    } else {
+        free(node);
+    }
 }
 
 void qsbr_quiescent() {
-    uint64_t loc = 1ULL << TID;
-    uint64_t q = FAOR(&gc.quiescent, loc, ACQ_REL);
-    uint64_t active = LOAD(&gc.active, ACQUIRE);
-    if ((q | loc) == active) {
-        if (!pthread_mutex_trylock(&gc.lock)) {
-            q = LOAD(&gc.quiescent, ACQUIRE);
-            active = LOAD(&gc.active, ACQUIRE);
-            if (q == active) {
-                // Drain prev
-                process_queue(gc.prev);
-                // Safe, as threads putting to curr will use the same pointer,
-                // but we treat unfinished put as previous interval.
-                cqueue *oprev = gc.prev;
-                gc.prev = gc.curr;
-                gc.curr = oprev;
-                STORE(&gc.quiescent, 0, RELEASE);
-            }
-            pthread_mutex_unlock(&gc.lock);
-        }
+    assert(t_online && "Thread offline");
+    if (t_pool.hits + t_pool.misses >= POOL_STATS_FOLD) {
+        pool_fold_stats();
     }
+    report(FLIP_TRY);
+    // Loaded after the report, see `Limbo`.
+    t_epoch = LOAD(&gc.epoch, ACQUIRE);
+    limbo_collect(t_epoch);
 }
 // NOTE: Assumes exclusive access on destroy
 void qsbr_destroy() {
-    process_queue(gc.prev);
-    process_queue(gc.curr);
-    cq_destroy(gc.prev);
-    cq_destroy(gc.curr);
-    gc.prev = NULL;
-    gc.curr = NULL;
+    for (int i = 0; i < LIMBO_SLOTS; i++) {
+        limbo_reclaim(&t_limbo[i]);
+    }
+    orphans_collect(0, true);
+    // Nodes pooled by threads that are still registered are lost.
+    pool_flush();
+    for (int cls = 0; cls < POOL_CLASSES; cls++) {
+        for (Node *head; (head = depot_pop(cls));) {
+            free_list(head);
+        }
+    }
+    pthread_mutex_destroy(&gc.depot.lock);
     pthread_mutex_destroy(&gc.lock);
-    atomic_init(&gc.quiescent, 0);
-    atomic_init(&gc.active, 0);
+    for (int w = 0; w < QSBR_WORDS; w++) {
+        atomic_init(&gc.words[w].quiescent, 0);
+        atomic_init(&gc.words[w].active, 0);
+        atomic_init(&gc.words[w].offline, 0);
+        gc.words[w].used = 0;
+    }
+    atomic_init(&gc.done, QSBR_ALL_WORDS);
+}
+
+void qsbr_pool_stats(uint64_t *hits, uint64_t *misses) {
+    pool_fold_stats();
+    *hits = LOAD(&gc.hits, RELAXED);
+    *misses = LOAD(&gc.misses, RELAXED);
 }
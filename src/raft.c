@@ -0,0 +1,1557 @@
+#include "raft.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kvstore.h"
+#include "list.h"
+#include "parse.h"
+#include "serialize.h"
+#include "smr.h"
+#include "snapshot.h"
+#include "utils.h"
+
+#define RAFT_LOG_MAGIC "KVRAFTL\1"
+// The magic, the index of the first entry & the term of the one before it.
+#define RAFT_LOG_HEAD 24
+// Election timer resolution.
+#define RAFT_TICK_MS 10
+// Entries the applier takes per round, reporting quiescent in between.
+#define RAFT_APPLY_BATCH 1024
+#define RAFT_SNAP_CHUNK (1u << 20)
+// Anything longer is garbage, not a message.
+#define RAFT_MAX_MSG (128u << 20)
+
+enum RaftRole {
+    ROLE_FOLLOWER,
+    ROLE_CANDIDATE,
+    ROLE_LEADER,
+};
+
+// Each request is answered by the next type on the connection it came on.
+enum RaftMsgType {
+    MSG_VOTE = 1,
+    MSG_VOTE_RESP,
+    MSG_APPEND,
+    MSG_APPEND_RESP,
+    MSG_SNAP,
+    MSG_SNAP_RESP,
+};
+
+// Fixed part of every message, `len` counts the bytes after it.
+struct RaftMsg {
+    uint32_t len, type;
+    uint64_t term;
+    uint32_t from;
+    // MSG_APPEND: entries following. MSG_SNAP: whether it's the last chunk.
+    // Replies: whether granted.
+    uint32_t n;
+    // MSG_VOTE: our last entry & its term. MSG_APPEND: the entry before the
+    // first sent & its term. MSG_SNAP: the last entry in the snapshot & its
+    // term. MSG_APPEND_RESP: the last entry matching, or the last we have on
+    // a rejection.
+    uint64_t index, index_term;
+    // MSG_APPEND: the leader's commit index. MSG_SNAP(_RESP): chunk offset,
+    // then the offset acked.
+    uint64_t commit;
+    // MSG_APPEND(_RESP): the leader's clock as it sent, echoed for its lease.
+    uint64_t sent_ms;
+};
+typedef struct RaftMsg RaftMsg;
+
+// Ahead of each entry in the log file & in MSG_APPEND.
+struct RaftEntryHead {
+    uint32_t len, sum;
+    uint64_t term;
+};
+typedef struct RaftEntryHead RaftEntryHead;
+
+struct RaftEntry {
+    uint64_t term;
+    // Of its head in the log file.
+    uint64_t off;
+    uint32_t len, sum;
+    // The record past its length (see `aof.h`), NULL for the no-op a leader
+    // starts its term with.
+    uint8_t *rec;
+};
+typedef struct RaftEntry RaftEntry;
+
+// A write waiting to be applied.
+struct RaftWait {
+    DList node;
+    uint64_t index;
+    RingBuf *out;
+    const char *err;
+    bool done;
+};
+typedef struct RaftWait RaftWait;
+
+// Writes to the keys of a stripe enter the log in the order they hold it.
+struct RaftStripe {
+    alignas(64) pthread_mutex_t lock;
+};
+typedef struct RaftStripe RaftStripe;
+
+// Link to another node, we send requests & it replies.
+struct RaftPeer {
+    Raft *raft;
+    char *host;
+    int port;
+    pthread_t sender, reader;
+    // Below is under `raft->mu`. -1 while disconnected, `down` once the
+    // link broke.
+    int fd;
+    bool down;
+    // Next entry to send, last one known to match & AppendEntries unanswered.
+    uint64_t next, match;
+    uint32_t inflight;
+    // Term we asked for its vote in, commit index last sent & when.
+    uint64_t vote_term, sent_commit, sent_ms;
+    // Send time of the last round it acked in this term.
+    uint64_t ack_ms;
+    // Snapshot being sent: the file, its last entry & term, bytes acked.
+    int snap_fd;
+    uint64_t snap_index, snap_term, snap_off, snap_size;
+};
+typedef struct RaftPeer RaftPeer;
+
+// Link from another node, it sends requests & we reply.
+struct RaftConn {
+    DList node;
+    Raft *raft;
+    int fd;
+    pthread_t thread;
+    atomic_bool done;
+    // Snapshot being received.
+    int snap_fd;
+    uint64_t snap_index;
+};
+typedef struct RaftConn RaftConn;
+
+struct Raft {
+    KVStore *kv;
+    int id, n;
+    char *dir;
+    // Errors sending clients of a follower to the leader.
+    char *redirect[RAFT_MAX_NODES];
+    int lfd;
+    pthread_t main, applier, acceptor;
+    // Everything below is under `mu`. `main` waits on `disk_wake` for
+    // entries to write, peer senders on `peer_wake` for things to send, the
+    // applier on `apply_wake` for commits. `done` signals fsyncs & applies.
+    pthread_mutex_t mu;
+    pthread_cond_t disk_wake, peer_wake, apply_wake, done;
+    bool stop;
+    // In `meta`.
+    uint64_t term;
+    int voted_for;
+    int role, leader, votes;
+    uint64_t election_at, heard_ms;
+    // Entries from `base` on, the snapshot ends at `base - 1` of `base_term`.
+    RaftEntry *log;
+    size_t nlog, log_cap;
+    uint64_t base, base_term;
+    int log_fd;
+    // Last entry on disk. Cutting entries off bumps `cut_gen` & leaves
+    // `cut` set until the file is truncated too.
+    uint64_t persisted, cut_gen;
+    bool cut;
+    // For `main` to write the log anew, the snapshot moved.
+    bool rewrite;
+    uint64_t commit, applied;
+    // The applier works on entries outside `mu`, none may be freed.
+    bool applying;
+    // A snapshot received for the applier to load, past `applied`.
+    uint64_t install;
+    // Where the last snapshot was taken or tried.
+    uint64_t snap_at, snap_entries;
+    // Our no-op as a leader, reads wait for it to apply, & when we took over.
+    uint64_t lead_index, lead_ms;
+    // Writes waiting to be applied, by index.
+    DList waiters;
+    DList conns;
+    uint64_t rng;
+    // `main` only.
+    ByteBuf disk_buf;
+    RaftPeer peers[RAFT_MAX_NODES];
+    RaftStripe stripes[RAFT_STRIPES];
+    // Until when reads are served locally, 0 unless leading.
+    alignas(64) atomic_u64 lease_until;
+};
+
+static bool pwrite_all(const int fd, const void *buf, size_t len, off_t off) {
+    const uint8_t *p = buf;
+    while (len) {
+        const ssize_t n = pwrite(fd, p, len, off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool pread_all(const int fd, void *buf, size_t len, off_t off) {
+    uint8_t *p = buf;
+    while (len) {
+        const ssize_t n = pread(fd, p, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return true;
+}
+
+// A message & its payload into `in`, false once the link breaks or on garbage.
+static bool recv_msg(const int fd, RaftMsg *m, ByteBuf *in) {
+    if (!recv_all(fd, m, sizeof(RaftMsg)))
+        return false;
+    if (m->len < sizeof(RaftMsg) - 4 || m->len > RAFT_MAX_MSG)
+        return false;
+    in->len = 0;
+    const size_t extra = m->len - (sizeof(RaftMsg) - 4);
+    buf_reserve(in, extra);
+    in->len = extra;
+    return recv_all(fd, in->dat, extra);
+}
+
+static bool send_reply(const int fd, RaftMsg *m) {
+    m->len = sizeof(RaftMsg) - 4;
+    return send_all(fd, m, sizeof(RaftMsg));
+}
+
+static void timed_wait(pthread_cond_t *cond, pthread_mutex_t *mu, const int ms) {
+    struct timespec ts;
+    deadline_in(&ts, ms);
+    pthread_cond_timedwait(cond, mu, &ts);
+}
+
+static void raft_path(const Raft *r, char *buf, const char *fmt, ...) {
+    const int len = snprintf(buf, PATH_MAX, "%s/", r->dir);
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf + len, PATH_MAX - len, fmt, args);
+    va_end(args);
+}
+
+static inline uint32_t rec_sum(const uint8_t *p, const size_t n) { return (uint32_t) bytes_hash_rapid(p, n); }
+
+// --- Log ---
+
+static inline uint64_t last_index(const Raft *r) { return r->base + r->nlog - 1; }
+
+static inline RaftEntry *entry_at(Raft *r, const uint64_t i) { return &r->log[i - r->base]; }
+
+// Term of entry `i`, 0 if we don't have it.
+static uint64_t term_at(const Raft *r, const uint64_t i) {
+    if (i == r->base - 1)
+        return r->base_term;
+    if (i < r->base || i > last_index(r))
+        return 0;
+    return r->log[i - r->base].term;
+}
+
+// File offset past entry `i`.
+static uint64_t entry_end(Raft *r, const uint64_t i) {
+    if (i < r->base)
+        return RAFT_LOG_HEAD;
+    const RaftEntry *e = entry_at(r, i);
+    return e->off + sizeof(RaftEntryHead) + e->len;
+}
+
+// Append an entry taking over `rec`, returns its index.
+static uint64_t log_push(Raft *r, const uint64_t term, uint8_t *rec, const uint32_t len, const uint32_t sum) {
+    if (r->nlog == r->log_cap) {
+        r->log_cap = r->log_cap ? r->log_cap * 2 : 1024;
+        r->log = realloc(r->log, r->log_cap * sizeof(RaftEntry));
+        if (!r->log)
+            die("realloc()");
+    }
+    const uint64_t off = entry_end(r, last_index(r));
+    r->log[r->nlog++] = (RaftEntry) {term, off, len, sum, rec};
+    return last_index(r);
+}
+
+// Drop entries from `i` on, a newer leader has others there.
+static void log_cut(Raft *r, const uint64_t i) {
+    for (uint64_t j = i; j <= last_index(r); j++) {
+        free(entry_at(r, j)->rec);
+    }
+    r->nlog = i - r->base;
+    r->persisted = MIN(r->persisted, i - 1);
+    r->cut_gen++;
+    r->cut = true;
+}
+
+// Drop entries up to `i` covered by a snapshot, with the term of `i`.
+static void log_compact(Raft *r, const uint64_t i, const uint64_t term) {
+    const uint64_t drop = MIN(i + 1, r->base + r->nlog) - r->base;
+    for (uint64_t j = 0; j < drop; j++) {
+        free(r->log[j].rec);
+    }
+    memmove(r->log, r->log + drop, (r->nlog - drop) * sizeof(RaftEntry));
+    r->nlog -= drop;
+    r->base = i + 1;
+    r->base_term = term;
+    r->persisted = MAX(r->persisted, i);
+    r->cut_gen++;
+    r->rewrite = true;
+    pthread_cond_signal(&r->disk_wake);
+}
+
+static void meta_save(Raft *r) {
+    char path[PATH_MAX], tmp[PATH_MAX];
+    raft_path(r, path, "meta");
+    raft_path(r, tmp, "meta.tmp");
+    const int64_t meta[2] = {(int64_t) r->term, r->voted_for};
+    const int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    const bool ok = fd >= 0 && write_all(fd, meta, sizeof(meta)) && !fdatasync(fd);
+    if (fd >= 0)
+        close(fd);
+    // A vote or term forgotten could elect two leaders.
+    if (!ok || rename(tmp, path) || !fsync_dir(path))
+        die("[raft] Can't save the term");
+}
+
+static bool meta_load(Raft *r) {
+    char path[PATH_MAX];
+    raft_path(r, path, "meta");
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT;
+    int64_t meta[2];
+    const bool ok = read(fd, meta, sizeof(meta)) == sizeof(meta);
+    close(fd);
+    if (ok) {
+        r->term = (uint64_t) meta[0];
+        r->voted_for = (int) meta[1];
+    }
+    return ok;
+}
+
+// Read the log, a torn last entry is cut off the file.
+static bool log_load(Raft *r) {
+    char path[PATH_MAX];
+    raft_path(r, path, "log");
+    const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    r->log_fd = fd;
+    r->base = 1;
+    r->base_term = 0;
+    if (!st.st_size) {
+        uint8_t head[RAFT_LOG_HEAD];
+        memcpy(head, RAFT_LOG_MAGIC, 8);
+        memcpy(head + 8, &r->base, 8);
+        memcpy(head + 16, &r->base_term, 8);
+        return write_all(fd, head, sizeof(head)) && !fdatasync(fd) && fsync_dir(path);
+    }
+    const size_t size = (size_t) st.st_size;
+    uint8_t *dat = malloc(size);
+    if (!dat || !pread_all(fd, dat, size, 0) || size < RAFT_LOG_HEAD || memcmp(dat, RAFT_LOG_MAGIC, 8)) {
+        logger(stderr, "ERROR", "[raft] %s is not a log\n", path);
+        free(dat);
+        return false;
+    }
+    memcpy(&r->base, dat + 8, 8);
+    memcpy(&r->base_term, dat + 16, 8);
+    size_t off = RAFT_LOG_HEAD;
+    while (size - off >= sizeof(RaftEntryHead)) {
+        RaftEntryHead h;
+        memcpy(&h, dat + off, sizeof(h));
+        const uint8_t *rec = dat + off + sizeof(h);
+        if (h.len > size - off - sizeof(h) || rec_sum(rec, h.len) != h.sum)
+            break;
+        uint8_t *copy = NULL;
+        if (h.len) {
+            copy = malloc(h.len);
+            memcpy(copy, rec, h.len);
+        }
+        log_push(r, h.term, copy, h.len, h.sum);
+        off += sizeof(h) + h.len;
+    }
+    free(dat);
+    if (off < size) {
+        logger(stderr, "WARN", "[raft] Cutting a torn entry off %s at %zu\n", path, off);
+        if (ftruncate(fd, (off_t) off))
+            return false;
+    }
+    r->persisted = last_index(r);
+    return true;
+}
+
+// Write the entries past `persisted` & fsync them, `mu` is released meanwhile.
+static void log_flush(Raft *r) {
+    ByteBuf *b = &r->disk_buf;
+    const uint64_t gen = r->cut_gen, from = MAX(r->persisted + 1, r->base), to = last_index(r);
+    const uint64_t off = entry_end(r, from - 1);
+    const bool cut = r->cut;
+    r->cut = false;
+    b->len = 0;
+    for (uint64_t i = from; i <= to; i++) {
+        const RaftEntry *e = entry_at(r, i);
+        const RaftEntryHead h = {e->len, e->sum, e->term};
+        buf_put(b, &h, sizeof(h));
+        if (e->len)
+            buf_put(b, e->rec, e->len);
+    }
+    const int fd = r->log_fd;
+    pthread_mutex_unlock(&r->mu);
+    const bool ok = (!b->len || pwrite_all(fd, b->dat, b->len, (off_t) off)) &&
+                    (!cut || !ftruncate(fd, (off_t) (off + b->len))) && !fdatasync(fd);
+    pthread_mutex_lock(&r->mu);
+    if (!ok)
+        die("[raft] Can't write the log");
+    if (gen == r->cut_gen && to > r->persisted)
+        r->persisted = to;
+    pthread_cond_broadcast(&r->done);
+}
+
+static void snaps_drop(Raft *r);
+
+// Write the log anew from memory, after the snapshot moved.
+static void log_rewrite(Raft *r) {
+    char path[PATH_MAX], tmp[PATH_MAX];
+    raft_path(r, path, "log");
+    raft_path(r, tmp, "log.tmp");
+    ByteBuf *b = &r->disk_buf;
+    b->len = 0;
+    buf_put(b, RAFT_LOG_MAGIC, 8);
+    buf_put(b, &r->base, 8);
+    buf_put(b, &r->base_term, 8);
+    for (size_t i = 0; i < r->nlog; i++) {
+        RaftEntry *e = &r->log[i];
+        e->off = b->len;
+        const RaftEntryHead h = {e->len, e->sum, e->term};
+        buf_put(b, &h, sizeof(h));
+        if (e->len)
+            buf_put(b, e->rec, e->len);
+    }
+    const int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || !write_all(fd, b->dat, b->len) || fdatasync(fd) || rename(tmp, path) || !fsync_dir(path))
+        die("[raft] Can't rewrite the log");
+    close(r->log_fd);
+    r->log_fd = fd;
+    r->persisted = last_index(r);
+    r->cut = false;
+    r->cut_gen++;
+    r->rewrite = false;
+    snaps_drop(r);
+    pthread_cond_broadcast(&r->done);
+}
+
+// Remove snapshots the log doesn't start from.
+static void snaps_drop(Raft *r) {
+    DIR *d = opendir(r->dir);
+    if (!d)
+        return;
+    char keep[64];
+    snprintf(keep, sizeof(keep), "snap-%" PRIu64, r->base - 1);
+    for (const struct dirent *de; (de = readdir(d));) {
+        if (!strncmp(de->d_name, "snap-", 5) && strcmp(de->d_name, keep)) {
+            char path[PATH_MAX];
+            raft_path(r, path, "%s", de->d_name);
+            unlink(path);
+        }
+    }
+    closedir(d);
+}
+
+// --- Roles ---
+
+static uint64_t election_timeout(Raft *r) {
+    r->rng ^= r->rng << 13;
+    r->rng ^= r->rng >> 7;
+    r->rng ^= r->rng << 17;
+    return RAFT_ELECTION_MS + r->rng % RAFT_ELECTION_MS;
+}
+
+static const char *redirect(const Raft *r) {
+    return r->leader >= 0 && r->leader != r->id ? r->redirect[r->leader] : "no leader elected";
+}
+
+static void sort_desc(uint64_t *a, const int n) {
+    for (int i = 1; i < n; i++) {
+        const uint64_t v = a[i];
+        int j = i;
+        for (; j > 0 && a[j - 1] < v; j--) {
+            a[j] = a[j - 1];
+        }
+        a[j] = v;
+    }
+}
+
+// Send time of the latest round acked by enough followers for a majority
+// with us, 0 if none in this term.
+static uint64_t majority_ack(const Raft *r) {
+    uint64_t acks[RAFT_MAX_NODES];
+    int k = 0;
+    for (int i = 0; i < r->n; i++) {
+        if (i != r->id)
+            acks[k++] = r->peers[i].ack_ms;
+    }
+    sort_desc(acks, k);
+    return acks[r->n / 2 - 1];
+}
+
+// Reads are local until a majority may have moved on without us.
+static void lease_update(Raft *r) {
+    uint64_t until = 0;
+    if (r->role == ROLE_LEADER && r->applied >= r->lead_index) {
+        if (r->n == 1) {
+            until = UINT64_MAX;
+        } else {
+            const uint64_t sent = majority_ack(r);
+            until = sent ? sent + RAFT_LEASE_MS : 0;
+        }
+    }
+    STORE(&r->lease_until, until, RELEASE);
+}
+
+// Commit what a majority has on disk, from our term on.
+static void leader_commit(Raft *r) {
+    uint64_t match[RAFT_MAX_NODES];
+    for (int i = 0; i < r->n; i++) {
+        match[i] = i == r->id ? r->persisted : r->peers[i].match;
+    }
+    sort_desc(match, r->n);
+    const uint64_t idx = match[r->n / 2];
+    if (idx > r->commit && term_at(r, idx) == r->term) {
+        r->commit = idx;
+        pthread_cond_signal(&r->apply_wake);
+        pthread_cond_broadcast(&r->peer_wake);
+    }
+}
+
+static void fail_waiters(Raft *r, const char *err) {
+    while (!dlist_empty(&r->waiters)) {
+        RaftWait *w = container_of(r->waiters.next, RaftWait, node);
+        dlist_detach(&w->node);
+        w->err = err;
+        w->done = true;
+    }
+    pthread_cond_broadcast(&r->done);
+}
+
+static void step_down(Raft *r, const uint64_t term) {
+    if (term > r->term) {
+        r->term = term;
+        r->voted_for = -1;
+        r->leader = -1;
+        meta_save(r);
+    }
+    if (r->role == ROLE_LEADER) {
+        logger(stderr, "INFO", "[raft] Node %d steps down in term %" PRIu64 "\n", r->id, r->term);
+        fail_waiters(r, "lost the lead, the write may still apply");
+    }
+    // Give whoever won time to reach us.
+    if (r->role != ROLE_FOLLOWER)
+        r->election_at = get_clock_ms() + election_timeout(r);
+    r->role = ROLE_FOLLOWER;
+    lease_update(r);
+}
+
+// On a message from the leader of `term`.
+static void follow(Raft *r, const uint64_t term, const int leader, const uint64_t now) {
+    if (term > r->term || r->role != ROLE_FOLLOWER)
+        step_down(r, term);
+    if (r->leader != leader) {
+        r->leader = leader;
+        logger(stderr, "INFO", "[raft] Node %d follows node %d in term %" PRIu64 "\n", r->id, leader, term);
+    }
+    r->heard_ms = now;
+    r->election_at = now + election_timeout(r);
+}
+
+static void peer_snap_close(RaftPeer *p) {
+    if (p->snap_fd >= 0)
+        close(p->snap_fd);
+    p->snap_fd = -1;
+}
+
+static void become_leader(Raft *r) {
+    r->role = ROLE_LEADER;
+    r->leader = r->id;
+    for (int i = 0; i < r->n; i++) {
+        RaftPeer *p = &r->peers[i];
+        p->next = last_index(r) + 1;
+        p->match = 0;
+        p->inflight = 0;
+        p->sent_commit = p->sent_ms = p->ack_ms = 0;
+        peer_snap_close(p);
+    }
+    r->lead_ms = get_clock_ms();
+    // Entries of past terms commit with it.
+    r->lead_index = log_push(r, r->term, NULL, 0, rec_sum((const uint8_t *) "", 0));
+    logger(stderr, "INFO", "[raft] Node %d leads term %" PRIu64 "\n", r->id, r->term);
+    lease_update(r);
+    pthread_cond_signal(&r->disk_wake);
+    pthread_cond_broadcast(&r->peer_wake);
+}
+
+static void start_election(Raft *r, const uint64_t now) {
+    r->term++;
+    r->voted_for = r->id;
+    meta_save(r);
+    r->role = ROLE_CANDIDATE;
+    r->leader = -1;
+    r->votes = 1;
+    r->election_at = now + election_timeout(r);
+    logger(stderr, "INFO", "[raft] Node %d stands for term %" PRIu64 "\n", r->id, r->term);
+    if (r->votes > r->n / 2) {
+        become_leader(r);
+    } else {
+        pthread_cond_broadcast(&r->peer_wake);
+    }
+}
+
+// Writes the log & runs the election timer.
+static void *raft_main(void *arg) {
+    Raft *r = arg;
+    pthread_mutex_lock(&r->mu);
+    while (!r->stop) {
+        const uint64_t now = get_clock_ms();
+        if (r->role != ROLE_LEADER && now >= r->election_at)
+            start_election(r, now);
+        // Cut off from a majority, writes would wait for nothing.
+        if (r->role == ROLE_LEADER && r->n > 1 && now - MAX(majority_ack(r), r->lead_ms) >= RAFT_ELECTION_MS)
+            step_down(r, r->term);
+        if (r->rewrite) {
+            log_rewrite(r);
+        } else if (r->persisted < last_index(r) || r->cut) {
+            log_flush(r);
+        } else {
+            timed_wait(&r->disk_wake, &r->mu, RAFT_TICK_MS);
+            continue;
+        }
+        if (r->role == ROLE_LEADER)
+            leader_commit(r);
+    }
+    pthread_mutex_unlock(&r->mu);
+    return NULL;
+}
+
+// --- Applier ---
+
+static void apply_entry(Raft *r, const RaftEntry *e, RingBuf *rb, RingBuf *out) {
+    if (e->len >= rb->cap)
+        rb_resize(rb, next_pow2(e->len + 1));
+    rb_clear(rb);
+    rb_write(rb, e->rec, e->len);
+    OwnedRequest oreq = {0};
+    if (!new_owned_req(&oreq, rb, e->len)) {
+        logger(stderr, "ERROR", "[raft] Bad entry of term %" PRIu64 "\n", e->term);
+        out_err(out, ERR_UNKNOWN, "bad log entry");
+    } else {
+        smr_enter();
+        kv_apply(r->kv, &oreq, out);
+        smr_exit();
+    }
+    owned_req_destroy(&oreq);
+}
+
+// Save the applied state & cut the log at it, writes wait meanwhile.
+static void snapshot_take(Raft *r) {
+    const uint64_t index = r->applied, term = term_at(r, index);
+    r->snap_at = index;
+    r->applying = true;
+    pthread_mutex_unlock(&r->mu);
+    char path[PATH_MAX];
+    raft_path(r, path, "snap-%" PRIu64, index);
+    const uint64_t start_ms = get_clock_ms();
+    Snapshot *snap = snap_new(path, 0);
+    const int64_t keys = snap_save(snap, r->kv);
+    snap_free(snap);
+    pthread_mutex_lock(&r->mu);
+    r->applying = false;
+    pthread_cond_broadcast(&r->done);
+    if (keys < 0) {
+        logger(stderr, "ERROR", "[raft] Can't save %s\n", path);
+        return;
+    }
+    logger(stderr, "INFO", "[raft] Saved %" PRId64 " keys at %" PRIu64 " in %" PRIu64 " ms\n", keys, index,
+           get_clock_ms() - start_ms);
+    if (index >= r->base)
+        log_compact(r, index, term);
+}
+
+// Replace the keyspace by the snapshot received.
+static void snapshot_install(Raft *r) {
+    const uint64_t index = r->install;
+    r->applying = true;
+    pthread_mutex_unlock(&r->mu);
+    char path[PATH_MAX];
+    raft_path(r, path, "snap-%" PRIu64, index);
+    kv_flush(r->kv, NULL, NULL);
+    const int64_t keys = snap_load(r->kv, path, (int) sysconf(_SC_NPROCESSORS_ONLN));
+    if (keys < 0)
+        die("[raft] Can't load the snapshot received");
+    logger(stderr, "INFO", "[raft] Installed %" PRId64 " keys at %" PRIu64 "\n", keys, index);
+    pthread_mutex_lock(&r->mu);
+    r->applying = false;
+    r->applied = r->snap_at = index;
+    pthread_cond_broadcast(&r->done);
+}
+
+// Runs committed entries in order, & hands replies to waiting writes.
+static void *raft_applier(void *arg) {
+    Raft *r = arg;
+    smr_reg();
+    RingBuf rb, scratch;
+    rb_init(&rb, 4096);
+    rb_init(&scratch, 256);
+    RaftEntry *batch = malloc(RAFT_APPLY_BATCH * sizeof(RaftEntry));
+    pthread_mutex_lock(&r->mu);
+    while (!r->stop) {
+        if (r->install > r->applied) {
+            snapshot_install(r);
+            continue;
+        }
+        if (r->applied >= r->commit) {
+            smr_offline();
+            pthread_cond_wait(&r->apply_wake, &r->mu);
+            smr_online();
+            continue;
+        }
+        const uint64_t from = r->applied + 1, to = MIN(r->commit, r->applied + RAFT_APPLY_BATCH);
+        memcpy(batch, entry_at(r, from), (to - from + 1) * sizeof(RaftEntry));
+        DList mine;
+        dlist_init(&mine);
+        while (!dlist_empty(&r->waiters)) {
+            RaftWait *w = container_of(r->waiters.next, RaftWait, node);
+            if (w->index > to)
+                break;
+            dlist_detach(&w->node);
+            dlist_insert_before(&mine, &w->node);
+        }
+        r->applying = true;
+        pthread_mutex_unlock(&r->mu);
+
+        DList *next = mine.next;
+        for (uint64_t i = from; i <= to; i++) {
+            RaftWait *w = next != &mine ? container_of(next, RaftWait, node) : NULL;
+            RingBuf *out = &scratch;
+            if (w && w->index == i) {
+                out = w->out;
+                next = next->next;
+            }
+            rb_clear(&scratch);
+            if (batch[i - from].rec)
+                apply_entry(r, &batch[i - from], &rb, out);
+        }
+        smr_quiescent();
+
+        pthread_mutex_lock(&r->mu);
+        r->applying = false;
+        r->applied = to;
+        while (!dlist_empty(&mine)) {
+            RaftWait *w = container_of(mine.next, RaftWait, node);
+            dlist_detach(&w->node);
+            w->done = true;
+        }
+        pthread_cond_broadcast(&r->done);
+        if (r->role == ROLE_LEADER)
+            lease_update(r);
+        if (r->applied - r->snap_at >= r->snap_entries)
+            snapshot_take(r);
+    }
+    pthread_mutex_unlock(&r->mu);
+    free(batch);
+    rb_destroy(&rb);
+    rb_destroy(&scratch);
+    smr_quiescent();
+    smr_unreg();
+    return NULL;
+}
+
+// --- Inbound ---
+
+static void on_vote(Raft *r, const RaftMsg *m, RaftMsg *resp) {
+    pthread_mutex_lock(&r->mu);
+    const uint64_t now = get_clock_ms();
+    // The leader & its live followers ignore candidates, its lease counts on
+    // it. So does a node that just started, it may have acked a lease.
+    const bool sticky = r->role == ROLE_LEADER || now - r->heard_ms < RAFT_ELECTION_MS;
+    if (m->term > r->term && !sticky)
+        step_down(r, m->term);
+    const uint64_t last = last_index(r), last_term = term_at(r, last);
+    const bool up_to_date = m->index_term > last_term || (m->index_term == last_term && m->index >= last);
+    if (m->term == r->term && !sticky && (r->voted_for < 0 || r->voted_for == (int) m->from) && up_to_date) {
+        r->voted_for = (int) m->from;
+        meta_save(r);
+        r->election_at = now + election_timeout(r);
+        resp->n = 1;
+    }
+    resp->term = r->term;
+    pthread_mutex_unlock(&r->mu);
+}
+
+// False on a malformed message.
+static bool on_append(Raft *r, const RaftMsg *m, const ByteBuf *in, RaftMsg *resp) {
+    pthread_mutex_lock(&r->mu);
+    resp->sent_ms = m->sent_ms;
+    if (m->term < r->term) {
+        resp->term = r->term;
+        resp->index = last_index(r);
+        pthread_mutex_unlock(&r->mu);
+        return true;
+    }
+    follow(r, m->term, (int) m->from, get_clock_ms());
+    resp->term = r->term;
+    if (m->index > last_index(r) || (m->index >= r->base && term_at(r, m->index) != m->index_term)) {
+        // Not there yet, or from an older leader: go back a step.
+        resp->index = MIN(last_index(r), m->index - 1);
+        pthread_mutex_unlock(&r->mu);
+        return true;
+    }
+    const uint8_t *p = in->dat, *end = in->dat + in->len;
+    uint64_t want_term = m->index_term;
+    for (uint32_t k = 0; k < m->n; k++) {
+        RaftEntryHead h;
+        if (end - p < (ptrdiff_t) sizeof(h)) {
+            pthread_mutex_unlock(&r->mu);
+            return false;
+        }
+        memcpy(&h, p, sizeof(h));
+        p += sizeof(h);
+        if ((size_t) (end - p) < h.len || rec_sum(p, h.len) != h.sum) {
+            pthread_mutex_unlock(&r->mu);
+            return false;
+        }
+        const uint64_t i = m->index + 1 + k;
+        want_term = h.term;
+        // In the snapshot, or had already.
+        if (i < r->base || (i <= last_index(r) && term_at(r, i) == h.term)) {
+            p += h.len;
+            continue;
+        }
+        if (i <= last_index(r))
+            log_cut(r, i);
+        uint8_t *rec = NULL;
+        if (h.len) {
+            rec = malloc(h.len);
+            memcpy(rec, p, h.len);
+        }
+        log_push(r, h.term, rec, h.len, h.sum);
+        p += h.len;
+    }
+    // Acked once on disk.
+    const uint64_t want = m->index + m->n;
+    if (r->persisted < want)
+        pthread_cond_signal(&r->disk_wake);
+    while (!r->stop && r->persisted < want && r->term == m->term)
+        pthread_cond_wait(&r->done, &r->mu);
+    if (r->term == m->term && r->persisted >= want && (want < r->base || term_at(r, want) == want_term)) {
+        resp->n = 1;
+        resp->index = want;
+        const uint64_t commit = MIN(m->commit, want);
+        if (commit > r->commit) {
+            r->commit = commit;
+            pthread_cond_signal(&r->apply_wake);
+        }
+    } else {
+        resp->index = last_index(r);
+    }
+    resp->term = r->term;
+    pthread_mutex_unlock(&r->mu);
+    return true;
+}
+
+static void on_snap(Raft *r, RaftConn *c, const RaftMsg *m, const ByteBuf *in, RaftMsg *resp) {
+    pthread_mutex_lock(&r->mu);
+    resp->term = r->term;
+    if (m->term < r->term) {
+        pthread_mutex_unlock(&r->mu);
+        return;
+    }
+    follow(r, m->term, (int) m->from, get_clock_ms());
+    resp->term = r->term;
+    pthread_mutex_unlock(&r->mu);
+
+    char path[PATH_MAX], tmp[PATH_MAX];
+    raft_path(r, path, "snap-%" PRIu64, m->index);
+    raft_path(r, tmp, "snap-%" PRIu64 ".tmp", m->index);
+    if (!m->commit) {
+        if (c->snap_fd >= 0)
+            close(c->snap_fd);
+        c->snap_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        c->snap_index = m->index;
+    }
+    if (c->snap_fd < 0 || c->snap_index != m->index || !pwrite_all(c->snap_fd, in->dat, in->len, (off_t) m->commit))
+        return;
+    resp->commit = m->commit + in->len;
+    if (m->n) {
+        const bool ok = !fdatasync(c->snap_fd) && !rename(tmp, path) && fsync_dir(path);
+        close(c->snap_fd);
+        c->snap_fd = -1;
+        if (!ok)
+            return;
+        pthread_mutex_lock(&r->mu);
+        while (r->applying && !r->stop)
+            pthread_cond_wait(&r->done, &r->mu);
+        if (m->index > r->applied && term_at(r, m->index) != m->index_term) {
+            // Nothing of ours is worth keeping past it.
+            for (size_t i = 0; i < r->nlog; i++) {
+                free(r->log[i].rec);
+            }
+            r->nlog = 0;
+            log_compact(r, m->index, m->index_term);
+            r->commit = MAX(r->commit, m->index);
+            r->install = m->index;
+            pthread_cond_signal(&r->apply_wake);
+        } else if (m->index > r->commit) {
+            r->commit = MIN(m->index, last_index(r));
+            pthread_cond_signal(&r->apply_wake);
+        }
+        pthread_mutex_unlock(&r->mu);
+    }
+    resp->n = 1;
+}
+
+static void *conn_main(void *arg) {
+    RaftConn *c = arg;
+    Raft *r = c->raft;
+    ByteBuf in = {0};
+    RaftMsg m;
+    while (recv_msg(c->fd, &m, &in)) {
+        RaftMsg resp = {.type = m.type + 1, .from = (uint32_t) r->id};
+        if (m.type == MSG_VOTE) {
+            on_vote(r, &m, &resp);
+        } else if (m.type == MSG_APPEND) {
+            if (!on_append(r, &m, &in, &resp))
+                break;
+        } else if (m.type == MSG_SNAP) {
+            on_snap(r, c, &m, &in, &resp);
+        } else {
+            break;
+        }
+        if (!send_reply(c->fd, &resp))
+            break;
+    }
+    if (c->snap_fd >= 0)
+        close(c->snap_fd);
+    free(in.dat);
+    STORE(&c->done, true, RELEASE);
+    return NULL;
+}
+
+static void conn_free(RaftConn *c) {
+    pthread_join(c->thread, NULL);
+    close(c->fd);
+    free(c);
+}
+
+static void *raft_acceptor(void *arg) {
+    Raft *r = arg;
+    for (;;) {
+        const int fd = accept(r->lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        RaftConn *c = calloc(1, sizeof(RaftConn));
+        c->raft = r;
+        c->fd = fd;
+        c->snap_fd = -1;
+        atomic_init(&c->done, false);
+
+        pthread_mutex_lock(&r->mu);
+        for (DList *n = r->conns.next, *next; n != &r->conns; n = next) {
+            next = n->next;
+            RaftConn *old = container_of(n, RaftConn, node);
+            if (LOAD(&old->done, ACQUIRE)) {
+                dlist_detach(n);
+                conn_free(old);
+            }
+        }
+        const bool ok = !r->stop && !pthread_create(&c->thread, NULL, conn_main, c);
+        if (ok)
+            dlist_insert_before(&r->conns, &c->node);
+        pthread_mutex_unlock(&r->mu);
+        if (!ok) {
+            close(fd);
+            free(c);
+        }
+    }
+    return NULL;
+}
+
+// --- Outbound ---
+
+// A blocking socket connected to `p`, -1 if it can't be reached.
+static int peer_connect(const RaftPeer *p) {
+    char port[8];
+    snprintf(port, sizeof(port), "%d", p->port);
+    const struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *res;
+    if (getaddrinfo(p->host, port, &hints, &res))
+        return -1;
+    int fd = -1;
+    for (const struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) < 0)
+            continue;
+        // Bounds the connect only.
+        struct timeval tv = {RAFT_HEARTBEAT_MS / 1000, RAFT_HEARTBEAT_MS % 1000 * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        tv = (struct timeval) {0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// Under `mu`, on a reply from `p`.
+static void peer_on_reply(Raft *r, RaftPeer *p, const RaftMsg *m) {
+    if (m->term > r->term) {
+        step_down(r, m->term);
+        return;
+    }
+    if (m->term != r->term)
+        return;
+    if (m->type == MSG_VOTE_RESP) {
+        if (r->role == ROLE_CANDIDATE && m->n && ++r->votes > r->n / 2)
+            become_leader(r);
+        return;
+    }
+    if (r->role != ROLE_LEADER)
+        return;
+    if (m->type == MSG_APPEND_RESP) {
+        p->inflight -= p->inflight > 0;
+        p->ack_ms = MAX(p->ack_ms, m->sent_ms);
+        if (m->n) {
+            p->match = MAX(p->match, m->index);
+            leader_commit(r);
+        } else {
+            // Resend from what it has, the rest in flight fails too.
+            p->next = MIN(p->next, m->index + 1);
+            p->inflight = 0;
+        }
+        p->next = MAX(p->next, p->match + 1);
+        lease_update(r);
+    } else if (m->type == MSG_SNAP_RESP && p->snap_fd >= 0) {
+        p->inflight = 0;
+        if (!m->n) {
+            peer_snap_close(p);
+        } else if ((p->snap_off = m->commit) >= p->snap_size) {
+            p->match = MAX(p->match, p->snap_index);
+            p->next = p->snap_index + 1;
+            peer_snap_close(p);
+            leader_commit(r);
+        }
+    }
+    pthread_cond_broadcast(&r->peer_wake);
+}
+
+static void *peer_reader(void *arg) {
+    RaftPeer *p = arg;
+    Raft *r = p->raft;
+    ByteBuf in = {0};
+    RaftMsg m;
+    while (recv_msg(p->fd, &m, &in)) {
+        pthread_mutex_lock(&r->mu);
+        peer_on_reply(r, p, &m);
+        pthread_mutex_unlock(&r->mu);
+    }
+    free(in.dat);
+    pthread_mutex_lock(&r->mu);
+    p->down = true;
+    pthread_cond_broadcast(&r->peer_wake);
+    pthread_mutex_unlock(&r->mu);
+    return NULL;
+}
+
+// Under `mu`, released meanwhile.
+static void peer_disconnect(Raft *r, RaftPeer *p) {
+    const int fd = p->fd;
+    shutdown(fd, SHUT_RDWR);
+    pthread_mutex_unlock(&r->mu);
+    pthread_join(p->reader, NULL);
+    pthread_mutex_lock(&r->mu);
+    close(fd);
+    p->fd = -1;
+    p->down = false;
+    p->inflight = 0;
+    peer_snap_close(p);
+}
+
+// Under `mu`, start sending the snapshot the log starts from.
+static bool peer_snap_open(Raft *r, RaftPeer *p) {
+    char path[PATH_MAX];
+    raft_path(r, path, "snap-%" PRIu64, r->base - 1);
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        if (fd >= 0)
+            close(fd);
+        logger(stderr, "ERROR", "[raft] Can't open %s\n", path);
+        return false;
+    }
+    p->snap_fd = fd;
+    p->snap_index = r->base - 1;
+    p->snap_term = r->base_term;
+    p->snap_off = 0;
+    p->snap_size = (uint64_t) st.st_size;
+    return true;
+}
+
+// Under `mu`, the next message for `p` into `out`, false if none is due. A
+// snapshot chunk of `chunk` bytes is left to read from `p->snap_fd`.
+static bool peer_next_msg(Raft *r, RaftPeer *p, ByteBuf *out, size_t *chunk) {
+    const uint64_t now = get_clock_ms();
+    RaftMsg m = {.term = r->term, .from = (uint32_t) r->id};
+    out->len = 0;
+    buf_reserve(out, sizeof(RaftMsg));
+    out->len = sizeof(RaftMsg);
+    *chunk = 0;
+    if (r->role == ROLE_CANDIDATE && p->vote_term != r->term) {
+        p->vote_term = r->term;
+        m.type = MSG_VOTE;
+        m.index = last_index(r);
+        m.index_term = term_at(r, m.index);
+    } else if (r->role != ROLE_LEADER || p->inflight >= RAFT_PIPELINE) {
+        return false;
+    } else if (p->next < r->base) {
+        // Cut off the log, one chunk of the snapshot at a time.
+        if (p->inflight || (p->snap_fd < 0 && !peer_snap_open(r, p)))
+            return false;
+        m.type = MSG_SNAP;
+        m.index = p->snap_index;
+        m.index_term = p->snap_term;
+        m.commit = p->snap_off;
+        *chunk = MIN(RAFT_SNAP_CHUNK, p->snap_size - p->snap_off);
+        m.n = p->snap_off + *chunk == p->snap_size;
+        p->inflight = 1;
+        p->sent_ms = now;
+    } else if (p->next <= last_index(r) || p->sent_commit < r->commit || now - p->sent_ms >= RAFT_HEARTBEAT_MS) {
+        m.type = MSG_APPEND;
+        m.index = p->next - 1;
+        m.index_term = term_at(r, m.index);
+        m.commit = r->commit;
+        m.sent_ms = now;
+        for (uint64_t i = p->next; i <= last_index(r) && out->len - sizeof(RaftMsg) < RAFT_BATCH_BYTES; i++) {
+            const RaftEntry *e = entry_at(r, i);
+            const RaftEntryHead h = {e->len, e->sum, e->term};
+            buf_put(out, &h, sizeof(h));
+            if (e->len)
+                buf_put(out, e->rec, e->len);
+            m.n++;
+        }
+        // Pipelined, the next goes on from here before this one is acked.
+        p->next += m.n;
+        p->inflight++;
+        p->sent_commit = r->commit;
+        p->sent_ms = now;
+    } else {
+        return false;
+    }
+    m.len = (uint32_t) (out->len - 4 + *chunk);
+    memcpy(out->dat, &m, sizeof(m));
+    return true;
+}
+
+static void *peer_sender(void *arg) {
+    RaftPeer *p = arg;
+    Raft *r = p->raft;
+    ByteBuf out = {0};
+    pthread_mutex_lock(&r->mu);
+    while (!r->stop) {
+        if (p->down) {
+            peer_disconnect(r, p);
+            continue;
+        }
+        if (p->fd < 0) {
+            pthread_mutex_unlock(&r->mu);
+            const int fd = peer_connect(p);
+            pthread_mutex_lock(&r->mu);
+            if (fd >= 0 && !r->stop) {
+                p->fd = fd;
+                if (pthread_create(&p->reader, NULL, peer_reader, p)) {
+                    close(fd);
+                    p->fd = -1;
+                }
+            } else if (fd >= 0) {
+                close(fd);
+            }
+            if (p->fd < 0 && !r->stop)
+                timed_wait(&r->peer_wake, &r->mu, RAFT_HEARTBEAT_MS);
+            continue;
+        }
+        size_t chunk;
+        if (!peer_next_msg(r, p, &out, &chunk)) {
+            timed_wait(&r->peer_wake, &r->mu, RAFT_HEARTBEAT_MS);
+            continue;
+        }
+        const int fd = p->fd, snap_fd = p->snap_fd;
+        const uint64_t snap_off = p->snap_off;
+        pthread_mutex_unlock(&r->mu);
+        bool ok = true;
+        if (chunk) {
+            buf_reserve(&out, chunk);
+            ok = pread_all(snap_fd, out.dat + out.len, chunk, (off_t) snap_off);
+            out.len += chunk;
+        }
+        ok = ok && send_all(fd, out.dat, out.len);
+        pthread_mutex_lock(&r->mu);
+        if (!ok)
+            p->down = true;
+    }
+    if (p->fd >= 0)
+        peer_disconnect(r, p);
+    pthread_mutex_unlock(&r->mu);
+    free(out.dat);
+    return NULL;
+}
+
+// --- API ---
+
+static int raft_listen(const int port) {
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    set_reuseaddr(fd);
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(0)};
+    if (bind(fd, (const struct sockaddr *) &addr, sizeof(addr)) || listen(fd, SOMAXCONN)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void raft_free(Raft *r) {
+    for (int i = 0; i < r->n; i++) {
+        free(r->redirect[i]);
+        free(r->peers[i].host);
+    }
+    for (size_t i = 0; i < r->nlog; i++) {
+        free(r->log[i].rec);
+    }
+    free(r->log);
+    free(r->disk_buf.dat);
+    if (r->log_fd >= 0)
+        close(r->log_fd);
+    if (r->lfd >= 0)
+        close(r->lfd);
+    pthread_cond_destroy(&r->disk_wake);
+    pthread_cond_destroy(&r->peer_wake);
+    pthread_cond_destroy(&r->apply_wake);
+    pthread_cond_destroy(&r->done);
+    pthread_mutex_destroy(&r->mu);
+    for (int i = 0; i < RAFT_STRIPES; i++) {
+        pthread_mutex_destroy(&r->stripes[i].lock);
+    }
+    free(r->dir);
+    free(r);
+}
+
+Raft *raft_open(KVStore *kv, const int id, const int n, const char *const *addrs, const char *dir) {
+    if (n < 1 || n > RAFT_MAX_NODES || id < 0 || id >= n)
+        return NULL;
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        logger(stderr, "ERROR", "[raft] Can't create %s\n", dir);
+        return NULL;
+    }
+    Raft *r = calloc(1, sizeof(Raft));
+    r->kv = kv;
+    r->id = id;
+    r->n = n;
+    r->dir = strdup(dir);
+    r->lfd = r->log_fd = -1;
+    r->voted_for = -1;
+    r->leader = -1;
+    r->snap_entries = RAFT_SNAP_ENTRIES;
+    // Nodes started a few ms apart must not time out in step.
+    r->rng = (int_hash_rapid(get_unix_ms()) ^ int_hash_rapid((uint64_t) id + 1)) | 1;
+    pthread_mutex_init(&r->mu, NULL);
+    cond_init_monotonic(&r->disk_wake);
+    cond_init_monotonic(&r->peer_wake);
+    cond_init_monotonic(&r->apply_wake);
+    cond_init_monotonic(&r->done);
+    dlist_init(&r->waiters);
+    dlist_init(&r->conns);
+    for (int i = 0; i < RAFT_STRIPES; i++) {
+        pthread_mutex_init(&r->stripes[i].lock, NULL);
+    }
+    atomic_init(&r->lease_until, 0);
+    bool ok = true;
+    for (int i = 0; i < n; i++) {
+        RaftPeer *p = &r->peers[i];
+        p->raft = r;
+        p->fd = p->snap_fd = -1;
+        p->host = strdup(addrs[i]);
+        char *colon = strrchr(p->host, ':');
+        const long port = colon ? strtol(colon + 1, NULL, 10) : 0;
+        if (!colon || port <= 0 || port + RAFT_PORT_OFFSET > 65535) {
+            logger(stderr, "ERROR", "[raft] Bad address %s\n", addrs[i]);
+            ok = false;
+            continue;
+        }
+        *colon = '\0';
+        p->port = (int) port + RAFT_PORT_OFFSET;
+        const size_t len = strlen(addrs[i]) + 32;
+        r->redirect[i] = malloc(len);
+        snprintf(r->redirect[i], len, "not leader, try %s", addrs[i]);
+    }
+    if (!ok || !meta_load(r) || !log_load(r)) {
+        logger(stderr, "ERROR", "[raft] Can't read the state in %s\n", dir);
+        raft_free(r);
+        return NULL;
+    }
+    // The keyspace loads as the cluster has it, TTLs past due included.
+    kv_set_raft(kv, r);
+    if (r->base > 1) {
+        char path[PATH_MAX];
+        raft_path(r, path, "snap-%" PRIu64, r->base - 1);
+        const int64_t keys = snap_load(kv, path, (int) sysconf(_SC_NPROCESSORS_ONLN));
+        if (keys < 0) {
+            kv_set_raft(kv, NULL);
+            raft_free(r);
+            return NULL;
+        }
+        logger(stderr, "INFO", "[raft] Loaded %" PRId64 " keys at %" PRIu64 "\n", keys, r->base - 1);
+    }
+    r->commit = r->applied = r->snap_at = r->base - 1;
+    if ((r->lfd = raft_listen(r->peers[id].port)) < 0) {
+        logger(stderr, "ERROR", "[raft] Can't listen on %d\n", r->peers[id].port);
+        kv_set_raft(kv, NULL);
+        raft_free(r);
+        return NULL;
+    }
+    const uint64_t now = get_clock_ms();
+    r->heard_ms = now;
+    r->election_at = now + election_timeout(r);
+    logger(stderr, "INFO", "[raft] Node %d of %d at term %" PRIu64 ", entries %" PRIu64 " to %" PRIu64 "\n", id, n,
+           r->term, r->base, last_index(r));
+
+    pthread_create(&r->main, NULL, raft_main, r);
+    pthread_create(&r->applier, NULL, raft_applier, r);
+    pthread_create(&r->acceptor, NULL, raft_acceptor, r);
+    for (int i = 0; i < n; i++) {
+        if (i != id)
+            pthread_create(&r->peers[i].sender, NULL, peer_sender, &r->peers[i]);
+    }
+    return r;
+}
+
+void raft_close(Raft *r) {
+    if (!r)
+        return;
+    pthread_mutex_lock(&r->mu);
+    r->stop = true;
+    fail_waiters(r, "shutting down");
+    for (DList *n = r->conns.next; n != &r->conns; n = n->next) {
+        shutdown(container_of(n, RaftConn, node)->fd, SHUT_RDWR);
+    }
+    for (int i = 0; i < r->n; i++) {
+        if (r->peers[i].fd >= 0)
+            shutdown(r->peers[i].fd, SHUT_RDWR);
+    }
+    pthread_cond_broadcast(&r->disk_wake);
+    pthread_cond_broadcast(&r->peer_wake);
+    pthread_cond_broadcast(&r->apply_wake);
+    pthread_cond_broadcast(&r->done);
+    pthread_mutex_unlock(&r->mu);
+
+    shutdown(r->lfd, SHUT_RDWR);
+    pthread_join(r->acceptor, NULL);
+    for (int i = 0; i < r->n; i++) {
+        if (i != r->id)
+            pthread_join(r->peers[i].sender, NULL);
+    }
+    pthread_join(r->applier, NULL);
+    pthread_join(r->main, NULL);
+    while (!dlist_empty(&r->conns)) {
+        RaftConn *c = container_of(r->conns.next, RaftConn, node);
+        dlist_detach(&c->node);
+        conn_free(c);
+    }
+    // What's appended but not on disk is lost, the cluster doesn't count on it.
+    raft_free(r);
+}
+
+// `argv` as an entry, see `new_owned_req`.
+static uint8_t *rec_new(const uint32_t argc, const vstr *const *argv, uint32_t *len) {
+    *len = 4;
+    for (uint32_t i = 0; i < argc; i++) {
+        *len += 4 + argv[i]->len;
+    }
+    uint8_t *rec = malloc(*len), *p = rec;
+    memcpy(p, &argc, 4);
+    p += 4;
+    for (uint32_t i = 0; i < argc; i++) {
+        memcpy(p, &argv[i]->len, 4);
+        memcpy(p + 4, argv[i]->dat, argv[i]->len);
+        p += 4 + argv[i]->len;
+    }
+    return rec;
+}
+
+// Append `rec` if leading, under `mu`. An error for the client otherwise,
+// `rec` is freed then.
+static const char *leader_push(Raft *r, uint8_t *rec, const uint32_t len, const uint32_t sum, uint64_t *index) {
+    if (r->role != ROLE_LEADER || r->stop) {
+        free(rec);
+        return r->stop ? "shutting down" : redirect(r);
+    }
+    *index = log_push(r, r->term, rec, len, sum);
+    pthread_cond_signal(&r->disk_wake);
+    pthread_cond_broadcast(&r->peer_wake);
+    return NULL;
+}
+
+uint32_t raft_stripe(const vstr *key) { return (uint32_t) vstr_hash_rapid(key) & (RAFT_STRIPES - 1); }
+
+void raft_lock(Raft *r, const uint32_t stripe) { pthread_mutex_lock(&r->stripes[stripe].lock); }
+
+void raft_unlock(Raft *r, const uint32_t stripe) { pthread_mutex_unlock(&r->stripes[stripe].lock); }
+
+bool raft_trylock(Raft *r, const uint32_t stripe) { return !pthread_mutex_trylock(&r->stripes[stripe].lock); }
+
+const char *raft_submit(Raft *r, const uint32_t stripe, const uint32_t argc, const vstr *const *argv,
+                        RingBuf *out) {
+    uint32_t len;
+    uint8_t *rec = rec_new(argc, argv, &len);
+    const uint32_t sum = rec_sum(rec, len);
+
+    RaftWait w = {.out = out};
+    pthread_mutex_lock(&r->mu);
+    const char *err = leader_push(r, rec, len, sum, &w.index);
+    raft_unlock(r, stripe);
+    if (err) {
+        pthread_mutex_unlock(&r->mu);
+        return err;
+    }
+    dlist_insert_before(&r->waiters, &w.node);
+    while (!w.done)
+        pthread_cond_wait(&r->done, &r->mu);
+    pthread_mutex_unlock(&r->mu);
+    return w.err;
+}
+
+bool raft_propose(Raft *r, const uint32_t argc, const vstr *const *argv) {
+    uint32_t len;
+    uint8_t *rec = rec_new(argc, argv, &len);
+    const uint32_t sum = rec_sum(rec, len);
+    uint64_t index;
+    pthread_mutex_lock(&r->mu);
+    const char *err = leader_push(r, rec, len, sum, &index);
+    pthread_mutex_unlock(&r->mu);
+    return !err;
+}
+
+const char *raft_settle(Raft *r) {
+    pthread_mutex_lock(&r->mu);
+    const uint64_t last = last_index(r);
+    const char *err = NULL;
+    for (;;) {
+        if (r->stop) {
+            err = "shutting down";
+        } else if (r->role != ROLE_LEADER) {
+            err = redirect(r);
+        } else if (r->applied < last) {
+            timed_wait(&r->done, &r->mu, RAFT_TICK_MS);
+            continue;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&r->mu);
+    return err;
+}
+
+bool raft_leading(Raft *r) {
+    pthread_mutex_lock(&r->mu);
+    const bool leading = r->role == ROLE_LEADER && !r->stop;
+    pthread_mutex_unlock(&r->mu);
+    return leading;
+}
+
+bool raft_lease_valid(Raft *r) { return get_clock_ms() < LOAD(&r->lease_until, ACQUIRE); }
+
+const char *raft_read_barrier(Raft *r) {
+    if (raft_lease_valid(r))
+        return NULL;
+    pthread_mutex_lock(&r->mu);
+    const uint64_t end = get_clock_ms() + RAFT_ELECTION_MS;
+    const char *err = NULL;
+    while (!raft_lease_valid(r)) {
+        if (r->stop) {
+            err = "shutting down";
+        } else if (r->role != ROLE_LEADER) {
+            err = redirect(r);
+        } else if (get_clock_ms() >= end) {
+            err = "no majority reachable";
+        } else {
+            timed_wait(&r->done, &r->mu, RAFT_TICK_MS);
+            continue;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&r->mu);
+    return err;
+}
+
+int raft_leader(Raft *r) {
+    pthread_mutex_lock(&r->mu);
+    const int leader = r->leader;
+    pthread_mutex_unlock(&r->mu);
+    return leader;
+}
+
+uint64_t raft_term(Raft *r) {
+    pthread_mutex_lock(&r->mu);
+    const uint64_t term = r->term;
+    pthread_mutex_unlock(&r->mu);
+    return term;
+}
+
+uint64_t raft_applied(Raft *r) {
+    pthread_mutex_lock(&r->mu);
+    const uint64_t applied = r->applied;
+    pthread_mutex_unlock(&r->mu);
+    return applied;
+}
+
+void raft_set_snap_entries(Raft *r, const uint64_t entries) {
+    pthread_mutex_lock(&r->mu);
+    r->snap_entries = entries;
+    pthread_mutex_unlock(&r->mu);
+}
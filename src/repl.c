@@ -0,0 +1,580 @@
+#include "repl.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "kvstore.h"
+#include "list.h"
+#include "parse.h"
+#include "ringbuf.h"
+#include "smr.h"
+#include "utils.h"
+
+// Buckets dumped per critical section, dumped records go out in chunks of
+// this size.
+#define REPL_DUMP_BUCKETS 1024
+#define REPL_DUMP_BUF (1 << 20)
+// Anything longer is garbage, not a record.
+#define REPL_MAX_RECORD (64u << 20)
+#define REPLICA_READ_BUF (1 << 16)
+// Records a replica applies between reporting quiescent.
+#define REPLICA_QUIESCE 1024
+
+// --- Primary ---
+
+// The records of a tick, shared by the links it went out to.
+struct ReplBatch {
+    atomic_u64 refs;
+    size_t len;
+    uint8_t dat[];
+};
+typedef struct ReplBatch ReplBatch;
+
+struct ReplQueued {
+    struct ReplQueued *next;
+    ReplBatch *batch;
+};
+typedef struct ReplQueued ReplQueued;
+
+struct ReplLink {
+    DList node;
+    Repl *repl;
+    KVStore *kv;
+    int fd;
+    pthread_t thread;
+    // Batches from `head` to `tail`, `queued` bytes in all, are under `mu`.
+    pthread_mutex_t mu;
+    pthread_cond_t wake;
+    ReplQueued *head, *tail;
+    size_t queued;
+    // Set to drop the link, the sender reaps it once `done`.
+    atomic_bool stop, done;
+    // Link thread only, dumped records.
+    ByteBuf dump;
+};
+typedef struct ReplLink ReplLink;
+
+struct ReplStripe {
+    alignas(64) pthread_mutex_t lock;
+    ByteBuf buf;
+};
+typedef struct ReplStripe ReplStripe;
+
+struct Repl {
+    pthread_t sender;
+    // `links` & `stop` are under `mu`, the sender waits on `wake` for a link.
+    pthread_mutex_t mu;
+    pthread_cond_t wake;
+    DList links;
+    bool stop;
+    // Links in `links`, read under a stripe lock by appenders.
+    alignas(64) atomic_u64 nlinks;
+    // Sender only, the drained records.
+    ByteBuf out;
+    ReplStripe stripes[REPL_STRIPES];
+};
+
+static void batch_unref(ReplBatch *b) {
+    if (FAA(&b->refs, -1, ACQ_REL) == 1)
+        free(b);
+}
+
+static void link_stop(ReplLink *l) {
+    pthread_mutex_lock(&l->mu);
+    STORE(&l->stop, true, RELAXED);
+    // Unblocks a send to a stuck replica.
+    shutdown(l->fd, SHUT_RDWR);
+    pthread_cond_signal(&l->wake);
+    pthread_mutex_unlock(&l->mu);
+}
+
+// Joins the link thread.
+static void link_free(ReplLink *l) {
+    pthread_join(l->thread, NULL);
+    close(l->fd);
+    for (ReplQueued *q = l->head, *next; q; q = next) {
+        next = q->next;
+        batch_unref(q->batch);
+        free(q);
+    }
+    free(l->dump.dat);
+    pthread_cond_destroy(&l->wake);
+    pthread_mutex_destroy(&l->mu);
+    free(l);
+}
+
+static void link_push(ReplLink *l, ReplBatch *b) {
+    pthread_mutex_lock(&l->mu);
+    if (LOAD(&l->stop, RELAXED)) {
+        pthread_mutex_unlock(&l->mu);
+        return;
+    }
+    if (l->queued + b->len > REPL_BACKLOG_MAX) {
+        const size_t queued = l->queued;
+        pthread_mutex_unlock(&l->mu);
+        logger(stderr, "WARN", "[repl] Replica %d fell %zu bytes behind, dropping it\n", l->fd, queued);
+        link_stop(l);
+        return;
+    }
+    ReplQueued *q = malloc(sizeof(ReplQueued));
+    q->next = NULL;
+    q->batch = b;
+    FAA(&b->refs, 1, RELAXED);
+    if (l->tail) {
+        l->tail->next = q;
+    } else {
+        l->head = q;
+    }
+    l->tail = q;
+    l->queued += b->len;
+    pthread_cond_signal(&l->wake);
+    pthread_mutex_unlock(&l->mu);
+}
+
+static void *repl_sender(void *arg) {
+    Repl *repl = arg;
+    for (;;) {
+        pthread_mutex_lock(&repl->mu);
+        while (dlist_empty(&repl->links) && !repl->stop)
+            pthread_cond_wait(&repl->wake, &repl->mu);
+        if (!repl->stop) {
+            struct timespec ts;
+            deadline_in(&ts, REPL_SEND_MS);
+            pthread_cond_timedwait(&repl->wake, &repl->mu, &ts);
+        }
+        const bool stop = repl->stop;
+        pthread_mutex_unlock(&repl->mu);
+        if (stop)
+            break;
+
+        repl->out.len = 0;
+        for (int i = 0; i < REPL_STRIPES; i++) {
+            ReplStripe *s = &repl->stripes[i];
+            pthread_mutex_lock(&s->lock);
+            if (s->buf.len) {
+                buf_reserve(&repl->out, s->buf.len);
+                buf_put(&repl->out, s->buf.dat, s->buf.len);
+                s->buf.len = 0;
+            }
+            pthread_mutex_unlock(&s->lock);
+        }
+        ReplBatch *b = NULL;
+        if (repl->out.len) {
+            b = malloc(sizeof(ReplBatch) + repl->out.len);
+            atomic_init(&b->refs, 1);
+            b->len = repl->out.len;
+            memcpy(b->dat, repl->out.dat, b->len);
+        }
+
+        pthread_mutex_lock(&repl->mu);
+        for (DList *n = repl->links.next, *next; n != &repl->links; n = next) {
+            next = n->next;
+            ReplLink *l = container_of(n, ReplLink, node);
+            if (LOAD(&l->done, ACQUIRE)) {
+                dlist_detach(n);
+                FAA(&repl->nlinks, -1, RELAXED);
+                link_free(l);
+            } else if (b) {
+                link_push(l, b);
+            }
+        }
+        pthread_mutex_unlock(&repl->mu);
+        if (b)
+            batch_unref(b);
+    }
+    return NULL;
+}
+
+static bool link_emit(void *arg, const uint32_t argc, const vstr *const *argv) {
+    ReplLink *l = arg;
+    buf_put_record(&l->dump, argc, argv);
+    return true;
+}
+
+// Send the dumped records outside the critical section.
+static bool link_flush(ReplLink *l) {
+    smr_offline();
+    const bool ok = send_all(l->fd, l->dump.dat, l->dump.len);
+    smr_online();
+    l->dump.len = 0;
+    return ok;
+}
+
+static void *link_main(void *arg) {
+    ReplLink *l = arg;
+    Repl *repl = l->repl;
+    // Writes that hold a stripe lock from here on see us & are queued, the
+    // dump covers those before.
+    for (int i = 0; i < REPL_STRIPES; i++) {
+        pthread_mutex_lock(&repl->stripes[i].lock);
+        pthread_mutex_unlock(&repl->stripes[i].lock);
+    }
+    const uint64_t start_ms = get_clock_ms();
+    bool ok = true;
+    smr_reg();
+    uint64_t cursor = 0;
+    do {
+        cursor = kv_dump(l->kv, cursor, REPL_DUMP_BUCKETS, link_emit, l);
+        smr_quiescent();
+        if (l->dump.len >= REPL_DUMP_BUF)
+            ok = link_flush(l);
+    } while (cursor && ok && !LOAD(&l->stop, RELAXED));
+    vstr *sync = vstr_new_s("sync");
+    buf_put_record(&l->dump, 1, (const vstr *const *) &sync);
+    vstr_destroy(sync);
+    ok = ok && !LOAD(&l->stop, RELAXED) && link_flush(l);
+    smr_unreg();
+    free(l->dump.dat);
+    l->dump = (ByteBuf) {0};
+    if (ok)
+        logger(stderr, "INFO", "[repl] Replica %d synced in %" PRIu64 " ms\n", l->fd, get_clock_ms() - start_ms);
+
+    while (ok) {
+        pthread_mutex_lock(&l->mu);
+        while (!l->head && !LOAD(&l->stop, RELAXED))
+            pthread_cond_wait(&l->wake, &l->mu);
+        ReplQueued *q = l->head;
+        l->head = l->tail = NULL;
+        l->queued = 0;
+        ok = !LOAD(&l->stop, RELAXED);
+        pthread_mutex_unlock(&l->mu);
+        for (ReplQueued *next; q; q = next) {
+            next = q->next;
+            ok = ok && send_all(l->fd, q->batch->dat, q->batch->len);
+            batch_unref(q->batch);
+            free(q);
+        }
+    }
+    logger(stderr, "INFO", "[repl] Replica %d disconnected\n", l->fd);
+    STORE(&l->done, true, RELEASE);
+    return NULL;
+}
+
+Repl *repl_new(void) {
+    Repl *repl = calloc(1, sizeof(Repl));
+    pthread_mutex_init(&repl->mu, NULL);
+    cond_init_monotonic(&repl->wake);
+    dlist_init(&repl->links);
+    atomic_init(&repl->nlinks, 0);
+    for (int i = 0; i < REPL_STRIPES; i++) {
+        pthread_mutex_init(&repl->stripes[i].lock, NULL);
+    }
+    if (pthread_create(&repl->sender, NULL, repl_sender, repl)) {
+        free(repl);
+        return NULL;
+    }
+    return repl;
+}
+
+void repl_free(Repl *repl) {
+    if (!repl)
+        return;
+    pthread_mutex_lock(&repl->mu);
+    repl->stop = true;
+    pthread_cond_signal(&repl->wake);
+    pthread_mutex_unlock(&repl->mu);
+    pthread_join(repl->sender, NULL);
+    while (!dlist_empty(&repl->links)) {
+        ReplLink *l = container_of(repl->links.next, ReplLink, node);
+        dlist_detach(&l->node);
+        link_stop(l);
+        link_free(l);
+    }
+    for (int i = 0; i < REPL_STRIPES; i++) {
+        pthread_mutex_destroy(&repl->stripes[i].lock);
+        free(repl->stripes[i].buf.dat);
+    }
+    free(repl->out.dat);
+    pthread_cond_destroy(&repl->wake);
+    pthread_mutex_destroy(&repl->mu);
+    free(repl);
+}
+
+uint32_t repl_stripe(const vstr *key) { return (uint32_t) vstr_hash_rapid(key) & (REPL_STRIPES - 1); }
+
+void repl_lock(Repl *repl, const uint32_t stripe) { pthread_mutex_lock(&repl->stripes[stripe].lock); }
+
+void repl_unlock(Repl *repl, const uint32_t stripe) { pthread_mutex_unlock(&repl->stripes[stripe].lock); }
+
+bool repl_trylock(Repl *repl, const uint32_t stripe) { return !pthread_mutex_trylock(&repl->stripes[stripe].lock); }
+
+void repl_append(Repl *repl, const uint32_t stripe, const uint32_t argc, const vstr *const *argv) {
+    // A link registers before its barrier on the stripe locks, ours orders the two.
+    if (!LOAD(&repl->nlinks, RELAXED))
+        return;
+    buf_put_record(&repl->stripes[stripe].buf, argc, argv);
+}
+
+bool repl_add(Repl *repl, KVStore *kv, const int fd) {
+    // The link thread blocks on it.
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    const int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    ReplLink *l = calloc(1, sizeof(ReplLink));
+    l->repl = repl;
+    l->kv = kv;
+    l->fd = fd;
+    pthread_mutex_init(&l->mu, NULL);
+    pthread_cond_init(&l->wake, NULL);
+    atomic_init(&l->stop, false);
+    atomic_init(&l->done, false);
+
+    pthread_mutex_lock(&repl->mu);
+    bool ok = !repl->stop;
+    if (ok) {
+        dlist_insert_before(&repl->links, &l->node);
+        FAA(&repl->nlinks, 1, RELAXED);
+        ok = !pthread_create(&l->thread, NULL, link_main, l);
+        if (ok) {
+            pthread_cond_signal(&repl->wake);
+        } else {
+            dlist_detach(&l->node);
+            FAA(&repl->nlinks, -1, RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&repl->mu);
+    if (!ok) {
+        close(fd);
+        pthread_cond_destroy(&l->wake);
+        pthread_mutex_destroy(&l->mu);
+        free(l);
+        return false;
+    }
+    logger(stderr, "INFO", "[repl] Replica %d connected, syncing\n", fd);
+    return true;
+}
+
+size_t repl_replicas(Repl *repl) { return (size_t) LOAD(&repl->nlinks, RELAXED); }
+
+// --- Replica ---
+
+struct Replica {
+    KVStore *kv;
+    char *host;
+    int port;
+    pthread_t thread;
+    // `fd` & `stop` are under `mu`, `replica_stop` cuts short a retry wait
+    // on `wake`.
+    pthread_mutex_t mu;
+    pthread_cond_t wake;
+    int fd;
+    bool stop;
+    atomic_bool synced;
+    atomic_u64 applied;
+    // Replica thread only, a record to parse & the replies nobody reads.
+    RingBuf rb, out;
+};
+
+// A blocking socket connected to the primary, -1 if it can't be reached.
+static int replica_connect(Replica *r) {
+    char port[8];
+    snprintf(port, sizeof(port), "%d", r->port);
+    const struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *res;
+    if (getaddrinfo(r->host, port, &hints, &res))
+        return -1;
+    int fd = -1;
+    for (const struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) < 0)
+            continue;
+        // Bounds the connect, the one send after it is tiny.
+        const struct timeval tv = {REPLICA_RETRY_MS / 1000, REPLICA_RETRY_MS % 1000 * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// Apply a record past its length, false if it's bad.
+static bool replica_apply(Replica *r, const uint8_t *rec, const uint32_t len) {
+    if (len >= r->rb.cap) {
+        rb_resize(&r->rb, next_pow2(len + 1));
+    }
+    rb_clear(&r->rb);
+    rb_write(&r->rb, rec, len);
+    OwnedRequest oreq = {0};
+    if (!new_owned_req(&oreq, &r->rb, len)) {
+        owned_req_destroy(&oreq);
+        return false;
+    }
+    if (oreq.req.type == CMD_SYNC) {
+        if (!LOAD(&r->synced, RELAXED))
+            logger(stderr, "INFO", "[replica] Synced with %s:%d\n", r->host, r->port);
+        STORE(&r->synced, true, RELEASE);
+    } else {
+        rb_clear(&r->out);
+        smr_enter();
+        do_owned_req(r->kv, &oreq, &r->out);
+        smr_exit();
+    }
+    owned_req_destroy(&oreq);
+    return true;
+}
+
+// Follow the primary over `fd` until the link breaks or we stop.
+static void replica_follow(Replica *r, const int fd) {
+    const uint32_t sync[] = {12, 1, 4};
+    ByteBuf in = {0};
+    buf_reserve(&in, sizeof(sync) + 4);
+    buf_put(&in, sync, sizeof(sync));
+    buf_put(&in, "sync", 4);
+    const bool sent = send_all(fd, in.dat, in.len);
+    in.len = 0;
+    if (!sent) {
+        free(in.dat);
+        return;
+    }
+    logger(stderr, "INFO", "[replica] Connected to %s:%d, syncing\n", r->host, r->port);
+    // Drop the keys we have, the primary sends all of its own.
+    kv_flush(r->kv, NULL, NULL);
+
+    size_t start = 0;
+    for (;;) {
+        buf_reserve(&in, REPLICA_READ_BUF);
+        smr_offline();
+        const ssize_t n = recv(fd, in.dat + in.len, in.cap - in.len, 0);
+        smr_online();
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        in.len += n;
+        bool bad = false;
+        while (in.len - start >= 4) {
+            uint32_t len;
+            memcpy(&len, in.dat + start, 4);
+            if (len < 4 || len > REPL_MAX_RECORD) {
+                bad = true;
+                break;
+            }
+            if (in.len - start - 4 < len) {
+                buf_reserve(&in, 4 + len);
+                break;
+            }
+            if (!replica_apply(r, in.dat + start + 4, len)) {
+                bad = true;
+                break;
+            }
+            start += 4 + len;
+            if (FAA(&r->applied, 1, RELAXED) % REPLICA_QUIESCE == 0)
+                smr_quiescent();
+        }
+        if (bad) {
+            logger(stderr, "ERROR", "[replica] Bad record from %s:%d\n", r->host, r->port);
+            break;
+        }
+        // Keep the partial record at the front.
+        memmove(in.dat, in.dat + start, in.len - start);
+        in.len -= start;
+        start = 0;
+        smr_quiescent();
+    }
+    free(in.dat);
+    logger(stderr, "WARN", "[replica] Lost the link to %s:%d\n", r->host, r->port);
+}
+
+static void *replica_main(void *arg) {
+    Replica *r = arg;
+    smr_reg();
+    for (;;) {
+        smr_offline();
+        const int fd = replica_connect(r);
+        smr_online();
+        pthread_mutex_lock(&r->mu);
+        const bool stop = r->stop;
+        if (!stop)
+            r->fd = fd;
+        pthread_mutex_unlock(&r->mu);
+        if (stop) {
+            if (fd >= 0)
+                close(fd);
+            break;
+        }
+        if (fd >= 0) {
+            replica_follow(r, fd);
+            pthread_mutex_lock(&r->mu);
+            r->fd = -1;
+            pthread_mutex_unlock(&r->mu);
+            close(fd);
+            STORE(&r->synced, false, RELAXED);
+        }
+
+        smr_offline();
+        pthread_mutex_lock(&r->mu);
+        if (!r->stop) {
+            struct timespec ts;
+            deadline_in(&ts, REPLICA_RETRY_MS);
+            pthread_cond_timedwait(&r->wake, &r->mu, &ts);
+        }
+        const bool stopped = r->stop;
+        pthread_mutex_unlock(&r->mu);
+        smr_online();
+        if (stopped)
+            break;
+    }
+    smr_quiescent();
+    smr_unreg();
+    return NULL;
+}
+
+Replica *replica_start(KVStore *kv, const char *host, const int port) {
+    Replica *r = calloc(1, sizeof(Replica));
+    r->kv = kv;
+    r->host = strdup(host);
+    r->port = port;
+    r->fd = -1;
+    pthread_mutex_init(&r->mu, NULL);
+    cond_init_monotonic(&r->wake);
+    atomic_init(&r->synced, false);
+    atomic_init(&r->applied, 0);
+    rb_init(&r->rb, 4096);
+    rb_init(&r->out, 256);
+    if (pthread_create(&r->thread, NULL, replica_main, r)) {
+        rb_destroy(&r->rb);
+        rb_destroy(&r->out);
+        free(r->host);
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+void replica_stop(Replica *r) {
+    if (!r)
+        return;
+    pthread_mutex_lock(&r->mu);
+    r->stop = true;
+    if (r->fd >= 0)
+        shutdown(r->fd, SHUT_RDWR);
+    pthread_cond_signal(&r->wake);
+    pthread_mutex_unlock(&r->mu);
+    pthread_join(r->thread, NULL);
+    rb_destroy(&r->rb);
+    rb_destroy(&r->out);
+    pthread_cond_destroy(&r->wake);
+    pthread_mutex_destroy(&r->mu);
+    free(r->host);
+    free(r);
+}
+
+bool replica_synced(Replica *r) { return LOAD(&r->synced, ACQUIRE); }
+
+uint64_t replica_applied(Replica *r) { return LOAD(&r->applied, RELAXED); }
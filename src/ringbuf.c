@@ -125,6 +125,13 @@ void rb_consume(RingBuf *rb, const size_t len) {
     rb->head = (rb->head + consume_len) % rb->cap;
 }
 
+void rb_truncate(RingBuf *rb, const size_t len) {
+    if (!rb || len >= rb_size(rb))
+        return;
+
+    rb->tail = (rb->head + len) % rb->cap;
+}
+
 void rb_clear(RingBuf *rb) {
     if (!rb)
         return;
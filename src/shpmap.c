@@ -291,3 +291,9 @@ bool shpm_foreach(struct SHPMap *m, bool (*f)(struct BNode *, void *), void *arg
 
     return hpt_foreach(nxt, f, arg) && hpt_foreach(t, f, arg);
 }
+
+static u64 hpt_mem(const struct SHPTable *t) {
+    return t ? sizeof(struct SHPTable) + sizeof(struct Bucket) * (t->mask + 1 + INSERT_RANGE) : 0;
+}
+
+u64 shpm_mem(struct SHPMap *m) { return hpt_mem(m->active) + hpt_mem(m->active->next); }
@@ -0,0 +1,72 @@
+#include "smr.h"
+
+#include <string.h>
+
+#include "ebr.h"
+#include "qsbr.h"
+
+static void nop() {}
+
+static void no_stats(uint64_t *hits, uint64_t *misses) { *hits = *misses = 0; }
+
+const SMR smr_qsbr = {
+        .name = "qsbr",
+        .init = qsbr_init,
+        .destroy = qsbr_destroy,
+        .reg = qsbr_reg,
+        .unreg = qsbr_unreg,
+        .calloc = qsbr_calloc,
+        .retire = qsbr_retire,
+        .free = qsbr_free,
+        .enter = nop,
+        .exit = nop,
+        .quiescent = qsbr_quiescent,
+        .offline = qsbr_offline,
+        .online = qsbr_online,
+        .pool_stats = qsbr_pool_stats,
+};
+
+const SMR smr_ebr = {
+        .name = "ebr",
+        .init = ebr_init,
+        .destroy = ebr_destroy,
+        .reg = ebr_reg,
+        .unreg = ebr_unreg,
+        .calloc = ebr_calloc,
+        .retire = ebr_retire,
+        .free = ebr_free,
+        .enter = ebr_enter,
+        .exit = ebr_exit,
+        .quiescent = ebr_quiescent,
+        // Threads outside a critical section don't hold EBR up.
+        .offline = nop,
+        .online = nop,
+        .pool_stats = no_stats,
+};
+
+static const SMR *smr = &smr_qsbr;
+
+void smr_init(const SMR *backend, const size_t back_logs) {
+    smr = backend;
+    smr->init(back_logs);
+}
+const SMR *smr_find(const char *name) {
+    if (!strcmp(name, smr_qsbr.name))
+        return &smr_qsbr;
+    if (!strcmp(name, smr_ebr.name))
+        return &smr_ebr;
+    return NULL;
+}
+const SMR *smr_backend() { return smr; }
+void smr_destroy() { smr->destroy(); }
+void smr_reg() { smr->reg(); }
+void smr_unreg() { smr->unreg(); }
+void *smr_calloc(const size_t nmemb, const size_t size) { return smr->calloc(nmemb, size); }
+void smr_retire(void *ptr, void (*cb)(void *)) { smr->retire(ptr, cb); }
+void smr_free(void *ptr) { smr->free(ptr); }
+void smr_enter() { smr->enter(); }
+void smr_exit() { smr->exit(); }
+void smr_quiescent() { smr->quiescent(); }
+void smr_offline() { smr->offline(); }
+void smr_online() { smr->online(); }
+void smr_pool_stats(uint64_t *hits, uint64_t *misses) { smr->pool_stats(hits, misses); }
@@ -0,0 +1,548 @@
+#include "snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hpmap.h"
+#include "kvstore.h"
+#include "lz.h"
+#include "smr.h"
+#include "utils.h"
+#include "zset.h"
+
+// Written in chunks of this size, of blocks of keys of about SNAP_BLOCK.
+#define SNAP_BUF (1 << 20)
+#define SNAP_BLOCK (64u << 10)
+// Buckets walked per critical section.
+#define SNAP_SCAN_BUCKETS 1024
+// Pacing sleeps once this far ahead of the rate.
+#define SNAP_MIN_SLEEP_MS 2
+// The walk is cut into 2^SNAP_RANGE_BITS hash ranges, each a section of its
+// own unless it's over SNAP_SECTION_BYTES, then it's cut up further.
+#define SNAP_RANGE_BITS 8
+#define SNAP_SECTION_BYTES (16u << 20)
+// Loads report quiescent every that many keys.
+#define SNAP_LOAD_BATCH 1024
+
+struct Snapshot {
+    char *path;
+    uint64_t rate;
+    atomic_bool compress;
+    pthread_t thread;
+    // Set while a save runs, foreground or background.
+    atomic_bool running;
+    bool started, ok;
+    atomic_u64 last_save;
+    KVStore *kv;
+};
+
+struct SnapWriter {
+    int fd;
+    bool ok, compress;
+    // Keys of the current block, blocks to write.
+    ByteBuf blk, buf;
+    // Bytes flushed, keys encoded & their bytes before compression.
+    uint64_t written, nkeys, raw;
+    // Where the current section starts & its keys, the sections so far.
+    uint64_t sec_off, sec_keys;
+    ByteBuf index;
+    // `get_clock_ms` as of the current chunk & its offset to the wall clock.
+    uint64_t now_ms;
+    int64_t clock_off;
+};
+typedef struct SnapWriter SnapWriter;
+
+static inline void put_u8(ByteBuf *b, const uint8_t v) {
+    buf_reserve(b, 1);
+    b->dat[b->len++] = v;
+}
+
+static inline void put_varint(ByteBuf *b, uint64_t v) {
+    buf_reserve(b, 10);
+    while (v >= 0x80) {
+        b->dat[b->len++] = (uint8_t) (v | 0x80);
+        v >>= 7;
+    }
+    b->dat[b->len++] = (uint8_t) v;
+}
+
+static inline void put_str(ByteBuf *b, const char *s, const size_t len) {
+    put_varint(b, len);
+    buf_put(b, s, len);
+}
+
+static void snap_flush(SnapWriter *w) {
+    if (w->ok && w->buf.len && !write_all(w->fd, w->buf.dat, w->buf.len)) {
+        logger(stderr, "ERROR", "[snapshot] write(): %s\n", strerror(errno));
+        w->ok = false;
+    }
+    w->written += w->buf.len;
+    w->buf.len = 0;
+}
+
+// Frame the keys so far as a block.
+static void snap_seal(SnapWriter *w) {
+    if (!w->blk.len)
+        return;
+    buf_reserve(&w->buf, lz_block_bound(w->blk.len));
+    w->buf.len += lz_block_put(w->blk.dat, w->blk.len, w->buf.dat + w->buf.len, w->compress);
+    w->raw += w->blk.len;
+    w->blk.len = 0;
+    if (w->buf.len >= SNAP_BUF)
+        snap_flush(w);
+}
+
+static void put_head(SnapWriter *w, const uint8_t type, const CSKey expire_ms, const vstr *key) {
+    if (cskey_cmp(expire_ms, NOEXPIRE)) {
+        put_u8(&w->blk, type | SNAP_F_TTL);
+        const int64_t deadline = (int64_t) expire_ms.key + w->clock_off;
+        buf_put(&w->blk, &deadline, 8);
+    } else {
+        put_u8(&w->blk, type);
+    }
+    put_str(&w->blk, key->dat, key->len);
+}
+
+static inline bool expired(const SnapWriter *w, const CSKey expire_ms) {
+    return cskey_cmp(expire_ms, NOEXPIRE) && expire_ms.key <= w->now_ms;
+}
+
+static bool snap_cb(BNode *node, void *arg) {
+    SnapWriter *w = arg;
+    Entry *ent = container_of(node, Entry, node);
+    const vstr *key = entry_key(ent);
+    CSKey expire_ms;
+    switch (LOAD(&ent->type, ACQUIRE)) {
+        case ENT_STR: {
+            // Like GET, the value stays alive for our critical section.
+            const vstr *s = LOAD(&ent->val.s, ACQUIRE);
+            rw_rlock(&ent->lock);
+            expire_ms = ent->expire_ms;
+            rw_runlock(&ent->lock);
+            if (expired(w, expire_ms))
+                return true;
+            if (val_is_int(s)) {
+                put_head(w, SNAP_INT, expire_ms, key);
+                const int64_t n = val_int(s);
+                put_varint(&w->blk, ((uint64_t) n << 1) ^ (uint64_t) (n >> 63));
+            } else {
+                put_head(w, SNAP_STR, expire_ms, key);
+                put_str(&w->blk, s->dat, s->len);
+            }
+            break;
+        }
+        case ENT_ZSET: {
+            rw_rlock(&ent->lock);
+            expire_ms = ent->expire_ms;
+            const ZSet *zs = ent->val.zs;
+            if (expired(w, expire_ms) || !zs->hm.size) {
+                rw_runlock(&ent->lock);
+                return true;
+            }
+            put_head(w, SNAP_ZSET, expire_ms, key);
+            put_varint(&w->blk, zs->hm.size);
+            for (SLNode *sn = zs->sl.head->next[0]; sn; sn = sn->next[0]) {
+                const ZNode *zn = container_of(sn, ZNode, tnode);
+                put_str(&w->blk, zn->name, zn->len);
+                buf_put(&w->blk, &zn->score, 8);
+            }
+            rw_runlock(&ent->lock);
+            break;
+        }
+        default:
+            return true;
+    }
+    w->nkeys++;
+    w->sec_keys++;
+    if (w->blk.len >= SNAP_BLOCK)
+        snap_seal(w);
+    return w->ok;
+}
+
+static inline uint64_t snap_offset(const SnapWriter *w) { return w->written + w->buf.len; }
+
+// End the current section, unless it's empty.
+static void snap_cut(SnapWriter *w) {
+    snap_seal(w);
+    const uint64_t off = snap_offset(w);
+    if (off == w->sec_off)
+        return;
+    const uint64_t sec[3] = {w->sec_off, off - w->sec_off, w->sec_keys};
+    buf_put(&w->index, sec, sizeof(sec));
+    w->sec_off = off;
+    w->sec_keys = 0;
+}
+
+// Sleep off being ahead of the rate, outside any critical section.
+static void snap_pace(const Snapshot *snap, const SnapWriter *w, const uint64_t start_ms) {
+    if (!snap->rate)
+        return;
+    const uint64_t due_ms = snap_offset(w) * 1000 / snap->rate;
+    const uint64_t elapsed = get_clock_ms() - start_ms;
+    if (due_ms < elapsed + SNAP_MIN_SLEEP_MS)
+        return;
+    smr_offline();
+    usleep((useconds_t) MIN(due_ms - elapsed, 1000) * 1000);
+    smr_online();
+}
+
+static int64_t snap_do_save(Snapshot *snap, KVStore *kv) {
+    const size_t plen = strlen(snap->path);
+    char *tmp = malloc(plen + sizeof(".tmp"));
+    memcpy(tmp, snap->path, plen);
+    memcpy(tmp + plen, ".tmp", sizeof(".tmp"));
+    SnapWriter w = {
+            .fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644),
+            .ok = true,
+            .compress = LOAD(&snap->compress, RELAXED),
+            .clock_off = (int64_t) get_unix_ms() - (int64_t) get_clock_ms(),
+    };
+    if (w.fd < 0) {
+        logger(stderr, "ERROR", "[snapshot] open(%s): %s\n", tmp, strerror(errno));
+        free(tmp);
+        return -1;
+    }
+
+    const uint64_t start_ms = get_clock_ms();
+    buf_put(&w.buf, SNAP_MAGIC, SNAP_MAGIC_LEN);
+    w.sec_off = SNAP_MAGIC_LEN;
+    // A first bucket tells the table size, the hash ranges follow from it.
+    w.now_ms = start_ms;
+    uint64_t cursor = chpm_scan(kv->store, 0, 1, snap_cb, &w, entry_eq);
+    while (cursor && w.ok) {
+        const uint64_t bits = CHPM_SCAN_BITS(cursor), pos = CHPM_SCAN_POS(cursor);
+        const uint64_t shift = bits > SNAP_RANGE_BITS ? bits - SNAP_RANGE_BITS : 0;
+        const uint64_t range_end = ((pos >> shift) + 1) << shift;
+        w.now_ms = get_clock_ms();
+        cursor = chpm_scan(kv->store, cursor, MIN(range_end - pos, SNAP_SCAN_BUCKETS), snap_cb, &w, entry_eq);
+        if (!cursor || CHPM_SCAN_POS(cursor) == range_end || snap_offset(&w) + w.blk.len - w.sec_off >= SNAP_SECTION_BYTES)
+            snap_cut(&w);
+        smr_quiescent();
+        snap_pace(snap, &w, start_ms);
+    }
+    snap_cut(&w);
+    // The index of sections, then its length & the keys in all.
+    buf_put(&w.buf, w.index.dat, w.index.len);
+    const uint64_t tail[2] = {w.index.len / SNAP_SECTION_LEN, w.nkeys};
+    buf_put(&w.buf, tail, sizeof(tail));
+    buf_put(&w.buf, SNAP_TAIL, SNAP_MAGIC_LEN);
+    snap_flush(&w);
+    free(w.blk.dat);
+    free(w.buf.dat);
+    free(w.index.dat);
+
+    bool ok = w.ok && !fdatasync(w.fd);
+    ok = !close(w.fd) && ok && !rename(tmp, snap->path);
+    if (ok) {
+        if (!fsync_dir(snap->path))
+            logger(stderr, "WARN", "[snapshot] Can't fsync the directory of %s\n", snap->path);
+        STORE(&snap->last_save, get_unix_ms(), RELAXED);
+        logger(stderr, "INFO",
+               "[snapshot] Saved %" PRIu64 " keys, %" PRIu64 " bytes (%" PRIu64 " raw) to %s in %" PRIu64 " ms\n",
+               w.nkeys, w.written, w.raw, snap->path, get_clock_ms() - start_ms);
+    } else {
+        logger(stderr, "ERROR", "[snapshot] Save to %s failed: %s\n", snap->path, strerror(errno));
+        unlink(tmp);
+    }
+    free(tmp);
+    return ok ? (int64_t) w.nkeys : -1;
+}
+
+Snapshot *snap_new(const char *path, const uint64_t rate) {
+    Snapshot *snap = calloc(1, sizeof(Snapshot));
+    snap->path = strdup(path);
+    snap->rate = rate;
+    return snap;
+}
+
+void snap_set_compress(Snapshot *snap, const bool on) { STORE(&snap->compress, on, RELAXED); }
+
+void snap_free(Snapshot *snap) {
+    if (!snap)
+        return;
+    snap_wait(snap);
+    free(snap->path);
+    free(snap);
+}
+
+int64_t snap_save(Snapshot *snap, KVStore *kv) {
+    bool expected = false;
+    if (!CMPXCHG(&snap->running, &expected, true, ACQ_REL, RELAXED))
+        return SNAP_BUSY;
+    const int64_t n = snap_do_save(snap, kv);
+    STORE(&snap->running, false, RELEASE);
+    return n;
+}
+
+static void *snap_main(void *arg) {
+    Snapshot *snap = arg;
+    smr_reg();
+    snap->ok = snap_do_save(snap, snap->kv) >= 0;
+    smr_quiescent();
+    smr_unreg();
+    STORE(&snap->running, false, RELEASE);
+    return NULL;
+}
+
+bool snap_start(Snapshot *snap, KVStore *kv) {
+    bool expected = false;
+    if (!CMPXCHG(&snap->running, &expected, true, ACQ_REL, RELAXED))
+        return false;
+    // The last one is done, reap it.
+    if (snap->started) {
+        pthread_join(snap->thread, NULL);
+    }
+    snap->kv = kv;
+    snap->started = !pthread_create(&snap->thread, NULL, snap_main, snap);
+    if (!snap->started) {
+        STORE(&snap->running, false, RELEASE);
+    }
+    return snap->started;
+}
+
+bool snap_wait(Snapshot *snap) {
+    if (!snap->started)
+        return false;
+    pthread_join(snap->thread, NULL);
+    snap->started = false;
+    return snap->ok;
+}
+
+bool snap_running(Snapshot *snap) { return LOAD(&snap->running, ACQUIRE); }
+
+uint64_t snap_last_save(Snapshot *snap) { return LOAD(&snap->last_save, RELAXED); }
+
+struct SnapReader {
+    const uint8_t *p, *end;
+};
+typedef struct SnapReader SnapReader;
+
+static inline bool get_raw(SnapReader *r, void *dst, const size_t len) {
+    if ((size_t) (r->end - r->p) < len)
+        return false;
+    memcpy(dst, r->p, len);
+    r->p += len;
+    return true;
+}
+
+static inline bool get_varint(SnapReader *r, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; shift < 64 && r->p < r->end; shift += 7) {
+        const uint8_t b = *r->p++;
+        *v |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// A `vstr` reused across records.
+struct Scratch {
+    vstr *v;
+    size_t cap;
+};
+typedef struct Scratch Scratch;
+
+static inline const vstr *get_vstr(SnapReader *r, Scratch *sc) {
+    uint64_t len;
+    if (!get_varint(r, &len) || len > UINT32_MAX || (uint64_t) (r->end - r->p) < len)
+        return NULL;
+    if (!sc->v || len > sc->cap) {
+        sc->cap = next_pow2(len | 63);
+        sc->v = realloc(sc->v, sizeof(vstr) + sc->cap + 1);
+    }
+    sc->v->len = (uint32_t) len;
+    memcpy(sc->v->dat, r->p, len);
+    sc->v->dat[len] = '\0';
+    r->p += len;
+    return sc->v;
+}
+
+// One key & its TTL, false if the record is bad or the key came up before.
+static bool load_key(KVStore *kv, SnapReader *r, const uint8_t head, Scratch *key_sc, Scratch *val_sc) {
+    int64_t deadline = -1;
+    if (head & SNAP_F_TTL && !get_raw(r, &deadline, 8))
+        return false;
+    const vstr *key = get_vstr(r, key_sc);
+    if (!key)
+        return false;
+    switch (head & ~SNAP_F_TTL) {
+        case SNAP_STR: {
+            const vstr *val = get_vstr(r, val_sc);
+            return val && kv_restore_str(kv, key, val, deadline);
+        }
+        case SNAP_INT: {
+            uint64_t z;
+            return get_varint(r, &z) && kv_restore_int(kv, key, (int64_t) (z >> 1) ^ -(int64_t) (z & 1), deadline);
+        }
+        case SNAP_ZSET: {
+            uint64_t n;
+            if (!get_varint(r, &n))
+                return false;
+            ZSet *zs = malloc(sizeof(ZSet));
+            zset_init(zs);
+            for (uint64_t i = 0; i < n; i++) {
+                uint64_t len;
+                double score;
+                if (!get_varint(r, &len) || (uint64_t) (r->end - r->p) < len + 8) {
+                    zset_destroy(zs);
+                    free(zs);
+                    return false;
+                }
+                const char *name = (const char *) r->p;
+                r->p += len;
+                get_raw(r, &score, 8);
+                zset_insert(zs, name, len, score);
+            }
+            return kv_restore_zset(kv, key, zs, deadline);
+        }
+        default:
+            return false;
+    }
+}
+
+struct SnapLoad {
+    KVStore *kv;
+    const uint8_t *map;
+    // Offset, length & keys per section.
+    const uint8_t *index;
+    uint64_t nsections;
+    atomic_u64 next, loaded;
+    atomic_bool bad;
+};
+typedef struct SnapLoad SnapLoad;
+
+// Take sections until there are none left or one is bad.
+static void load_sections(SnapLoad *ld) {
+    Scratch key_sc = {0}, val_sc = {0};
+    uint8_t *raw_buf = NULL;
+    size_t raw_cap = 0;
+    uint64_t n = 0;
+    for (uint64_t i; !LOAD(&ld->bad, RELAXED) && (i = FAA(&ld->next, 1, RELAXED)) < ld->nsections;) {
+        uint64_t sec[3];
+        memcpy(sec, ld->index + i * SNAP_SECTION_LEN, sizeof(sec));
+        const uint8_t *p = ld->map + sec[0], *end = p + sec[1];
+        uint64_t keys = 0;
+        bool bad = false;
+        while (p < end && !bad) {
+            LZBlock b;
+            const uint8_t *raw = NULL;
+            if (end - p >= LZ_BLOCK_HEAD && lz_block_head(p, &b) && b.len <= (size_t) (end - p - LZ_BLOCK_HEAD)) {
+                if (b.raw_len > raw_cap) {
+                    raw_cap = next_pow2(b.raw_len);
+                    raw_buf = realloc(raw_buf, raw_cap);
+                }
+                raw = lz_block_get(&b, p + LZ_BLOCK_HEAD, raw_buf);
+            }
+            if (!raw) {
+                logger(stderr, "ERROR", "[snapshot] Bad block at offset %zu\n", (size_t) (p - ld->map));
+                bad = true;
+                break;
+            }
+            for (SnapReader r = {raw, raw + b.raw_len}; r.p < r.end;) {
+                uint8_t head;
+                get_raw(&r, &head, 1);
+                if (!load_key(ld->kv, &r, head, &key_sc, &val_sc)) {
+                    logger(stderr, "ERROR", "[snapshot] Bad record in the block at offset %zu\n",
+                           (size_t) (p - ld->map));
+                    bad = true;
+                    break;
+                }
+                keys++;
+                if (++n % SNAP_LOAD_BATCH == 0)
+                    smr_quiescent();
+            }
+            p += LZ_BLOCK_HEAD + b.len;
+        }
+        if (bad || keys != sec[2]) {
+            STORE(&ld->bad, true, RELAXED);
+        }
+        FAA(&ld->loaded, keys, RELAXED);
+    }
+    free(raw_buf);
+    free(key_sc.v);
+    free(val_sc.v);
+}
+
+static void *load_main(void *arg) {
+    smr_reg();
+    load_sections(arg);
+    smr_quiescent();
+    smr_unreg();
+    return NULL;
+}
+
+// The index at the tail, NULL if it doesn't describe the file.
+static const uint8_t *snap_index(const uint8_t *map, const size_t size, uint64_t *nsections, uint64_t *nkeys) {
+    const size_t tail = 2 * 8 + SNAP_MAGIC_LEN;
+    if (size < SNAP_MAGIC_LEN + tail || memcmp(map, SNAP_MAGIC, SNAP_MAGIC_LEN) ||
+        memcmp(map + size - SNAP_MAGIC_LEN, SNAP_TAIL, SNAP_MAGIC_LEN))
+        return NULL;
+    memcpy(nsections, map + size - tail, 8);
+    memcpy(nkeys, map + size - tail + 8, 8);
+    if (*nsections > (size - SNAP_MAGIC_LEN - tail) / SNAP_SECTION_LEN)
+        return NULL;
+    const size_t index_off = size - tail - *nsections * SNAP_SECTION_LEN;
+    const uint8_t *index = map + index_off;
+    uint64_t off = SNAP_MAGIC_LEN, keys = 0;
+    for (uint64_t i = 0; i < *nsections; i++) {
+        uint64_t sec[3];
+        memcpy(sec, index + i * SNAP_SECTION_LEN, sizeof(sec));
+        if (sec[0] != off || sec[1] > index_off - off)
+            return NULL;
+        off += sec[1];
+        keys += sec[2];
+    }
+    return off == index_off && keys == *nkeys ? index : NULL;
+}
+
+int64_t snap_load(KVStore *kv, const char *path, int nthreads) {
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    if (fstat(fd, &st) || !st.st_size) {
+        close(fd);
+        logger(stderr, "ERROR", "[snapshot] Can't read %s\n", path);
+        return -1;
+    }
+    const size_t size = (size_t) st.st_size;
+    uint8_t *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    SnapLoad ld = {.kv = kv, .map = map};
+    uint64_t nkeys;
+    if (!(ld.index = snap_index(map, size, &ld.nsections, &nkeys))) {
+        logger(stderr, "ERROR", "[snapshot] %s is not a snapshot or is truncated\n", path);
+        munmap(map, size);
+        return -1;
+    }
+    // No resizes on the way.
+    chpm_reserve(kv->store, chpm_size(kv->store) + nkeys, entry_eq);
+
+    // The caller loads too.
+    nthreads = (int) MIN((uint64_t) MAX(nthreads, 1), MAX(ld.nsections, 1));
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    for (int i = 1; i < nthreads; i++) {
+        pthread_create(&threads[i], NULL, load_main, &ld);
+    }
+    load_sections(&ld);
+    for (int i = 1; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    munmap(map, size);
+    return LOAD(&ld.bad, RELAXED) ? -1 : (int64_t) LOAD(&ld.loaded, RELAXED);
+}
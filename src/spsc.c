@@ -0,0 +1,61 @@
+#include "spsc.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "utils.h"
+
+spscq *spsc_init(spscq *q, size_t cap) {
+    if (!q) {
+        q = calloc(1, sizeof(spscq));
+        q->is_alloc = true;
+    } else {
+        q->is_alloc = false;
+    }
+    cap = next_pow2(cap < 2 ? 2 : cap);
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    q->tail_cache = 0;
+    q->head_cache = 0;
+    q->mask = cap - 1;
+    q->buf = calloc(cap, sizeof(cnode *));
+    atomic_thread_fence(RELEASE);
+    return q;
+}
+
+void spsc_destroy(spscq *q) {
+    free(q->buf);
+    if (q->is_alloc)
+        free(q);
+}
+
+bool spsc_put(spscq *q, cnode *n) {
+    const size_t head = LOAD(&q->head, RELAXED);
+    if (head - q->tail_cache > q->mask) {
+        q->tail_cache = LOAD(&q->tail, ACQUIRE);
+        if (head - q->tail_cache > q->mask) {
+            // queue is full
+            return false;
+        }
+    }
+    q->buf[head & q->mask] = n;
+    STORE(&q->head, head + 1, RELEASE);
+    return true;
+}
+
+cnode *spsc_pop(spscq *q) {
+    const size_t tail = LOAD(&q->tail, RELAXED);
+    if (tail == q->head_cache) {
+        q->head_cache = LOAD(&q->head, ACQUIRE);
+        if (tail == q->head_cache) {
+            return NULL;
+        }
+    }
+    cnode *n = q->buf[tail & q->mask];
+    STORE(&q->tail, tail + 1, RELEASE);
+    return n;
+}
+
+size_t spsc_size(spscq *q) { return LOAD(&q->head, ACQUIRE) - LOAD(&q->tail, ACQUIRE); }
+size_t spsc_cap(spscq *q) { return q->mask + 1; }
@@ -5,55 +5,185 @@
 
 #include <ev.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "cqueue.h"
-#include "qsbr.h"
+#include "smr.h"
+#include "spsc.h"
+#include "topo.h"
 #include "utils.h"
 
 static pthread_barrier_t barrier;
 
+// Busy-poll `ready` for up to `*spin` rounds, then adapt the budget: grow it
+// when work showed up while spinning, shrink it when the spin was wasted.
+static bool spin_poll(bool (*ready)(void *), void *arg, uint32_t *spin, const uint32_t spin_max) {
+    if (!spin_max)
+        return false;
+    for (uint32_t i = 0; i < *spin; i++) {
+        if (ready(arg)) {
+            *spin = MIN(*spin << 1, spin_max);
+            return true;
+        }
+        cpu_relax();
+    }
+    *spin = MAX(*spin >> 1, MIN(POOL_SPIN_MIN, spin_max));
+    return false;
+}
+
+// Publish the parked state, then recheck `ready` so a producer that missed the
+// flag can't leave a job behind. Returns true if it is safe to block.
+static bool try_park(atomic_bool *sleeping, bool (*ready)(void *), void *arg) {
+    STORE(sleeping, true, RELAXED);
+    atomic_thread_fence(SEQ_CST);
+    if (!ready(arg))
+        return true;
+    STORE(sleeping, false, RELAXED);
+    return false;
+}
+
+// Pairs with `try_park`, called after the job is put on the queue.
+static inline void wake(atomic_bool *sleeping, struct ev_loop *loop, ev_async *w) {
+    atomic_thread_fence(SEQ_CST);
+    if (LOAD(sleeping, RELAXED)) {
+        ev_async_send(loop, w);
+    }
+}
+
+// Go offline while blocked in the loop, so an idle thread doesn't hold up
+// QSBR grace periods.
+static void loop_release(EV_P) { smr_offline(); }
+static void loop_acquire(EV_P) { smr_online(); }
+
+static bool worker_ready(void *arg) { return cq_size(((wctx *) arg)->q); }
+static bool master_ready(void *arg) {
+    ThreadPool *pool = arg;
+    if (LOAD(&pool->master->stop, RELAXED) || pool->held)
+        return true;
+    for (int i = 0; pool->workers && i < pool->nworkers; i++) {
+        if (spsc_size(pool->workers[i]->rq))
+            return true;
+    }
+    return false;
+}
+
+static cnode *held_next(const cnode *p) {
+    cnode *next;
+    memcpy(&next, p->_pad, sizeof(next));
+    return next;
+}
+
+// Move every ring's results to `held`, keeping their order.
+static void pool_hold(ThreadPool *pool) {
+    cnode *p, *none = NULL;
+    for (int i = 0; i < pool->nworkers; i++) {
+        while ((p = spsc_pop(pool->workers[i]->rq))) {
+            memcpy(p->_pad, &none, sizeof(none));
+            if (pool->held_tail) {
+                memcpy(pool->held_tail->_pad, &p, sizeof(p));
+            } else {
+                pool->held = p;
+            }
+            pool->held_tail = p;
+        }
+    }
+}
+
+// Drain the held results, then every worker's ring in turn, returns true once
+// `res_cb` asks to stop.
+static bool pool_drain(ThreadPool *pool) {
+    cnode *p;
+    while ((p = pool->held)) {
+        pool->held = held_next(p);
+        if (!pool->held)
+            pool->held_tail = NULL;
+        if (pool->res_cb(p))
+            return true;
+    }
+    for (int i = 0; pool->workers && i < pool->nworkers; i++) {
+        spscq *rq = pool->workers[i]->rq;
+        while ((p = spsc_pop(rq))) {
+            if (pool->res_cb(p))
+                return true;
+        }
+    }
+    return LOAD(&pool->master->stop, RELAXED);
+}
+
 static void pool_cb(EV_P_ ev_async *w, const int revents) {
     ThreadPool *pool = w->data;
-    cnode *p;
     bool res = false;
-    while ((p = cq_pop(pool->result_q)) && !res) {
-        res = pool->res_cb(p);
-    }
+    STORE(&pool->master->sleeping, false, RELAXED);
+    do {
+        res = pool_drain(pool);
+        smr_quiescent();
+    } while (!res && (spin_poll(master_ready, pool, &pool->spin, pool->spin_max) ||
+                      !try_park(&pool->master->sleeping, master_ready, pool)));
     if (res) {
+        // Leave the flag parked so a restarted pool still wakes the master,
+        // and release workers blocked on a full ring.
+        STORE(&pool->master->sleeping, true, RELAXED);
+        STORE(&pool->master->stop, true, RELAXED);
         logger(stderr, "INFO", "[master] Get stop condition, exiting...\n");
         ev_async_stop(EV_A_ w);
         ev_break(EV_A_ EVBREAK_ALL);
         pool_stop(pool);
     }
-    qsbr_quiescent();
+    smr_quiescent();
 }
 
 static void worker_cb(EV_P_ ev_async *w, const int revents) {
     wctx *ctx = w->data;
     cnode *p, *res;
-    while ((p = cq_pop(ctx->q))) {
-        if ((uint64_t) p == STOP_MAGIC) {
-            logger(stderr, "INFO", "[worker %d] Get STOP_MAGIC, exiting...\n", ctx->id);
-            ev_async_stop(EV_A_ w);
-            ev_break(EV_A_ EVBREAK_ALL);
-            qsbr_quiescent();
-            return;
+    STORE(&ctx->sleeping, false, RELAXED);
+    do {
+        while ((p = cq_pop(ctx->q))) {
+            if ((uint64_t) p == STOP_MAGIC) {
+                logger(stderr, "INFO", "[worker %d] Get STOP_MAGIC, exiting...\n", ctx->id);
+                ev_async_stop(EV_A_ w);
+                ev_break(EV_A_ EVBREAK_ALL);
+                smr_quiescent();
+                return;
+            }
+            res = ctx->f(p);
+            // Jobs don't hold references past their end.
+            smr_quiescent();
+            // Ring full: the master is behind, kick it and give it the core.
+            // NOTE: Once the master is stopping nobody drains the ring, so the
+            // result is dropped like any other undrained one.
+            while (!spsc_put(ctx->rq, res) && !LOAD(ctx->mstop, RELAXED)) {
+                ev_async_send(ctx->master, ctx->rev);
+                sched_yield();
+            }
+            wake(ctx->msleeping, ctx->master, ctx->rev);
         }
-        res = ctx->f(p);
-        cq_put(ctx->rq, res);
-        ev_async_send(ctx->master, ctx->rev);
-    }
-    qsbr_quiescent();
+    } while (spin_poll(worker_ready, ctx, &ctx->spin, ctx->spin_max) ||
+             !try_park(&ctx->sleeping, worker_ready, ctx));
+    smr_quiescent();
 }
 
 static void *worker_f(void *arg) {
-    qsbr_reg();
     wctx *ctx = (wctx *) arg;
+    // Pin before anything is allocated so first-touch lands on our node.
+    if (ctx->cpu >= 0 && topo_pin(pthread_self(), &ctx->cpu, 1)) {
+        logger(stderr, "WARN", "[worker %d] Can't pin to CPU %d\n", ctx->id, ctx->cpu);
+    } else if (ctx->node >= 0) {
+        int cpus[TOPO_MAX_CPUS];
+        const int n = topo_node_cpus(ctx->node, cpus, TOPO_MAX_CPUS);
+        if (n <= 0 || topo_pin(pthread_self(), cpus, n) || topo_local()) {
+            logger(stderr, "WARN", "[worker %d] Can't pin to node %d\n", ctx->id, ctx->node);
+        }
+    }
+    smr_reg();
 
     ctx->loop = ev_loop_new(0);
+    ev_set_loop_release_cb(ctx->loop, loop_release, loop_acquire);
     ev_async_init(&ctx->wev, worker_cb);
     ctx->wev.data = ctx;
     ev_async_start(ctx->loop, &ctx->wev);
@@ -61,17 +191,27 @@ static void *worker_f(void *arg) {
     pthread_barrier_wait(&barrier);
 
     ev_run(ctx->loop, 0);
-    qsbr_quiescent();
-    qsbr_unreg();
+    smr_quiescent();
+    smr_unreg();
     return NULL;
 }
 
 void pool_init(ThreadPool *pool, bool (*res_cb)(cnode *)) {
     if (!pool)
         return;
-    pthread_barrier_init(&barrier, NULL, WORKERS + 1);
     pool->rr_idx = 0;
     pool->res_cb = res_cb;
+    pool->workers = NULL;
+    pool->nworkers = WORKERS;
+    pool->qsize = QUEUESIZE;
+    pool->cpus = NULL;
+    pool->ncpus = 0;
+    pool->numa = false;
+    pool->spin_cfg = POOL_SPIN_AUTO;
+    pool->held = pool->held_tail = NULL;
+    pool->master = calloc(1, sizeof(mctx));
+    atomic_init(&pool->master->sleeping, true);
+    atomic_init(&pool->master->stop, false);
     // get default Loop
     // NOTE: it should be main() calling ev_run on the default loop.
     pool->loop = ev_default_loop(0);
@@ -79,49 +219,115 @@ void pool_init(ThreadPool *pool, bool (*res_cb)(cnode *)) {
     ev_async_init(&pool->rev, pool_cb);
     pool->rev.data = pool;
     ev_async_start(pool->loop, &pool->rev);
-    // setup result queue
-    pool->result_q = cq_init(NULL, QUEUESIZE * WORKERS);
 }
+void pool_set_spin(ThreadPool *pool, const uint32_t spin_max) { pool->spin_cfg = spin_max; }
+void pool_set_workers(ThreadPool *pool, const int nworkers) { pool->nworkers = nworkers > 0 ? nworkers : 1; }
+void pool_set_queue_size(ThreadPool *pool, const size_t qsize) { pool->qsize = qsize > 1 ? qsize : 2; }
+void pool_set_cpus(ThreadPool *pool, const int *cpus, const int n) {
+    free(pool->cpus);
+    pool->cpus = NULL;
+    pool->ncpus = 0;
+    if (n > 0) {
+        pool->cpus = malloc(n * sizeof(int));
+        memcpy(pool->cpus, cpus, n * sizeof(int));
+        pool->ncpus = n;
+    }
+}
+void pool_set_numa(ThreadPool *pool, const bool on) { pool->numa = on; }
 void pool_start(ThreadPool *pool, cnode *(*f)(cnode *) ) {
-    for (int i = 0; i < WORKERS; i++) {
+    int nodes[TOPO_MAX_NODES], nnodes = 0;
+    if (pool->numa && !pool->ncpus) {
+        nnodes = topo_nodes(nodes, TOPO_MAX_NODES);
+    }
+    if (pool->spin_cfg == POOL_SPIN_AUTO) {
+        // Spinning only pays off when every worker & the master can own a core.
+        const long ncores = pool->ncpus ? pool->ncpus : sysconf(_SC_NPROCESSORS_ONLN);
+        pool->spin_max = ncores > pool->nworkers ? POOL_SPIN : 0;
+    } else {
+        pool->spin_max = pool->spin_cfg;
+    }
+    pool->spin = pool->spin_max;
+    pool->rr_idx = 0;
+    STORE(&pool->master->sleeping, true, RELAXED);
+    STORE(&pool->master->stop, false, RELAXED);
+    pool->workers = calloc(pool->nworkers, sizeof(wctx *));
+    pthread_barrier_init(&barrier, NULL, pool->nworkers + 1);
+    for (int i = 0; i < pool->nworkers; i++) {
         wctx *w = calloc(1, sizeof(wctx));
 
         w->id = i;
+        w->cpu = pool->ncpus ? pool->cpus[i % pool->ncpus] : -1;
+        w->node = nnodes ? nodes[i % nnodes] : -1;
         w->rev = &pool->rev;
-        w->q = cq_init(NULL, QUEUESIZE);
-        w->rq = pool->result_q;
+        w->q = cq_init(NULL, pool->qsize);
+        w->rq = spsc_init(NULL, pool->qsize);
         w->f = f;
         w->master = pool->loop;
+        w->msleeping = &pool->master->sleeping;
+        w->mstop = &pool->master->stop;
+        w->spin_max = pool->spin_max;
+        w->spin = pool->spin_max;
+        atomic_init(&w->sleeping, true);
         pthread_create(&w->thread, NULL, worker_f, w);
 
         pool->workers[i] = w;
     }
     pthread_barrier_wait(&barrier);
+    pthread_barrier_destroy(&barrier);
+    // NOTE: The master thread must be registered with QSBR too.
+    ev_set_loop_release_cb(pool->loop, loop_release, loop_acquire);
 }
 void pool_post(ThreadPool *pool, cnode *work) {
     wctx *w = pool->workers[pool->rr_idx];
-    pool->rr_idx = (pool->rr_idx + 1) % WORKERS;
-    cq_put(w->q, work);
-    ev_async_send(w->loop, &w->wev);
+    pool->rr_idx = (pool->rr_idx + 1) % pool->nworkers;
+    // Queue full: the worker is behind, kick it and give it the core. It may
+    // itself wait on its full result ring, so empty those meanwhile. Callers
+    // may be mid-dispatch, `res_cb` runs for them once back in the loop.
+    while (!cq_put(w->q, work)) {
+        pool_hold(pool);
+        ev_async_send(w->loop, &w->wev);
+        sched_yield();
+    }
+    if (pool->held) {
+        ev_async_send(pool->loop, &pool->rev);
+    }
+    wake(&w->sleeping, w->loop, &w->wev);
+}
+void pool_notify_stop(ThreadPool *pool) {
+    STORE(&pool->master->stop, true, RELAXED);
+    ev_async_send(pool->loop, &pool->rev);
+}
+size_t pool_backlog(ThreadPool *pool) {
+    return pool->workers ? cq_size(pool->workers[pool->rr_idx]->q) : 0;
 }
 void pool_stop(ThreadPool *pool) {
-    for (int i = 0; i < WORKERS; i++) {
+    for (int i = 0; i < pool->nworkers; i++) {
         wctx *w = pool->workers[i];
-        cq_put(w->q, (cnode *) STOP_MAGIC);
+        while (!cq_put(w->q, (cnode *) STOP_MAGIC)) {
+            ev_async_send(w->loop, &w->wev);
+            sched_yield();
+        }
         ev_async_send(w->loop, &w->wev);
     }
+    ev_set_loop_release_cb(pool->loop, NULL, NULL);
 
-    for (int i = 0; i < WORKERS; i++) {
-        wctx *w = pool->workers[i];
-        pool->workers[i] = NULL;
+    wctx **workers = pool->workers;
+    pool->workers = NULL;
+    for (int i = 0; i < pool->nworkers; i++) {
+        wctx *w = workers[i];
 
         pthread_join(w->thread, NULL);
         ev_loop_destroy(w->loop);
         cq_destroy(w->q);
+        spsc_destroy(w->rq);
         free(w);
     }
+    free(workers);
 }
 void pool_destroy(ThreadPool *pool) {
     ev_async_stop(pool->loop, &pool->rev);
-    cq_destroy(pool->result_q);
+    free(pool->cpus);
+    pool->cpus = NULL;
+    free(pool->master);
+    pool->master = NULL;
 }
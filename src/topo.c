@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+#include "topo.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// From <numaif.h>, called through syscall() to not depend on libnuma.
+#define MPOL_DEFAULT 0
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
+#define MPOL_LOCAL 4
+
+#define MASK_WORDS (TOPO_MAX_NODES / (8 * sizeof(unsigned long)))
+
+static atomic_bool g_numa;
+
+int topo_parse_cpulist(const char *s, int *cpus, const int max) {
+    int n = 0;
+    while (*s && !isspace((unsigned char) *s)) {
+        char *end;
+        long lo = strtol(s, &end, 10), hi = lo;
+        if (end == s || lo < 0)
+            return -1;
+        s = end;
+        if (*s == '-') {
+            hi = strtol(s + 1, &end, 10);
+            if (end == s + 1 || hi < lo)
+                return -1;
+            s = end;
+        }
+        if (hi >= TOPO_MAX_CPUS || n + (hi - lo + 1) > max)
+            return -1;
+        for (long c = lo; c <= hi; c++) {
+            cpus[n++] = (int) c;
+        }
+        if (*s == ',')
+            s++;
+        else if (*s && !isspace((unsigned char) *s))
+            return -1;
+    }
+    return n;
+}
+
+int topo_node_cpus(const int node, int *cpus, const int max) {
+    char path[64], buf[4096];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    const char *line = fgets(buf, sizeof(buf), f);
+    fclose(f);
+    return line ? topo_parse_cpulist(buf, cpus, max) : -1;
+}
+
+int topo_pin(const pthread_t t, const int *cpus, const int n) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < n; i++) {
+        if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE)
+            return EINVAL;
+        CPU_SET(cpus[i], &set);
+    }
+    return pthread_setaffinity_np(t, sizeof(cpu_set_t), &set);
+}
+
+int topo_nodes(int *nodes, const int max) {
+    char buf[256];
+    FILE *f = fopen("/sys/devices/system/node/online", "r");
+    const char *line = f ? fgets(buf, sizeof(buf), f) : NULL;
+    if (f)
+        fclose(f);
+    const int n = line ? topo_parse_cpulist(buf, nodes, max) : -1;
+    if (n > 0)
+        return n;
+    nodes[0] = 0;
+    return 1;
+}
+
+void topo_set_numa(const bool on) { atomic_store_explicit(&g_numa, on, memory_order_relaxed); }
+bool topo_numa(void) { return atomic_load_explicit(&g_numa, memory_order_relaxed); }
+
+// Shrink `[p, p + len)` to the whole pages inside it, false if there's none.
+static bool page_range(void **p, size_t *len) {
+    const uintptr_t pg = sysconf(_SC_PAGESIZE);
+    const uintptr_t lo = ((uintptr_t) *p + pg - 1) & ~(pg - 1);
+    const uintptr_t hi = ((uintptr_t) *p + *len) & ~(pg - 1);
+    if (hi <= lo)
+        return false;
+    *p = (void *) lo;
+    *len = hi - lo;
+    return true;
+}
+
+static int mbind_mask(void *p, size_t len, const int mode, const unsigned long *mask) {
+    if (!page_range(&p, &len))
+        return 0;
+    if (syscall(SYS_mbind, p, len, mode, mask, mask ? TOPO_MAX_NODES + 1 : 0, 0))
+        return errno;
+    return 0;
+}
+
+int topo_interleave(void *p, const size_t len) {
+    int nodes[TOPO_MAX_NODES];
+    const int n = topo_nodes(nodes, TOPO_MAX_NODES);
+    if (n < 2)
+        return 0;
+    unsigned long mask[MASK_WORDS] = {0};
+    for (int i = 0; i < n && nodes[i] < TOPO_MAX_NODES; i++) {
+        mask[nodes[i] / (8 * sizeof(unsigned long))] |= 1UL << (nodes[i] % (8 * sizeof(unsigned long)));
+    }
+    return mbind_mask(p, len, MPOL_INTERLEAVE, mask);
+}
+
+int topo_bind(void *p, const size_t len, const int node) {
+    int nodes[TOPO_MAX_NODES];
+    if (node < 0 || node >= TOPO_MAX_NODES)
+        return EINVAL;
+    if (topo_nodes(nodes, TOPO_MAX_NODES) < 2)
+        return node ? EINVAL : 0;
+    unsigned long mask[MASK_WORDS] = {0};
+    mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+    return mbind_mask(p, len, MPOL_BIND, mask);
+}
+
+void *topo_map_interleaved(const size_t len) {
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    topo_interleave(p, len);
+    return p;
+}
+
+void topo_unmap(void *p, const size_t len) {
+    if (p) {
+        munmap(p, len);
+    }
+}
+
+int topo_local(void) {
+    int nodes[TOPO_MAX_NODES];
+    if (topo_nodes(nodes, TOPO_MAX_NODES) < 2)
+        return 0;
+    if (!syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0))
+        return 0;
+    // MPOL_LOCAL needs 3.8+, the default policy is local allocation too.
+    return syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0) ? errno : 0;
+}
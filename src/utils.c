@@ -1,7 +1,9 @@
 #include "utils.h"
 
+#include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/futex.h>
 #include <pthread.h>
 #include <rapidhash.h>
 #include <sched.h>
@@ -13,8 +15,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <threads.h>
 #include <time.h>
+#include <unistd.h>
 
 u64 next_pow2(const u64 x) { return x == 1 ? 1 : 1 << (64 - __builtin_clzll(x - 1)); }
 
@@ -127,12 +131,255 @@ uint64_t get_clock_ms() {
     return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
 }
 
+uint64_t get_unix_ms() {
+    struct timespec ts = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+bool write_all(const int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len) {
+        const ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool send_all(const int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len) {
+        const ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool recv_all(const int fd, void *buf, size_t len) {
+    uint8_t *p = buf;
+    while (len) {
+        const ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+void deadline_in(struct timespec *ts, const int ms) {
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_nsec += (long) ms * 1000000;
+    ts->tv_sec += ts->tv_nsec / 1000000000;
+    ts->tv_nsec %= 1000000000;
+}
+
+void cond_init_monotonic(pthread_cond_t *cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+void buf_reserve(ByteBuf *b, const size_t extra) {
+    if (b->len + extra <= b->cap)
+        return;
+    b->cap = next_pow2(b->len + extra);
+    b->dat = realloc(b->dat, b->cap);
+    if (!b->dat)
+        die("realloc()");
+}
+
+void buf_put_record(ByteBuf *b, const uint32_t argc, const vstr *const *argv) {
+    uint32_t len = 4;
+    for (uint32_t i = 0; i < argc; i++) {
+        len += 4 + argv[i]->len;
+    }
+    buf_reserve(b, 4 + len);
+    buf_put(b, &len, 4);
+    buf_put(b, &argc, 4);
+    for (uint32_t i = 0; i < argc; i++) {
+        buf_put(b, &argv[i]->len, 4);
+        buf_put(b, argv[i]->dat, argv[i]->len);
+    }
+}
+
+bool fsync_dir(const char *path) {
+    char *dir = strdup(path);
+    char *slash = strrchr(dir, '/');
+    if (slash) {
+        *(slash == dir ? slash + 1 : slash) = '\0';
+    }
+    const int fd = open(slash ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(dir);
+    if (fd < 0)
+        return false;
+    const bool ok = !fsync(fd);
+    close(fd);
+    return ok;
+}
+
+// Whether `c` is in the class opening at `pat[i]`, `*end` past its `]`.
+static bool glob_class(const char *pat, const size_t plen, size_t i, const unsigned char c, size_t *end) {
+    const bool neg = ++i < plen && (pat[i] == '^' || pat[i] == '!');
+    bool hit = false;
+    for (i += neg; i < plen && pat[i] != ']';) {
+        if (pat[i] == '\\' && i + 1 < plen)
+            i++;
+        unsigned char lo = pat[i++], hi = lo;
+        if (i + 1 < plen && pat[i] == '-' && pat[i + 1] != ']') {
+            i += pat[i + 1] == '\\' && i + 2 < plen;
+            hi = pat[i + 1];
+            i += 2;
+        }
+        hit |= MIN(lo, hi) <= c && c <= MAX(lo, hi);
+    }
+    // An unterminated class runs to the end.
+    *end = MIN(i + 1, plen);
+    return hit != neg;
+}
+
+bool glob_match(const char *pat, const size_t plen, const char *s, const size_t slen) {
+    // Past the last `*` & where it's matched to: on a mismatch it takes one
+    // more char, earlier ones needn't take any more.
+    size_t p = 0, i = 0, star_p = SIZE_MAX, star_i = 0;
+    while (i < slen) {
+        if (p < plen) {
+            size_t next = p + 1;
+            bool hit;
+            switch (pat[p]) {
+                case '*':
+                    star_p = ++p;
+                    star_i = i;
+                    continue;
+                case '?':
+                    hit = true;
+                    break;
+                case '[':
+                    hit = glob_class(pat, plen, p, s[i], &next);
+                    break;
+                case '\\':
+                    next += p + 1 < plen;
+                    hit = pat[next - 1] == s[i];
+                    break;
+                default:
+                    hit = pat[p] == s[i];
+            }
+            if (hit) {
+                p = next;
+                i++;
+                continue;
+            }
+        }
+        if (star_p == SIZE_MAX)
+            return false;
+        p = star_p;
+        i = ++star_i;
+    }
+    while (p < plen && pat[p] == '*') {
+        p++;
+    }
+    return p == plen;
+}
+
+static bool glob_special(const char c) {
+    return c == '*' || c == '?' || c == '[' || c == '\\';
+}
+
+void glob_compile(Glob *g, const char *pat, const size_t plen) {
+    *g = (Glob) {.pat = pat, .plen = plen, .kind = GLOB_EXACT};
+    while (g->prefix < plen && !glob_special(pat[g->prefix])) {
+        g->prefix++;
+    }
+    if (g->prefix == plen)
+        return;
+    // The suffix starts past the last wildcard, class or escape.
+    size_t tail = g->prefix;
+    for (size_t i = g->prefix; i < plen;) {
+        if (pat[i] == '[') {
+            glob_class(pat, plen, i, 0, &i);
+        } else if (pat[i] == '\\') {
+            i = MIN(i + 2, plen);
+        } else if (!glob_special(pat[i++])) {
+            continue;
+        }
+        tail = i;
+    }
+    g->suffix = plen - tail;
+    g->mid = pat + g->prefix;
+    g->mid_len = tail - g->prefix;
+    // Only stars, or stars around a literal.
+    const char *lit = g->mid, *lit_end = g->mid + g->mid_len;
+    while (lit < lit_end && *lit == '*') {
+        lit++;
+    }
+    while (lit_end > lit && lit_end[-1] == '*') {
+        lit_end--;
+    }
+    bool plain = lit > g->mid && lit_end < g->mid + g->mid_len;
+    for (const char *p = lit; p < lit_end && plain; p++) {
+        plain = !glob_special(*p);
+    }
+    if (lit == lit_end) {
+        g->kind = GLOB_ANY;
+    } else if (plain) {
+        g->kind = GLOB_FIND;
+        g->mid = lit;
+        g->mid_len = lit_end - lit;
+    } else {
+        g->kind = GLOB_FULL;
+    }
+}
+
+bool glob_test(const Glob *g, const char *s, const size_t slen) {
+    if (g->kind == GLOB_EXACT)
+        return slen == g->plen && !memcmp(s, g->pat, slen);
+    if (slen < g->prefix + g->suffix || memcmp(s, g->pat, g->prefix) ||
+        memcmp(s + slen - g->suffix, g->pat + g->plen - g->suffix, g->suffix))
+        return false;
+    const char *mid = s + g->prefix;
+    const size_t mid_len = slen - g->prefix - g->suffix;
+    switch (g->kind) {
+        case GLOB_ANY:
+            return true;
+        case GLOB_FIND:
+            // Keys are short, memchr to candidates beats memmem's setup.
+            if (mid_len < g->mid_len)
+                return false;
+            for (const char *p = mid, *last = mid + mid_len - g->mid_len; p <= last; p++) {
+                p = memchr(p, g->mid[0], last - p + 1);
+                if (!p)
+                    return false;
+                if (!memcmp(p + 1, g->mid + 1, g->mid_len - 1))
+                    return true;
+            }
+            return false;
+        default:
+            return glob_match(g->mid, g->mid_len, mid, mid_len);
+    }
+}
+
 void spin_rw_init(spin_rwlock *l) { l->ticket = ATOMIC_VAR_INIT(0); }
 void spin_rw_rlock(spin_rwlock *l) {
     int v = atomic_load_explicit(&l->ticket, memory_order_acquire);
     while (v < 0 ||
            !atomic_compare_exchange_weak_explicit(&l->ticket, &v, v + 1, memory_order_acq_rel, memory_order_relaxed)) {
-        __builtin_ia32_pause();
+        cpu_relax();
         v = atomic_load_explicit(&l->ticket, memory_order_acquire);
     }
 }
@@ -140,8 +387,151 @@ void spin_rw_runlock(spin_rwlock *l) { atomic_fetch_sub_explicit(&l->ticket, 1,
 void spin_rw_wlock(spin_rwlock *l) {
     int v = 0;
     while (!atomic_compare_exchange_weak_explicit(&l->ticket, &v, -1, memory_order_acq_rel, memory_order_relaxed)) {
-        __builtin_ia32_pause();
+        cpu_relax();
         v = 0;
     }
 }
 void spin_rw_wunlock(spin_rwlock *l) { atomic_store_explicit(&l->ticket, 0, memory_order_release); }
+
+// State layout, the scheme of Rust's futex RwLock: the low 30 bits hold the
+// reader count, all ones meaning write locked.
+#define RW_MASK ((1u << 30) - 1)
+#define RW_WRITE_LOCKED RW_MASK
+#define RW_MAX_READERS (RW_MASK - 1)
+#define RW_READERS_WAITING (1u << 30)
+#define RW_WRITERS_WAITING (1u << 31)
+#define RW_SPIN 100
+
+static inline bool rw_unlocked(const u32 s) { return (s & RW_MASK) == 0; }
+static inline bool rw_write_locked(const u32 s) { return (s & RW_MASK) == RW_WRITE_LOCKED; }
+// Waiting writers stop new readers, so they can't starve.
+static inline bool rw_read_lockable(const u32 s) {
+    return (s & RW_MASK) < RW_MAX_READERS && !(s & (RW_READERS_WAITING | RW_WRITERS_WAITING));
+}
+
+static void futex_wait(_Atomic(uint32_t) *addr, const u32 val) {
+    // EAGAIN if `*addr != val` already, EINTR on signals: the callers recheck.
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static int futex_wake(_Atomic(uint32_t) *addr, const int n) {
+    return (int) syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+// Spin while write locked & nobody is parked, it's likely released soon.
+static u32 rw_spin_read(rwlock *l) {
+    u32 s = LOAD(&l->state, RELAXED);
+    for (int i = 0; i < RW_SPIN && rw_write_locked(s) && !(s & (RW_READERS_WAITING | RW_WRITERS_WAITING)); i++) {
+        cpu_relax();
+        s = LOAD(&l->state, RELAXED);
+    }
+    return s;
+}
+
+// Spin while locked & no other writer is parked.
+static u32 rw_spin_write(rwlock *l) {
+    u32 s = LOAD(&l->state, RELAXED);
+    for (int i = 0; i < RW_SPIN && !rw_unlocked(s) && !(s & RW_WRITERS_WAITING); i++) {
+        cpu_relax();
+        s = LOAD(&l->state, RELAXED);
+    }
+    return s;
+}
+
+// Unlocked with waiters: hand over to one writer first, else wake every
+// reader.
+static void rw_wake(rwlock *l, u32 s) {
+    if (s == RW_WRITERS_WAITING) {
+        if (CMPXCHG(&l->state, &s, 0, RELAXED, RELAXED)) {
+            FAA(&l->writer_seq, 1, RELEASE);
+            futex_wake(&l->writer_seq, 1);
+            return;
+        }
+    }
+    if (s == (RW_READERS_WAITING | RW_WRITERS_WAITING)) {
+        if (!CMPXCHG(&l->state, &s, RW_READERS_WAITING, RELAXED, RELAXED))
+            return;
+        FAA(&l->writer_seq, 1, RELEASE);
+        if (futex_wake(&l->writer_seq, 1) > 0)
+            return;
+        // No writer was parked after all, fall back to the readers.
+        s = RW_READERS_WAITING;
+    }
+    if (s == RW_READERS_WAITING && CMPXCHG(&l->state, &s, 0, RELAXED, RELAXED)) {
+        futex_wake(&l->state, INT32_MAX);
+    }
+}
+
+void rw_init(rwlock *l) {
+    atomic_init(&l->state, 0);
+    atomic_init(&l->writer_seq, 0);
+}
+
+void rw_rlock(rwlock *l) {
+    u32 s = LOAD(&l->state, RELAXED);
+    if (rw_read_lockable(s) && WCMPXCHG(&l->state, &s, s + 1, ACQUIRE, RELAXED))
+        return;
+
+    s = rw_spin_read(l);
+    for (;;) {
+        if (rw_read_lockable(s)) {
+            if (WCMPXCHG(&l->state, &s, s + 1, ACQUIRE, RELAXED))
+                return;
+            continue;
+        }
+        assert((s & RW_MASK) != RW_MAX_READERS && "Too many readers");
+        // Announce ourselves before parking, whoever unlocks will wake us.
+        if (!(s & RW_READERS_WAITING)) {
+            if (!CMPXCHG(&l->state, &s, s | RW_READERS_WAITING, RELAXED, RELAXED))
+                continue;
+        }
+        futex_wait(&l->state, s | RW_READERS_WAITING);
+        s = rw_spin_read(l);
+    }
+}
+
+void rw_runlock(rwlock *l) {
+    const u32 s = FAS(&l->state, 1, RELEASE) - 1;
+    // Readers waiting alone mean a write lock, so only writers can be parked
+    // behind the last reader.
+    if (rw_unlocked(s) && (s & RW_WRITERS_WAITING))
+        rw_wake(l, s);
+}
+
+void rw_wlock(rwlock *l) {
+    u32 s = 0;
+    if (CMPXCHG(&l->state, &s, RW_WRITE_LOCKED, ACQUIRE, RELAXED))
+        return;
+
+    s = rw_spin_write(l);
+    // Once parked, we can't tell whether other writers still are: keep the
+    // flag on acquire, the worst case is a spurious wake up.
+    u32 others = 0;
+    for (;;) {
+        if (rw_unlocked(s)) {
+            if (WCMPXCHG(&l->state, &s, s | RW_WRITE_LOCKED | others, ACQUIRE, RELAXED))
+                return;
+            continue;
+        }
+        if (!(s & RW_WRITERS_WAITING)) {
+            if (!CMPXCHG(&l->state, &s, s | RW_WRITERS_WAITING, RELAXED, RELAXED))
+                continue;
+        }
+        others = RW_WRITERS_WAITING;
+        // An unlock may have taken our flag & bumped the sequence before we
+        // read it, then nobody wakes us. Only park while the lock is held &
+        // still flagged: whoever releases it next bumps past `seq`.
+        const u32 seq = LOAD(&l->writer_seq, ACQUIRE);
+        s = LOAD(&l->state, RELAXED);
+        if (rw_unlocked(s) || !(s & RW_WRITERS_WAITING))
+            continue;
+        futex_wait(&l->writer_seq, seq);
+        s = rw_spin_write(l);
+    }
+}
+
+void rw_wunlock(rwlock *l) {
+    const u32 s = FAS(&l->state, RW_WRITE_LOCKED, RELEASE) - RW_WRITE_LOCKED;
+    if (s & (RW_READERS_WAITING | RW_WRITERS_WAITING))
+        rw_wake(l, s);
+}
@@ -68,6 +68,7 @@ void zset_init(ZSet *zset) {
 
     sl_init(&zset->sl);
     shpm_new(&zset->hm, 1024);
+    zset->bytes = 0;
 }
 
 void zset_update(ZSet *zset, ZNode *node, const double score) {
@@ -93,6 +94,7 @@ bool zset_insert(ZSet *zset, const char *name, const size_t len, const double sc
     }
 
     node = znode_new(name, len, score);
+    zset->bytes += sizeof(ZNode) + len;
     shpm_upsert(&zset->hm, &node->hnode, zhcmp);
     sl_insert(&zset->sl, &node->tnode, zcmp);
     return true;
@@ -110,6 +112,7 @@ void zset_delete(ZSet *zset, ZNode *node) {
     const BNode *found = shpm_remove(&zset->hm, &zkey.node, zhkey_cmp);
     sl_delete(&zset->sl, &node->tnode, zcmp);
     shpm_remove(&zset->hm, &node->hnode, zhcmp);
+    zset->bytes -= sizeof(ZNode) + node->len;
     free(node);
 }
 
@@ -176,3 +179,5 @@ void zset_destroy(ZSet *zset) {
     free(zset->sl.head);
     shpm_destroy(&zset->hm);
 }
+
+size_t zset_mem(ZSet *zset) { return sizeof(ZSet) + sizeof(SLNode) + shpm_mem(&zset->hm) + zset->bytes; }
@@ -0,0 +1,423 @@
+// tests/aof_test.cpp
+#include "aof.h"
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <map>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "kvstore.h"
+#include "lz.h"
+#include "parse.h"
+#include "qsbr.h"
+#include "ringbuf.h"
+#include "serialize.h"
+
+class AOFTest : public ::testing::Test {
+protected:
+    std::string path;
+    RingBuf out;
+    AOF *aof = nullptr;
+
+    void SetUp() override {
+        qsbr_init(65536);
+        qsbr_reg();
+        path = ::testing::TempDir() + "aof_test_" + std::to_string(getpid()) + ".aof";
+        unlink(path.c_str());
+        rb_init(&out, 1024);
+    }
+
+    void TearDown() override {
+        rb_destroy(&out);
+        unlink(path.c_str());
+        qsbr_unreg();
+        qsbr_destroy();
+    }
+
+    KVStore *open_kv(const int fsync_ms) {
+        KVStore *kv = kv_new(nullptr);
+        aof = aof_open(path.c_str(), fsync_ms);
+        EXPECT_NE(aof, nullptr);
+        kv_set_aof(kv, aof);
+        return kv;
+    }
+
+    void run(KVStore *kv, const std::vector<std::string> &args) {
+        OwnedRequest oreq;
+        oreq.is_alloc = false;
+        oreq.base.argc = args.size();
+        oreq.base.argv = (vstr **) malloc(oreq.base.argc * sizeof(vstr *));
+        for (size_t i = 0; i < oreq.base.argc; ++i) {
+            oreq.base.argv[i] = vstr_new(args[i].c_str(), args[i].length());
+        }
+        simple2req(&oreq.base, &oreq.req);
+        rb_clear(&out);
+        do_owned_req(kv, &oreq, &out);
+        owned_req_destroy(&oreq);
+    }
+
+    uint8_t out_tag() {
+        uint8_t tag = 0xff;
+        rb_peek0(&out, &tag, 1);
+        return tag;
+    }
+
+    std::string get(KVStore *kv, const std::string &key) {
+        run(kv, {"get", key});
+        uint8_t tag;
+        rb_read(&out, &tag, 1);
+        if (tag != TAG_STR)
+            return "<nil>";
+        uint32_t len;
+        rb_read(&out, (uint8_t *) &len, 4);
+        std::string s(len, '\0');
+        rb_read(&out, (uint8_t *) s.data(), len);
+        return s;
+    }
+
+    int64_t read_int() {
+        uint8_t tag;
+        rb_read(&out, &tag, 1);
+        EXPECT_EQ(tag, TAG_INT);
+        int64_t v = 0;
+        rb_read(&out, (uint8_t *) &v, 8);
+        return v;
+    }
+
+    double zscore(KVStore *kv, const std::string &key, const std::string &name) {
+        run(kv, {"zscore", key, name});
+        uint8_t tag;
+        rb_read(&out, &tag, 1);
+        if (tag != TAG_DBL)
+            return -1;
+        double v;
+        rb_read(&out, (uint8_t *) &v, 8);
+        return v;
+    }
+
+    static off_t file_size(const std::string &p) {
+        std::ifstream f(p, std::ios::binary | std::ios::ate);
+        return f ? (off_t) f.tellg() : -1;
+    }
+};
+
+TEST_F(AOFTest, ReplayRestoresWrites) {
+    KVStore *kv = open_kv(AOF_FSYNC_NEVER);
+    run(kv, {"set", "a", "1"});
+    run(kv, {"set", "b", std::string(200, 'x')});
+    run(kv, {"set", "a", "2"});
+    run(kv, {"incrby", "n", "41"});
+    run(kv, {"incr", "n"});
+    run(kv, {"zadd", "z", "1.5", "m1"});
+    run(kv, {"zadd", "z", "2.5", "m2"});
+    run(kv, {"zrem", "z", "m1"});
+    run(kv, {"set", "gone", "v"});
+    run(kv, {"del", "gone"});
+    // Failed writes stay out of the log.
+    run(kv, {"set", "z", "v"});
+    EXPECT_EQ(out_tag(), TAG_ERR);
+    // Reads too.
+    run(kv, {"get", "a"});
+    kv_clear(kv);
+
+    kv = kv_new(nullptr);
+    EXPECT_EQ(aof_load(kv, path.c_str(), 4), 10);
+    EXPECT_EQ(get(kv, "a"), "2");
+    EXPECT_EQ(get(kv, "b"), std::string(200, 'x'));
+    EXPECT_EQ(get(kv, "n"), "42");
+    EXPECT_EQ(get(kv, "gone"), "<nil>");
+    EXPECT_EQ(zscore(kv, "z", "m1"), -1);
+    EXPECT_EQ(zscore(kv, "z", "m2"), 2.5);
+    kv_clear(kv);
+}
+
+TEST_F(AOFTest, MissingFileIsEmpty) {
+    KVStore *kv = kv_new(nullptr);
+    EXPECT_EQ(aof_load(kv, path.c_str(), 2), 0);
+    kv_clear(kv);
+}
+
+// TTLs are logged as deadlines, they don't restart on replay.
+TEST_F(AOFTest, TTLKeepsDeadline) {
+    KVStore *kv = open_kv(AOF_FSYNC_NEVER);
+    run(kv, {"set", "t", "v"});
+    run(kv, {"pexpire", "t", "100000"});
+    run(kv, {"set", "old", "v"});
+    run(kv, {"pexpireat", "old", std::to_string(get_unix_ms() - 1)});
+    EXPECT_EQ(read_int(), 1);
+    EXPECT_EQ(get(kv, "old"), "<nil>");
+    kv_clear(kv);
+
+    usleep(20000);
+    kv = kv_new(nullptr);
+    EXPECT_EQ(aof_load(kv, path.c_str(), 1), 4);
+    run(kv, {"pttl", "t"});
+    const int64_t ttl = read_int();
+    EXPECT_GT(ttl, 0);
+    EXPECT_LE(ttl, 100000 - 20);
+    EXPECT_EQ(get(kv, "old"), "<nil>");
+    kv_clear(kv);
+}
+
+// A crash mid-write leaves a torn record, it is cut off & the rest replays.
+TEST_F(AOFTest, TornTailIsTruncated) {
+    KVStore *kv = open_kv(AOF_FSYNC_NEVER);
+    run(kv, {"set", "a", "1"});
+    run(kv, {"set", "b", "2"});
+    kv_clear(kv);
+    const off_t size = file_size(path);
+    {
+        std::ofstream f(path, std::ios::binary | std::ios::app);
+        const uint32_t len = 100, argc = 3;
+        f.write((const char *) &len, 4);
+        f.write((const char *) &argc, 4);
+        f.write("\x03\0\0\0set", 7);
+    }
+
+    kv = kv_new(nullptr);
+    EXPECT_EQ(aof_load(kv, path.c_str(), 2), 2);
+    EXPECT_EQ(file_size(path), size);
+    EXPECT_EQ(get(kv, "b"), "2");
+    kv_clear(kv);
+}
+
+TEST_F(AOFTest, CorruptRecordFails) {
+    {
+        std::ofstream f(path, std::ios::binary);
+        const uint32_t len = 12, argc = 1000;
+        f.write((const char *) &len, 4);
+        f.write((const char *) &argc, 4);
+        f.write("\0\0\0\0\0\0\0\0", 8);
+    }
+    KVStore *kv = kv_new(nullptr);
+    EXPECT_EQ(aof_load(kv, path.c_str(), 2), -1);
+    kv_clear(kv);
+}
+
+// Under `always` every reply waits for its fsync, concurrent writers share
+// them. Each key's records keep their order.
+TEST_F(AOFTest, AlwaysGroupCommit) {
+    const int nthreads = 4, n = 300;
+    KVStore *kv = open_kv(AOF_FSYNC_ALWAYS);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nthreads; t++) {
+        threads.emplace_back([&, t]() {
+            qsbr_reg();
+            RingBuf tout;
+            rb_init(&tout, 64);
+            auto req = [&](const std::vector<std::string> &args) {
+                OwnedRequest oreq;
+                oreq.is_alloc = false;
+                oreq.base.argc = args.size();
+                oreq.base.argv = (vstr **) malloc(oreq.base.argc * sizeof(vstr *));
+                for (size_t i = 0; i < oreq.base.argc; ++i)
+                    oreq.base.argv[i] = vstr_new(args[i].c_str(), args[i].length());
+                simple2req(&oreq.base, &oreq.req);
+                rb_clear(&tout);
+                do_owned_req(kv, &oreq, &tout);
+                owned_req_destroy(&oreq);
+            };
+            for (int i = 0; i < n; i++) {
+                req({"incr", "shared"});
+                req({"set", "own" + std::to_string(t), std::to_string(i)});
+                qsbr_quiescent();
+            }
+            rb_destroy(&tout);
+            qsbr_unreg();
+        });
+    }
+    for (auto &t: threads)
+        t.join();
+    kv_clear(kv);
+
+    kv = kv_new(nullptr);
+    EXPECT_EQ(aof_load(kv, path.c_str(), 4), 2 * nthreads * n);
+    EXPECT_EQ(get(kv, "shared"), std::to_string(nthreads * n));
+    for (int t = 0; t < nthreads; t++)
+        EXPECT_EQ(get(kv, "own" + std::to_string(t)), std::to_string(n - 1));
+    kv_clear(kv);
+}
+
+// A write the log can't take is answered with an error, later ones are refused
+// before they apply.
+TEST_F(AOFTest, FailedWritesAreRefused) {
+    KVStore *kv = kv_new(nullptr);
+    aof = aof_open("/dev/full", AOF_FSYNC_ALWAYS);
+    ASSERT_NE(aof, nullptr);
+    kv_set_aof(kv, aof);
+    run(kv, {"set", "k", "v"});
+    EXPECT_EQ(out_tag(), TAG_ERR);
+    EXPECT_TRUE(aof_failed(aof));
+    run(kv, {"set", "k2", "v"});
+    EXPECT_EQ(out_tag(), TAG_ERR);
+    EXPECT_EQ(get(kv, "k2"), "<nil>");
+    kv_clear(kv);
+}
+
+// A rewrite leaves one record per key & member, later writes append to it.
+TEST_F(AOFTest, RewriteCompacts) {
+    KVStore *kv = open_kv(AOF_FSYNC_NEVER);
+    for (int i = 0; i < 1000; i++) {
+        run(kv, {"set", "k" + std::to_string(i % 10), std::to_string(i)});
+        run(kv, {"incr", "ctr"});
+        run(kv, {"zadd", "z", std::to_string(i), "m" + std::to_string(i % 5)});
+    }
+    run(kv, {"pexpire", "k0", "100000"});
+    run(kv, {"set", "dead", "v"});
+    run(kv, {"del", "dead"});
+    run(kv, {"bgrewriteaof"});
+    EXPECT_NE(out_tag(), TAG_ERR);
+    EXPECT_TRUE(aof_rewrite_wait(aof));
+    const uint64_t compacted = aof_size(aof);
+    EXPECT_EQ((off_t) compacted, file_size(path));
+    EXPECT_LT(compacted, 1024);
+    run(kv, {"set", "after", "v"});
+    kv_clear(kv);
+
+    kv = kv_new(nullptr);
+    // 10 SETs, INCR as a SET, 5 ZADDs, the TTL & the SET after.
+    EXPECT_EQ(aof_load(kv, path.c_str(), 2), 18);
+    EXPECT_EQ(get(kv, "k9"), "999");
+    EXPECT_EQ(get(kv, "ctr"), "1000");
+    EXPECT_EQ(zscore(kv, "z", "m4"), 999);
+    EXPECT_EQ(get(kv, "dead"), "<nil>");
+    EXPECT_EQ(get(kv, "after"), "v");
+    run(kv, {"pttl", "k0"});
+    EXPECT_GT(read_int(), 0);
+    kv_clear(kv);
+}
+
+// Writers never stop for a rewrite, what they did meanwhile replays on top of
+// the dump.
+TEST_F(AOFTest, RewriteUnderWrites) {
+    const int nthreads = 3, n = 20000, nkeys = 64;
+    KVStore *kv = open_kv(AOF_FSYNC_NEVER);
+    std::atomic<int> running{nthreads};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nthreads; t++) {
+        threads.emplace_back([&, t]() {
+            qsbr_reg();
+            RingBuf tout;
+            rb_init(&tout, 64);
+            auto req = [&](const std::vector<std::string> &args) {
+                OwnedRequest oreq;
+                oreq.is_alloc = false;
+                oreq.base.argc = args.size();
+                oreq.base.argv = (vstr **) malloc(oreq.base.argc * sizeof(vstr *));
+                for (size_t i = 0; i < oreq.base.argc; ++i)
+                    oreq.base.argv[i] = vstr_new(args[i].c_str(), args[i].length());
+                simple2req(&oreq.base, &oreq.req);
+                rb_clear(&tout);
+                do_owned_req(kv, &oreq, &tout);
+                owned_req_destroy(&oreq);
+            };
+            for (int i = 0; i < n; i++) {
+                const std::string k = std::to_string(i % nkeys);
+                switch (i % 4) {
+                    case 0:
+                        req({"incr", "c" + k});
+                        break;
+                    case 1:
+                        req({"set", "s" + k, std::to_string(i)});
+                        break;
+                    case 2:
+                        req({"zadd", "z", std::to_string(i), "m" + std::to_string(t)});
+                        break;
+                    case 3:
+                        req({(i / 4) % 2 ? "del" : "set", "d" + k, "v"});
+                        break;
+                }
+                if (i % 64 == 0)
+                    qsbr_quiescent();
+            }
+            rb_destroy(&tout);
+            qsbr_unreg();
+            running--;
+        });
+    }
+    int rewrites = 0;
+    while (running) {
+        if (aof_rewrite_start(aof, kv)) {
+            EXPECT_TRUE(aof_rewrite_wait(aof));
+            rewrites++;
+        }
+    }
+    for (auto &t: threads)
+        t.join();
+    EXPECT_GT(rewrites, 0);
+
+    std::map<std::string, std::string> live;
+    for (int k = 0; k < nkeys; k++) {
+        for (const char *p: {"c", "s", "d"}) {
+            const std::string key = p + std::to_string(k);
+            live[key] = get(kv, key);
+        }
+    }
+    std::vector<double> scores;
+    for (int t = 0; t < nthreads; t++)
+        scores.push_back(zscore(kv, "z", "m" + std::to_string(t)));
+    kv_clear(kv);
+
+    kv = kv_new(nullptr);
+    EXPECT_GT(aof_load(kv, path.c_str(), 4), 0);
+    for (const auto &[key, val]: live)
+        EXPECT_EQ(get(kv, key), val) << key;
+    for (int t = 0; t < nthreads; t++)
+        EXPECT_EQ(zscore(kv, "z", "m" + std::to_string(t)), scores[t]);
+    kv_clear(kv);
+}
+
+// Compressed blocks & plain records mix in a log. A torn block is cut off like
+// a torn record, a corrupt one fails the replay.
+TEST_F(AOFTest, CompressedBlocks) {
+    KVStore *kv = open_kv(AOF_FSYNC_NEVER);
+    const std::string val(200, 'v');
+    for (int i = 0; i < 2000; i++) {
+        run(kv, {"set", "k" + std::to_string(i), val});
+    }
+    aof_set_compress(aof, true);
+    EXPECT_TRUE(aof_rewrite_start(aof, kv));
+    EXPECT_TRUE(aof_rewrite_wait(aof));
+    EXPECT_LT(aof_size(aof), 2000 * val.size() / 4);
+    for (int i = 0; i < 1000; i++) {
+        run(kv, {"set", "k" + std::to_string(i), "new"});
+    }
+    aof_set_compress(aof, false);
+    run(kv, {"set", "plain", "p"});
+    kv_clear(kv);
+
+    kv = kv_new(nullptr);
+    EXPECT_EQ(aof_load(kv, path.c_str(), 2), 3001);
+    EXPECT_EQ(get(kv, "k0"), "new");
+    EXPECT_EQ(get(kv, "k1999"), val);
+    EXPECT_EQ(get(kv, "plain"), "p");
+    kv_clear(kv);
+
+    const off_t size = file_size(path);
+    {
+        std::ofstream f(path, std::ios::binary | std::ios::app);
+        const uint32_t mark = AOF_BLOCK_MARK, head[3] = {100, 50, 0};
+        f.write((const char *) &mark, 4);
+        f.write((const char *) head, sizeof(head));
+        f.write("torn", 4);
+    }
+    kv = kv_new(nullptr);
+    EXPECT_EQ(aof_load(kv, path.c_str(), 2), 3001);
+    EXPECT_EQ(file_size(path), size);
+    kv_clear(kv);
+
+    // Into the payload of the first block.
+    {
+        std::fstream f(path, std::ios::binary | std::ios::in | std::ios::out);
+        f.seekp(4 + LZ_BLOCK_HEAD + 20);
+        f.put('\x7f');
+    }
+    kv = kv_new(nullptr);
+    EXPECT_EQ(aof_load(kv, path.c_str(), 2), -1);
+    kv_clear(kv);
+}
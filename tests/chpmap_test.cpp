@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <gtest/gtest.h>
 #include <random>
 #include <thread>
@@ -5,6 +6,7 @@
 
 #include "hpmap.h"
 #include "qsbr.h"
+#include "topo.h"
 #include "utils.h"
 
 
@@ -206,3 +208,136 @@ TEST_F(CHPMapTest, SingleThreadUpsert) {
     delete entry2_new;
     qsbr_quiescent();
 }
+
+// NUMA mode only changes where bucket pages live, the tables (including the
+// ones grown by resize) must behave the same.
+TEST_F(CHPMapTest, NumaInterleavedTables) {
+    topo_set_numa(true);
+    const uint64_t nkeys = 50000;
+    std::vector<TestEntry *> entries(nkeys);
+    for (uint64_t k = 0; k < nkeys; ++k) {
+        entries[k] = new TestEntry{{int_hash_rapid(k)}, k, k};
+        ASSERT_TRUE(chpm_add(cmap, &entries[k]->node, test_entry_eq));
+    }
+    topo_set_numa(false);
+
+    ASSERT_EQ(chpm_size(cmap), nkeys);
+    for (uint64_t k = 0; k < nkeys; ++k) {
+        TestEntry query{{int_hash_rapid(k)}, k, 0};
+        ASSERT_TRUE(chpm_contains(cmap, &query.node, test_entry_eq)) << "Key " << k << " was not found.";
+    }
+    qsbr_quiescent();
+
+    for (auto *entry: entries) {
+        delete entry;
+    }
+}
+
+static bool count_visit(BNode *node, void *arg) {
+    auto *seen = static_cast<std::vector<int> *>(arg);
+    (*seen)[container_of(node, TestEntry, node)->key]++;
+    return true;
+}
+
+// A scan paused between calls while the table grows many times over still
+// visits every key that was there all along exactly once.
+TEST_F(CHPMapTest, ScanStableAcrossResizes) {
+    const uint64_t nkeys = 1000, nlate = 50000;
+    std::vector<TestEntry *> entries(nkeys + nlate);
+    for (uint64_t k = 0; k < nkeys; ++k) {
+        entries[k] = new TestEntry{{int_hash_rapid(k)}, k, k};
+        ASSERT_TRUE(chpm_add(cmap, &entries[k]->node, test_entry_eq));
+    }
+
+    std::vector<int> seen(nkeys + nlate);
+    uint64_t cursor = 0, late = nkeys, calls = 0;
+    do {
+        cursor = chpm_scan(cmap, cursor, 8, count_visit, &seen, test_entry_eq);
+        calls++;
+        // Grow the table between calls.
+        for (int i = 0; i < 500 && late < nkeys + nlate; ++i, ++late) {
+            entries[late] = new TestEntry{{int_hash_rapid(late)}, late, late};
+            ASSERT_TRUE(chpm_add(cmap, &entries[late]->node, test_entry_eq));
+        }
+        qsbr_quiescent();
+    } while (cursor);
+
+    EXPECT_GT(calls, 1u);
+    for (uint64_t k = 0; k < nkeys; ++k) {
+        ASSERT_EQ(seen[k], 1) << "Key " << k;
+    }
+    for (uint64_t k = nkeys; k < late; ++k) {
+        ASSERT_LE(seen[k], 1) << "Key " << k;
+    }
+    // A fresh scan of the grown table sees everything once.
+    std::fill(seen.begin(), seen.end(), 0);
+    cursor = 0;
+    do {
+        cursor = chpm_scan(cmap, cursor, 1024, count_visit, &seen, test_entry_eq);
+    } while (cursor);
+    for (uint64_t k = 0; k < late; ++k) {
+        ASSERT_EQ(seen[k], 1) << "Key " << k;
+    }
+    // Garbage cursors end the scan.
+    EXPECT_EQ(chpm_scan(cmap, ~0ull, 1, count_visit, &seen, test_entry_eq), 0u);
+    qsbr_quiescent();
+
+    for (uint64_t k = 0; k < late; ++k) {
+        delete entries[k];
+    }
+}
+
+// Reserving ahead of the adds leaves nothing for them to resize.
+TEST_F(CHPMapTest, ReserveAvoidsResizes) {
+    const uint64_t nkeys = 100000;
+    chpm_reserve(cmap, nkeys, test_entry_eq);
+    const uint64_t mem = chpm_mem(cmap);
+    EXPECT_GT(mem, nkeys * 8 / 5 * sizeof(uint64_t));
+    std::vector<TestEntry *> entries(nkeys);
+    for (uint64_t k = 0; k < nkeys; ++k) {
+        entries[k] = new TestEntry{{int_hash_rapid(k)}, k, k};
+        ASSERT_TRUE(chpm_add(cmap, &entries[k]->node, test_entry_eq));
+    }
+    EXPECT_EQ(chpm_mem(cmap), mem);
+    // A smaller reserve is a no-op.
+    chpm_reserve(cmap, 10, test_entry_eq);
+    EXPECT_EQ(chpm_mem(cmap), mem);
+    for (uint64_t k = 0; k < nkeys; ++k) {
+        TestEntry query{{int_hash_rapid(k)}, k, 0};
+        ASSERT_TRUE(chpm_contains(cmap, &query.node, test_entry_eq));
+    }
+    qsbr_quiescent();
+    for (auto *entry: entries) {
+        delete entry;
+    }
+}
+
+// Adds in the bucket order of a bigger table, as when copying one over, crowd
+// neighbourhoods long before the load calls for a resize.
+TEST_F(CHPMapTest, HashOrderedAddsGrow) {
+    const uint64_t nkeys = 20000;
+    std::vector<TestEntry *> entries(nkeys);
+    for (uint64_t k = 0; k < nkeys; ++k) {
+        entries[k] = new TestEntry{{int_hash_rapid(k)}, k, k};
+    }
+    std::sort(entries.begin(), entries.end(), [](const TestEntry *a, const TestEntry *b) {
+        return (a->node.hcode & 32767) < (b->node.hcode & 32767);
+    });
+    for (size_t i = 0; i < nkeys; ++i) {
+        BNode *n = &entries[i]->node;
+        if (i % 2) {
+            ASSERT_TRUE(chpm_add(cmap, n, test_entry_eq));
+        } else {
+            ASSERT_EQ(chpm_upsert(cmap, n, test_entry_eq), n);
+        }
+    }
+    EXPECT_EQ(chpm_size(cmap), nkeys);
+    for (uint64_t k = 0; k < nkeys; ++k) {
+        TestEntry query{{int_hash_rapid(k)}, k, 0};
+        ASSERT_TRUE(chpm_contains(cmap, &query.node, test_entry_eq));
+    }
+    qsbr_quiescent();
+    for (auto *entry: entries) {
+        delete entry;
+    }
+}
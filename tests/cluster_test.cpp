@@ -0,0 +1,470 @@
+// tests/cluster_test.cpp
+#include "cluster.h"
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "kvstore.h"
+#include "parse.h"
+#include "qsbr.h"
+#include "ringbuf.h"
+#include "serialize.h"
+
+#define NODES 3
+
+static bool read_full(const int fd, void *buf, size_t len) {
+    auto *p = (uint8_t *) buf;
+    while (len) {
+        const ssize_t n = read(fd, p, len);
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static std::vector<uint8_t> frame(const std::vector<std::string> &args) {
+    std::vector<uint8_t> b(8);
+    const uint32_t argc = args.size();
+    memcpy(b.data() + 4, &argc, 4);
+    for (const auto &a: args) {
+        const uint32_t len = a.size();
+        b.insert(b.end(), (uint8_t *) &len, (uint8_t *) &len + 4);
+        b.insert(b.end(), a.begin(), a.end());
+    }
+    const uint32_t len = b.size() - 4;
+    memcpy(b.data(), &len, 4);
+    return b;
+}
+
+class ClusterTest : public ::testing::Test {
+protected:
+    KVStore *kv[NODES] = {};
+    Cluster *cl[NODES] = {};
+    int lfd[NODES] = {-1, -1, -1};
+    std::thread acceptors[NODES];
+    std::string addrs[NODES], maps[NODES];
+    const char *addr_ptrs[NODES];
+    char root[32] = "/tmp/cluster_test_XXXXXX";
+    RingBuf out;
+    // Plays the target of imports instead of the node when set.
+    std::function<void(int)> importer;
+    std::vector<std::thread> imports;
+
+    void SetUp() override {
+        qsbr_init(65536);
+        qsbr_reg();
+        rb_init(&out, 1024);
+        ASSERT_NE(mkdtemp(root), nullptr);
+        for (int i = 0; i < NODES; i++) {
+            lfd[i] = socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            ASSERT_EQ(bind(lfd[i], (sockaddr *) &addr, sizeof(addr)), 0);
+            ASSERT_EQ(listen(lfd[i], 16), 0);
+            socklen_t len = sizeof(addr);
+            getsockname(lfd[i], (sockaddr *) &addr, &len);
+            addrs[i] = "127.0.0.1:" + std::to_string(ntohs(addr.sin_port));
+            addr_ptrs[i] = addrs[i].c_str();
+            maps[i] = std::string(root) + "/n" + std::to_string(i) + ".map";
+        }
+        for (int i = 0; i < NODES; i++) {
+            start(i);
+            acceptors[i] = std::thread([this, i] { serve(i); });
+        }
+    }
+
+    void TearDown() override {
+        for (auto &t: imports) {
+            t.join();
+        }
+        for (int i = 0; i < NODES; i++) {
+            shutdown(lfd[i], SHUT_RDWR);
+            acceptors[i].join();
+            close(lfd[i]);
+        }
+        for (int i = 0; i < NODES; i++) {
+            stop(i);
+        }
+        rb_destroy(&out);
+        qsbr_quiescent();
+        qsbr_unreg();
+        qsbr_destroy();
+        std::system(("rm -rf " + std::string(root)).c_str());
+    }
+
+    void start(const int i) {
+        kv[i] = kv_new(nullptr);
+        cl[i] = cluster_new(kv[i], i, NODES, addr_ptrs, maps[i].c_str());
+        ASSERT_NE(cl[i], nullptr);
+        kv_set_cluster(kv[i], cl[i]);
+    }
+
+    void stop(const int i) {
+        if (!kv[i])
+            return;
+        kv_clear(kv[i]);
+        kv[i] = nullptr;
+        cl[i] = nullptr;
+    }
+
+    // What the event loop does: CLUSTER IMPORT hands the socket over, other
+    // requests are answered until the peer hangs up.
+    void serve(const int i) {
+        qsbr_reg();
+        RingBuf rb, reply;
+        rb_init(&rb, 4096);
+        rb_init(&reply, 256);
+        for (;;) {
+            qsbr_offline();
+            const int fd = accept(lfd[i], nullptr, nullptr);
+            qsbr_online();
+            if (fd < 0)
+                break;
+            for (;;) {
+                uint32_t len = 0;
+                std::vector<uint8_t> req;
+                qsbr_offline();
+                bool ok = read_full(fd, &len, 4);
+                if (ok) {
+                    req.resize(len);
+                    ok = read_full(fd, req.data(), len);
+                }
+                qsbr_online();
+                if (!ok) {
+                    close(fd);
+                    break;
+                }
+                if (len >= rb.cap)
+                    rb_resize(&rb, next_pow2(len + 1));
+                rb_clear(&rb);
+                rb_write(&rb, req.data(), len);
+                OwnedRequest oreq{};
+                ASSERT_NE(new_owned_req(&oreq, &rb, len), nullptr);
+                if (oreq.req.type == CMD_CLUSTER_IMPORT && importer) {
+                    imports.emplace_back(importer, fd);
+                    owned_req_destroy(&oreq);
+                    break;
+                }
+                if (oreq.req.type == CMD_CLUSTER_IMPORT) {
+                    cluster_import(cl[i], fd, oreq.req.args.slots.first, oreq.req.args.slots.last);
+                    owned_req_destroy(&oreq);
+                    break;
+                }
+                rb_clear(&reply);
+                do_owned_req(kv[i], &oreq, &reply);
+                owned_req_destroy(&oreq);
+                const uint32_t n = rb_size(&reply);
+                std::vector<uint8_t> resp(4 + n);
+                memcpy(resp.data(), &n, 4);
+                rb_read(&reply, resp.data() + 4, n);
+                write(fd, resp.data(), resp.size());
+                qsbr_quiescent();
+            }
+        }
+        rb_destroy(&rb);
+        rb_destroy(&reply);
+        qsbr_unreg();
+    }
+
+    // Poll `pred` for up to 10s, quiescent in between.
+    static bool eventually(const std::function<bool()> &pred) {
+        const auto end = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (std::chrono::steady_clock::now() < end) {
+            if (pred())
+                return true;
+            qsbr_quiescent();
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+        return pred();
+    }
+
+    static OwnedRequest make_req(const std::vector<std::string> &args) {
+        OwnedRequest oreq{};
+        oreq.base.argc = args.size();
+        oreq.base.argv = (vstr **) malloc(oreq.base.argc * sizeof(vstr *));
+        for (size_t i = 0; i < oreq.base.argc; ++i) {
+            oreq.base.argv[i] = vstr_new(args[i].c_str(), args[i].length());
+        }
+        simple2req(&oreq.base, &oreq.req);
+        return oreq;
+    }
+
+    // On node `i`, returns the reply tag.
+    uint8_t run(const int i, const std::vector<std::string> &args) {
+        OwnedRequest oreq = make_req(args);
+        rb_clear(&out);
+        qsbr_quiescent();
+        do_owned_req(kv[i], &oreq, &out);
+        owned_req_destroy(&oreq);
+        uint8_t tag = 0xff;
+        rb_peek0(&out, &tag, 1);
+        return tag;
+    }
+
+    std::string str() {
+        uint8_t tag;
+        uint32_t len;
+        rb_read(&out, &tag, 1);
+        if (tag == TAG_ERR)
+            rb_consume(&out, 4);
+        else if (tag != TAG_STR)
+            return "<nil>";
+        rb_read(&out, (uint8_t *) &len, 4);
+        std::string s(len, '\0');
+        rb_read(&out, (uint8_t *) s.data(), len);
+        return s;
+    }
+
+    int64_t num() {
+        uint8_t tag;
+        int64_t n = 0;
+        rb_read(&out, &tag, 1);
+        rb_read(&out, (uint8_t *) &n, 8);
+        return n;
+    }
+
+    // Through the cluster from node `i`, following redirects like a client.
+    uint8_t route(const std::vector<std::string> &args, int i = 0) {
+        for (int hops = 0; hops < NODES; hops++) {
+            const uint8_t tag = run(i, args);
+            if (tag != TAG_ERR)
+                return tag;
+            uint32_t len = 0;
+            rb_peek(&out, (uint8_t *) &len, 4, 5);
+            std::string s(len, '\0');
+            rb_peek(&out, (uint8_t *) s.data(), len, 9);
+            if (s.rfind("moved ", 0))
+                return tag;
+            i = node_of(s.substr(6));
+        }
+        return 0xff;
+    }
+
+    std::string get(const std::string &key, const int i = 0) {
+        route({"get", key}, i);
+        return str();
+    }
+
+    int node_of(const std::string &addr) {
+        for (int i = 0; i < NODES; i++) {
+            if (addrs[i] == addr)
+                return i;
+        }
+        return -1;
+    }
+
+    // What node `i` has, bypassing the cluster.
+    std::string local_get(const int i, const std::string &key) {
+        OwnedRequest oreq = make_req({"get", key});
+        rb_clear(&out);
+        qsbr_quiescent();
+        kv_apply(kv[i], &oreq, &out);
+        owned_req_destroy(&oreq);
+        return str();
+    }
+
+    static uint32_t slot_of(const std::string &key) {
+        vstr *v = vstr_new(key.c_str(), key.size());
+        const uint32_t slot = cluster_slot(v);
+        vstr_destroy(v);
+        return slot;
+    }
+
+    // A key mapping to a slot in `first` to `last`.
+    static std::string key_in(const uint32_t first, const uint32_t last, int from = 0) {
+        for (int i = from;; i++) {
+            const std::string key = "k" + std::to_string(i);
+            const uint32_t slot = slot_of(key);
+            if (slot >= first && slot <= last)
+                return key;
+        }
+    }
+};
+
+TEST_F(ClusterTest, SlotsSplitEvenly) {
+    EXPECT_EQ(cluster_owner(cl[0], 0), 0);
+    EXPECT_EQ(cluster_owner(cl[0], CLUSTER_SLOTS - 1), NODES - 1);
+    size_t total = 0;
+    for (int i = 0; i < NODES; i++) {
+        total += cluster_owned(cl[i]);
+        EXPECT_NEAR((double) cluster_owned(cl[i]), (double) CLUSTER_SLOTS / NODES, 1.0);
+    }
+    EXPECT_EQ(total, (size_t) CLUSTER_SLOTS);
+
+    ASSERT_EQ(run(1, {"cluster", "keyslot", "foo"}), TAG_INT);
+    EXPECT_EQ(num(), slot_of("foo"));
+    // first, last & address per node.
+    ASSERT_EQ(run(2, {"cluster", "slots"}), TAG_ARR);
+    uint8_t tag;
+    uint32_t n;
+    rb_read(&out, &tag, 1);
+    rb_read(&out, (uint8_t *) &n, 4);
+    EXPECT_EQ(n, 3u * NODES);
+    EXPECT_EQ(num(), 0);
+    EXPECT_EQ(num(), cluster_owned(cl[0]) - 1);
+    EXPECT_EQ(str(), addrs[0]);
+
+    EXPECT_EQ(run(0, {"cluster", "migrate", "1", "x", "2"}), TAG_ERR);
+    EXPECT_EQ(str(), "expect i64");
+    EXPECT_EQ(run(0, {"cluster", "migrate", "0", "99999", "1"}), TAG_ERR);
+    EXPECT_EQ(run(0, {"cluster", "migrate", "0", "10", "0"}), TAG_ERR);
+    // Slots of another node aren't ours to move.
+    EXPECT_EQ(run(0, {"cluster", "migrate", "16000", "16001", "1"}), TAG_ERR);
+    EXPECT_EQ(str(), "slots not all here");
+}
+
+TEST_F(ClusterTest, RedirectsToOwner) {
+    for (int k = 0; k < 300; k++) {
+        const std::string key = "key" + std::to_string(k);
+        const int owner = cluster_owner(cl[0], slot_of(key));
+        ASSERT_EQ(run(owner, {"set", key, "v"}), TAG_NIL) << key;
+        for (int i = 0; i < NODES; i++) {
+            if (i == owner)
+                continue;
+            ASSERT_EQ(run(i, {"get", key}), TAG_ERR);
+            ASSERT_EQ(str(), "moved " + addrs[owner]);
+            ASSERT_EQ(run(i, {"zadd", key, "1", "m"}), TAG_ERR);
+            ASSERT_EQ(local_get(i, key), "<nil>");
+        }
+        ASSERT_EQ(get(key, (owner + 1) % NODES), "v");
+    }
+    // Node-local commands still run anywhere.
+    EXPECT_EQ(run(1, {"stats"}), TAG_ARR);
+}
+
+TEST_F(ClusterTest, MigrateUnderWrites) {
+    const uint32_t first = 0, last = 2047;
+    std::vector<std::string> keys;
+    for (int i = 0; keys.size() < 3000; i++) {
+        const std::string key = "k" + std::to_string(i);
+        ASSERT_EQ(route({"set", key, "0"}), TAG_NIL);
+        if (slot_of(key) <= last)
+            keys.push_back(key);
+    }
+    const std::string zkey = key_in(first, last, 1000000), tkey = key_in(first, last, 2000000);
+    ASSERT_EQ(run(0, {"zadd", zkey, "1.5", "a"}), TAG_INT);
+    ASSERT_EQ(run(0, {"zadd", zkey, "2.5", "b"}), TAG_INT);
+    ASSERT_EQ(run(0, {"set", tkey, "t"}), TAG_NIL);
+    ASSERT_EQ(run(0, {"pexpire", tkey, "100000"}), TAG_INT);
+
+    ASSERT_EQ(run(0, {"cluster", "migrate", std::to_string(first), std::to_string(last), "1"}), TAG_STR);
+    // Every key is rewritten while it moves, wherever it is by then.
+    for (int round = 1; round <= 3; round++) {
+        for (const auto &key: keys) {
+            ASSERT_EQ(route({"set", key, std::to_string(round)}), TAG_NIL) << key;
+        }
+    }
+    ASSERT_EQ(route({"zrem", zkey, "a"}), TAG_INT);
+    ASSERT_TRUE(eventually([&] { return !cluster_busy(cl[0]); }));
+
+    for (int i = 0; i < NODES; i++) {
+        EXPECT_EQ(cluster_owner(cl[i], first), 1) << i;
+        EXPECT_EQ(cluster_owner(cl[i], last), 1) << i;
+        EXPECT_EQ(cluster_owner(cl[i], last + 1), 0) << i;
+    }
+    EXPECT_EQ(cluster_owned(cl[1]), CLUSTER_SLOTS / NODES + (last - first + 1));
+    for (const auto &key: keys) {
+        ASSERT_EQ(local_get(1, key), "3") << key;
+        // The source gave them away.
+        ASSERT_EQ(local_get(0, key), "<nil>") << key;
+        ASSERT_EQ(run(0, {"get", key}), TAG_ERR);
+        ASSERT_EQ(str(), "moved " + addrs[1]);
+    }
+    ASSERT_EQ(run(1, {"zscore", zkey, "b"}), TAG_DBL);
+    ASSERT_EQ(run(1, {"zscore", zkey, "a"}), TAG_NIL);
+    ASSERT_EQ(run(1, {"pttl", tkey}), TAG_INT);
+    EXPECT_GT(num(), 90000);
+    // Slots that stayed are still served.
+    const std::string stay = key_in(last + 1, CLUSTER_SLOTS / NODES - 1);
+    EXPECT_EQ(run(0, {"get", stay}), TAG_STR);
+
+    // The map survives a restart.
+    stop(0);
+    start(0);
+    EXPECT_EQ(cluster_owner(cl[0], first), 1);
+    // Node 0 got the odd slot.
+    EXPECT_EQ(cluster_owned(cl[0]), CLUSTER_SLOTS / NODES + 1 - (last - first + 1));
+}
+
+TEST_F(ClusterTest, BrokenImportIsDropped) {
+    const std::string key = key_in(0, 10);
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(std::stoi(addrs[1].substr(addrs[1].rfind(':') + 1)));
+    ASSERT_EQ(connect(fd, (sockaddr *) &addr, sizeof(addr)), 0);
+    auto b = frame({"cluster", "import", "0", "10"});
+    const auto rec = frame({"set", key, "v"});
+    b.insert(b.end(), rec.begin(), rec.end());
+    ASSERT_EQ(write(fd, b.data(), b.size()), (ssize_t) b.size());
+    ASSERT_TRUE(eventually([&] { return local_get(1, key) == "v"; }));
+    // Node 1 never got the slots, what it imported goes.
+    close(fd);
+    ASSERT_TRUE(eventually([&] { return local_get(1, key) == "<nil>"; }));
+    EXPECT_EQ(cluster_owner(cl[1], 0), 0);
+}
+
+TEST_F(ClusterTest, UnackedFlipHoldsTheSlots) {
+    const std::string key = key_in(0, 10);
+    ASSERT_EQ(run(0, {"set", key, "v"}), TAG_NIL);
+    cluster_set_flip_ms(cl[0], 50);
+    // Takes the import & sits on the SETSLOT until released, then acks it
+    // or hangs up.
+    std::atomic<int> release{0};
+    importer = [&](const int fd) {
+        const uint8_t taken[] = {1, 0, 0, 0, TAG_NIL};
+        bool ok = write(fd, taken, sizeof(taken)) == sizeof(taken);
+        for (std::string rec; ok && rec.find("setslot") == std::string::npos;) {
+            uint32_t len = 0;
+            ok = read_full(fd, &len, 4);
+            rec.resize(len);
+            ok = ok && read_full(fd, rec.data(), len);
+        }
+        while (!release)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        const uint8_t ack = 1;
+        if (release == 2)
+            ok = write(fd, &ack, 1) == 1;
+        close(fd);
+    };
+    auto held = [&] { return run(0, {"get", key}) == TAG_ERR && str() == "tryagain slots are changing hands"; };
+
+    // It hangs up & node 1 doesn't list the slots as its own, they stay.
+    ASSERT_EQ(run(0, {"cluster", "migrate", "0", "10", "1"}), TAG_STR);
+    ASSERT_TRUE(eventually(held));
+    EXPECT_EQ(cluster_owner(cl[0], 0), 0);
+    EXPECT_EQ(run(0, {"get", key_in(11, 100)}), TAG_NIL);
+    release = 1;
+    ASSERT_TRUE(eventually([&] { return !cluster_busy(cl[0]); }));
+    EXPECT_EQ(cluster_owner(cl[0], 0), 0);
+    EXPECT_EQ(run(0, {"get", key}), TAG_STR);
+
+    // A late ack hands them over.
+    release = 0;
+    ASSERT_EQ(run(0, {"cluster", "migrate", "0", "10", "1"}), TAG_STR);
+    ASSERT_TRUE(eventually(held));
+    release = 2;
+    ASSERT_TRUE(eventually([&] { return !cluster_busy(cl[0]); }));
+    EXPECT_EQ(cluster_owner(cl[0], 0), 1);
+    EXPECT_EQ(run(0, {"get", key}), TAG_ERR);
+    EXPECT_EQ(str(), "moved " + addrs[1]);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -3,8 +3,10 @@
 
 #include <cstdio>
 #include <gtest/gtest.h>
+#include <map>
 #include <set>
 #include <string>
+#include <thread>
 #include <unistd.h>
 #include <vector>
 
@@ -96,6 +98,20 @@ protected:
         ASSERT_EQ(val, expected);
     }
 
+    // Helper to read an error & check its code
+    void verify_out_err(uint32_t expected) {
+        uint8_t tag;
+        rb_read(&out, &tag, 1);
+        ASSERT_EQ(tag, TAG_ERR);
+
+        uint32_t code, len;
+        rb_read(&out, (uint8_t *) &code, 4);
+        rb_read(&out, (uint8_t *) &len, 4);
+        std::vector<char> msg(len);
+        rb_read(&out, (uint8_t *) msg.data(), len);
+        ASSERT_EQ(code, expected);
+    }
+
     double read_out_dbl() {
         uint8_t tag;
         rb_read(&out, &tag, 1);
@@ -105,6 +121,30 @@ protected:
         return val;
     }
 
+    // Run STATS and collect the name/value pairs
+    std::map<std::string, int64_t> read_stats() {
+        OwnedRequest stats_req = create_req({"stats"});
+        rb_clear(&out);
+        do_owned_req(kv, &stats_req, &out);
+        free_req(stats_req);
+
+        std::map<std::string, int64_t> stats;
+        uint8_t tag;
+        uint32_t count;
+        rb_read(&out, &tag, 1);
+        EXPECT_EQ(tag, TAG_ARR);
+        rb_read(&out, (uint8_t *) &count, 4);
+        for (uint32_t i = 0; i < count; i += 2) {
+            std::string name = read_out_str();
+            int64_t val;
+            rb_read(&out, &tag, 1);
+            EXPECT_EQ(tag, TAG_INT);
+            rb_read(&out, (uint8_t *) &val, 8);
+            stats[name] = val;
+        }
+        return stats;
+    }
+
     // Helper to create a heap-allocated OwnedRequest
     static OwnedRequest *create_heap_req(const std::vector<std::string> &args) {
         auto *oreq = (OwnedRequest *) calloc(1, sizeof(OwnedRequest));
@@ -145,6 +185,193 @@ TEST_F(KVStoreTest, GetSetDel) {
     free_req(get_after_del_req);
 }
 
+// Values switch between inline in the entry & separately allocated.
+TEST_F(KVStoreTest, InlineAndLargeValues) {
+    const std::string small(ENT_INLINE_MAX, 's'), large(ENT_INLINE_MAX + 1, 'l');
+    for (const auto &v: {small, large, small, large}) {
+        OwnedRequest set_req = create_req({"set", "k", v});
+        do_owned_req(kv, &set_req, &out);
+        verify_out_nil();
+        free_req(set_req);
+        OwnedRequest get_req = create_req({"get", "k"});
+        do_owned_req(kv, &get_req, &out);
+        verify_out_str(v);
+        free_req(get_req);
+    }
+    // Created with a large value
+    OwnedRequest set_req = create_req({"set", "k2", large});
+    do_owned_req(kv, &set_req, &out);
+    verify_out_nil();
+    free_req(set_req);
+    OwnedRequest get_req = create_req({"get", "k2"});
+    do_owned_req(kv, &get_req, &out);
+    verify_out_str(large);
+    free_req(get_req);
+}
+
+TEST_F(KVStoreTest, IncrDecr) {
+    auto run = [&](std::initializer_list<std::string> args) {
+        OwnedRequest req = create_req(args);
+        rb_clear(&out);
+        do_owned_req(kv, &req, &out);
+        free_req(req);
+    };
+    run({"incr", "c"});
+    verify_out_int(1);
+    run({"incrby", "c", "10"});
+    verify_out_int(11);
+    run({"decr", "c"});
+    verify_out_int(10);
+    run({"decrby", "c", "15"});
+    verify_out_int(-5);
+    run({"get", "c"});
+    verify_out_str("-5");
+
+    // Strings holding an integer count, others don't.
+    run({"set", "c", "41"});
+    verify_out_nil();
+    run({"incr", "c"});
+    verify_out_int(42);
+    run({"set", "c", "abc"});
+    verify_out_nil();
+    run({"incr", "c"});
+    verify_out_err(ERR_BAD_ARG);
+    run({"incrby", "c", "x"});
+    verify_out_err(ERR_BAD_ARG);
+
+    // Past 63 bits the value is stored formatted, up to overflow.
+    run({"set", "c", std::to_string(INT64_MAX - 2)});
+    verify_out_nil();
+    run({"incr", "c"});
+    verify_out_int(INT64_MAX - 1);
+    run({"incr", "c"});
+    verify_out_int(INT64_MAX);
+    run({"incr", "c"});
+    verify_out_err(ERR_BAD_ARG);
+    run({"get", "c"});
+    verify_out_str(std::to_string(INT64_MAX));
+    run({"decrby", "c", std::to_string(INT64_MAX)});
+    verify_out_int(0);
+
+    run({"zadd", "z", "1", "m"});
+    verify_out_int(1);
+    run({"incr", "z"});
+    verify_out_err(ERR_BAD_TYP);
+}
+
+TEST_F(KVStoreTest, ConcurrentIncr) {
+    const int nthreads = 4, n = 10000;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nthreads; t++) {
+        threads.emplace_back([&, t]() {
+            qsbr_reg();
+            RingBuf tout;
+            rb_init(&tout, 64);
+            // Half create the key through SET, the others through INCR.
+            OwnedRequest req = create_req({t % 2 ? "incr" : "decrby", "ctr", "-1"});
+            if (t % 2) {
+                free_req(req);
+                req = create_req({"incr", "ctr"});
+            }
+            for (int i = 0; i < n; i++) {
+                rb_clear(&tout);
+                do_owned_req(kv, &req, &tout);
+                qsbr_quiescent();
+            }
+            free_req(req);
+            rb_destroy(&tout);
+            qsbr_unreg();
+        });
+    }
+    for (auto &t: threads)
+        t.join();
+    OwnedRequest get_req = create_req({"get", "ctr"});
+    do_owned_req(kv, &get_req, &out);
+    free_req(get_req);
+    verify_out_str(std::to_string(nthreads * n));
+}
+
+TEST_F(KVStoreTest, MemoryAccounting) {
+    auto run = [&](std::initializer_list<std::string> args) {
+        OwnedRequest req = create_req(args);
+        rb_clear(&out);
+        do_owned_req(kv, &req, &out);
+        free_req(req);
+    };
+    const size_t base = kv_used_memory(kv);
+    run({"set", "k", std::string(200, 'x')});
+    const size_t big = kv_used_memory(kv);
+    EXPECT_GT(big, base + 200);
+    run({"set", "k", "small"});
+    EXPECT_LT(kv_used_memory(kv), big);
+    run({"del", "k"});
+    EXPECT_EQ(kv_used_memory(kv), base);
+
+    for (int i = 0; i < 100; i++)
+        run({"zadd", "z", std::to_string(i), "m" + std::to_string(i)});
+    EXPECT_GT(kv_used_memory(kv), base + 100 * sizeof(ZNode));
+    run({"zrem", "z", "m0"});
+    run({"incr", "c"});
+    run({"del", "z"});
+    run({"del", "c"});
+    EXPECT_EQ(kv_used_memory(kv), base);
+}
+
+// Past the limit writes evict the least frequently used keys, a hot key
+// outlives the cold ones.
+TEST_F(KVStoreTest, MaxmemoryEvictsLFU) {
+    auto run = [&](std::initializer_list<std::string> args) {
+        OwnedRequest req = create_req(args);
+        rb_clear(&out);
+        do_owned_req(kv, &req, &out);
+        free_req(req);
+    };
+    const size_t limit = kv_used_memory(kv) + (256 << 10);
+    kv_set_maxmemory(kv, limit, EVICT_LFU);
+    run({"set", "hot", "v"});
+    for (int i = 0; i < 5000; i++) {
+        run({"set", "key:" + std::to_string(i), std::string(64, 'x')});
+        run({"get", "hot"});
+        qsbr_quiescent();
+    }
+    auto stats = read_stats();
+    EXPECT_GT(stats["evicted_keys"], 0);
+    EXPECT_EQ(stats["maxmemory"], (int64_t) limit);
+    // Each write evicts a few keys at most, it may overshoot a little.
+    EXPECT_LE(stats["used_memory"], (int64_t) (limit + (16 << 10)));
+    EXPECT_LT(stats["keys"], 5001);
+    run({"get", "hot"});
+    verify_out_str("v");
+}
+
+TEST_F(KVStoreTest, MaxmemoryNoEviction) {
+    auto run = [&](std::initializer_list<std::string> args) {
+        OwnedRequest req = create_req(args);
+        rb_clear(&out);
+        do_owned_req(kv, &req, &out);
+        free_req(req);
+    };
+    kv_set_maxmemory(kv, kv_used_memory(kv) + (4 << 10), EVICT_NONE);
+    int i = 0;
+    for (;; i++) {
+        run({"set", "key:" + std::to_string(i), std::string(100, 'x')});
+        uint8_t tag = 0;
+        rb_peek0(&out, &tag, 1);
+        if (tag == TAG_ERR)
+            break;
+        ASSERT_LT(i, 1000);
+    }
+    verify_out_err(ERR_OOM);
+    EXPECT_EQ(read_stats()["evicted_keys"], 0);
+    // Reads & deletes still go through, freeing room for writes.
+    run({"get", "key:0"});
+    verify_out_str(std::string(100, 'x'));
+    run({"del", "key:0"});
+    verify_out_int(1);
+    run({"set", "key:0", "v"});
+    verify_out_nil();
+}
+
 TEST_F(KVStoreTest, KeysCommand) {
     OwnedRequest set_req1 = create_req({"set", "key1", "val1"});
     do_owned_req(kv, &set_req1, &out);
@@ -182,6 +409,109 @@ TEST_F(KVStoreTest, KeysCommand) {
     ASSERT_EQ(keys.count("zkey1"), 1);
 
     free_req(keys_req);
+
+    // keys pattern
+    OwnedRequest match_req = create_req({"keys", "key*"});
+    rb_clear(&out);
+    do_owned_req(kv, &match_req, &out);
+    rb_read(&out, &tag, 1);
+    ASSERT_EQ(tag, TAG_ARR);
+    rb_read(&out, (uint8_t *) &count, 4);
+    ASSERT_EQ(count, 2);
+    keys.clear();
+    for (uint32_t i = 0; i < count; ++i) {
+        keys.insert(read_out_str());
+    }
+    ASSERT_EQ(keys, (std::set<std::string>{"key1", "key2"}));
+    free_req(match_req);
+}
+
+// Walks in calls of a few buckets, each key present throughout seen once as the
+// table grows under it.
+TEST_F(KVStoreTest, ScanCommand) {
+    auto run = [&](std::initializer_list<std::string> args) {
+        OwnedRequest req = create_req(args);
+        rb_clear(&out);
+        do_owned_req(kv, &req, &out);
+        free_req(req);
+    };
+    // Next cursor & the keys of one call.
+    auto scan = [&](int64_t cursor, std::initializer_list<std::string> opts) {
+        std::vector<std::string> args = {"scan", std::to_string(cursor)};
+        args.insert(args.end(), opts);
+        OwnedRequest req = create_req(args);
+        rb_clear(&out);
+        do_owned_req(kv, &req, &out);
+        free_req(req);
+        uint8_t tag;
+        uint32_t n;
+        rb_read(&out, &tag, 1);
+        EXPECT_EQ(tag, TAG_ARR);
+        rb_read(&out, (uint8_t *) &n, 4);
+        EXPECT_EQ(n, 2);
+        rb_read(&out, &tag, 1);
+        EXPECT_EQ(tag, TAG_INT);
+        int64_t next;
+        rb_read(&out, (uint8_t *) &next, 8);
+        rb_read(&out, &tag, 1);
+        EXPECT_EQ(tag, TAG_ARR);
+        rb_read(&out, (uint8_t *) &n, 4);
+        std::vector<std::string> keys;
+        for (uint32_t i = 0; i < n; i++) {
+            keys.push_back(read_out_str());
+        }
+        return std::make_pair(next, keys);
+    };
+
+    const int n = 2000;
+    for (int i = 0; i < n; i++) {
+        run({"set", "key:" + std::to_string(i), "v"});
+    }
+    std::map<std::string, int> seen;
+    int64_t cursor = 0, calls = 0, added = 0;
+    do {
+        auto [next, keys] = scan(cursor, {"count", "16"});
+        for (const auto &k: keys) {
+            seen[k]++;
+        }
+        cursor = next;
+        // Enough to grow the table a few times over.
+        for (int i = 0; i < 64; i++, added++) {
+            run({"set", "new:" + std::to_string(added), "v"});
+        }
+        ASSERT_LT(++calls, 100000);
+    } while (cursor);
+    EXPECT_GT(calls, 1);
+    for (int i = 0; i < n; i++) {
+        EXPECT_EQ(seen["key:" + std::to_string(i)], 1) << i;
+    }
+    for (const auto &[k, times]: seen) {
+        EXPECT_EQ(times, 1) << k;
+    }
+
+    // MATCH filters what the walk visits.
+    std::set<std::string> matched;
+    cursor = 0;
+    do {
+        auto [next, keys] = scan(cursor, {"match", "key:1?[05]", "count", "1000"});
+        matched.insert(keys.begin(), keys.end());
+        cursor = next;
+    } while (cursor);
+    std::set<std::string> expected;
+    for (int i = 100; i < 200; i++) {
+        if (i % 5 == 0)
+            expected.insert("key:" + std::to_string(i));
+    }
+    EXPECT_EQ(matched, expected);
+
+    for (const auto &bad: std::vector<std::vector<std::string>>{
+                 {"scan", "x"}, {"scan", "0", "count", "0"}, {"scan", "0", "count"}, {"scan", "0", "limit", "1"}}) {
+        OwnedRequest req = create_req(bad);
+        rb_clear(&out);
+        do_owned_req(kv, &req, &out);
+        free_req(req);
+        verify_out_err(ERR_BAD_ARG);
+    }
 }
 
 TEST_F(KVStoreTest, ZSetOperations) {
@@ -314,6 +644,244 @@ TEST_F(KVStoreTest, Expiration) {
     free_req(get_expired_req);
 }
 
+TEST_F(KVStoreTest, InlineDispatchAndStats) {
+    OwnedRequest set_req = create_req({"set", "ikey", "ival"});
+    do_owned_req(kv, &set_req, &out);
+    verify_out_nil();
+    free_req(set_req);
+
+    // GET on a small key runs on the calling thread and writes a framed reply.
+    Conn c{};
+    rb_init(&c.outgo, 64);
+    kv_dispatch(kv, &c, create_heap_req({"get", "ikey"}));
+    ASSERT_EQ(c.inflight, 0);
+    uint32_t len = 0;
+    ASSERT_EQ(rb_read(&c.outgo, (uint8_t *) &len, 4), 4);
+    ASSERT_EQ(len, rb_size(&c.outgo));
+    out_buf(&out, &c.outgo);
+    verify_out_str("ival");
+    rb_destroy(&c.outgo);
+
+    auto stats = read_stats();
+    EXPECT_EQ(stats["keys"], 1);
+    EXPECT_EQ(stats["inline_reqs"], 1);
+    EXPECT_EQ(stats["offload_reqs"], 0);
+}
+
+// Entries freed by DEL come back from the QSBR pools on the next SET.
+TEST_F(KVStoreTest, StatsRecycle) {
+    auto before = read_stats();
+    OwnedRequest set_req = create_req({"set", "rkey", "v"});
+    OwnedRequest del_req = create_req({"del", "rkey"});
+    do_owned_req(kv, &set_req, &out);
+    do_owned_req(kv, &del_req, &out);
+    // Single registered thread, each quiescent state ends a grace period
+    for (int i = 0; i < 3; i++)
+        qsbr_quiescent();
+    do_owned_req(kv, &set_req, &out);
+    free_req(set_req);
+    free_req(del_req);
+
+    auto after = read_stats();
+    EXPECT_GE(after["recycle_hits"], before["recycle_hits"] + 1);
+    EXPECT_GE(after["recycle_misses"], before["recycle_misses"]);
+}
+
+// GETs of a hot key race SETs swapping its value, every reply is one of the
+// values whole.
+TEST_F(KVStoreTest, ConcurrentGetSet) {
+    const std::string small(8, 'a'), large(1000, 'b');
+    std::atomic<bool> stop{false};
+    std::atomic<int> bad{0};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 3; t++) {
+        readers.emplace_back([&]() {
+            qsbr_reg();
+            RingBuf rout;
+            rb_init(&rout, 2048);
+            OwnedRequest get_req = create_req({"get", "hot"});
+            while (!stop) {
+                rb_clear(&rout);
+                do_owned_req(kv, &get_req, &rout);
+                uint8_t tag;
+                uint32_t len = 0;
+                rb_read(&rout, &tag, 1);
+                if (tag == TAG_NIL)
+                    continue;
+                rb_read(&rout, (uint8_t *) &len, 4);
+                std::string got(len, '\0');
+                rb_read(&rout, (uint8_t *) got.data(), len);
+                if (tag != TAG_STR || (got != small && got != large))
+                    bad++;
+                qsbr_quiescent();
+            }
+            free_req(get_req);
+            rb_destroy(&rout);
+            qsbr_unreg();
+        });
+    }
+    OwnedRequest set_small = create_req({"set", "hot", small});
+    OwnedRequest set_large = create_req({"set", "hot", large});
+    for (int i = 0; i < 20000; i++) {
+        rb_clear(&out);
+        do_owned_req(kv, i % 2 ? &set_large : &set_small, &out);
+        qsbr_quiescent();
+    }
+    stop = true;
+    for (auto &t: readers)
+        t.join();
+    free_req(set_small);
+    free_req(set_large);
+    EXPECT_EQ(bad, 0);
+}
+
+// Writers race on the INIT -> STR transition & the unlocked swap after it.
+TEST_F(KVStoreTest, ConcurrentSetDel) {
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 4; t++) {
+        writers.emplace_back([&, t]() {
+            qsbr_reg();
+            RingBuf wout;
+            rb_init(&wout, 64);
+            OwnedRequest set_req = create_req({"set", "hot", std::string(16 + t, 'a' + t)});
+            OwnedRequest del_req = create_req({"del", "hot"});
+            for (int i = 0; i < 5000; i++) {
+                rb_clear(&wout);
+                do_owned_req(kv, t == 0 && i % 8 == 0 ? &del_req : &set_req, &wout);
+                qsbr_quiescent();
+            }
+            free_req(set_req);
+            free_req(del_req);
+            rb_destroy(&wout);
+            qsbr_unreg();
+        });
+    }
+    for (auto &t: writers)
+        t.join();
+
+    OwnedRequest get_req = create_req({"get", "hot"});
+    do_owned_req(kv, &get_req, &out);
+    free_req(get_req);
+    uint8_t tag;
+    uint32_t len = 0;
+    rb_read(&out, &tag, 1);
+    ASSERT_EQ(tag, TAG_STR);
+    rb_read(&out, (uint8_t *) &len, 4);
+    std::string got(len, '\0');
+    rb_read(&out, (uint8_t *) got.data(), len);
+    ASSERT_GE(len, 16u);
+    EXPECT_EQ(got, std::string(len, 'a' + (len - 16)));
+}
+
+// Writers get through while readers keep scanning the same ZSet.
+TEST_F(KVStoreTest, ConcurrentZaddZquery) {
+    for (int i = 0; i < 1000; i++) {
+        OwnedRequest req = create_req({"zadd", "hz", std::to_string(i), "m" + std::to_string(i)});
+        rb_clear(&out);
+        do_owned_req(kv, &req, &out);
+        free_req(req);
+    }
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 3; t++) {
+        readers.emplace_back([&]() {
+            qsbr_reg();
+            RingBuf rout;
+            rb_init(&rout, 4096);
+            OwnedRequest query = create_req({"zquery", "hz", "0", "", "0", "2000"});
+            while (!stop) {
+                rb_clear(&rout);
+                do_owned_req(kv, &query, &rout);
+                qsbr_quiescent();
+            }
+            free_req(query);
+            rb_destroy(&rout);
+            qsbr_unreg();
+        });
+    }
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 2; t++) {
+        writers.emplace_back([&, t]() {
+            qsbr_reg();
+            RingBuf wout;
+            rb_init(&wout, 64);
+            for (int i = 0; i < 2000; i++) {
+                OwnedRequest req = create_req({"zadd", "hz", std::to_string(-i), "w" + std::to_string(t)});
+                rb_clear(&wout);
+                do_owned_req(kv, &req, &wout);
+                free_req(req);
+                qsbr_quiescent();
+            }
+            rb_destroy(&wout);
+            qsbr_unreg();
+        });
+    }
+    for (auto &t: writers)
+        t.join();
+    stop = true;
+    for (auto &t: readers)
+        t.join();
+
+    OwnedRequest zscore = create_req({"zscore", "hz", "w1"});
+    rb_clear(&out);
+    do_owned_req(kv, &zscore, &out);
+    free_req(zscore);
+    uint8_t tag;
+    double score;
+    rb_read(&out, &tag, 1);
+    ASSERT_EQ(tag, TAG_DBL);
+    rb_read(&out, (uint8_t *) &score, sizeof(score));
+    EXPECT_EQ(score, -1999);
+}
+
+TEST_F(KVStoreTest, DispatchOffload) {
+    struct ev_loop *loop = ev_default_loop(0);
+    kv_start(kv);
+    OwnedRequest set_req = create_req({"set", "big", std::string(INLINE_COST_CAP, 'x')});
+    do_owned_req(kv, &set_req, &out);
+    verify_out_nil();
+    free_req(set_req);
+
+    Conn c{};
+    rb_init(&c.outgo, 64);
+    auto drain = [&] {
+        while (c.inflight > 0) {
+            ev_run(loop, EVRUN_ONCE);
+        }
+    };
+
+    // Writes never run inline.
+    kv_dispatch(kv, &c, create_heap_req({"set", "k", "v"}));
+    EXPECT_EQ(c.inflight, 1);
+    drain();
+
+    // Values above the inline cap are offloaded even in INLINE_ALWAYS.
+    kv_set_inline(kv, INLINE_ALWAYS, INLINE_COST_MAX);
+    kv_dispatch(kv, &c, create_heap_req({"get", "big"}));
+    EXPECT_EQ(c.inflight, 1);
+    drain();
+
+    // A reply still pending on a worker keeps the next read off the I/O thread.
+    kv_dispatch(kv, &c, create_heap_req({"set", "k", "v2"}));
+    kv_dispatch(kv, &c, create_heap_req({"get", "k"}));
+    EXPECT_EQ(c.inflight, 2);
+    drain();
+
+    // INLINE_OFF offloads cheap reads too.
+    kv_set_inline(kv, INLINE_OFF, INLINE_COST_MAX);
+    kv_dispatch(kv, &c, create_heap_req({"get", "k"}));
+    EXPECT_EQ(c.inflight, 1);
+    drain();
+
+    auto stats = read_stats();
+    EXPECT_EQ(stats["inline_reqs"], 0);
+    EXPECT_EQ(stats["offload_reqs"], 5);
+
+    kv_stop(kv);
+    ev_run(loop, 0);
+    rb_destroy(&c.outgo);
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
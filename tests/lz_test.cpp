@@ -0,0 +1,126 @@
+// tests/lz_test.cpp
+#include "lz.h"
+
+#include <cstring>
+#include <gtest/gtest.h>
+#include <random>
+#include <string>
+#include <vector>
+
+// Values & member names as they show up in a keyspace, repetitive.
+static std::string kv_like(const size_t n) {
+    std::string s;
+    std::mt19937_64 rng(42);
+    while (s.size() < n) {
+        s += "user:" + std::to_string(rng() % 10000) + "\x05session-token-";
+        s += std::string(rng() % 40, 'a' + (char) (rng() % 3));
+    }
+    s.resize(n);
+    return s;
+}
+
+static std::string random_bytes(const size_t n) {
+    std::string s(n, '\0');
+    std::mt19937_64 rng(7);
+    for (auto &c: s) {
+        c = (char) rng();
+    }
+    return s;
+}
+
+static std::string round_trip(const std::string &in) {
+    std::vector<uint8_t> buf(lz_bound(in.size()));
+    const size_t len = lz_compress((const uint8_t *) in.data(), in.size(), buf.data());
+    EXPECT_LE(len, buf.size());
+    std::string out(in.size(), '\0');
+    EXPECT_TRUE(lz_decompress(buf.data(), len, (uint8_t *) out.data(), out.size()));
+    return out;
+}
+
+TEST(LZTest, RoundTrip) {
+    for (const size_t n: {0, 1, 5, 12, 13, 16, 64, 1000, 65535, 65536, 70000, 1 << 20}) {
+        const std::string kv = kv_like(n), rnd = random_bytes(n);
+        ASSERT_EQ(round_trip(kv), kv) << n;
+        ASSERT_EQ(round_trip(rnd), rnd) << n;
+        ASSERT_EQ(round_trip(std::string(n, 'z')), std::string(n, 'z')) << n;
+    }
+    // Overlapping matches of every short period.
+    for (size_t period = 1; period < 20; period++) {
+        std::string s;
+        for (size_t i = 0; i < 5000; i++) {
+            s += (char) ('a' + i % period);
+        }
+        ASSERT_EQ(round_trip(s), s) << period;
+    }
+}
+
+TEST(LZTest, Compresses) {
+    const std::string kv = kv_like(1 << 16);
+    std::vector<uint8_t> buf(lz_bound(kv.size()));
+    EXPECT_LT(lz_compress((const uint8_t *) kv.data(), kv.size(), buf.data()), kv.size() / 2);
+    const std::string zeros(1 << 16, '\0');
+    EXPECT_LT(lz_compress((const uint8_t *) zeros.data(), zeros.size(), buf.data()), 300u);
+}
+
+TEST(LZTest, DecompressRejectsGarbage) {
+    const std::string kv = kv_like(4096);
+    std::vector<uint8_t> buf(lz_bound(kv.size()));
+    const size_t len = lz_compress((const uint8_t *) kv.data(), kv.size(), buf.data());
+    std::string out(kv.size(), '\0');
+    // Wrong raw length either way, cut short.
+    EXPECT_FALSE(lz_decompress(buf.data(), len, (uint8_t *) out.data(), out.size() - 1));
+    out.resize(kv.size() + 1);
+    EXPECT_FALSE(lz_decompress(buf.data(), len, (uint8_t *) out.data(), out.size()));
+    out.resize(kv.size());
+    for (size_t cut = 0; cut < len; cut += 7) {
+        EXPECT_FALSE(lz_decompress(buf.data(), cut, (uint8_t *) out.data(), out.size())) << cut;
+    }
+    // Random input stays in bounds, whatever it decodes to.
+    std::mt19937_64 rng(1);
+    for (int i = 0; i < 10000; i++) {
+        const std::string junk = random_bytes(1 + rng() % 64);
+        std::vector<uint8_t> dst(rng() % 256);
+        lz_decompress((const uint8_t *) junk.data(), junk.size(), dst.data(), dst.size());
+    }
+}
+
+TEST(LZTest, Blocks) {
+    const std::string kv = kv_like(10000), rnd = random_bytes(10000);
+    std::vector<uint8_t> blk(lz_block_bound(kv.size()));
+    std::vector<uint8_t> raw(kv.size());
+    LZBlock b;
+
+    // Compressed, then corrupted anywhere.
+    size_t len = lz_block_put((const uint8_t *) kv.data(), kv.size(), blk.data(), true);
+    ASSERT_TRUE(lz_block_head(blk.data(), &b));
+    EXPECT_EQ(b.raw_len, kv.size());
+    EXPECT_EQ(LZ_BLOCK_HEAD + b.len, len);
+    EXPECT_LT(b.len, b.raw_len);
+    const uint8_t *got = lz_block_get(&b, blk.data() + LZ_BLOCK_HEAD, raw.data());
+    ASSERT_EQ(got, raw.data());
+    EXPECT_EQ(std::string((const char *) got, b.raw_len), kv);
+    // An offset may move to equal bytes, the output is right all the same.
+    for (size_t i = LZ_BLOCK_HEAD; i < len; i += 13) {
+        blk[i] ^= 0x10;
+        got = lz_block_get(&b, blk.data() + LZ_BLOCK_HEAD, raw.data());
+        EXPECT_TRUE(!got || std::string((const char *) got, b.raw_len) == kv) << i;
+        blk[i] ^= 0x10;
+    }
+
+    // Incompressible or uncompressed, stored & read in place.
+    for (const bool compress: {true, false}) {
+        const std::string &in = compress ? rnd : kv;
+        len = lz_block_put((const uint8_t *) in.data(), in.size(), blk.data(), compress);
+        ASSERT_TRUE(lz_block_head(blk.data(), &b));
+        EXPECT_EQ(b.len, b.raw_len);
+        EXPECT_EQ(lz_block_get(&b, blk.data() + LZ_BLOCK_HEAD, raw.data()), blk.data() + LZ_BLOCK_HEAD);
+        blk[len - 1] ^= 1;
+        EXPECT_EQ(lz_block_get(&b, blk.data() + LZ_BLOCK_HEAD, raw.data()), nullptr);
+    }
+
+    // Claims of more than the codec can expand to.
+    const LZBlock huge = {UINT32_MAX, 10, 0};
+    uint8_t head[LZ_BLOCK_HEAD];
+    memcpy(head, &huge, LZ_BLOCK_HEAD);
+    EXPECT_FALSE(lz_block_head(head, &b));
+}
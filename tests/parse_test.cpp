@@ -5,6 +5,7 @@
 #include <cmath> // For isnan
 #include <gtest/gtest.h>
 #include <string>
+#include <tuple>
 #include <vector>
 
 // --- Tests for Helper Functions ---
@@ -28,6 +29,72 @@ TEST(StrConvTest, Str2Int) {
     vstr_destroy(v);
 }
 
+TEST(StrConvTest, Str2IntStrict) {
+    int64_t out;
+    for (const char *ok: {"0", "-42", "9223372036854775807", "-9223372036854775808"}) {
+        vstr *v = vstr_new(ok, strlen(ok));
+        EXPECT_TRUE(str2int_strict(v, &out)) << ok;
+        vstr_destroy(v);
+    }
+    for (const char *bad: {"", "hello", "12a", "1.5", "9223372036854775808"}) {
+        vstr *v = vstr_new(bad, strlen(bad));
+        EXPECT_FALSE(str2int_strict(v, &out)) << bad;
+        vstr_destroy(v);
+    }
+}
+
+TEST(GlobTest, Patterns) {
+    const std::vector<std::tuple<const char *, const char *, bool>> cases = {
+            {"*", "", true},
+            {"*", "anything", true},
+            {"key:*", "key:1", true},
+            {"key:*", "kex:1", false},
+            {"*:1", "key:1", true},
+            {"*:1", "key:10", false},
+            {"a*b*c", "aXbYbZc", true},
+            {"a*b*c", "aXbYbZ", false},
+            {"h?llo", "hello", true},
+            {"h?llo", "hllo", false},
+            {"h[ae]llo", "hallo", true},
+            {"h[ae]llo", "hillo", false},
+            {"h[^e]llo", "hallo", true},
+            {"h[^e]llo", "hello", false},
+            {"h[a-c]llo", "hbllo", true},
+            {"h[c-a]llo", "hbllo", true},
+            {"h[a-c]llo", "hdllo", false},
+            {"h\\*llo", "h*llo", true},
+            {"h\\*llo", "hello", false},
+            {"[\\]]", "]", true},
+            {"", "", true},
+            {"", "a", false},
+            {"**x", "abx", true},
+    };
+    for (const auto &[pat, s, want]: cases) {
+        EXPECT_EQ(glob_match(pat, strlen(pat), s, strlen(s)), want) << pat << " " << s;
+    }
+}
+
+// Split around its literal ends, a compiled glob agrees with the plain one.
+TEST(GlobTest, Compiled) {
+    const std::vector<std::pair<const char *, enum glob_kind>> pats = {
+            {"key:1", GLOB_EXACT}, {"", GLOB_EXACT},      {"key:*", GLOB_ANY},    {"*:1", GLOB_ANY},
+            {"k*1", GLOB_ANY},     {"**", GLOB_ANY},      {"*ey*", GLOB_FIND},    {"k*y:*1", GLOB_FIND},
+            {"k?y*", GLOB_FULL},   {"k[a-z]y*", GLOB_FULL}, {"*\\**", GLOB_FULL}, {"key[1", GLOB_FULL},
+            {"*y\\:1", GLOB_FULL}, {"?", GLOB_FULL},
+    };
+    const std::vector<std::string> strs = {"", "key:1", "key:10", "kay:1", "k", "ey", "k*y:1", "key[1", "ky:1",
+                                           "xkey:1x", std::string("ke\0y:1", 6)};
+    for (const auto &[pat, kind]: pats) {
+        Glob g;
+        glob_compile(&g, pat, strlen(pat));
+        EXPECT_EQ(g.kind, kind) << pat;
+        for (const auto &s: strs) {
+            EXPECT_EQ(glob_test(&g, s.data(), s.size()), glob_match(pat, strlen(pat), s.data(), s.size()))
+                    << pat << " " << s;
+        }
+    }
+}
+
 TEST(StrConvTest, Str2Dbl) {
     double out;
     vstr* v = vstr_new("123.45", 6);
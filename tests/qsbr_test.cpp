@@ -0,0 +1,253 @@
+// tests/qsbr_test.cpp
+
+#include "qsbr.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+static std::atomic<long> g_freed{0};
+static void count_free(void *) { g_freed.fetch_add(1, std::memory_order_relaxed); }
+
+// With a single registered thread every quiescent state ends a grace period,
+// a retired object is reclaimed once three have passed.
+static void pass_grace_periods() {
+    for (int i = 0; i < 3; i++)
+        qsbr_quiescent();
+}
+
+class QSBRTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        g_freed = 0;
+        qsbr_init(16);
+        qsbr_reg();
+    }
+
+    void TearDown() override {
+        qsbr_unreg();
+        qsbr_destroy();
+    }
+};
+
+TEST_F(QSBRTest, ReclaimAfterGracePeriods) {
+    void *p = qsbr_calloc(1, 64);
+    ASSERT_NE(p, nullptr);
+    qsbr_retire(p, count_free);
+    // Double retire is ignored
+    qsbr_retire(p, count_free);
+    EXPECT_EQ(g_freed, 0);
+
+    qsbr_quiescent();
+    EXPECT_EQ(g_freed, 0);
+    pass_grace_periods();
+    EXPECT_EQ(g_freed, 1);
+}
+
+TEST_F(QSBRTest, WaitsForOtherThreads) {
+    std::atomic<int> stage{0};
+    std::thread reader([&]() {
+        qsbr_reg();
+        stage = 1;
+        while (stage != 2)
+            std::this_thread::yield();
+        qsbr_quiescent();
+        stage = 3;
+        while (stage != 4)
+            std::this_thread::yield();
+        qsbr_quiescent();
+        qsbr_unreg();
+    });
+    while (stage != 1)
+        std::this_thread::yield();
+
+    qsbr_retire(qsbr_calloc(1, 8), count_free);
+    // The reader hasn't passed a quiescent state, nothing can be freed
+    for (int i = 0; i < 4; i++)
+        qsbr_quiescent();
+    EXPECT_EQ(g_freed, 0);
+
+    stage = 2;
+    while (stage != 3)
+        std::this_thread::yield();
+    qsbr_quiescent();
+    stage = 4;
+    reader.join();
+    pass_grace_periods();
+    EXPECT_EQ(g_freed, 1);
+}
+
+// More retires than the `qsbr_init` backlog, from many threads: nothing may be
+// dropped.
+TEST_F(QSBRTest, UnboundedConcurrentRetire) {
+    const int nthreads = 8, per_thread = 20000;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nthreads; t++) {
+        threads.emplace_back([]() {
+            qsbr_reg();
+            for (int i = 0; i < per_thread; i++) {
+                qsbr_retire(qsbr_calloc(1, 32), count_free);
+                if (i % 1000 == 0)
+                    qsbr_quiescent();
+            }
+            qsbr_unreg();
+        });
+    }
+    for (auto &t: threads)
+        t.join();
+
+    pass_grace_periods();
+    EXPECT_EQ(g_freed, (long) nthreads * per_thread);
+}
+
+// More threads than fit in one 64-bit mask, all registered at once.
+TEST_F(QSBRTest, ManyThreads) {
+    const int nthreads = 200;
+    std::atomic<int> registered{0};
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(20);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nthreads; t++) {
+        threads.emplace_back([&]() {
+            qsbr_reg();
+            qsbr_retire(qsbr_calloc(1, 16), count_free);
+            registered++;
+            while (registered != nthreads)
+                std::this_thread::yield();
+            // Every slot has to report for the grace periods to end
+            while (g_freed < nthreads && std::chrono::steady_clock::now() < deadline) {
+                qsbr_quiescent();
+                std::this_thread::yield();
+            }
+            qsbr_unreg();
+        });
+    }
+    while (g_freed < nthreads && std::chrono::steady_clock::now() < deadline) {
+        qsbr_quiescent();
+        std::this_thread::yield();
+    }
+    for (auto &t: threads)
+        t.join();
+    EXPECT_EQ(g_freed, nthreads);
+}
+
+TEST_F(QSBRTest, OfflineDoesNotStall) {
+    std::atomic<int> stage{0};
+    std::thread idle([&]() {
+        qsbr_reg();
+        qsbr_offline();
+        stage = 1;
+        while (stage != 2)
+            std::this_thread::yield();
+        qsbr_online();
+        stage = 3;
+        while (stage != 4)
+            std::this_thread::yield();
+        qsbr_quiescent();
+        stage = 5;
+        qsbr_unreg();
+    });
+    while (stage != 1)
+        std::this_thread::yield();
+
+    // Offline threads are not waited for
+    qsbr_retire(qsbr_calloc(1, 8), count_free);
+    qsbr_quiescent();
+    pass_grace_periods();
+    EXPECT_EQ(g_freed, 1);
+
+    // Back online, it is again
+    stage = 2;
+    while (stage != 3)
+        std::this_thread::yield();
+    qsbr_retire(qsbr_calloc(1, 8), count_free);
+    for (int i = 0; i < 4; i++)
+        qsbr_quiescent();
+    EXPECT_EQ(g_freed, 1);
+
+    stage = 4;
+    while (stage != 5)
+        std::this_thread::yield();
+    idle.join();
+    pass_grace_periods();
+    EXPECT_EQ(g_freed, 2);
+}
+
+TEST_F(QSBRTest, DestroyReclaimsPending) {
+    for (int i = 0; i < 100; i++)
+        qsbr_retire(qsbr_calloc(1, 16), count_free);
+    qsbr_unreg();
+    qsbr_destroy();
+    EXPECT_EQ(g_freed, 100);
+    // Re-init for TearDown
+    qsbr_init(16);
+    qsbr_reg();
+}
+
+TEST_F(QSBRTest, RecycleSameSizeClass) {
+    uint64_t hits0, misses0, hits, misses;
+    qsbr_pool_stats(&hits0, &misses0);
+
+    const int n = 1000;
+    std::vector<char *> ptrs;
+    for (int i = 0; i < n; i++) {
+        ptrs.push_back(static_cast<char *>(qsbr_calloc(1, 100)));
+        memset(ptrs.back(), 0xab, 100);
+    }
+    qsbr_pool_stats(&hits, &misses);
+    EXPECT_EQ(misses - misses0, n);
+    for (char *p: ptrs)
+        qsbr_retire(p, count_free);
+    pass_grace_periods();
+    ASSERT_EQ(g_freed, n);
+
+    // Another size of the same class, served from the pool & zeroed again
+    for (int i = 0; i < n; i++) {
+        auto *p = static_cast<unsigned char *>(qsbr_calloc(1, 140));
+        for (int j = 0; j < 140; j++)
+            ASSERT_EQ(p[j], 0);
+        qsbr_retire(p, nullptr);
+    }
+    qsbr_pool_stats(&hits, &misses);
+    EXPECT_EQ(hits - hits0, n);
+    EXPECT_EQ(misses - misses0, n);
+
+    // Too big to pool
+    qsbr_retire(qsbr_calloc(1, 1 << 20), nullptr);
+    uint64_t hits2, misses2;
+    qsbr_pool_stats(&hits2, &misses2);
+    EXPECT_EQ(hits2, hits);
+    EXPECT_EQ(misses2, misses);
+}
+
+// Nodes reclaimed by one thread are reused by another through the depot.
+TEST_F(QSBRTest, RecycleAcrossThreads) {
+    const int n = 2000;
+    for (int i = 0; i < n; i++)
+        qsbr_retire(qsbr_calloc(1, 40), nullptr);
+    pass_grace_periods();
+    // Hand everything this thread pooled over to the depot
+    qsbr_unreg();
+
+    uint64_t hits0, misses0;
+    qsbr_pool_stats(&hits0, &misses0);
+    std::thread t([]() {
+        qsbr_reg();
+        for (int i = 0; i < n; i++)
+            qsbr_retire(qsbr_calloc(1, 40), nullptr);
+        qsbr_unreg();
+    });
+    t.join();
+    uint64_t hits, misses;
+    qsbr_pool_stats(&hits, &misses);
+    EXPECT_EQ(hits - hits0, n);
+    EXPECT_EQ(misses, misses0);
+    qsbr_reg();
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
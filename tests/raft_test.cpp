@@ -0,0 +1,389 @@
+// tests/raft_test.cpp
+#include "raft.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <gtest/gtest.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "kvstore.h"
+#include "parse.h"
+#include "qsbr.h"
+#include "ringbuf.h"
+#include "serialize.h"
+
+#define NODES 3
+
+class RaftTest : public ::testing::Test {
+protected:
+    KVStore *kv[NODES] = {};
+    Raft *raft[NODES] = {};
+    std::string dirs[NODES], addrs[NODES];
+    const char *addr_ptrs[NODES];
+    char root[32] = "/tmp/raft_test_XXXXXX";
+    RingBuf out;
+
+    void SetUp() override {
+        qsbr_init(65536);
+        qsbr_reg();
+        rb_init(&out, 1024);
+        ASSERT_NE(mkdtemp(root), nullptr);
+        // Client ports, peers listen RAFT_PORT_OFFSET above, below the
+        // ephemeral range. Every test on ports of its own, the last ones may
+        // linger.
+        static int round = 0;
+        const int base = 10000 + (int) (getpid() % 700) * 16 + (round++ % 4) * NODES;
+        for (int i = 0; i < NODES; i++) {
+            dirs[i] = std::string(root) + "/n" + std::to_string(i);
+            addrs[i] = "127.0.0.1:" + std::to_string(base + i);
+            addr_ptrs[i] = addrs[i].c_str();
+        }
+    }
+
+    void TearDown() override {
+        for (int i = 0; i < NODES; i++) {
+            stop(i);
+        }
+        rb_destroy(&out);
+        qsbr_quiescent();
+        qsbr_unreg();
+        qsbr_destroy();
+        std::system(("rm -rf " + std::string(root)).c_str());
+    }
+
+    void start(const int i) {
+        kv[i] = kv_new(nullptr);
+        raft[i] = raft_open(kv[i], i, NODES, addr_ptrs, dirs[i].c_str());
+        ASSERT_NE(raft[i], nullptr);
+    }
+
+    void stop(const int i) {
+        if (!kv[i])
+            return;
+        kv_clear(kv[i]);
+        kv[i] = nullptr;
+        raft[i] = nullptr;
+    }
+
+    // Poll `pred` for up to 10s, quiescent in between.
+    static bool eventually(const std::function<bool()> &pred) {
+        const auto end = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (std::chrono::steady_clock::now() < end) {
+            if (pred())
+                return true;
+            qsbr_quiescent();
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        return pred();
+    }
+
+    // The node leading every running one with its lease, -1 if none.
+    int leader() {
+        int lead = -1;
+        for (int i = 0; i < NODES; i++) {
+            if (raft[i] && raft_leader(raft[i]) == i && raft_lease_valid(raft[i]))
+                lead = i;
+        }
+        for (int i = 0; lead >= 0 && i < NODES; i++) {
+            if (raft[i] && raft_leader(raft[i]) != lead)
+                return -1;
+        }
+        return lead;
+    }
+
+    int wait_leader() {
+        int lead = -1;
+        EXPECT_TRUE(eventually([&] { return (lead = leader()) >= 0; }));
+        return lead;
+    }
+
+    static OwnedRequest make_req(const std::vector<std::string> &args) {
+        OwnedRequest oreq{};
+        oreq.base.argc = args.size();
+        oreq.base.argv = (vstr **) malloc(oreq.base.argc * sizeof(vstr *));
+        for (size_t i = 0; i < oreq.base.argc; ++i) {
+            oreq.base.argv[i] = vstr_new(args[i].c_str(), args[i].length());
+        }
+        simple2req(&oreq.base, &oreq.req);
+        return oreq;
+    }
+
+    // Through the cluster, returns the reply tag.
+    uint8_t run(const int i, const std::vector<std::string> &args) {
+        OwnedRequest oreq = make_req(args);
+        rb_clear(&out);
+        qsbr_quiescent();
+        do_owned_req(kv[i], &oreq, &out);
+        owned_req_destroy(&oreq);
+        uint8_t tag = 0xff;
+        rb_peek0(&out, &tag, 1);
+        return tag;
+    }
+
+    // The error message of the last reply.
+    std::string err() {
+        uint8_t tag;
+        uint32_t code, len;
+        rb_read(&out, &tag, 1);
+        rb_read(&out, (uint8_t *) &code, 4);
+        rb_read(&out, (uint8_t *) &len, 4);
+        std::string s(len, '\0');
+        rb_read(&out, (uint8_t *) s.data(), len);
+        return s;
+    }
+
+    // What node `i` has, bypassing the cluster.
+    std::string local_get(const int i, const std::string &key) {
+        OwnedRequest oreq = make_req({"get", key});
+        rb_clear(&out);
+        qsbr_quiescent();
+        kv_apply(kv[i], &oreq, &out);
+        owned_req_destroy(&oreq);
+        uint8_t tag;
+        rb_read(&out, &tag, 1);
+        if (tag != TAG_STR)
+            return "<nil>";
+        uint32_t len;
+        rb_read(&out, (uint8_t *) &len, 4);
+        std::string s(len, '\0');
+        rb_read(&out, (uint8_t *) s.data(), len);
+        return s;
+    }
+
+    // Wait until node `i` applied as far as `lead`.
+    bool caught_up(const int i, const int lead) {
+        return eventually([&] { return raft_applied(raft[i]) >= raft_applied(raft[lead]); });
+    }
+};
+
+TEST_F(RaftTest, ElectsOneLeader) {
+    for (int i = 0; i < NODES; i++) {
+        start(i);
+    }
+    const int lead = wait_leader();
+    ASSERT_GE(lead, 0);
+    const uint64_t term = raft_term(raft[lead]);
+    for (int i = 0; i < NODES; i++) {
+        EXPECT_EQ(raft_term(raft[i]), term);
+    }
+    // Heartbeats keep it in place.
+    std::this_thread::sleep_for(std::chrono::milliseconds(3 * RAFT_ELECTION_MS));
+    EXPECT_EQ(leader(), lead);
+    EXPECT_EQ(raft_term(raft[lead]), term);
+}
+
+TEST_F(RaftTest, WritesReplicate) {
+    for (int i = 0; i < NODES; i++) {
+        start(i);
+    }
+    const int lead = wait_leader();
+    ASSERT_GE(lead, 0);
+    for (int i = 0; i < 500; i++) {
+        ASSERT_EQ(run(lead, {"set", "k" + std::to_string(i), "v" + std::to_string(i)}), TAG_NIL) << i;
+    }
+    EXPECT_EQ(run(lead, {"incrby", "n", "41"}), TAG_INT);
+    EXPECT_EQ(run(lead, {"incr", "n"}), TAG_INT);
+    EXPECT_EQ(run(lead, {"zadd", "z", "1.5", "a"}), TAG_INT);
+    EXPECT_EQ(run(lead, {"pexpire", "k0", "100000"}), TAG_INT);
+    EXPECT_EQ(run(lead, {"del", "k1"}), TAG_INT);
+    // Failed writes fail on every node alike.
+    EXPECT_EQ(run(lead, {"incr", "k2"}), TAG_ERR);
+    // Leader reads see every write acked.
+    EXPECT_EQ(run(lead, {"get", "n"}), TAG_STR);
+    EXPECT_EQ(run(lead, {"pttl", "k0"}), TAG_INT);
+
+    for (int i = 0; i < NODES; i++) {
+        ASSERT_TRUE(caught_up(i, lead)) << i;
+        EXPECT_EQ(local_get(i, "n"), "42") << i;
+        EXPECT_EQ(local_get(i, "k1"), "<nil>") << i;
+        EXPECT_EQ(local_get(i, "k2"), "v2") << i;
+        EXPECT_EQ(local_get(i, "k499"), "v499") << i;
+    }
+}
+
+TEST_F(RaftTest, ExpiryGoesThroughTheLog) {
+    for (int i = 0; i < NODES; i++) {
+        start(i);
+    }
+    const int lead = wait_leader();
+    ASSERT_GE(lead, 0);
+    ASSERT_EQ(run(lead, {"set", "t", "1"}), TAG_NIL);
+    ASSERT_EQ(run(lead, {"pexpire", "t", "1"}), TAG_INT);
+    for (int i = 0; i < NODES; i++) {
+        ASSERT_TRUE(caught_up(i, lead)) << i;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    // Followers keep it until the leader's DEL applies.
+    for (int i = 0; i < NODES; i++) {
+        if (i != lead) {
+            kv_clean_expired(kv[i]);
+            EXPECT_EQ(local_get(i, "t"), "1") << i;
+        }
+    }
+    kv_clean_expired(kv[lead]);
+    for (int i = 0; i < NODES; i++) {
+        EXPECT_TRUE(eventually([&] { return local_get(i, "t") == "<nil>"; })) << i;
+    }
+}
+
+TEST_F(RaftTest, IncrLogsTheResult) {
+    for (int i = 0; i < NODES; i++) {
+        start(i);
+    }
+    const int lead = wait_leader();
+    ASSERT_GE(lead, 0);
+    ASSERT_EQ(run(lead, {"set", "n", "40"}), TAG_NIL);
+    ASSERT_EQ(run(lead, {"incrby", "n", "2"}), TAG_INT);
+    int64_t n = 0;
+    rb_read(&out, (uint8_t *) &n, 1);
+    rb_read(&out, (uint8_t *) &n, 8);
+    EXPECT_EQ(n, 42);
+    ASSERT_EQ(run(lead, {"zadd", "z", "1", "a"}), TAG_INT);
+    EXPECT_EQ(run(lead, {"incr", "z"}), TAG_ERR);
+    ASSERT_EQ(run(lead, {"set", "max", "9223372036854775807"}), TAG_NIL);
+    EXPECT_EQ(run(lead, {"incr", "max"}), TAG_ERR);
+    for (int i = 0; i < NODES; i++) {
+        ASSERT_TRUE(caught_up(i, lead)) << i;
+        EXPECT_EQ(local_get(i, "n"), "42") << i;
+        EXPECT_EQ(local_get(i, "max"), "9223372036854775807") << i;
+    }
+}
+
+TEST_F(RaftTest, EvictionGoesThroughTheLog) {
+    for (int i = 0; i < NODES; i++) {
+        start(i);
+    }
+    const int lead = wait_leader();
+    ASSERT_GE(lead, 0);
+    for (int i = 0; i < NODES; i++) {
+        kv_set_maxmemory(kv[i], kv_used_memory(kv[i]) + 16 * 1024, EVICT_LRU);
+    }
+    const std::string val(256, 'v');
+    const int keys = 300;
+    for (int i = 0; i < keys; i++) {
+        ASSERT_EQ(run(lead, {"set", "k" + std::to_string(i), val}), TAG_NIL) << i;
+    }
+    // The same keys are gone everywhere.
+    std::string have[NODES];
+    for (int i = 0; i < NODES; i++) {
+        ASSERT_TRUE(caught_up(i, lead)) << i;
+        for (int k = 0; k < keys; k++) {
+            have[i] += local_get(i, "k" + std::to_string(k)) == "<nil>" ? '0' : '1';
+        }
+    }
+    EXPECT_NE(have[lead].find('0'), std::string::npos);
+    for (int i = 0; i < NODES; i++) {
+        EXPECT_EQ(have[i], have[lead]) << i;
+    }
+}
+
+TEST_F(RaftTest, FollowersRedirect) {
+    for (int i = 0; i < NODES; i++) {
+        start(i);
+    }
+    const int lead = wait_leader();
+    ASSERT_GE(lead, 0);
+    const int follower = (lead + 1) % NODES;
+    const std::string want = "not leader, try " + addrs[lead];
+    EXPECT_EQ(run(follower, {"set", "k", "v"}), TAG_ERR);
+    EXPECT_EQ(err(), want);
+    EXPECT_EQ(run(follower, {"get", "k"}), TAG_ERR);
+    EXPECT_EQ(err(), want);
+    // Node-local commands still run.
+    EXPECT_EQ(run(follower, {"stats"}), TAG_ARR);
+    EXPECT_EQ(local_get(follower, "k"), "<nil>");
+}
+
+TEST_F(RaftTest, Failover) {
+    for (int i = 0; i < NODES; i++) {
+        start(i);
+    }
+    const int lead = wait_leader();
+    ASSERT_GE(lead, 0);
+    ASSERT_EQ(run(lead, {"set", "a", "1"}), TAG_NIL);
+    const uint64_t term = raft_term(raft[lead]);
+    stop(lead);
+
+    const int next = wait_leader();
+    ASSERT_GE(next, 0);
+    EXPECT_NE(next, lead);
+    EXPECT_GT(raft_term(raft[next]), term);
+    EXPECT_EQ(run(next, {"get", "a"}), TAG_STR);
+    ASSERT_EQ(run(next, {"set", "b", "2"}), TAG_NIL);
+
+    // The old leader rejoins as a follower & catches up from the log.
+    start(lead);
+    ASSERT_TRUE(eventually([&] { return raft_leader(raft[lead]) == next; }));
+    ASSERT_TRUE(caught_up(lead, next));
+    EXPECT_EQ(local_get(lead, "a"), "1");
+    EXPECT_EQ(local_get(lead, "b"), "2");
+}
+
+TEST_F(RaftTest, LeaderWithoutMajority) {
+    for (int i = 0; i < NODES; i++) {
+        start(i);
+    }
+    const int lead = wait_leader();
+    ASSERT_GE(lead, 0);
+    ASSERT_EQ(run(lead, {"set", "a", "1"}), TAG_NIL);
+    ASSERT_EQ(run(lead, {"get", "a"}), TAG_STR);
+    for (int i = 0; i < NODES; i++) {
+        if (i != lead)
+            stop(i);
+    }
+    // It steps down, neither writes nor reads hang.
+    EXPECT_EQ(run(lead, {"set", "a", "2"}), TAG_ERR);
+    EXPECT_TRUE(eventually([&] { return !raft_lease_valid(raft[lead]); }));
+    EXPECT_EQ(run(lead, {"get", "a"}), TAG_ERR);
+}
+
+TEST_F(RaftTest, SnapshotCatchUpAndRestart) {
+    for (int i = 0; i < NODES; i++) {
+        start(i);
+        raft_set_snap_entries(raft[i], 100);
+    }
+    int lead = wait_leader();
+    ASSERT_GE(lead, 0);
+    const int lagging = (lead + 1) % NODES;
+    stop(lagging);
+    for (int i = 0; i < 1000; i++) {
+        ASSERT_EQ(run(lead, {"set", "k" + std::to_string(i), std::to_string(i)}), TAG_NIL) << i;
+    }
+    ASSERT_EQ(run(lead, {"zadd", "z", "2.5", "m"}), TAG_INT);
+
+    // What it missed is cut off the leader's log, it gets the snapshot.
+    start(lagging);
+    raft_set_snap_entries(raft[lagging], 100);
+    ASSERT_TRUE(caught_up(lagging, lead));
+    for (int i = 0; i < 1000; i += 37) {
+        ASSERT_EQ(local_get(lagging, "k" + std::to_string(i)), std::to_string(i)) << i;
+    }
+    ASSERT_EQ(run(lead, {"set", "after", "1"}), TAG_NIL);
+    ASSERT_TRUE(caught_up(lagging, lead));
+    EXPECT_EQ(local_get(lagging, "after"), "1");
+
+    // Everything comes back from the snapshots & logs on disk.
+    for (int i = 0; i < NODES; i++) {
+        stop(i);
+    }
+    for (int i = 0; i < NODES; i++) {
+        start(i);
+    }
+    lead = wait_leader();
+    ASSERT_GE(lead, 0);
+    EXPECT_EQ(run(lead, {"get", "after"}), TAG_STR);
+    for (int i = 0; i < NODES; i++) {
+        ASSERT_TRUE(caught_up(i, lead)) << i;
+        EXPECT_EQ(local_get(i, "k999"), "999") << i;
+        EXPECT_EQ(local_get(i, "after"), "1") << i;
+    }
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,338 @@
+// tests/repl_test.cpp
+#include "repl.h"
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <gtest/gtest.h>
+#include <mutex>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "kvstore.h"
+#include "parse.h"
+#include "qsbr.h"
+#include "ringbuf.h"
+#include "serialize.h"
+
+class ReplTest : public ::testing::Test {
+protected:
+    KVStore *primary = nullptr, *replica_kv = nullptr;
+    Repl *repl = nullptr;
+    Replica *replica = nullptr;
+    RingBuf out;
+    int lfd = -1, port = 0;
+    std::thread acceptor;
+    std::mutex mu;
+    // Sockets of the links, to break them.
+    std::vector<int> links;
+
+    void SetUp() override {
+        qsbr_init(65536);
+        qsbr_reg();
+        rb_init(&out, 1024);
+        primary = kv_new(nullptr);
+        repl = repl_new();
+        ASSERT_NE(repl, nullptr);
+        kv_set_repl(primary, repl);
+        replica_kv = kv_new(nullptr);
+
+        // What the event loop does for SYNC: read it, then hand the socket over.
+        lfd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        ASSERT_EQ(bind(lfd, (sockaddr *) &addr, sizeof(addr)), 0);
+        ASSERT_EQ(listen(lfd, 16), 0);
+        socklen_t len = sizeof(addr);
+        getsockname(lfd, (sockaddr *) &addr, &len);
+        port = ntohs(addr.sin_port);
+        acceptor = std::thread([this] {
+            for (;;) {
+                const int fd = accept(lfd, nullptr, nullptr);
+                if (fd < 0)
+                    return;
+                uint8_t frame[16];
+                size_t got = 0;
+                while (got < sizeof(frame)) {
+                    const ssize_t n = read(fd, frame + got, sizeof(frame) - got);
+                    if (n <= 0)
+                        break;
+                    got += n;
+                }
+                if (got < sizeof(frame) || memcmp(frame + 12, "sync", 4)) {
+                    close(fd);
+                    continue;
+                }
+                std::lock_guard<std::mutex> g(mu);
+                links.push_back(fd);
+                repl_add(repl, primary, fd);
+            }
+        });
+    }
+
+    void TearDown() override {
+        // Stops `replica`, then `repl` goes with the primary.
+        kv_clear(replica_kv);
+        shutdown(lfd, SHUT_RDWR);
+        close(lfd);
+        acceptor.join();
+        kv_clear(primary);
+        rb_destroy(&out);
+        qsbr_quiescent();
+        qsbr_unreg();
+        qsbr_destroy();
+    }
+
+    void start_replica() {
+        replica = replica_start(replica_kv, "127.0.0.1", port);
+        ASSERT_NE(replica, nullptr);
+        kv_set_replica(replica_kv, replica);
+    }
+
+    // Poll `pred` for up to 10s, quiescent in between.
+    static bool eventually(const std::function<bool()> &pred) {
+        const auto end = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (std::chrono::steady_clock::now() < end) {
+            if (pred())
+                return true;
+            qsbr_quiescent();
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+        return pred();
+    }
+
+    static OwnedRequest *make_req(const std::vector<std::string> &args) {
+        auto *oreq = (OwnedRequest *) calloc(1, sizeof(OwnedRequest));
+        oreq->is_alloc = true;
+        oreq->base.argc = args.size();
+        oreq->base.argv = (vstr **) malloc(oreq->base.argc * sizeof(vstr *));
+        for (size_t i = 0; i < oreq->base.argc; ++i) {
+            oreq->base.argv[i] = vstr_new(args[i].c_str(), args[i].length());
+        }
+        simple2req(&oreq->base, &oreq->req);
+        return oreq;
+    }
+
+    void run(KVStore *kv, const std::vector<std::string> &args) {
+        OwnedRequest *oreq = make_req(args);
+        rb_clear(&out);
+        qsbr_quiescent();
+        do_owned_req(kv, oreq, &out);
+        owned_req_destroy(oreq);
+    }
+
+    std::string get(KVStore *kv, const std::string &key) {
+        run(kv, {"get", key});
+        uint8_t tag;
+        rb_read(&out, &tag, 1);
+        if (tag != TAG_STR)
+            return "<nil>";
+        uint32_t len;
+        rb_read(&out, (uint8_t *) &len, 4);
+        std::string s(len, '\0');
+        rb_read(&out, (uint8_t *) s.data(), len);
+        return s;
+    }
+
+    double zscore(KVStore *kv, const std::string &key, const std::string &name) {
+        run(kv, {"zscore", key, name});
+        uint8_t tag;
+        rb_read(&out, &tag, 1);
+        if (tag != TAG_DBL)
+            return -1;
+        double d;
+        rb_read(&out, (uint8_t *) &d, 8);
+        return d;
+    }
+
+    int64_t pttl(KVStore *kv, const std::string &key) {
+        run(kv, {"pttl", key});
+        uint8_t tag;
+        int64_t n = 0;
+        rb_read(&out, &tag, 1);
+        rb_read(&out, (uint8_t *) &n, 8);
+        return n;
+    }
+};
+
+TEST_F(ReplTest, SyncThenStream) {
+    for (int i = 0; i < 5000; i++) {
+        run(primary, {"set", "k" + std::to_string(i), "v" + std::to_string(i)});
+    }
+    run(primary, {"zadd", "z", "1.5", "a"});
+    run(primary, {"zadd", "z", "2.5", "b"});
+    run(primary, {"incrby", "n", "41"});
+    run(primary, {"pexpire", "k0", "100000"});
+    EXPECT_EQ(repl_replicas(repl), 0u);
+
+    start_replica();
+    ASSERT_TRUE(eventually([&] { return replica_synced(replica); }));
+    EXPECT_EQ(repl_replicas(repl), 1u);
+    for (int i = 0; i < 5000; i++) {
+        ASSERT_EQ(get(replica_kv, "k" + std::to_string(i)), "v" + std::to_string(i)) << i;
+    }
+    EXPECT_EQ(zscore(replica_kv, "z", "b"), 2.5);
+    EXPECT_EQ(get(replica_kv, "n"), "41");
+    EXPECT_GT(pttl(replica_kv, "k0"), 90000);
+    EXPECT_EQ(pttl(replica_kv, "k1"), -1);
+
+    // Writes stream as the log records them.
+    run(primary, {"set", "k1", "new"});
+    run(primary, {"del", "k2"});
+    run(primary, {"incr", "n"});
+    run(primary, {"zrem", "z", "a"});
+    run(primary, {"pexpire", "k3", "50000"});
+    run(primary, {"set", "last", "1"});
+    ASSERT_TRUE(eventually([&] { return get(replica_kv, "last") == "1"; }));
+    EXPECT_EQ(get(replica_kv, "k1"), "new");
+    EXPECT_EQ(get(replica_kv, "k2"), "<nil>");
+    EXPECT_EQ(get(replica_kv, "n"), "42");
+    EXPECT_EQ(zscore(replica_kv, "z", "a"), -1);
+    EXPECT_GT(pttl(replica_kv, "k3"), 40000);
+    // Failed writes aren't streamed.
+    run(primary, {"incr", "k1"});
+    run(primary, {"set", "last", "2"});
+    ASSERT_TRUE(eventually([&] { return get(replica_kv, "last") == "2"; }));
+    EXPECT_EQ(get(replica_kv, "k1"), "new");
+}
+
+TEST_F(ReplTest, WritesDuringSync) {
+    for (int i = 0; i < 20000; i++) {
+        run(primary, {"set", "k" + std::to_string(i), "0"});
+    }
+    start_replica();
+    // Every key is rewritten while the dump runs, the replica ends up with
+    // the last of each.
+    for (int round = 1; round <= 3; round++) {
+        for (int i = 0; i < 20000; i++) {
+            run(primary, {"set", "k" + std::to_string(i), std::to_string(round)});
+        }
+    }
+    run(primary, {"set", "done", "1"});
+    ASSERT_TRUE(eventually([&] { return get(replica_kv, "done") == "1"; }));
+    for (int i = 0; i < 20000; i++) {
+        ASSERT_EQ(get(replica_kv, "k" + std::to_string(i)), "3") << i;
+    }
+}
+
+TEST_F(ReplTest, ReplicaDropsOwnKeys) {
+    run(replica_kv, {"set", "stale", "x"});
+    run(replica_kv, {"zadd", "zstale", "1", "m"});
+    run(replica_kv, {"zadd", "zstale", "2", "n"});
+    run(primary, {"set", "fresh", "y"});
+    start_replica();
+    ASSERT_TRUE(eventually([&] { return replica_synced(replica); }));
+    EXPECT_EQ(get(replica_kv, "stale"), "<nil>");
+    EXPECT_EQ(zscore(replica_kv, "zstale", "m"), -1);
+    EXPECT_EQ(get(replica_kv, "fresh"), "y");
+}
+
+TEST_F(ReplTest, Reconnects) {
+    run(primary, {"set", "a", "1"});
+    run(primary, {"set", "b", "1"});
+    start_replica();
+    ASSERT_TRUE(eventually([&] { return replica_synced(replica); }));
+    ASSERT_EQ(get(replica_kv, "a"), "1");
+
+    // Cut the link, writes meanwhile come with the resync.
+    {
+        std::lock_guard<std::mutex> g(mu);
+        shutdown(links.back(), SHUT_RDWR);
+    }
+    ASSERT_TRUE(eventually([&] { return !replica_synced(replica); }));
+    run(primary, {"set", "a", "2"});
+    run(primary, {"del", "b"});
+    ASSERT_TRUE(eventually([&] { return replica_synced(replica) && get(replica_kv, "a") == "2"; }));
+    EXPECT_EQ(get(replica_kv, "b"), "<nil>");
+    {
+        std::lock_guard<std::mutex> g(mu);
+        EXPECT_EQ(links.size(), 2u);
+    }
+    // The broken link is reaped once a send fails.
+    run(primary, {"set", "c", "1"});
+    ASSERT_TRUE(eventually([&] { return get(replica_kv, "c") == "1"; }));
+    ASSERT_TRUE(eventually([&] {
+        run(primary, {"set", "tick", "1"});
+        return repl_replicas(repl) == 1;
+    }));
+}
+
+// Keys the primary expires or evicts on its own go away on the replica too.
+TEST_F(ReplTest, UnlinksStreamAsDels) {
+    for (int i = 0; i < 1000; i++) {
+        run(primary, {"set", "k" + std::to_string(i), "v"});
+    }
+    run(primary, {"set", "ttl", "v"});
+    start_replica();
+    ASSERT_TRUE(eventually([&] { return replica_synced(replica); }));
+
+    run(primary, {"pexpire", "ttl", "1"});
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    kv_clean_expired(primary);
+    EXPECT_EQ(get(primary, "ttl"), "<nil>");
+    // Each write past the limit evicts.
+    kv_set_maxmemory(primary, kv_used_memory(primary), EVICT_LRU);
+    for (int i = 1000; i < 2000; i++) {
+        run(primary, {"set", "k" + std::to_string(i), "v"});
+    }
+    kv_set_maxmemory(primary, 0, EVICT_LRU);
+    run(primary, {"set", "last", "1"});
+    ASSERT_TRUE(eventually([&] { return get(replica_kv, "last") == "1"; }));
+    EXPECT_EQ(get(replica_kv, "ttl"), "<nil>");
+    int evicted = 0;
+    for (int i = 0; i < 2000; i++) {
+        const std::string k = "k" + std::to_string(i);
+        const std::string v = get(primary, k);
+        evicted += v == "<nil>";
+        ASSERT_EQ(get(replica_kv, k), v) << k;
+    }
+    EXPECT_GT(evicted, 0);
+}
+
+TEST_F(ReplTest, ReplicaIsReadOnly) {
+    run(primary, {"set", "k", "v"});
+    start_replica();
+    ASSERT_TRUE(eventually([&] { return replica_synced(replica); }));
+
+    struct ev_loop *loop = ev_default_loop(0);
+    kv_start(replica_kv);
+    Conn c{};
+    rb_init(&c.outgo, 64);
+    auto reply_tag = [&] {
+        while (c.inflight > 0) {
+            ev_run(loop, EVRUN_ONCE);
+        }
+        uint32_t len = 0;
+        uint8_t tag = 0xff;
+        rb_read(&c.outgo, (uint8_t *) &len, 4);
+        rb_peek0(&c.outgo, &tag, 1);
+        rb_consume(&c.outgo, len);
+        return tag;
+    };
+
+    EXPECT_EQ(kv_dispatch(replica_kv, &c, make_req({"set", "k", "w"})), OK);
+    EXPECT_EQ(reply_tag(), TAG_ERR);
+    EXPECT_EQ(kv_dispatch(replica_kv, &c, make_req({"get", "k"})), OK);
+    EXPECT_EQ(reply_tag(), TAG_STR);
+    // Without replicas of its own, SYNC is refused.
+    rb_init(&c.income, 64);
+    EXPECT_EQ(kv_dispatch(replica_kv, &c, make_req({"sync"})), OK);
+    EXPECT_EQ(reply_tag(), TAG_ERR);
+    EXPECT_EQ(get(replica_kv, "k"), "v");
+
+    kv_stop(replica_kv);
+    ev_run(loop, 0);
+    rb_destroy(&c.income);
+    rb_destroy(&c.outgo);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
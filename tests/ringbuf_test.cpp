@@ -206,6 +206,26 @@ TEST_F(RingBufTest, Consume) {
     EXPECT_EQ(read_buf, expected_data);
 }
 
+TEST_F(RingBufTest, TruncateWrapAround) {
+    std::vector<uint8_t> write_buf(10);
+    std::iota(write_buf.begin(), write_buf.end(), 0);
+    rb_write(&rb, write_buf.data(), write_buf.size());
+    rb_consume(&rb, 10);
+    // Wraps around the end, then drop all but the first 3 bytes.
+    rb_write(&rb, write_buf.data(), write_buf.size());
+    rb_truncate(&rb, 3);
+
+    EXPECT_EQ(rb_size(&rb), 3);
+    std::vector<uint8_t> read_buf(3);
+    rb_read(&rb, read_buf.data(), read_buf.size());
+    EXPECT_EQ(read_buf, std::vector<uint8_t>(write_buf.begin(), write_buf.begin() + 3));
+
+    // Longer than what's there is a no-op.
+    rb_write(&rb, write_buf.data(), 2);
+    rb_truncate(&rb, 5);
+    EXPECT_EQ(rb_size(&rb), 2);
+}
+
 // Utility Operations
 
 TEST_F(RingBufTest, Clear) {
@@ -0,0 +1,238 @@
+// tests/smr_test.cpp
+
+#include "smr.h"
+
+#include <atomic>
+#include <gtest/gtest.h>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "hpmap.h"
+#include "utils.h"
+
+static std::atomic<long> g_freed{0};
+static void count_free(void *) { g_freed.fetch_add(1, std::memory_order_relaxed); }
+
+// Enough quiescent points for either backend to pass its grace periods.
+static void pass_grace_periods() {
+    for (int i = 0; i < 1024; i++)
+        smr_quiescent();
+}
+
+class SMRTest : public ::testing::TestWithParam<const SMR *> {
+protected:
+    void SetUp() override {
+        g_freed = 0;
+        smr_init(GetParam(), 16);
+        smr_reg();
+    }
+
+    void TearDown() override {
+        smr_unreg();
+        smr_destroy();
+    }
+};
+
+TEST_P(SMRTest, ReclaimAfterGracePeriods) {
+    smr_enter();
+    void *p = smr_calloc(1, 64);
+    ASSERT_NE(p, nullptr);
+    smr_retire(p, count_free);
+    smr_exit();
+    pass_grace_periods();
+    EXPECT_EQ(g_freed, 1);
+}
+
+// A thread inside an operation keeps retired objects alive under both
+// schemes: pinned under EBR, not reporting under QSBR.
+TEST_P(SMRTest, ReaderHoldsReclaim) {
+    std::atomic<int> stage{0};
+    std::thread reader([&]() {
+        smr_reg();
+        smr_enter();
+        stage = 1;
+        while (stage != 2)
+            std::this_thread::yield();
+        smr_exit();
+        smr_quiescent();
+        smr_unreg();
+    });
+    while (stage != 1)
+        std::this_thread::yield();
+
+    smr_retire(smr_calloc(1, 8), count_free);
+    pass_grace_periods();
+    EXPECT_EQ(g_freed, 0);
+
+    stage = 2;
+    reader.join();
+    pass_grace_periods();
+    EXPECT_EQ(g_freed, 1);
+}
+
+struct TestEntry {
+    BNode node;
+    uint64_t key;
+};
+
+static bool test_entry_eq(BNode *lhs, BNode *rhs) {
+    if (!lhs || !rhs)
+        return lhs == rhs;
+    return container_of(lhs, TestEntry, node)->key == container_of(rhs, TestEntry, node)->key;
+}
+
+// Replace entries from several threads, every removed entry is retired &
+// eventually freed.
+//
+// NOTE: Sized not to resize, a remove racing a migration may hand the same
+// node to two threads.
+TEST_P(SMRTest, ConcurrentMapChurn) {
+    const int nthreads = 4, ops = 20000;
+    const uint64_t nkeys = 4096;
+    CHPMap *m = chpm_new(nullptr, nkeys * 2);
+    std::atomic<long> retired{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nthreads; t++) {
+        threads.emplace_back([&, t]() {
+            smr_reg();
+            std::mt19937 rng(t);
+            for (int i = 0; i < ops; i++) {
+                const uint64_t key = rng() % nkeys;
+                TestEntry q{{int_hash_rapid(key)}, key};
+                smr_enter();
+                if (rng() % 4) {
+                    BNode *n = chpm_lookup(m, &q.node, test_entry_eq);
+                    if (n) {
+                        EXPECT_EQ(container_of(n, TestEntry, node)->key, key);
+                    }
+                } else if (BNode *old = chpm_remove(m, &q.node, test_entry_eq)) {
+                    smr_retire(container_of(old, TestEntry, node), count_free);
+                    retired++;
+                } else {
+                    auto *e = static_cast<TestEntry *>(smr_calloc(1, sizeof(TestEntry)));
+                    e->key = key;
+                    e->node.hcode = int_hash_rapid(key);
+                    if (!chpm_add(m, &e->node, test_entry_eq))
+                        smr_retire(e, nullptr);
+                }
+                smr_exit();
+                smr_quiescent();
+            }
+            smr_unreg();
+        });
+    }
+    for (auto &t: threads)
+        t.join();
+
+    pass_grace_periods();
+    EXPECT_EQ(g_freed, retired);
+    chpm_destroy(m);
+}
+
+TEST(SMRBackend, Find) {
+    EXPECT_EQ(smr_find("qsbr"), &smr_qsbr);
+    EXPECT_EQ(smr_find("ebr"), &smr_ebr);
+    EXPECT_EQ(smr_find("rcu"), nullptr);
+}
+
+// Under EBR a registered thread outside a critical section holds nothing up.
+TEST(SMRBackend, EBRIdleThreadDoesNotStall) {
+    g_freed = 0;
+    smr_init(&smr_ebr, 16);
+    smr_reg();
+    std::atomic<int> stage{0};
+    std::thread idle([&]() {
+        smr_reg();
+        stage = 1;
+        while (stage != 2)
+            std::this_thread::yield();
+        smr_unreg();
+    });
+    while (stage != 1)
+        std::this_thread::yield();
+
+    smr_retire(smr_calloc(1, 8), count_free);
+    pass_grace_periods();
+    EXPECT_EQ(g_freed, 1);
+
+    stage = 2;
+    idle.join();
+    smr_unreg();
+    smr_destroy();
+}
+
+// Threads flipping offline & online around every operation, as a pool's loop
+// does, while another one idles offline: nothing stalls & nothing is freed
+// under a reader.
+TEST(SMRBackend, QSBROfflineChurn) {
+    g_freed = 0;
+    smr_init(&smr_qsbr, 16);
+    smr_reg();
+    const int nthreads = 4, ops = 20000;
+    const uint64_t nkeys = 4096;
+    CHPMap *m = chpm_new(nullptr, nkeys * 2);
+    std::atomic<long> retired{0};
+    std::atomic<int> stage{0};
+    std::thread idle([&]() {
+        smr_reg();
+        smr_offline();
+        stage = 1;
+        while (stage != 2)
+            std::this_thread::yield();
+        smr_online();
+        smr_unreg();
+    });
+    while (stage != 1)
+        std::this_thread::yield();
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nthreads; t++) {
+        threads.emplace_back([&, t]() {
+            smr_reg();
+            std::mt19937 rng(t);
+            for (int i = 0; i < ops; i++) {
+                const uint64_t key = rng() % nkeys;
+                TestEntry q{{int_hash_rapid(key)}, key};
+                smr_online();
+                if (rng() % 4) {
+                    BNode *n = chpm_lookup(m, &q.node, test_entry_eq);
+                    if (n) {
+                        EXPECT_EQ(container_of(n, TestEntry, node)->key, key);
+                    }
+                } else if (BNode *old = chpm_remove(m, &q.node, test_entry_eq)) {
+                    smr_retire(container_of(old, TestEntry, node), count_free);
+                    retired++;
+                } else {
+                    auto *e = static_cast<TestEntry *>(smr_calloc(1, sizeof(TestEntry)));
+                    e->key = key;
+                    e->node.hcode = int_hash_rapid(key);
+                    if (!chpm_add(m, &e->node, test_entry_eq))
+                        smr_retire(e, nullptr);
+                }
+                smr_quiescent();
+                smr_offline();
+            }
+            smr_online();
+            smr_unreg();
+        });
+    }
+    for (auto &t: threads)
+        t.join();
+
+    pass_grace_periods();
+    EXPECT_EQ(g_freed, retired);
+    stage = 2;
+    idle.join();
+    chpm_destroy(m);
+    smr_unreg();
+    smr_destroy();
+}
+
+INSTANTIATE_TEST_SUITE_P(Backends, SMRTest, ::testing::Values(&smr_qsbr, &smr_ebr),
+                         [](const ::testing::TestParamInfo<const SMR *> &info) { return std::string(info.param->name); });
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,349 @@
+// tests/snapshot_test.cpp
+#include "snapshot.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "kvstore.h"
+#include "parse.h"
+#include "qsbr.h"
+#include "ringbuf.h"
+#include "serialize.h"
+
+class SnapshotTest : public ::testing::Test {
+protected:
+    std::string path;
+    RingBuf out;
+    Snapshot *snap = nullptr;
+
+    void SetUp() override {
+        qsbr_init(65536);
+        qsbr_reg();
+        path = ::testing::TempDir() + "snapshot_test_" + std::to_string(getpid()) + ".snap";
+        unlink(path.c_str());
+        rb_init(&out, 1024);
+    }
+
+    void TearDown() override {
+        rb_destroy(&out);
+        unlink(path.c_str());
+        qsbr_unreg();
+        qsbr_destroy();
+    }
+
+    KVStore *open_kv(const uint64_t rate = 0) {
+        KVStore *kv = kv_new(nullptr);
+        snap = snap_new(path.c_str(), rate);
+        kv_set_snapshot(kv, snap);
+        return kv;
+    }
+
+    void run(KVStore *kv, const std::vector<std::string> &args, RingBuf *rb = nullptr) {
+        rb = rb ? rb : &out;
+        OwnedRequest oreq;
+        oreq.is_alloc = false;
+        oreq.base.argc = args.size();
+        oreq.base.argv = (vstr **) malloc(oreq.base.argc * sizeof(vstr *));
+        for (size_t i = 0; i < oreq.base.argc; ++i) {
+            oreq.base.argv[i] = vstr_new(args[i].c_str(), args[i].length());
+        }
+        simple2req(&oreq.base, &oreq.req);
+        rb_clear(rb);
+        do_owned_req(kv, &oreq, rb);
+        owned_req_destroy(&oreq);
+    }
+
+    uint8_t out_tag() {
+        uint8_t tag = 0xff;
+        rb_peek0(&out, &tag, 1);
+        return tag;
+    }
+
+    std::string get(KVStore *kv, const std::string &key) {
+        run(kv, {"get", key});
+        uint8_t tag;
+        rb_read(&out, &tag, 1);
+        if (tag != TAG_STR)
+            return "<nil>";
+        uint32_t len;
+        rb_read(&out, (uint8_t *) &len, 4);
+        std::string s(len, '\0');
+        rb_read(&out, (uint8_t *) s.data(), len);
+        return s;
+    }
+
+    int64_t read_int() {
+        uint8_t tag;
+        rb_read(&out, &tag, 1);
+        EXPECT_EQ(tag, TAG_INT);
+        int64_t v = 0;
+        rb_read(&out, (uint8_t *) &v, 8);
+        return v;
+    }
+
+    double zscore(KVStore *kv, const std::string &key, const std::string &name) {
+        run(kv, {"zscore", key, name});
+        uint8_t tag;
+        rb_read(&out, &tag, 1);
+        if (tag != TAG_DBL)
+            return -1;
+        double v;
+        rb_read(&out, (uint8_t *) &v, 8);
+        return v;
+    }
+
+    void write_file(const std::string &data) {
+        std::ofstream f(path, std::ios::binary | std::ios::trunc);
+        f.write(data.data(), (std::streamsize) data.size());
+    }
+
+    std::string read_file() {
+        std::ifstream f(path, std::ios::binary);
+        return {std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>()};
+    }
+};
+
+TEST_F(SnapshotTest, SaveLoadRoundTrip) {
+    KVStore *kv = open_kv();
+    run(kv, {"set", "s", "hello"});
+    run(kv, {"set", "big", std::string(5000, 'x')});
+    run(kv, {"incrby", "n", "-42"});
+    run(kv, {"incrby", "huge", "4611686018427387904"}); // past 63 bits, a string
+    for (int i = 0; i < 300; i++) {
+        run(kv, {"zadd", "z", std::to_string(i * 0.25), "m" + std::to_string(i)});
+    }
+    run(kv, {"set", "ttl", "v"});
+    run(kv, {"pexpire", "ttl", "60000"});
+    run(kv, {"set", "expired", "v"});
+    run(kv, {"pexpire", "expired", "0"});
+
+    run(kv, {"save"});
+    EXPECT_EQ(read_int(), 6); // expired left out
+    // Busy guard clears once done.
+    run(kv, {"save"});
+    EXPECT_EQ(read_int(), 6);
+    kv_clear(kv);
+
+    kv = kv_new(nullptr);
+    ASSERT_EQ(snap_load(kv, path.c_str(), 1), 6);
+    EXPECT_EQ(get(kv, "s"), "hello");
+    EXPECT_EQ(get(kv, "big"), std::string(5000, 'x'));
+    EXPECT_EQ(get(kv, "n"), "-42");
+    EXPECT_EQ(get(kv, "huge"), "4611686018427387904");
+    run(kv, {"incr", "n"});
+    EXPECT_EQ(read_int(), -41);
+    for (int i = 0; i < 300; i++) {
+        ASSERT_EQ(zscore(kv, "z", "m" + std::to_string(i)), i * 0.25);
+    }
+    EXPECT_EQ(get(kv, "ttl"), "v");
+    run(kv, {"pttl", "ttl"});
+    const int64_t ttl = read_int();
+    EXPECT_GT(ttl, 50000);
+    EXPECT_LE(ttl, 60000);
+    EXPECT_EQ(get(kv, "expired"), "<nil>");
+    run(kv, {"pttl", "s"});
+    EXPECT_EQ(read_int(), -1);
+    kv_clear(kv);
+}
+
+TEST_F(SnapshotTest, NoSnapshotConfigured) {
+    KVStore *kv = kv_new(nullptr);
+    run(kv, {"save"});
+    EXPECT_EQ(out_tag(), TAG_ERR);
+    run(kv, {"bgsave"});
+    EXPECT_EQ(out_tag(), TAG_ERR);
+    kv_clear(kv);
+}
+
+TEST_F(SnapshotTest, LoadRejectsBadFiles) {
+    KVStore *kv = kv_new(nullptr);
+    EXPECT_EQ(snap_load(kv, path.c_str(), 1), 0);
+    write_file("not a snapshot");
+    EXPECT_EQ(snap_load(kv, path.c_str(), 1), -1);
+    kv_clear(kv);
+
+    kv = open_kv();
+    run(kv, {"set", "a", "1"});
+    run(kv, {"zadd", "z", "1", "m"});
+    run(kv, {"save"});
+    EXPECT_EQ(read_int(), 2);
+    kv_clear(kv);
+    const std::string good = read_file();
+
+    // Cut anywhere, the trailer no longer checks out.
+    for (size_t cut = SNAP_MAGIC_LEN; cut < good.size(); cut++) {
+        write_file(good.substr(0, cut));
+        kv = kv_new(nullptr);
+        EXPECT_EQ(snap_load(kv, path.c_str(), 1), -1) << "cut at " << cut;
+        kv_clear(kv);
+    }
+    std::string bad = good;
+    bad[SNAP_MAGIC_LEN] = 0x55;
+    write_file(bad);
+    kv = kv_new(nullptr);
+    EXPECT_EQ(snap_load(kv, path.c_str(), 1), -1);
+    kv_clear(kv);
+}
+
+// Keys untouched during a background save are all in it, whatever the
+// writers do to the others meanwhile, including growing the table.
+TEST_F(SnapshotTest, BgSaveUnderWrites) {
+    KVStore *kv = open_kv();
+    const int nstable = 20000;
+    for (int i = 0; i < nstable; i++) {
+        run(kv, {"set", "stable:" + std::to_string(i), std::to_string(i)});
+    }
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 3; t++) {
+        writers.emplace_back([&, t]() {
+            qsbr_reg();
+            RingBuf rb;
+            rb_init(&rb, 256);
+            for (int i = 0; !stop.load(std::memory_order_relaxed); i++) {
+                const std::string k = "hot:" + std::to_string(t) + ":" + std::to_string(i % 50000);
+                run(kv, {"set", k, "v"}, &rb);
+                run(kv, {"zadd", "hz" + std::to_string(t), std::to_string(i), std::to_string(i % 100)}, &rb);
+                if (i % 3 == 0)
+                    run(kv, {"del", k}, &rb);
+                if (i % 64 == 0)
+                    qsbr_quiescent();
+            }
+            rb_destroy(&rb);
+            qsbr_quiescent();
+            qsbr_unreg();
+        });
+    }
+
+    for (int round = 0; round < 3; round++) {
+        run(kv, {"bgsave"});
+        ASSERT_EQ(out_tag(), TAG_STR);
+        while (snap_running(snap)) {
+            qsbr_quiescent();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        EXPECT_TRUE(snap_wait(snap));
+    }
+    stop = true;
+    for (auto &w: writers) {
+        w.join();
+    }
+    EXPECT_GT(snap_last_save(snap), 0u);
+    kv_clear(kv);
+
+    kv = kv_new(nullptr);
+    ASSERT_GE(snap_load(kv, path.c_str(), 1), nstable);
+    for (int i = 0; i < nstable; i++) {
+        ASSERT_EQ(get(kv, "stable:" + std::to_string(i)), std::to_string(i));
+    }
+    kv_clear(kv);
+}
+
+// Sections load on several threads into a table sized up front, the result
+// is the same as loading on one.
+TEST_F(SnapshotTest, ParallelLoad) {
+    KVStore *kv = open_kv();
+    const int nkeys = 50000;
+    for (int i = 0; i < nkeys; i++) {
+        const std::string k = "k" + std::to_string(i);
+        if (i % 10 == 0) {
+            run(kv, {"zadd", k, std::to_string(i), "a"});
+            run(kv, {"zadd", k, std::to_string(-i), "b"});
+        } else if (i % 10 == 1) {
+            run(kv, {"incrby", k, std::to_string(i)});
+        } else {
+            run(kv, {"set", k, std::string(i % 100, 'v')});
+        }
+        if (i % 7 == 0)
+            run(kv, {"pexpire", k, "600000"});
+    }
+    run(kv, {"save"});
+    ASSERT_EQ(read_int(), nkeys);
+    kv_clear(kv);
+
+    for (const int threads: {1, 4}) {
+        kv = kv_new(nullptr);
+        ASSERT_EQ(snap_load(kv, path.c_str(), threads), nkeys);
+        for (int i = 0; i < nkeys; i++) {
+            const std::string k = "k" + std::to_string(i);
+            if (i % 10 == 0) {
+                ASSERT_EQ(zscore(kv, k, "a"), i);
+                ASSERT_EQ(zscore(kv, k, "b"), -i);
+            } else if (i % 10 == 1) {
+                ASSERT_EQ(get(kv, k), std::to_string(i));
+            } else {
+                ASSERT_EQ(get(kv, k), std::string(i % 100, 'v'));
+            }
+            run(kv, {"pttl", k});
+            ASSERT_EQ(read_int() > 0, i % 7 == 0) << k;
+        }
+        kv_clear(kv);
+    }
+}
+
+// Compressed saves load the same, much smaller for repetitive values. Blocks
+// are checksummed, a flipped byte fails the load.
+TEST_F(SnapshotTest, CompressedSaveLoad) {
+    KVStore *kv = open_kv();
+    const int nkeys = 20000;
+    for (int i = 0; i < nkeys; i++) {
+        const std::string k = "key:" + std::to_string(i);
+        if (i % 100 == 0) {
+            for (int m = 0; m < 20; m++) {
+                run(kv, {"zadd", k, std::to_string(m), "member:" + std::to_string(m)});
+            }
+        } else {
+            run(kv, {"set", k, "value-" + std::string(100, 'a' + i % 3)});
+        }
+    }
+    run(kv, {"save"});
+    ASSERT_EQ(read_int(), nkeys);
+    const size_t plain = read_file().size();
+    snap_set_compress(snap, true);
+    run(kv, {"save"});
+    ASSERT_EQ(read_int(), nkeys);
+    kv_clear(kv);
+    const std::string good = read_file();
+    EXPECT_LT(good.size(), plain / 4);
+
+    kv = kv_new(nullptr);
+    ASSERT_EQ(snap_load(kv, path.c_str(), 2), nkeys);
+    for (int i = 0; i < nkeys; i++) {
+        const std::string k = "key:" + std::to_string(i);
+        if (i % 100 == 0) {
+            ASSERT_EQ(zscore(kv, k, "member:19"), 19);
+        } else {
+            ASSERT_EQ(get(kv, k), "value-" + std::string(100, 'a' + i % 3));
+        }
+    }
+    kv_clear(kv);
+
+    std::string bad = good;
+    bad[SNAP_MAGIC_LEN + 40] ^= 0x20;
+    write_file(bad);
+    kv = kv_new(nullptr);
+    EXPECT_EQ(snap_load(kv, path.c_str(), 2), -1);
+    kv_clear(kv);
+}
+
+// A rate limit spreads the save out instead of running flat out.
+TEST_F(SnapshotTest, RateLimitPacesSave) {
+    KVStore *kv = open_kv(1 << 20);
+    const std::string val(1000, 'v');
+    for (int i = 0; i < 400; i++) {
+        run(kv, {"set", "k" + std::to_string(i), val});
+    }
+    const auto t0 = std::chrono::steady_clock::now();
+    ASSERT_EQ(snap_save(snap, kv), 400);
+    const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0);
+    // ~400KB at 1MB/s
+    EXPECT_GE(ms.count(), 300);
+    kv_clear(kv);
+}
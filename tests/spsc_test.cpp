@@ -0,0 +1,115 @@
+// tests/spsc_test.cpp
+
+#include "spsc.h"
+#include "utils.h"
+
+#include <gtest/gtest.h>
+#include <thread>
+
+struct TestNode {
+    cnode n;
+    int value;
+};
+
+class SPSCTest : public ::testing::Test {
+protected:
+    spscq *q = nullptr;
+    static constexpr size_t QUEUE_CAPACITY = 128;
+
+    void SetUp() override { q = spsc_init(q, QUEUE_CAPACITY); }
+
+    void TearDown() override {
+        cnode *node;
+        while ((node = spsc_pop(q))) {
+            delete container_of(node, TestNode, n);
+        }
+        spsc_destroy(q);
+    }
+};
+
+TEST_F(SPSCTest, Initialization) {
+    EXPECT_EQ(spsc_size(q), 0);
+    EXPECT_EQ(spsc_cap(q), QUEUE_CAPACITY);
+    EXPECT_EQ(spsc_pop(q), nullptr);
+
+    // Rounded up to a power of 2
+    spscq *odd = spsc_init(nullptr, 100);
+    EXPECT_EQ(spsc_cap(odd), 128);
+    spsc_destroy(odd);
+}
+
+TEST_F(SPSCTest, FIFO) {
+    for (int i = 0; i < 10; ++i) {
+        TestNode *node = new TestNode{{}, i};
+        ASSERT_TRUE(spsc_put(q, &node->n));
+    }
+    EXPECT_EQ(spsc_size(q), 10);
+
+    for (int i = 0; i < 10; ++i) {
+        cnode *c_node = spsc_pop(q);
+        ASSERT_NE(c_node, nullptr);
+        TestNode *t_node = container_of(c_node, TestNode, n);
+        EXPECT_EQ(t_node->value, i);
+        delete t_node;
+    }
+    EXPECT_EQ(spsc_size(q), 0);
+    EXPECT_EQ(spsc_pop(q), nullptr);
+}
+
+TEST_F(SPSCTest, FullAndEmptyWrapAround) {
+    // Several rounds so the indices wrap past the capacity
+    for (int round = 0; round < 3; ++round) {
+        for (size_t i = 0; i < QUEUE_CAPACITY; ++i) {
+            TestNode *n = new TestNode{{}, (int) i};
+            ASSERT_TRUE(spsc_put(q, &n->n));
+        }
+        EXPECT_EQ(spsc_size(q), QUEUE_CAPACITY);
+
+        TestNode extra{{}, 999};
+        ASSERT_FALSE(spsc_put(q, &extra.n));
+
+        for (size_t i = 0; i < QUEUE_CAPACITY; ++i) {
+            cnode *node = spsc_pop(q);
+            ASSERT_NE(node, nullptr);
+            EXPECT_EQ(container_of(node, TestNode, n)->value, (int) i);
+            delete container_of(node, TestNode, n);
+        }
+        EXPECT_EQ(spsc_size(q), 0);
+        ASSERT_EQ(spsc_pop(q), nullptr);
+    }
+}
+
+TEST_F(SPSCTest, ConcurrentProducerConsumer) {
+    const int total_items = 200000;
+
+    std::thread producer([this, total_items]() {
+        for (int i = 0; i < total_items; ++i) {
+            TestNode *node = new TestNode{{}, i};
+            while (!spsc_put(q, &node->n)) {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    // Items must come out in order with none lost or duplicated
+    int expected = 0;
+    while (expected < total_items) {
+        cnode *c_node = spsc_pop(q);
+        if (!c_node) {
+            std::this_thread::yield();
+            continue;
+        }
+        TestNode *t_node = container_of(c_node, TestNode, n);
+        ASSERT_EQ(t_node->value, expected);
+        expected++;
+        delete t_node;
+    }
+    producer.join();
+
+    EXPECT_EQ(spsc_size(q), 0);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -21,6 +21,8 @@ static int g_items_received = 0;
 static int g_num_items = 0;
 static std::vector<bool> g_received_check;
 static struct ev_loop *g_main_loop = nullptr;
+// Set around posts, results must wait for the loop.
+static bool g_posting = false;
 
 // --- Worker Function ---
 // Doubles the input value and cleans up the work node.
@@ -40,6 +42,7 @@ cnode *double_value_work(cnode *work) {
 // This function is called by the thread pool when a result is ready.
 bool test_res_cb(cnode *node) {
     EXPECT_NE(node, nullptr);
+    EXPECT_FALSE(g_posting);
     auto *r_node = static_cast<ResultNode *>(node);
 
     // Verify the work was done correctly
@@ -112,6 +115,53 @@ TEST_F(ThreadPoolTest, PostAndReceiveWork) {
     }
 }
 
+// Same workload with the busy-poll phase forced on and off, both must not
+// lose a wake-up when producers skip `ev_async_send` for running consumers.
+TEST_F(ThreadPoolTest, PostAndReceiveWorkSpinModes) {
+    for (uint32_t spin_max: {0u, (uint32_t) POOL_SPIN}) {
+        g_items_received = 0;
+        g_num_items = 4000;
+        g_received_check.assign(g_num_items, false);
+        pool_set_spin(&pool, spin_max);
+
+        pool_start(&pool, double_value_work);
+        for (int i = 0; i < g_num_items; ++i) {
+            auto *work = new WorkNode();
+            work->value = i;
+            pool_post(&pool, work);
+        }
+        ev_run(g_main_loop, 0);
+
+        EXPECT_EQ(g_items_received, g_num_items);
+        // Re-arm the master watcher stopped by the stop condition.
+        ev_async_start(g_main_loop, &pool.rev);
+    }
+}
+
+// Runtime-sized pool: fewer workers than the default, queues small enough to
+// fill up, and every worker pinned to the first CPU.
+TEST_F(ThreadPoolTest, PostAndReceiveWorkConfigured) {
+    g_num_items = 4000;
+    g_received_check.assign(g_num_items, false);
+    const int cpu = 0;
+    pool_set_workers(&pool, 3);
+    pool_set_queue_size(&pool, 16);
+    pool_set_cpus(&pool, &cpu, 1);
+
+    pool_start(&pool, double_value_work);
+    EXPECT_EQ(pool.nworkers, 3);
+    for (int i = 0; i < g_num_items; ++i) {
+        auto *work = new WorkNode();
+        work->value = i;
+        g_posting = true;
+        pool_post(&pool, work);
+        g_posting = false;
+    }
+    ev_run(g_main_loop, 0);
+
+    EXPECT_EQ(g_items_received, g_num_items);
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
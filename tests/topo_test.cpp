@@ -0,0 +1,109 @@
+// tests/topo_test.cpp
+
+#include "topo.h"
+
+#include <cerrno>
+#include <cstring>
+#include <gtest/gtest.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <vector>
+
+TEST(TopoTest, ParseCpulist) {
+    int cpus[16];
+    ASSERT_EQ(topo_parse_cpulist("0-3,8,10-11\n", cpus, 16), 7);
+    const std::vector<int> expect = {0, 1, 2, 3, 8, 10, 11};
+    EXPECT_EQ(std::vector<int>(cpus, cpus + 7), expect);
+
+    ASSERT_EQ(topo_parse_cpulist("5", cpus, 16), 1);
+    EXPECT_EQ(cpus[0], 5);
+    EXPECT_EQ(topo_parse_cpulist("", cpus, 16), 0);
+}
+
+TEST(TopoTest, ParseCpulistInvalid) {
+    int cpus[4];
+    EXPECT_EQ(topo_parse_cpulist("3-1", cpus, 4), -1);
+    EXPECT_EQ(topo_parse_cpulist("a", cpus, 4), -1);
+    EXPECT_EQ(topo_parse_cpulist("1;2", cpus, 4), -1);
+    EXPECT_EQ(topo_parse_cpulist("-1", cpus, 4), -1);
+    // More CPUs than fit
+    EXPECT_EQ(topo_parse_cpulist("0-4", cpus, 4), -1);
+}
+
+TEST(TopoTest, PinSelf) {
+    cpu_set_t orig;
+    ASSERT_EQ(pthread_getaffinity_np(pthread_self(), sizeof(orig), &orig), 0);
+    int cpu = -1;
+    for (int i = 0; i < CPU_SETSIZE && cpu < 0; i++) {
+        if (CPU_ISSET(i, &orig))
+            cpu = i;
+    }
+    ASSERT_GE(cpu, 0);
+
+    ASSERT_EQ(topo_pin(pthread_self(), &cpu, 1), 0);
+    cpu_set_t now;
+    ASSERT_EQ(pthread_getaffinity_np(pthread_self(), sizeof(now), &now), 0);
+    EXPECT_EQ(CPU_COUNT(&now), 1);
+    EXPECT_TRUE(CPU_ISSET(cpu, &now));
+
+    const int bad = -1;
+    EXPECT_NE(topo_pin(pthread_self(), &bad, 1), 0);
+    pthread_setaffinity_np(pthread_self(), sizeof(orig), &orig);
+}
+
+TEST(TopoTest, NodeCpus) {
+    int cpus[TOPO_MAX_CPUS];
+    EXPECT_EQ(topo_node_cpus(1 << 20, cpus, TOPO_MAX_CPUS), -1);
+    // Node 0 exists on any NUMA-enabled kernel
+    const int n = topo_node_cpus(0, cpus, TOPO_MAX_CPUS);
+    if (n < 0)
+        GTEST_SKIP() << "no sysfs NUMA info";
+    EXPECT_GT(n, 0);
+}
+
+TEST(TopoTest, Nodes) {
+    int nodes[TOPO_MAX_NODES];
+    const int n = topo_nodes(nodes, TOPO_MAX_NODES);
+    ASSERT_GE(n, 1);
+    for (int i = 0; i < n; i++) {
+        EXPECT_GE(nodes[i], 0);
+    }
+}
+
+TEST(TopoTest, MemPolicy) {
+    const size_t len = 1 << 22;
+    void *p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT_NE(p, MAP_FAILED);
+    int nodes[TOPO_MAX_NODES];
+    topo_nodes(nodes, TOPO_MAX_NODES);
+
+    const int err = topo_interleave(p, len);
+    if (err == EPERM || err == ENOSYS) {
+        munmap(p, len);
+        GTEST_SKIP() << "mbind not permitted";
+    }
+    EXPECT_EQ(err, 0);
+    EXPECT_EQ(topo_bind(p, len, nodes[0]), 0);
+    // Unaligned & sub-page ranges are shrunk / skipped, not rejected
+    EXPECT_EQ(topo_interleave(static_cast<char *>(p) + 1, len - 2), 0);
+    EXPECT_EQ(topo_interleave(static_cast<char *>(p) + 1, 16), 0);
+    EXPECT_NE(topo_bind(p, len, TOPO_MAX_NODES), 0);
+    EXPECT_EQ(topo_local(), 0);
+    // Memory is still usable
+    memset(p, 1, len);
+    munmap(p, len);
+}
+
+TEST(TopoTest, NumaMode) {
+    EXPECT_FALSE(topo_numa());
+    topo_set_numa(true);
+    EXPECT_TRUE(topo_numa());
+    topo_set_numa(false);
+    EXPECT_FALSE(topo_numa());
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}